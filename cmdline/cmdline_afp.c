@@ -20,6 +20,7 @@
 #include <ctype.h>
 
 #include "cmdline_main.h"
+#include "cmdline_transfer.h"
 
 static char curdir[AFP_MAX_PATH];
 static struct afp_url url;
@@ -31,7 +32,9 @@ int full_url=0;
 static struct afp_server * server = NULL;
 struct afp_volume * vol= NULL;
 
-static int recursive_get(char * path);
+static int transfer_jobs = TRANSFER_DEFAULT_JOBS;
+
+static int recursive_get(char * path, int jobs);
 
 static int escape_paths(char * outgoing1, char * outgoing2, char * incoming)
 {
@@ -74,6 +77,7 @@ static int escape_paths(char * outgoing1, char * outgoing2, char * incoming)
 					goto out;
 				writeto=outgoing2;
 				donewith1=1;
+				continue;
 			}
 		}
 add:
@@ -114,6 +118,49 @@ static void printdiff(struct timeval * starttv, struct timeval *endtv,
 	printf("(%.0f kB/s)\n", rate);
 }
 
+static void print_totals(struct timeval * starttv, struct timeval * endtv,
+	struct transfer_totals * totals)
+{
+	float frac = ((float) tvdiff(starttv,endtv)) / 1000.0;
+
+	printdiff(starttv,endtv,&totals->bytes);
+	printf("%u files and %u directories ",totals->files,totals->dirs);
+	printf("(%.0f files/s)",totals->files/frac);
+	if (totals->errors)
+		printf(", %u errors",totals->errors);
+	printf("\n");
+}
+
+/* Takes the -r and -j <jobs> flags off the front of arg */
+static char * transfer_flags(char * arg, int * recursive, int * jobs)
+{
+	char * end;
+
+	while (arg[0]=='-') {
+		if ((arg[1]=='r') && ((arg[2]=='\0') || (isspace(arg[2])))) {
+			*recursive=1;
+			arg+=2;
+		} else if (arg[1]=='j') {
+			*jobs=strtol(arg+2,&end,10);
+			if ((end==arg+2) || (*jobs<1))
+				return NULL;
+			arg=end;
+		} else
+			break;
+		while (isspace(arg[0])) arg++;
+	}
+	return arg;
+}
+
+/* Drops the slashes off the end of path, but not a lone one */
+static void chop_slashes(char * path)
+{
+	int len=strlen(path);
+
+	while ((len>1) && (path[len-1]=='/'))
+		path[--len]='\0';
+}
+
 static int cmdline_getpass(void)
 {
 	char * passwd;
@@ -138,7 +185,7 @@ static int get_server_path(char * filename,char * server_fullname)
 	return 0;
 }
 
-static void print_file_details(struct afp_file_info * p)
+static void print_file_details(struct afp_dirent * p)
 {
 	struct tm * mtime;
 	time_t t,t2;
@@ -146,10 +193,11 @@ static void print_file_details(struct afp_file_info * p)
 	char datestr[DATE_LEN];
 	char mode_str[11];
 	uint32_t mode;
-	struct stat stat;
 
-	afp_unixpriv_to_stat(p,&stat);
-	mode=stat.st_mode;
+	if (p->unixprivs.permissions)
+		mode=p->unixprivs.permissions;
+	else
+		mode=p->unixprivs.ua_permissions;
 
 	sprintf(mode_str,"----------");
 
@@ -343,7 +391,9 @@ int com_dir(char * arg)
 	if (!arg)
 		arg = "";
 
-	struct afp_file_info *filebase = NULL, *p;
+	struct afp_listing * listing;
+	struct afp_dirent * p;
+	unsigned int i;
 
 	if (server==NULL) {
 		printf("You're not connected yet to a volume\n");
@@ -358,13 +408,12 @@ int com_dir(char * arg)
 		goto out;
 	}
 	
-	if (ml_readdir(vol,curdir,&filebase)) goto error;
+	if (ml_readdir(vol,curdir,&listing)) goto error;
 
-	if (filebase==NULL) goto out;
-	for (p=filebase;p;p=p->next) {
+	for (i=0;(p=afp_listing_next(listing,&i));) {
 		print_file_details(p);
 	}
-	afp_ml_filebase_free(&filebase);
+	afp_listing_free(listing);
 
 out:
 	
@@ -434,6 +483,8 @@ error:
 }
 
 
+static int recursive_put(char * path, int jobs);
+
 int com_put(char *arg)
 {
 	int ret, amount_read;
@@ -450,17 +501,22 @@ int com_put(char *arg)
 	unsigned long long amount_written=0;
 	struct timeval starttv,endtv;
 	char filename[AFP_MAX_PATH];
+	int recursive=0, jobs=transfer_jobs;
 
 	if ((server==NULL) || (vol==NULL)) {
 		printf("You're not connected yet to a volume\n");
 		goto error;
 	}
 
-	if ((escape_paths(filename,NULL,arg))) {
-		printf("expecting format: put <filename>\n");
+	if (((arg=transfer_flags(arg,&recursive,&jobs))==NULL) ||
+		(escape_paths(filename,NULL,arg))) {
+		printf("expecting format: put [-r] [-j jobs] <filename>\n");
 		goto error;
 	}
 
+	if (recursive)
+		return recursive_put(filename,jobs);
+
 	/* FIXME find basename */
 	basename=filename;
 
@@ -652,17 +708,25 @@ error:
 int com_get (char *arg)
 {
 	unsigned long long amount_written;
-	char newpath[255];
+	char filename[AFP_MAX_PATH];
+	char newpath[AFP_MAX_PATH];
+	int recursive=0, jobs=transfer_jobs;
 
 	if ((server==NULL) || (vol==NULL)) {
 		printf("You're not connected yet to a volume\n");
 		goto error;
 	}
-	if ((arg[0]=='-') && (arg[1]=='r') && (arg[2]==' ')) {
-		arg+=3;
-		while ((arg) && (isspace(arg[0]))) arg++;
-		snprintf(newpath,255,"%s/%s",curdir,arg);
-		return recursive_get(newpath);
+	if ((arg=transfer_flags(arg,&recursive,&jobs))==NULL) {
+		printf("expecting format: get [-r] [-j jobs] <filename>\n");
+		goto error;
+	}
+	if (recursive) {
+		if (escape_paths(filename,NULL,arg)) {
+			printf("expecting format: get -r <directory>\n");
+			goto error;
+		}
+		get_server_path(filename,newpath);
+		return recursive_get(newpath,jobs);
 	} else 
 		return com_get_file(arg,0, &amount_written);
 error:
@@ -735,6 +799,211 @@ error:
 	return -1;
 }
 
+int com_copy (char * arg)
+{
+
+	char from_path[AFP_MAX_PATH], to_path[AFP_MAX_PATH];
+	char full_from_path[AFP_MAX_PATH], full_to_path[AFP_MAX_PATH];
+	char * p;
+	struct stat stbuf;
+	struct timeval starttv,endtv;
+	unsigned long long amount_copied;
+	int ret;
+
+	if ((server==NULL) || (vol==NULL)) {
+		printf("You're not connected yet to a volume\n");
+		goto error;
+	}
+
+	if (escape_paths(from_path,to_path,arg)) {
+		printf("Syntax: cp <fromfile> <tofile>\n");
+		goto error;
+	}
+
+	get_server_path(from_path,full_from_path);
+	get_server_path(to_path,full_to_path);
+
+	if ((ret=ml_getattr(vol,full_from_path,&stbuf))) {
+		printf("Could not find file %s, error was %d\n",
+			full_from_path,ret);
+		goto error;
+	}
+	amount_copied=stbuf.st_size;
+
+	/* Copying into a directory keeps the name */
+	ret=ml_getattr(vol,full_to_path,&stbuf);
+	if ((ret==0) && (stbuf.st_mode & S_IFDIR)) {
+		p=strrchr(full_from_path,'/');
+		chop_slashes(full_to_path);
+		if (strcmp(full_to_path,"/")==0)
+			full_to_path[0]='\0';
+		strncat(full_to_path,p,
+			AFP_MAX_PATH-strlen(full_to_path)-1);
+	} else if (ret==0) {
+		printf("File %s already exists\n",full_to_path);
+		goto error;
+	}
+	printf("Copying from %s to %s\n",full_from_path,full_to_path);
+
+	gettimeofday(&starttv,NULL);
+	if ((ret=ml_copy(vol,full_from_path,full_to_path))) {
+		printf("Could not copy, error was %d\n",ret);
+		goto error;
+	}
+	gettimeofday(&endtv,NULL);
+	printdiff(&starttv,&endtv,&amount_copied);
+
+	return 0;
+error:
+	return -1;
+}
+
+/* A size with an optional k, M or G after it */
+static int parse_size(char * arg, unsigned long long * size, char ** end)
+{
+	*size=strtoull(arg,end,10);
+	if (*end==arg) return -1;
+	switch (**end) {
+	case 'G': *size*=1024;
+	case 'M': *size*=1024;
+	case 'k': *size*=1024;
+		(*end)++;
+	}
+	return 0;
+}
+
+/* Takes the flags of find off the front of arg:
+ *   -f, -d	only files, or only directories
+ *   -x		the name has to match in full
+ *   -s [+|-]N	bigger than, smaller than or exactly N bytes
+ *   -m [+|-]N	modified more or less than, or exactly N days ago
+ *   -l		list the details of each match */
+static char * find_flags(char * arg, struct afp_catsearch_spec * spec,
+	int * details)
+{
+	unsigned long long n;
+	char * end, sign;
+	time_t now=time(NULL);
+
+	while (arg[0]=='-') {
+		switch (arg[1]) {
+		case 'f':
+			spec->dirs=0;
+			arg+=2;
+			break;
+		case 'd':
+			spec->files=0;
+			arg+=2;
+			break;
+		case 'x':
+			spec->partial=0;
+			arg+=2;
+			break;
+		case 'l':
+			*details=1;
+			arg+=2;
+			break;
+		case 's':
+		case 'm':
+			end=arg+2;
+			while (isspace(*end)) end++;
+			sign=*end;
+			if ((sign=='+') || (sign=='-')) end++;
+			if (arg[1]=='s') {
+				if (parse_size(end,&n,&end)) return NULL;
+				spec->bitmap|=kFPDataForkLenBit;
+				spec->size_from=(sign=='+') ? n+1 : 
+					((sign=='-') ? 0 : n);
+				spec->size_to=(sign=='+') ? ULLONG_MAX : 
+					((sign=='-') ? (n ? n-1 : 0) : n);
+			} else {
+				n=strtoull(end,&end,10);
+				spec->bitmap|=kFPModDateBit;
+				spec->modified_from=(sign=='-') ? now-n*86400 :
+					((sign=='+') ? 0 : now-(n+1)*86400);
+				spec->modified_to=(sign=='-') ? LONG_MAX :
+					now-n*86400;
+			}
+			arg=end;
+			break;
+		default:
+			return NULL;
+		}
+		if ((arg[0]) && (!isspace(arg[0]))) return NULL;
+		while (isspace(arg[0])) arg++;
+	}
+	return arg;
+}
+
+/* Finds what matches on the whole volume with a catalog search, and
+ * lists what is in the current directory */
+int com_find(char * arg)
+{
+	struct afp_catsearch_spec spec;
+	struct ml_catsearch * search;
+	struct afp_dirent * e;
+	struct timeval starttv,endtv;
+	unsigned int found=0, prefixlen;
+	int details=0, ret;
+
+	if ((server==NULL) || (vol==NULL)) {
+		printf("You're not connected yet to a volume\n");
+		goto error;
+	}
+
+	memset(&spec,0,sizeof(spec));
+	spec.files=1;
+	spec.dirs=1;
+	spec.partial=1;
+	if (arg==NULL) arg="";
+	if ((arg=find_flags(arg,&spec,&details))==NULL) {
+		printf("Syntax: find [-f|-d] [-x] [-s [+|-]size] "
+			"[-m [+|-]days] [-l] [name]\n");
+		goto error;
+	}
+	if (arg[0]) {
+		if (escape_paths(spec.name,NULL,arg)) goto error;
+		spec.bitmap|=kFPUTF8NameBit;
+	}
+	if (spec.bitmap==0) {
+		printf("Give a name, a size or a date to look for\n");
+		goto error;
+	}
+
+	gettimeofday(&starttv,NULL);
+	if ((ret=ml_catsearch_start(vol,&spec,&search))) {
+		if (ret==-ENOTSUP)
+			printf("This volume can't be searched\n");
+		else
+			printf("Could not search, error was %d\n",ret);
+		goto error;
+	}
+
+	prefixlen=(strlen(curdir)==1) ? 0 : strlen(curdir);
+	while ((ret=ml_catsearch_next(search,&e))>0) {
+		if ((strncmp(e->name,curdir,prefixlen)) ||
+			(e->name[prefixlen]!='/'))
+			continue;
+		found++;
+		if (details)
+			print_file_details(e);
+		else
+			printf("%s\n",e->name);
+	}
+	ml_catsearch_end(search);
+	gettimeofday(&endtv,NULL);
+
+	if (ret<0) {
+		printf("The search stopped, error was %d\n",ret);
+		goto error;
+	}
+	printf("Found %u in %.3f seconds\n",found,
+		tvdiff(&starttv,&endtv)/1000.0);
+	return 0;
+error:
+	return -1;
+}
+
 int com_delete (char *arg)
 {
 	
@@ -1068,67 +1337,63 @@ error:
 	return -1;
 }
 
-static int get_dir(char * server_base, char * path, 
-	unsigned long long * total)
+static int recursive_get(char * path, int jobs)
 {
-	struct afp_file_info * p, *filebase;
-	char total_path[AFP_MAX_PATH];	
-	unsigned long long amount_written, local_total=0;
-
-	if (strcmp(server_base,"/")==0) 
-		snprintf(total_path,AFP_MAX_PATH,"/%s",path);
-	else
-		snprintf(total_path,AFP_MAX_PATH,"%s/%s",server_base,path);
-
-	printf("Getting directory %s\n",total_path);
+	char * basec;
+	char * base;
+	struct timeval starttv, endtv;
+	struct transfer_totals totals;
+	int ret;
 
-	mkdir(path,0755);
-	chdir(path);
+	chop_slashes(path);
+	basec = strdup(path);
+	base = basename(basec);
+	if (strcmp(base,"/")==0)
+		base=vol->volume_name_printable;
 
-	if (ml_readdir(vol,total_path,&filebase)) goto error;
-	if (filebase==NULL) goto out;
-	for (p=filebase;p;p=p->next) {
-		if (p->isdir) {
-			get_dir(total_path,p->name, &amount_written);
-		} else {
-			snprintf(curdir,AFP_MAX_PATH,"%s",total_path);
-			com_get_file(p->name,1, &amount_written);
-		}
-		local_total+=amount_written;
-	}
-
-	afp_ml_filebase_free(&filebase);
+	gettimeofday(&starttv,NULL);
+	ret=transfer_get_tree(vol,path,base,jobs,&totals);
+	gettimeofday(&endtv,NULL);
 
-out:
+	print_totals(&starttv,&endtv,&totals);
 
-	*total=local_total;
-	chdir("..");
-	
-	return 0;
-error:
-	chdir("..");
-	return -1;
+	free(basec);
+	return ret;
 
 }
 
-
-static int recursive_get(char * path)
+static int recursive_put(char * path, int jobs)
 {
-	char * dirc = strdup(path);
-	char * base = basename(path);
-	char * dir = dirname(dirc);
-
+	char resolved[PATH_MAX];
+	char server_fullname[AFP_MAX_PATH];
 	struct timeval starttv, endtv;
-	unsigned long long amount_written;
+	struct transfer_totals totals;
+	char * base;
+	int ret;
+
+	if (realpath(path,resolved)==NULL) {
+		perror("Opening local directory");
+		return -1;
+	}
+	base=basename(resolved);
+	if (strcmp(base,"/")==0) {
+		printf("Cannot put the whole local filesystem\n");
+		return -1;
+	}
+	get_server_path(base,server_fullname);
 
 	gettimeofday(&starttv,NULL);
-	get_dir(dir,base, &amount_written);
+	ret=transfer_put_tree(vol,path,server_fullname,jobs,&totals);
 	gettimeofday(&endtv,NULL);
 
-	printdiff(&starttv,&endtv, &amount_written);
+	print_totals(&starttv,&endtv,&totals);
 
-	return 0;
+	return ret;
+}
 
+void cmdline_afp_set_jobs(int jobs)
+{
+	transfer_jobs=jobs;
 }
 
 static struct libafpclient afpclient = {
@@ -1185,7 +1450,7 @@ static void * cmdline_server_startup(int recursive)
 		snprintf(curdir,AFP_MAX_PATH,"%s",url.path);
 		printf("In directory %s\n",url.path);
 		if (recursive) {
-			recursive_get(url.path);
+			recursive_get(url.path,transfer_jobs);
 		}
 		
 	} else {
@@ -10,6 +10,8 @@ int com_put(char *filename);
 int com_get (char *filename);
 int com_view (char * arg);
 int com_rename (char * arg);
+int com_copy (char * arg);
+int com_find (char * arg);
 int com_delete (char *arg);
 int com_mkdir(char *arg);
 int com_rmdir(char *arg);
@@ -28,5 +30,6 @@ int com_disconnect(char * arg);
 void cmdline_afp_exit(void);
 
 int cmdline_afp_setup(int recursive, char * url_string);
+void cmdline_afp_set_jobs(int jobs);
 
 #endif
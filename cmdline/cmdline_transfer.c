@@ -0,0 +1,577 @@
+/*
+    cmdline_transfer.c: recursive get and put, with a pool of workers
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    A tree is copied by a number of worker threads sharing the volume.
+    There are two queues, of directories still to be listed and of files
+    still to be copied; a worker listing a directory adds what it finds
+    to them, and any worker picks up the next item.  So directories are
+    listed while files are being copied, and the requests for several
+    files are in flight on the connection at once instead of the open,
+    reads and close of one file after the other.
+
+    Workers take a directory while there are only a few files waiting,
+    and files otherwise, which keeps the listing ahead of the copying
+    without the queue growing with the size of the tree.
+
+    Remote items are found by the ID of their directory and their name,
+    so that nothing has to resolve whole paths; the paths are kept for
+    the messages.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/midlevel.h"
+#include "cmdline_transfer.h"
+
+#define TRANSFER_BUFSIZE (256*1024)
+
+/* How many files may be waiting, for each worker, before workers stop
+ * taking directories */
+#define TRANSFER_BACKLOG 64
+
+struct transfer_item {
+	struct transfer_item * next;
+	/* For directories being fetched, the ID of the directory itself;
+	 * otherwise that of the directory the item is (to be) in */
+	unsigned int did;
+	mode_t mode;
+	char * remote;
+	const char * name;	/* The last part of remote */
+	char * local;
+};
+
+struct transfer {
+	struct afp_volume * vol;
+	int put;
+	uid_t uid;
+	gid_t gid;
+	pthread_mutex_t mutex;	/* Held for everything below */
+	pthread_cond_t cond;
+	struct transfer_item * dirs;
+	struct transfer_item * files;
+	unsigned int waiting_files;
+	unsigned int backlog;
+	unsigned int busy;	/* Workers with an item in hand */
+	struct transfer_totals totals;
+};
+
+static struct transfer_item * transfer_item_new(unsigned int did,
+	const char * remote, const char * local, mode_t mode)
+{
+	struct transfer_item * item;
+	size_t remotelen=strlen(remote)+1, locallen=strlen(local)+1;
+	const char * p;
+
+	if ((item=malloc(sizeof(*item)+remotelen+locallen))==NULL) {
+		printf("Out of memory\n");
+		return NULL;
+	}
+	item->next=NULL;
+	item->did=did;
+	item->mode=mode;
+	item->remote=(char *) (item+1);
+	memcpy(item->remote,remote,remotelen);
+	item->local=item->remote+remotelen;
+	memcpy(item->local,local,locallen);
+	p=strrchr(item->remote,'/');
+	item->name = p ? p+1 : item->remote;
+	return item;
+}
+
+static int transfer_join(char * buf, size_t len, const char * dir,
+	const char * name)
+{
+	int n;
+
+	if (strcmp(dir,"/")==0)
+		n=snprintf(buf,len,"/%s",name);
+	else
+		n=snprintf(buf,len,"%s/%s",dir,name);
+	return ((n<0) || (n>=len)) ? -1 : 0;
+}
+
+static struct transfer_item * transfer_child(struct transfer_item * parent,
+	unsigned int did, const char * name, mode_t mode)
+{
+	char remote[AFP_MAX_PATH];
+	char local[PATH_MAX];
+
+	if ((transfer_join(remote,sizeof(remote),parent->remote,name)) ||
+		(transfer_join(local,sizeof(local),parent->local,name))) {
+		printf("Path too long: %s/%s\n",parent->remote,name);
+		return NULL;
+	}
+	return transfer_item_new(did,remote,local,mode);
+}
+
+/* Adds the items a worker found to the queues */
+static void transfer_queue(struct transfer * t, struct transfer_item * dirs,
+	struct transfer_item * files, unsigned int nfiles)
+{
+	struct transfer_item * item;
+
+	if ((dirs==NULL) && (files==NULL))
+		return;
+
+	pthread_mutex_lock(&t->mutex);
+	while ((item=dirs)) {
+		dirs=item->next;
+		item->next=t->dirs;
+		t->dirs=item;
+	}
+	while ((item=files)) {
+		files=item->next;
+		item->next=t->files;
+		t->files=item;
+	}
+	t->waiting_files+=nfiles;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->mutex);
+}
+
+static int write_all(int fd, const char * buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		if ((n=write(fd,buf,len))<0) {
+			if (errno==EINTR) continue;
+			return -1;
+		}
+		buf+=n;
+		len-=n;
+	}
+	return 0;
+}
+
+static int transfer_get_dir(struct transfer * t, struct transfer_item * item)
+{
+	struct afp_listing * listing;
+	struct afp_dirent * p;
+	struct transfer_item * child, * dirs=NULL, * files=NULL;
+	unsigned int i=0, nfiles=0;
+	mode_t mode;
+	int ret, errors=0;
+
+	printf("Getting directory %s\n",item->remote);
+
+	if ((mkdir(item->local,0755)) && (errno!=EEXIST)) {
+		printf("Could not make local directory %s: %s\n",
+			item->local,strerror(errno));
+		return -1;
+	}
+
+	if ((ret=ml_readdir_did(t->vol,item->did,&listing))) {
+		printf("Could not list %s, error %d\n",item->remote,ret);
+		return -1;
+	}
+
+	while ((p=afp_listing_next(listing,&i))) {
+		if (p->isdir) {
+			if ((child=transfer_child(item,p->fileid,p->name,0755))) {
+				child->next=dirs;
+				dirs=child;
+			}
+		} else {
+			mode=p->unixprivs.permissions & 07777;
+			if ((child=transfer_child(item,item->did,p->name,
+				mode ? mode : 0644))) {
+				child->next=files;
+				files=child;
+				nfiles++;
+			}
+		}
+		if (child==NULL) errors++;
+	}
+	afp_listing_free(listing);
+
+	transfer_queue(t,dirs,files,nfiles);
+	return errors ? -1 : 0;
+}
+
+static int transfer_get_file(struct transfer * t, struct transfer_item * item,
+	char * buf, unsigned long long * bytes)
+{
+	struct afp_file_info * fp;
+	off_t offset=0;
+	int fd, ret, eof=0;
+
+	if ((fd=open(item->local,O_CREAT|O_TRUNC|O_WRONLY,item->mode))<0) {
+		printf("Could not open local file %s: %s\n",
+			item->local,strerror(errno));
+		return -1;
+	}
+
+	if ((ret=ml_open_did(t->vol,item->did,item->name,O_RDONLY,&fp))) {
+		printf("Could not open %s on server, error %d\n",
+			item->remote,ret);
+		goto error;
+	}
+
+	while (!eof) {
+		ret=ml_read(t->vol,NULL,buf,TRANSFER_BUFSIZE,offset,fp,&eof);
+		if (ret<0) {
+			printf("Could not read %s, error %d\n",item->remote,ret);
+			break;
+		}
+		if (ret==0) break;
+		if (write_all(fd,buf,ret)) {
+			printf("Could not write local file %s: %s\n",
+				item->local,strerror(errno));
+			ret=-1;
+			break;
+		}
+		offset+=ret;
+	}
+
+	ml_close(t->vol,NULL,fp);
+	free(fp);
+	close(fd);
+	*bytes+=offset;
+	return (ret<0) ? -1 : 0;
+
+error:
+	close(fd);
+	return -1;
+}
+
+static int transfer_put_dir(struct transfer * t, struct transfer_item * item)
+{
+	DIR * dir;
+	struct dirent * de;
+	struct stat stbuf;
+	struct transfer_item * child, * dirs=NULL, * files=NULL;
+	unsigned int did, nfiles=0;
+	int ret, errors=0;
+
+	printf("Putting directory %s\n",item->local);
+
+	ret=ml_mkdir_did(t->vol,item->did,item->name,item->mode | 0700);
+	if ((ret) && (ret!=-EEXIST)) {
+		printf("Could not make directory %s on server, error %d\n",
+			item->remote,ret);
+		return -1;
+	}
+	if ((ret=ml_getattr_did(t->vol,item->did,item->name,&stbuf))) {
+		printf("Could not get attributes of %s, error %d\n",
+			item->remote,ret);
+		return -1;
+	}
+	if (!S_ISDIR(stbuf.st_mode)) {
+		printf("%s is not a directory on the server\n",item->remote);
+		return -1;
+	}
+	did=stbuf.st_ino;
+
+	if ((dir=opendir(item->local))==NULL) {
+		printf("Could not open local directory %s: %s\n",
+			item->local,strerror(errno));
+		return -1;
+	}
+
+	while ((de=readdir(dir))) {
+		if ((strcmp(de->d_name,".")==0) || (strcmp(de->d_name,"..")==0))
+			continue;
+		if ((child=transfer_child(item,did,de->d_name,0))==NULL) {
+			errors++;
+			continue;
+		}
+		if (lstat(child->local,&stbuf)) {
+			printf("Could not look at %s: %s\n",
+				child->local,strerror(errno));
+			free(child);
+			errors++;
+			continue;
+		}
+		child->mode=stbuf.st_mode & 07777;
+		if (S_ISDIR(stbuf.st_mode)) {
+			child->next=dirs;
+			dirs=child;
+		} else if (S_ISREG(stbuf.st_mode)) {
+			child->next=files;
+			files=child;
+			nfiles++;
+		} else {
+			printf("Skipping %s, not a file or directory\n",
+				child->local);
+			free(child);
+		}
+	}
+	closedir(dir);
+
+	transfer_queue(t,dirs,files,nfiles);
+	return errors ? -1 : 0;
+}
+
+static int transfer_put_file(struct transfer * t, struct transfer_item * item,
+	char * buf, unsigned long long * bytes)
+{
+	struct afp_file_info * fp;
+	off_t offset=0;
+	ssize_t amount_read;
+	int fd, ret, closeret, flags=O_RDWR;
+
+	if ((fd=open(item->local,O_RDONLY))<0) {
+		printf("Could not open local file %s: %s\n",
+			item->local,strerror(errno));
+		return -1;
+	}
+
+	ret=ml_creat_did(t->vol,item->did,item->name,item->mode);
+	if (ret==-EEXIST)
+		flags|=O_TRUNC;
+	else if (ret) {
+		printf("Could not create %s on server, error %d\n",
+			item->remote,ret);
+		goto error;
+	}
+
+	if ((ret=ml_open_did(t->vol,item->did,item->name,flags,&fp))) {
+		printf("Could not open %s on server, error %d\n",
+			item->remote,ret);
+		goto error;
+	}
+
+	while ((amount_read=read(fd,buf,TRANSFER_BUFSIZE))) {
+		if (amount_read<0) {
+			if (errno==EINTR) continue;
+			printf("Could not read local file %s: %s\n",
+				item->local,strerror(errno));
+			ret=-1;
+			break;
+		}
+		ret=ml_write(t->vol,NULL,buf,amount_read,offset,fp,
+			t->uid,t->gid);
+		if (ret<0) {
+			printf("Could not write %s, error %d\n",
+				item->remote,ret);
+			break;
+		}
+		offset+=amount_read;
+	}
+
+	/* Buffered writes that fail only show up here */
+	if ((closeret=ml_close(t->vol,NULL,fp))) {
+		if (closeret>0) closeret=-closeret;
+		printf("Could not close %s on server, error %d\n",
+			item->remote,closeret);
+		ret=-1;
+	}
+	free(fp);
+	close(fd);
+	*bytes+=offset;
+	return (ret<0) ? -1 : 0;
+
+error:
+	close(fd);
+	return -1;
+}
+
+static void * transfer_worker(void * other)
+{
+	struct transfer * t = other;
+	struct transfer_item * item;
+	unsigned long long bytes;
+	char * buf;
+	int isdir, ret;
+
+	if ((buf=malloc(TRANSFER_BUFSIZE))==NULL)
+		return NULL;
+
+	pthread_mutex_lock(&t->mutex);
+	while (1) {
+		while ((t->dirs==NULL) && (t->files==NULL) && (t->busy))
+			pthread_cond_wait(&t->cond,&t->mutex);
+		if ((t->dirs==NULL) && (t->files==NULL))
+			break;
+
+		if ((t->files) &&
+			((t->dirs==NULL) || (t->waiting_files>=t->backlog))) {
+			item=t->files;
+			t->files=item->next;
+			t->waiting_files--;
+			isdir=0;
+		} else {
+			item=t->dirs;
+			t->dirs=item->next;
+			isdir=1;
+		}
+		t->busy++;
+		pthread_mutex_unlock(&t->mutex);
+
+		bytes=0;
+		if (isdir)
+			ret = t->put ? transfer_put_dir(t,item) :
+				transfer_get_dir(t,item);
+		else
+			ret = t->put ? transfer_put_file(t,item,buf,&bytes) :
+				transfer_get_file(t,item,buf,&bytes);
+		free(item);
+
+		pthread_mutex_lock(&t->mutex);
+		t->busy--;
+		t->totals.bytes+=bytes;
+		if (ret)
+			t->totals.errors++;
+		else if (isdir)
+			t->totals.dirs++;
+		else
+			t->totals.files++;
+		if ((t->dirs==NULL) && (t->files==NULL) && (t->busy==0))
+			pthread_cond_broadcast(&t->cond);
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	free(buf);
+	return NULL;
+}
+
+static int transfer_run(struct transfer * t, struct transfer_item * root,
+	int jobs)
+{
+	pthread_t threads[TRANSFER_MAX_JOBS];
+	struct transfer_item * item;
+	int i, started=0;
+
+	if (jobs<1) jobs=1;
+	if (jobs>TRANSFER_MAX_JOBS) jobs=TRANSFER_MAX_JOBS;
+
+	pthread_mutex_init(&t->mutex,NULL);
+	pthread_cond_init(&t->cond,NULL);
+	t->dirs=root;
+	t->backlog=jobs*TRANSFER_BACKLOG;
+
+	/* This thread is a worker too */
+	for (i=1;i<jobs;i++)
+		if (pthread_create(&threads[started],NULL,
+			transfer_worker,t)==0)
+			started++;
+	transfer_worker(t);
+	for (i=0;i<started;i++)
+		pthread_join(threads[i],NULL);
+
+	/* Only left when no worker could get a buffer */
+	while ((item=t->dirs)) {
+		t->dirs=item->next;
+		free(item);
+		t->totals.errors++;
+	}
+	while ((item=t->files)) {
+		t->files=item->next;
+		free(item);
+		t->totals.errors++;
+	}
+
+	pthread_cond_destroy(&t->cond);
+	pthread_mutex_destroy(&t->mutex);
+
+	return t->totals.errors ? -1 : 0;
+}
+
+/* transfer_get_tree()
+ *
+ * Copies the directory remote on the server, and everything under it,
+ * to the local directory local, with jobs workers.
+ */
+
+int transfer_get_tree(struct afp_volume * vol, const char * remote,
+	const char * local, int jobs, struct transfer_totals * totals)
+{
+	struct transfer t;
+	struct transfer_item * root;
+	struct stat stbuf;
+	int ret;
+
+	memset(totals,0,sizeof(*totals));
+
+	if ((ret=ml_getattr(vol,remote,&stbuf))) {
+		printf("Could not get attributes of %s, error %d\n",remote,ret);
+		return -1;
+	}
+	if (!S_ISDIR(stbuf.st_mode)) {
+		printf("%s is not a directory\n",remote);
+		return -1;
+	}
+
+	memset(&t,0,sizeof(t));
+	t.vol=vol;
+
+	if ((root=transfer_item_new(stbuf.st_ino,remote,local,0755))==NULL)
+		return -1;
+
+	ret=transfer_run(&t,root,jobs);
+	*totals=t.totals;
+	return ret;
+}
+
+/* transfer_put_tree()
+ *
+ * Copies the local directory local, and everything under it, to remote
+ * on the server, with jobs workers.  The directory that remote is in has
+ * to exist already.
+ */
+
+int transfer_put_tree(struct afp_volume * vol, const char * local,
+	const char * remote, int jobs, struct transfer_totals * totals)
+{
+	struct transfer t;
+	struct transfer_item * root;
+	struct stat stbuf;
+	char parent[AFP_MAX_PATH];
+	int ret;
+
+	memset(totals,0,sizeof(*totals));
+
+	if (stat(local,&stbuf)) {
+		printf("Could not look at %s: %s\n",local,strerror(errno));
+		return -1;
+	}
+	if (!S_ISDIR(stbuf.st_mode)) {
+		printf("%s is not a directory\n",local);
+		return -1;
+	}
+
+	memset(&t,0,sizeof(t));
+	t.vol=vol;
+	t.put=1;
+	t.uid=getuid();
+	t.gid=getgid();
+
+	if ((root=transfer_item_new(0,remote,local,stbuf.st_mode & 07777))==NULL)
+		return -1;
+	if (strlen(root->name)==0) {
+		printf("Need a name for the directory on the server\n");
+		goto error;
+	}
+
+	snprintf(parent,sizeof(parent),"%s",remote);
+	if ((ret=ml_getattr(vol,dirname(parent),&stbuf))) {
+		printf("Could not get attributes of %s, error %d\n",
+			parent,ret);
+		goto error;
+	}
+	root->did=stbuf.st_ino;
+
+	ret=transfer_run(&t,root,jobs);
+	*totals=t.totals;
+	return ret;
+
+error:
+	free(root);
+	return -1;
+}
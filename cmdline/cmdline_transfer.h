@@ -0,0 +1,22 @@
+#ifndef __CMDLINE_TRANSFER_H_
+#define __CMDLINE_TRANSFER_H_
+
+#include "afpfs-ng/afp.h"
+
+#define TRANSFER_DEFAULT_JOBS 4
+#define TRANSFER_MAX_JOBS 64
+
+struct transfer_totals {
+	unsigned long long bytes;
+	unsigned int files;
+	unsigned int dirs;
+	unsigned int errors;
+};
+
+int transfer_get_tree(struct afp_volume * vol, const char * remote,
+	const char * local, int jobs, struct transfer_totals * totals);
+
+int transfer_put_tree(struct afp_volume * vol, const char * local,
+	const char * remote, int jobs, struct transfer_totals * totals);
+
+#endif
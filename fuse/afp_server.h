@@ -35,6 +35,10 @@ struct afp_server_mount_request {
 	unsigned int volume_options;
 	unsigned int map;
 	int changeuid;
+	unsigned int readahead_window;
+	unsigned int did_cache_timeout;
+	unsigned int attr_cache_timeout;
+	unsigned int sessions;
 };
 
 struct afp_server_status_request {
@@ -42,9 +46,19 @@ struct afp_server_status_request {
 	char servername[AFP_VOLUME_NAME_LEN];
 };
 
+/* In front of every request.  len covers the header and the request
+ * after it, so several can be sent without waiting for the answers. */
+struct afp_server_request_header {
+	char command;
+	unsigned int len;
+	unsigned int close;	/* afpfsd hangs up after answering */
+	unsigned int requestid;
+};
+
 struct afp_server_response {
 	char result;
 	unsigned int len;
+	unsigned int requestid;	/* copied from the request */
 };
 
 
@@ -155,6 +155,16 @@ static void usage(void)
 "               \"DHCAST128\", \"Client Krb v2\", \"DHX2\" \n\n"
 "         -m, --map <mapname> : use this uid/gid mapping method, one of:\n"
 "               \"Common user directory\", \"Login ids\"\n"
+"         -r, --readahead <n> : keep <n> reads in flight ahead of\n"
+"               sequential readers, 0 turns read-ahead off\n"
+"         -c, --cachetimeout <secs> : how long directory IDs are\n"
+"               cached, 0 turns the cache off\n"
+"         -t, --attrtimeout <secs> : how long file attributes are\n"
+"               cached, 0 turns the cache off\n"
+"         -s, --sessions <n> : open <n> more connections to the server\n"
+"               and spread large reads and writes over them\n"
+"         -i, --inodes : use the server's node IDs as inode numbers and\n"
+"               look files up by directory ID (AFP 3.x only)\n"
 "    status: get status of the AFP daemon\n\n"
 "    unmount <mountpoint> : unmount\n\n"
 "    suspend <servername> : terminates the connection to the server, but\n"
@@ -171,10 +181,26 @@ static int send_command(int sock, char * msg,int len)
 	return write(sock,msg,len);
 }
 
+/* Starts the outgoing buffer with the header for a request of len
+ * bytes, and returns where the request goes.  We only ever send the one,
+ * so afpfsd can hang up once it has answered. */
+static void * prepare_request(char command, unsigned int len)
+{
+	struct afp_server_request_header * header = (void *) outgoing_buffer;
+
+	outgoing_len=sizeof(*header)+len;
+	memset(outgoing_buffer,0,outgoing_len);
+	header->command=command;
+	header->len=outgoing_len;
+	header->close=1;
+	header->requestid=1;
+
+	return outgoing_buffer+sizeof(*header);
+}
+
 static int do_exit(int argc,char **argv)
 {
-	outgoing_len=1;
-	outgoing_buffer[0]=AFP_SERVER_COMMAND_EXIT;
+	prepare_request(AFP_SERVER_COMMAND_EXIT,0);
 
 	return 0;
 
@@ -192,10 +218,8 @@ static int do_status(int argc, char ** argv)
 		{0,0,0,0},
 	};
 
-	outgoing_len=sizeof(struct afp_server_status_request)+1;
-	req = (void *) outgoing_buffer+1;
-	memset(outgoing_buffer,0,outgoing_len);
-	outgoing_buffer[0]=AFP_SERVER_COMMAND_STATUS;
+	req = prepare_request(AFP_SERVER_COMMAND_STATUS,
+		sizeof(struct afp_server_status_request));
 
         while(1) {
 		optnum++;
@@ -216,16 +240,14 @@ static int do_status(int argc, char ** argv)
 static int do_resume(int argc, char ** argv) 
 {
 	struct afp_server_resume_request * req;
-	outgoing_len=sizeof(struct afp_server_resume_request)+1;
-	req = (void *) outgoing_buffer+1;
 	if (argc<3) {
 		usage();
 		return -1;
 	}
 
-	memset(req,0,sizeof(*req));
+	req = prepare_request(AFP_SERVER_COMMAND_RESUME,
+		sizeof(struct afp_server_resume_request));
 	snprintf(req->server_name,AFP_SERVER_NAME_LEN,"%s",argv[2]);
-	outgoing_buffer[0]=AFP_SERVER_COMMAND_RESUME;
 
 	return 0;
 }
@@ -233,16 +255,14 @@ static int do_resume(int argc, char ** argv)
 static int do_suspend(int argc, char ** argv) 
 {
 	struct afp_server_suspend_request * req;
-	outgoing_len=sizeof(struct afp_server_suspend_request)+1;
-	req = (void *) outgoing_buffer+1;
 	if (argc<3) {
 		usage();
 		return -1;
 	}
 
-	memset(req,0,sizeof(*req));
+	req = prepare_request(AFP_SERVER_COMMAND_SUSPEND,
+		sizeof(struct afp_server_suspend_request));
 	snprintf(req->server_name,AFP_SERVER_NAME_LEN,"%s",argv[2]);
-	outgoing_buffer[0]=AFP_SERVER_COMMAND_SUSPEND;
 
 	return 0;
 }
@@ -250,16 +270,14 @@ static int do_suspend(int argc, char ** argv)
 static int do_unmount(int argc, char ** argv) 
 {
 	struct afp_server_unmount_request * req;
-	outgoing_len=sizeof(struct afp_server_unmount_request)+1;
-	req = (void *) outgoing_buffer+1;
 	if (argc<2) {
 		usage();
 		return -1;
 	}
 
-	memset(req,0,sizeof(*req));
+	req = prepare_request(AFP_SERVER_COMMAND_UNMOUNT,
+		sizeof(struct afp_server_unmount_request));
 	snprintf(req->mountpoint,255,"%s",argv[2]);
-	outgoing_buffer[0]=AFP_SERVER_COMMAND_UNMOUNT;
 
 	return 0;
 }
@@ -270,6 +288,7 @@ static int do_mount(int argc, char ** argv)
         int option_index=0;
 	struct afp_server_mount_request * req;
 	int optnum;
+	int inodes=0;
 	unsigned int uam_mask=default_uams_mask();
 
 	struct option long_options[] = {
@@ -280,6 +299,11 @@ static int do_mount(int argc, char ** argv)
 		{"port",1,0,'o'},
 		{"uam",1,0,'a'},
 		{"map",1,0,'m'},
+		{"readahead",1,0,'r'},
+		{"cachetimeout",1,0,'c'},
+		{"attrtimeout",1,0,'t'},
+		{"sessions",1,0,'s'},
+		{"inodes",0,0,'i'},
 		{0,0,0,0},
 	};
 
@@ -288,16 +312,17 @@ static int do_mount(int argc, char ** argv)
 		return -1;
 	}
 
-	outgoing_len=sizeof(struct afp_server_mount_request)+1;
-	req = (void *) outgoing_buffer+1;
-	memset(outgoing_buffer,0,outgoing_len);
-	outgoing_buffer[0]=AFP_SERVER_COMMAND_MOUNT;
+	req = prepare_request(AFP_SERVER_COMMAND_MOUNT,
+		sizeof(struct afp_server_mount_request));
 	req->url.port=548;
 	req->map=AFP_MAPPING_UNKNOWN;
+	req->readahead_window=AFP_DEFAULT_READAHEAD_WINDOW;
+	req->did_cache_timeout=AFP_DEFAULT_DID_CACHE_TIMEOUT;
+	req->attr_cache_timeout=AFP_DEFAULT_ATTR_CACHE_TIMEOUT;
 
         while(1) {
 		optnum++;
-                c = getopt_long(argc,argv,"a:u:m:o:p:v:V:",
+                c = getopt_long(argc,argv,"a:c:iu:m:o:p:r:s:t:v:V:",
                         long_options,&option_index);
                 if (c==-1) break;
                 switch(c) {
@@ -310,6 +335,21 @@ static int do_mount(int argc, char ** argv)
                 case 'm':
 			req->map=map_string_to_num(optarg);
                         break;
+                case 'r':
+			req->readahead_window=strtol(optarg,NULL,10);
+                        break;
+                case 'c':
+			req->did_cache_timeout=strtol(optarg,NULL,10);
+                        break;
+                case 't':
+			req->attr_cache_timeout=strtol(optarg,NULL,10);
+                        break;
+                case 's':
+			req->sessions=strtol(optarg,NULL,10);
+                        break;
+                case 'i':
+			inodes=1;
+                        break;
                 case 'u':
                         snprintf(req->url.username,AFP_MAX_USERNAME_LEN,"%s",optarg);
                         break;
@@ -356,6 +396,7 @@ static int do_mount(int argc, char ** argv)
 
 	req->uam_mask=uam_mask;
 	req->volume_options=DEFAULT_MOUNT_FLAGS;
+	if (inodes) req->volume_options |= VOLUME_EXTRA_FLAGS_NODE_IDS;
 
 	if (optnum>=argc) {
 		printf("No mount point specified\n");
@@ -370,16 +411,21 @@ static int do_mount(int argc, char ** argv)
 
 static void mount_afp_usage(void)
 {
-	printf("Usage:\n     mount_afp [-o volpass=password] <afp url> <mountpoint>\n");
+	printf("Usage:\n     mount_afp [-o volpass=password,readahead=n,didtimeout=secs,attrtimeout=secs,sessions=n,inodes] <afp url> <mountpoint>\n");
 }
 
 static int handle_mount_afp(int argc, char * argv[])
 {
-	struct afp_server_mount_request * req = (void *) outgoing_buffer+1;
+	struct afp_server_mount_request * req;
 	unsigned int uam_mask=default_uams_mask();
 	char * urlstring, * mountpoint;
 	char * volpass = NULL;
 	int readonly=0;
+	int inodes=0;
+	unsigned int readahead=AFP_DEFAULT_READAHEAD_WINDOW;
+	unsigned int didtimeout=AFP_DEFAULT_DID_CACHE_TIMEOUT;
+	unsigned int attrtimeout=AFP_DEFAULT_ATTR_CACHE_TIMEOUT;
+	unsigned int sessions=0;
 
 	if (argc<2) {
 		mount_afp_usage();
@@ -423,6 +469,16 @@ static int handle_mount_afp(int argc, char * argv[])
 				/* Don't do anything */
 			} else if (strcmp(command,"ro")==0) {
 				readonly=1;
+			} else if (strncmp(command,"readahead=",10)==0) {
+				readahead=strtol(command+10,NULL,10);
+			} else if (strncmp(command,"didtimeout=",11)==0) {
+				didtimeout=strtol(command+11,NULL,10);
+			} else if (strncmp(command,"attrtimeout=",12)==0) {
+				attrtimeout=strtol(command+12,NULL,10);
+			} else if (strncmp(command,"sessions=",9)==0) {
+				sessions=strtol(command+9,NULL,10);
+			} else if (strcmp(command,"inodes")==0) {
+				inodes=1;
 			} else {
 				printf("Unknown option %s, skipping\n",command);
 			}
@@ -441,8 +497,8 @@ static int handle_mount_afp(int argc, char * argv[])
 	}
 
 
-	outgoing_len=sizeof(struct afp_server_mount_request)+1;
-	memset(outgoing_buffer,0,outgoing_len);
+	req = prepare_request(AFP_SERVER_COMMAND_MOUNT,
+		sizeof(struct afp_server_mount_request));
 
 	afp_default_url(&req->url);
 
@@ -450,9 +506,13 @@ static int handle_mount_afp(int argc, char * argv[])
 
 	req->volume_options|=DEFAULT_MOUNT_FLAGS;
 	if (readonly) req->volume_options |= VOLUME_EXTRA_FLAGS_READONLY;
+	if (inodes) req->volume_options |= VOLUME_EXTRA_FLAGS_NODE_IDS;
+	req->readahead_window=readahead;
+	req->did_cache_timeout=didtimeout;
+	req->attr_cache_timeout=attrtimeout;
+	req->sessions=sessions;
 	req->uam_mask=uam_mask;
 
-	outgoing_buffer[0]=AFP_SERVER_COMMAND_MOUNT;
 	req->map=AFP_MAPPING_UNKNOWN;
 	snprintf(req->mountpoint,255,"%s",mountpoint);
 	if (afp_parse_url(&req->url,urlstring,0) !=0) 
@@ -18,6 +18,8 @@
 #include <stdarg.h>
 #include <getopt.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
 #include "afpfs-ng/afp.h"
 #include "afpfs-ng/dsi.h"
@@ -58,20 +60,24 @@ void fuse_set_log_method(int new_method)
 }
 
 
+static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static int remove_client(struct fuse_client * toremove) 
 {
 	struct fuse_client * c, * prev=NULL;
 
+	pthread_mutex_lock(&client_mutex);
 	for (c=client_base;c;c=c->next) {
 		if (c==toremove) {
-			if (!prev) client_base=NULL;
+			if (!prev) client_base=toremove->next;
 			else prev->next=toremove->next;
+			pthread_mutex_unlock(&client_mutex);
 			free(toremove);
-			toremove=NULL;
 			return 0;
 		}
 		prev=c;
 	}
+	pthread_mutex_unlock(&client_mutex);
 	return -1;
 }
 
@@ -85,28 +91,40 @@ static int fuse_add_client(int fd)
 	memset(newc,0,sizeof(*newc));
 	newc->fd=fd;
 	newc->next=NULL;
+	pthread_mutex_lock(&client_mutex);
 	if (client_base==NULL) client_base=newc;
 	else {
 		for (c=client_base;c->next;c=c->next);
 		c->next=newc;
 
 	}
+	pthread_mutex_unlock(&client_mutex);
 	return 0;
 error:
 	return -1;
 }
 
+static void close_client(struct fuse_client * c)
+{
+	rm_fd_and_signal(c->fd);
+	close(c->fd);
+	remove_client(c);
+}
+
 static int fuse_process_client_fds(fd_set * set, int max_fd)
 {
 
 	struct fuse_client * c;
 
+	pthread_mutex_lock(&client_mutex);
 	for (c=client_base;c;c=c->next) {
 		if (FD_ISSET(c->fd,set)) {
-			if (process_command(c)<0) return -1;
+			pthread_mutex_unlock(&client_mutex);
+			process_command(c);
 			return 1;
 		}
 	}
+	pthread_mutex_unlock(&client_mutex);
 	return 0;
 
 }
@@ -118,42 +136,24 @@ static int fuse_scan_extra_fds(int command_fd, fd_set *set, int * max_fd)
 	socklen_t new_len = sizeof(struct sockaddr_un);
 	int new_fd;
 
-
-
 	if (FD_ISSET(command_fd,set)) {
 		new_fd=accept(command_fd,(struct sockaddr *) &new_addr,&new_len);
 		if (new_fd>=0) {
-			fuse_add_client(new_fd);
-			FD_SET(new_fd,set);
-			if ((new_fd+1) > *max_fd) *max_fd=new_fd+1;
+			if (fuse_add_client(new_fd)) 
+				close(new_fd);
+			else
+				add_fd_and_signal(new_fd);
 		}
+		return 1;
 	}
 
-	switch (fuse_process_client_fds(set,*max_fd)) {
-	case -1:
-		{
-			int i;
-			FD_CLR(new_fd,set);
-			for (i=*max_fd;i>=0;i--)
-				if (FD_ISSET(i,set)) {
-					*max_fd=i;
-					break;
-				}
-		}
+	if (fuse_process_client_fds(set,*max_fd))
+		return 1;
 
-		(*max_fd)++;
-		close(new_fd);
-		goto out;
-	case 1:
-		goto out;
-	}
 	/* unknown fd */
 	sleep(10);
 
 	return 0;
-
-out:
-	return 1;
 }
 
 static void fuse_log_for_client(void * priv,
@@ -191,6 +191,7 @@ static void * start_fuse_thread(void * other)
 	const char *fuseargv[200];
 #define mountstring_len (AFP_SERVER_NAME_LEN+1+AFP_VOLUME_NAME_LEN+1)
 	char mountstring[mountstring_len];
+	char timeouts[64];
 	struct start_fuse_thread_arg * arg = other;
 	struct afp_volume * volume = arg->volume;
 	struct fuse_client * c = arg->client;
@@ -221,6 +222,17 @@ static void * start_fuse_thread(void * other)
 		fuseargc++;
 	}
 
+	/* Let the kernel keep attributes as long as we do.  The low level
+	   interface gives the timeouts with each reply instead. */
+	if (!(volume->extra_flags & VOLUME_EXTRA_FLAGS_NODE_IDS)) {
+		snprintf(timeouts,64,"attr_timeout=%u,entry_timeout=%u",
+			volume->attr_cache_timeout,volume->attr_cache_timeout);
+		fuseargv[fuseargc]="-o";
+		fuseargc++;
+		fuseargv[fuseargc]=timeouts;
+		fuseargc++;
+	}
+
 
 /* #ifdef USE_SINGLE_THREAD */
 	fuseargv[fuseargc]="-s";
@@ -230,8 +242,12 @@ static void * start_fuse_thread(void * other)
 */
 	global_volume=volume; 
 
-	arg->fuse_result= 
-		afp_register_fuse(fuseargc, (char **) fuseargv,volume);
+	if (volume->extra_flags & VOLUME_EXTRA_FLAGS_NODE_IDS)
+		arg->fuse_result=
+			afp_register_fuse_ll(fuseargc,(char **) fuseargv,volume);
+	else
+		arg->fuse_result= 
+			afp_register_fuse(fuseargc, (char **) fuseargv,volume);
 
 	arg->fuse_errno=errno;
 
@@ -262,7 +278,8 @@ static int volopen(struct fuse_client * c, struct afp_volume * volume)
 
 static unsigned char process_suspend(struct fuse_client * c)
 {
-	struct afp_server_suspend_request * req =(void *)c->incoming_string+1;
+	struct afp_server_suspend_request * req =(void *) c->incoming_string+
+		sizeof(struct afp_server_request_header);
 	struct afp_server * s;
 
 	/* Find the server */
@@ -303,7 +320,8 @@ static int afp_server_reconnect_loud(struct fuse_client * c, struct afp_server *
 
 static unsigned char process_resume(struct fuse_client * c)
 {
-	struct afp_server_resume_request * req =(void *) c->incoming_string+1;
+	struct afp_server_resume_request * req =(void *) c->incoming_string+
+		sizeof(struct afp_server_request_header);
 	struct afp_server * s;
 
 	/* Find the server */
@@ -333,7 +351,8 @@ static unsigned char process_unmount(struct fuse_client * c)
 	struct afp_volume * v;
 	int j=0;
 
-	req=(void *) c->incoming_string+1;
+	req=(void *) c->incoming_string+
+		sizeof(struct afp_server_request_header);
 
 	for (s=get_server_base();s;s=s->next) {
 		for (j=0;j<s->num_volumes;j++) {
@@ -385,7 +404,8 @@ static unsigned char process_status(struct fuse_client * c)
 	char text[40960];
 	int len=40960;
 
-	if ((c->incoming_size + 1)< sizeof(struct afp_server_status_request)) 
+	if (c->incoming_size < sizeof(struct afp_server_request_header)+
+		sizeof(struct afp_server_status_request)) 
 		return AFP_SERVER_RESULT_ERROR;
 
 	afp_status_header(text,&len);
@@ -412,10 +432,12 @@ static int process_mount(struct fuse_client * c)
 	int ret;
 	struct stat lstat;
 
-	if ((c->incoming_size-1) < sizeof(struct afp_server_mount_request)) 
+	if (c->incoming_size < sizeof(struct afp_server_request_header)+
+		sizeof(struct afp_server_mount_request)) 
 		goto error;
 
-	req=(void *) c->incoming_string+1;
+	req=(void *) c->incoming_string+
+		sizeof(struct afp_server_request_header);
 
 	/* Todo should check the existance and perms of the mount point */
 
@@ -466,9 +488,27 @@ static int process_mount(struct fuse_client * c)
 
 	volume->extra_flags|=req->volume_options;
 
+	/* Only AFP 3.x node IDs last long enough to be inode numbers */
+	if ((volume->extra_flags & VOLUME_EXTRA_FLAGS_NODE_IDS) &&
+		(s->using_version->av_number < 30)) {
+		log_for_client((void *)c,AFPFSD,LOG_NOTICE,
+			"Inode numbers from node IDs need AFP 3.0 or later, "
+			"using paths\n");
+		volume->extra_flags&=~VOLUME_EXTRA_FLAGS_NODE_IDS;
+	}
+
 	volume->mapping=req->map;
+	volume->readahead_window=req->readahead_window;
+	volume->did_cache_timeout=req->did_cache_timeout;
+	volume->attr_cache_timeout=req->attr_cache_timeout;
 	afp_detect_mapping(volume);
 
+	if ((req->sessions) &&
+		(afp_sessions_start(s,req->sessions)<req->sessions))
+		log_for_client((void *)c,AFPFSD,LOG_NOTICE,
+			"Not all the extra sessions could be opened, "
+			"using what we have\n");
+
 	snprintf(volume->mountpoint,255, "%s", req->mountpoint);
 
 	/* Create the new thread and block until we get an answer back */
@@ -549,16 +589,84 @@ error:
 }
 
 
-static void * process_command_thread(void * other)
+/* take_request()
+ *
+ * Moves the next whole request out of pending_string and into
+ * incoming_string.  A client may send several without waiting for the
+ * answers, so there can be more behind it.
+ *
+ * Returns:
+ * 1: there is a request in incoming_string
+ * 0: we don't have all of the next one yet
+ * -1: the client sent something we can't make sense of
+ */
+
+static int take_request(struct fuse_client * c)
 {
+	struct afp_server_request_header * header = 
+		(void *) c->pending_string;
+	unsigned int len;
 
-	struct fuse_client * c = other;
-	int ret=0;
+	if (c->pending_size < sizeof(struct afp_server_request_header))
+		return 0;
+
+	len=header->len;
+	if ((len<sizeof(struct afp_server_request_header)) || 
+		(len>AFP_CLIENT_INCOMING_BUF))
+		return -1;
+
+	if (c->pending_size < len)
+		return 0;
+
+	memcpy(c->incoming_string,c->pending_string,len);
+	c->incoming_size=len;
+	c->close=header->close;
+
+	c->pending_size-=len;
+	memmove(c->pending_string,c->pending_string+len,c->pending_size);
+
+	return 1;
+}
+
+static int send_response(struct fuse_client * c, char result)
+{
+	struct afp_server_request_header * req = (void *) c->incoming_string;
 	char tosend[sizeof(struct afp_server_response) + MAX_CLIENT_RESPONSE];
 	struct afp_server_response response;
+	unsigned int total=0, len;
+	int ret;
+
+	response.result=result;
+	response.len=strlen(c->client_string);
+	response.requestid=req->requestid;
+
+	bcopy(&response,tosend,sizeof(response));
+	bcopy(c->client_string,tosend+sizeof(response),response.len);
+	len=sizeof(response)+response.len;
+
+	/* A client that has gone away mustn't take us down with SIGPIPE */
+	while (total<len) {
+		ret=send(c->fd,tosend+total,len-total,MSG_NOSIGNAL);
+		if (ret<0) {
+			if (errno==EINTR) continue;
+			perror("Writing");
+			return -1;
+		}
+		total+=ret;
+	}
+	return 0;
+}
 
+static void queue_command(struct fuse_client * c);
 
-	switch(c->incoming_string[0]) {
+static void process_command_thread(struct fuse_client * c)
+{
+	struct afp_server_request_header * req = (void *) c->incoming_string;
+	int ret=0;
+
+	c->client_string[0]='\0';
+
+	switch(req->command) {
 	case AFP_SERVER_COMMAND_MOUNT: 
 		ret=process_mount(c);
 		break;
@@ -579,51 +687,137 @@ static void * process_command_thread(void * other)
 		break;
 	case AFP_SERVER_COMMAND_EXIT: 
 		ret=process_exit(c);
+		c->close=1;
 		break;
 	default:
 		log_for_client((void *)c,AFPFSD,LOG_ERR,"Unknown command\n");
 	}
-	/* Send response */
-	response.result=ret;
-	response.len=strlen(c->client_string);
 
-	bcopy(&response,tosend,sizeof(response));
-	bcopy(c->client_string,tosend+sizeof(response),response.len);
-	ret=write(c->fd,tosend,sizeof(response)+response.len);
-	if (ret<0) {
-		perror("Writing");
+	if ((send_response(c,ret)) || (c->close)) {
+		close_client(c);
+		return;
 	}
 
-	if ((!c) || (c->fd==0)) return NULL;
-	rm_fd_and_signal(c->fd);
-	close(c->fd);
-	remove_client(c);
+	/* Run the next request if the client has already sent it, 
+	   otherwise go back to waiting for it */
+	switch (take_request(c)) {
+	case 1:
+		queue_command(c);
+		break;
+	case 0:
+		add_fd_and_signal(c->fd);
+		break;
+	default:
+		close_client(c);
+	}
+}
+
+/* The workers
+ *
+ * Commands are run by a fixed pool of threads that wait on a queue,
+ * rather than by a new thread for each command.  A client has at most
+ * one command queued or running at a time and isn't listened to until
+ * it has been answered, so the answers go back in the order asked.
+ */
+
+static struct fuse_client * command_queue_head = NULL;
+static struct fuse_client * command_queue_tail = NULL;
+static pthread_mutex_t command_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t command_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t command_workers_once = PTHREAD_ONCE_INIT;
+static unsigned int command_workers_started = 0;
+
+static void * command_worker(void * other)
+{
+	struct fuse_client * c;
+
+	while (1) {
+		pthread_mutex_lock(&command_queue_mutex);
+		while (command_queue_head==NULL)
+			pthread_cond_wait(&command_queue_cond,
+				&command_queue_mutex);
+		c=command_queue_head;
+		command_queue_head=c->queue_next;
+		if (command_queue_head==NULL)
+			command_queue_tail=NULL;
+		pthread_mutex_unlock(&command_queue_mutex);
+
+		process_command_thread(c);
+	}
 
 	return NULL;
+}
+
+static void start_command_workers(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (i=0;i<FUSE_NUM_WORKERS;i++) {
+		if (pthread_create(&thread,&attr,command_worker,NULL)) {
+			perror("pthread_create");
+			break;
+		}
+		command_workers_started++;
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+static void queue_command(struct fuse_client * c)
+{
+	pthread_once(&command_workers_once,start_command_workers);
+
+	if (command_workers_started==0) {
+		/* We couldn't start any, so do it ourselves */
+		process_command_thread(c);
+		return;
+	}
 
+	c->queue_next=NULL;
+
+	pthread_mutex_lock(&command_queue_mutex);
+	if (command_queue_tail)
+		command_queue_tail->queue_next=c;
+	else
+		command_queue_head=c;
+	command_queue_tail=c;
+	pthread_cond_signal(&command_queue_cond);
+	pthread_mutex_unlock(&command_queue_mutex);
 }
+
+/* Reads what the client has sent us and, once there is a whole request,
+ * hands it to a worker.  We stop listening to the client until the
+ * worker has answered. */
 static int process_command(struct fuse_client * c)
 {
 	int ret;
-	int fd;
 
-	ret=read(c->fd,&c->incoming_string,AFP_CLIENT_INCOMING_BUF);
+	ret=read(c->fd,c->pending_string+c->pending_size,
+		AFP_CLIENT_INCOMING_BUF-c->pending_size);
 
 	if (ret<=0) {
-		perror("reading");
+		if (ret<0) perror("reading");
 		goto out;
 	}
-	c->incoming_size=ret;
+	c->pending_size+=ret;
 
-	pthread_t thread;
-	pthread_create(&thread,NULL,process_command_thread,c);
+	switch (take_request(c)) {
+	case 0:
+		return 0;
+	case -1:
+		goto out;
+	}
+
+	rm_fd_and_signal(c->fd);
+	queue_command(c);
 	return 0;
 out:
-	fd=c->fd;
-	c->fd=0;
-	remove_client(c);
-	close(fd);
-	rm_fd_and_signal(fd);
+	close_client(c);
 	return 0;
 }
 
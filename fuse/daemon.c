@@ -30,14 +30,12 @@
 #include "afpfs-ng/utils.h"
 #include "daemon.h"
 #include "commands.h"
+#include "fuse_int.h"
 
 #define MAX_ERROR_LEN 1024
 #define STATUS_LEN 1024
 
 
-#define MAX_CLIENT_RESPONSE 2048
-
-
 static int debug_mode = 0;
 static char commandfilename[PATH_MAX];
 
@@ -67,7 +65,10 @@ void fuse_forced_ending_hook(void)
 int fuse_unmount_volume(struct afp_volume * volume)
 {
 	if (volume->priv) {
-		fuse_exit((struct fuse *)volume->priv);
+		if (volume->extra_flags & VOLUME_EXTRA_FLAGS_NODE_IDS)
+			afp_exit_fuse_ll(volume);
+		else
+			fuse_exit((struct fuse *)volume->priv);
 		pthread_kill(volume->thread, SIGHUP);
 		pthread_join(volume->thread,NULL);
 	}
@@ -118,6 +119,7 @@ static void usage(void)
 "  -l, --logmethod    Either 'syslog' or 'stdout'"
 "  -f, --foreground   Do not fork\n"
 "  -d, --debug        Does not fork, logs to stdout\n"
+"  -t, --threads=n    Receive from servers on n threads\n"
 "Version %s\n", AFPFS_VERSION);
 }
 
@@ -130,8 +132,7 @@ static int remove_other_daemon(void)
         char incoming_buffer[MAX_CLIENT_RESPONSE];
         struct timeval tv;
         fd_set rds;
-#define OUTGOING_PACKET_LEN 1
-	char outgoing_buffer[OUTGOING_PACKET_LEN];
+	struct afp_server_request_header ping;
 
 	if (access(commandfilename,F_OK)!=0) 
 		goto doesnotexist; /* file doesn't even exist */
@@ -153,9 +154,11 @@ static int remove_other_daemon(void)
 
 	/* Try writing to it */
 
-	outgoing_buffer[0]=AFP_SERVER_COMMAND_PING;
-	if (write(sock, outgoing_buffer,OUTGOING_PACKET_LEN)
-		<OUTGOING_PACKET_LEN)
+	memset(&ping,0,sizeof(ping));
+	ping.command=AFP_SERVER_COMMAND_PING;
+	ping.len=sizeof(ping);
+	ping.close=1;
+	if (write(sock,&ping,sizeof(ping))<sizeof(ping))
 		goto dead;
 
 	/* See if we get a response */
@@ -211,6 +214,7 @@ int main(int argc, char *argv[]) {
 		{"logmethod",1,0,'l'},
 		{"foreground",0,0,'f'},
 		{"debug",1,0,'d'},
+		{"threads",1,0,'t'},
 		{0,0,0,0},
 	};
 	int new_log_method=LOG_METHOD_SYSLOG;
@@ -230,7 +234,7 @@ int main(int argc, char *argv[]) {
 
 	while (1) {
 		optnum++;
-		c = getopt_long(argc,argv,"l:fdh",
+		c = getopt_long(argc,argv,"l:fdht:",
 			long_options,&option_index);
 		if (c==-1) break;
 		switch (c) {
@@ -252,6 +256,13 @@ int main(int argc, char *argv[]) {
 				debug_mode=1;
 				new_log_method=LOG_METHOD_STDOUT;
 				break;
+			case 't':
+				if (afp_loop_set_io_threads(atoi(optarg))<0) {
+					printf("Cannot use %s receive threads\n",
+						optarg);
+					return -1;
+				}
+				break;
 			case 'h':
 			default:
 				usage();
@@ -113,36 +113,70 @@ static int fuse_unlink(const char *path)
 }
 
 
-static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                         off_t offset, struct fuse_file_info *fi)
+/* The directory is read a batch at a time as the kernel asks for it,
+ * rather than listed in full first.  Offsets 1 and 2 follow . and ..,
+ * and each entry is at its index in the directory plus 3, so a readdir
+ * that carries on from an offset starts the enumerate there. */
+static int fuse_opendir(const char * path, struct fuse_file_info * fi)
 {
-	(void) offset;
-	(void) fi;
-	struct afp_file_info * filebase = NULL, * p;
+	struct ml_dir * dir;
 	int ret;
 	struct afp_volume * volume=
 		(struct afp_volume *)
 		((struct fuse_context *)(fuse_get_context()))->private_data;
 
-	log_fuse_event(AFPFSD,LOG_DEBUG,"*** readdir of %s\n",path);
+	log_fuse_event(AFPFSD,LOG_DEBUG,"*** opendir of %s\n",path);
 
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+	if ((ret=ml_opendir(volume,path,&dir)))
+		return ret;
+	fi->fh=(unsigned long) dir;
+	return 0;
+}
 
-	ret=ml_readdir(volume,path,&filebase);
+static int fuse_releasedir(const char * path, struct fuse_file_info * fi)
+{
+	ml_closedir((struct ml_dir *) (unsigned long) fi->fh);
+	return 0;
+}
 
-	if (ret) goto error;
+/* Each entry goes to the kernel with the attributes the enumerate
+ * already gave us.  Only the type gets through, but the getattrs that
+ * follow are answered from the attribute cache. */
+static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi)
+{
+	struct ml_dir * dir = (struct ml_dir *) (unsigned long) fi->fh;
+	struct afp_dirent * p;
+	struct stat stbuf;
+	unsigned int i;
+	int ret, plus;
+	struct afp_volume * volume=
+		(struct afp_volume *)
+		((struct fuse_context *)(fuse_get_context()))->private_data;
 
-	for (p=filebase;p;p=p->next) {
-		filler(buf,p->name,NULL,0);
+	log_fuse_event(AFPFSD,LOG_DEBUG,"*** readdir of %s from %lld\n",
+		path,(long long) offset);
+
+	if ((offset<1) && (filler(buf, ".", NULL, 1)))
+		return 0;
+	if ((offset<2) && (filler(buf, "..", NULL, 2)))
+		return 0;
+
+	/* What is in an AppleDouble directory is made up, and its
+	   attributes are worked out by getattr */
+	plus=!((volume->extra_flags & VOLUME_EXTRA_FLAGS_SHOW_APPLEDOUBLE) &&
+		(strstr(path,"/.AppleDouble")));
+
+	for (i=(offset>2) ? offset-2 : 0;
+		(ret=ml_readdir_entry(dir,i,&p))==1;i++) {
+		if ((plus) && (ml_dirent_stat(volume,p,&stbuf)==0)) {
+			if (filler(buf,p->name,&stbuf,i+3))
+				break;
+		} else if (filler(buf,p->name,NULL,i+3))
+			break;
 	}
 
-	afp_ml_filebase_free(&filebase);
-
-    return 0;
-
-error:
-	return ret;
+	return (ret<0) ? ret : 0;
 }
 
 static int fuse_mknod(const char *path, mode_t mode, dev_t dev)
@@ -181,6 +215,31 @@ error:
 	return ret;
 }
 
+static int fuse_flush(const char * path, struct fuse_file_info * fi)
+{
+	struct afp_file_info * fp = (void *) fi->fh;
+	struct afp_volume * volume=
+		(struct afp_volume *)
+		((struct fuse_context *)(fuse_get_context()))->private_data;
+
+	log_fuse_event(AFPFSD,LOG_DEBUG,"*** flush of %s\n",path);
+
+	return ml_flush(volume,path,fp);
+}
+
+static int fuse_fsync(const char * path, int datasync,
+	struct fuse_file_info * fi)
+{
+	struct afp_file_info * fp = (void *) fi->fh;
+	struct afp_volume * volume=
+		(struct afp_volume *)
+		((struct fuse_context *)(fuse_get_context()))->private_data;
+
+	log_fuse_event(AFPFSD,LOG_DEBUG,"*** fsync of %s\n",path);
+
+	return ml_flush(volume,path,fp);
+}
+
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
 
@@ -472,7 +531,9 @@ static struct fuse_operations afp_oper = {
 	.getattr	=fuse_getattr,
 	.open	= fuse_open,
 	.read	= fuse_read,
+	.opendir	= fuse_opendir,
 	.readdir	= fuse_readdir,
+	.releasedir	= fuse_releasedir,
 	.mkdir      = fuse_mkdir,
 	.readlink = fuse_readlink,
 	.rmdir	= fuse_rmdir,
@@ -480,6 +541,8 @@ static struct fuse_operations afp_oper = {
 	.mknod  = fuse_mknod,
 	.write = fuse_write,
 	.release= fuse_release,
+	.flush	= fuse_flush,
+	.fsync	= fuse_fsync,
 	.chmod=fuse_chmod,
 	.symlink=fuse_symlink,
 	.chown=fuse_chown,
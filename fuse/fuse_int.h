@@ -4,5 +4,9 @@
 
 
 int afp_register_fuse(int fuseargc, char *fuseargv[],struct afp_volume * vol);
+
+int afp_register_fuse_ll(int fuseargc, char *fuseargv[],
+	struct afp_volume * vol);
+void afp_exit_fuse_ll(struct afp_volume * vol);
 #endif
 
@@ -3,13 +3,21 @@
 
 #define AFP_CLIENT_INCOMING_BUF 2048
 
+/* Threads running client commands.  A mount can take several seconds,
+ * so there are enough that one doesn't hold up everyone else. */
+#define FUSE_NUM_WORKERS 8
+
 
 struct fuse_client {
-	char incoming_string[AFP_CLIENT_INCOMING_BUF];
+	char incoming_string[AFP_CLIENT_INCOMING_BUF];	/* being run */
 	int incoming_size;
+	char pending_string[AFP_CLIENT_INCOMING_BUF];	/* not yet run */
+	int pending_size;
+	int close;	/* hang up once this one is answered */
 	/* char client_string[sizeof(struct afp_server_response) + MAX_CLIENT_RESPONSE]; */
 	char client_string[1000 + MAX_CLIENT_RESPONSE];
 	int fd;
+	struct fuse_client * queue_next;
 	struct fuse_client * next;
 };
 
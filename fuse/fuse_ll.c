@@ -0,0 +1,944 @@
+/*
+    fuse_ll.c: FUSE low level interface for afpfs-ng, by inode
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    This is the alternative to fuse_int.c for AFP 3.x volumes.  The inode
+    numbers are the AFP node IDs, which stay the same for as long as a
+    file or directory exists, with the root of the volume as FUSE_ROOT_ID.
+    For every inode the kernel has looked up we keep the ID of the
+    directory it is in and its name, so that each call goes to the server
+    by directory ID and name without a path being resolved.  A node is
+    kept for as long as the kernel holds lookups on it and goes away when
+    they are all forgotten.
+
+    The attributes themselves are in the library's attribute cache, which
+    is keyed by the same directory ID and name.  The calls that don't
+    matter for speed (chmod, symlinks, and so on) rebuild the path from
+    the nodes and go through the usual ml_ functions.  AppleDouble files
+    aren't made up on this interface.
+
+    The session loop runs in several threads.  The node table, and the
+    parent and name of each node, are only touched with the mutex held;
+    calls that go to the server take copies first.  A node can't go away
+    while a call on it is running, since the kernel doesn't forget an
+    inode it is still using.
+*/
+
+#define HAVE_ARCH_STRUCT_FLOCK
+
+#define FUSE_USE_VERSION 26
+
+#include "afpfs-ng/afp.h"
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <asm/fcntl.h>
+#else
+#include <fcntl.h>
+#endif
+
+#include <utime.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "afpfs-ng/afp_protocol.h"
+#include "afpfs-ng/midlevel.h"
+#include "fuse_int.h"
+#include "fuse_error.h"
+
+#define FUSE_LL_BUCKETS 4096
+
+struct fuse_ll_node {
+	struct fuse_ll_node * next;	/* in the hash chain */
+	unsigned int id;		/* AFP node ID */
+	unsigned int parent;		/* ID of the directory it is in */
+	unsigned char isdir;
+	uint64_t nlookup;
+	char * name;
+};
+
+struct fuse_ll {
+	struct afp_volume * volume;
+	struct fuse_session * se;
+	pthread_mutex_t mutex;
+	struct fuse_ll_node * nodes[FUSE_LL_BUCKETS];
+	struct fuse_ll_node root;
+};
+
+/* DID 1 is the parent of the root, which is never looked up, so the root
+ * can take FUSE_ROOT_ID */
+static fuse_ino_t fuse_ll_ino(unsigned int id)
+{
+	return (id==AFP_ROOT_DID) ? FUSE_ROOT_ID : id;
+}
+
+static unsigned int fuse_ll_bucket(unsigned int id)
+{
+	return (id*2654435761U) & (FUSE_LL_BUCKETS-1);
+}
+
+/* Must be called with the mutex held */
+static struct fuse_ll_node * fuse_ll_find_locked(struct fuse_ll * ll,
+	fuse_ino_t ino)
+{
+	struct fuse_ll_node * node;
+
+	if (ino==FUSE_ROOT_ID)
+		return &ll->root;
+
+	for (node=ll->nodes[fuse_ll_bucket(ino)];node;node=node->next)
+		if (node->id==ino)
+			return node;
+	return NULL;
+}
+
+static struct fuse_ll_node * fuse_ll_find(struct fuse_ll * ll, fuse_ino_t ino)
+{
+	struct fuse_ll_node * node;
+
+	pthread_mutex_lock(&ll->mutex);
+	node=fuse_ll_find_locked(ll,ino);
+	pthread_mutex_unlock(&ll->mutex);
+	return node;
+}
+
+/* Copies where node is, for a call to the server.  A node whose file was
+ * replaced by a rename is nowhere any more. */
+static int fuse_ll_where(struct fuse_ll * ll, struct fuse_ll_node * node,
+	unsigned int * parent, char * name)
+{
+	int ret=0;
+
+	pthread_mutex_lock(&ll->mutex);
+	if (node->parent==0)
+		ret=-ESTALE;
+	else {
+		*parent=node->parent;
+		snprintf(name,AFP_MAX_PATH,"%s",node->name);
+	}
+	pthread_mutex_unlock(&ll->mutex);
+	return ret;
+}
+
+/* Must be called with the mutex held */
+static int fuse_ll_set_name(struct fuse_ll_node * node,
+	unsigned int parent, const char * name)
+{
+	char * copy;
+
+	node->parent=parent;
+	if ((node->name) && (strcmp(node->name,name)==0))
+		return 0;
+	if ((copy=strdup(name))==NULL)
+		return -ENOMEM;
+	free(node->name);
+	node->name=copy;
+	return 0;
+}
+
+/* Counts a lookup of id, which was found as name in parent.  If it has
+ * moved since we last saw it, it is moved here too. */
+static struct fuse_ll_node * fuse_ll_remember(struct fuse_ll * ll,
+	unsigned int id, unsigned int parent, const char * name,
+	unsigned char isdir)
+{
+	struct fuse_ll_node * node;
+	unsigned int bucket;
+
+	pthread_mutex_lock(&ll->mutex);
+	if ((node=fuse_ll_find_locked(ll,fuse_ll_ino(id)))==NULL) {
+		if ((node=malloc(sizeof(*node)))==NULL)
+			goto out;
+		memset(node,0,sizeof(*node));
+		node->id=id;
+		node->isdir=isdir;
+		bucket=fuse_ll_bucket(id);
+		node->next=ll->nodes[bucket];
+		ll->nodes[bucket]=node;
+	}
+
+	if ((node!=&ll->root) && (fuse_ll_set_name(node,parent,name))) {
+		node=NULL;
+		goto out;
+	}
+
+	node->nlookup++;
+out:
+	pthread_mutex_unlock(&ll->mutex);
+	return node;
+}
+
+static void fuse_ll_forget_node(struct fuse_ll * ll,
+	struct fuse_ll_node * node, unsigned long nlookup)
+{
+	struct fuse_ll_node ** pp;
+
+	pthread_mutex_lock(&ll->mutex);
+	if (node->nlookup>nlookup) {
+		node->nlookup-=nlookup;
+		goto out;
+	}
+	node->nlookup=0;
+	if (node==&ll->root)
+		goto out;
+
+	for (pp=&ll->nodes[fuse_ll_bucket(node->id)];*pp;pp=&(*pp)->next)
+		if (*pp==node) {
+			*pp=node->next;
+			break;
+		}
+	free(node->name);
+	free(node);
+out:
+	pthread_mutex_unlock(&ll->mutex);
+}
+
+static void fuse_ll_free_nodes(struct fuse_ll * ll)
+{
+	struct fuse_ll_node * node, * next;
+	int i;
+
+	for (i=0;i<FUSE_LL_BUCKETS;i++)
+		for (node=ll->nodes[i];node;node=next) {
+			next=node->next;
+			free(node->name);
+			free(node);
+		}
+}
+
+/* Puts together the path of node, for the calls that need one.  The
+ * kernel keeps the directories above anything it has looked up, so
+ * they should all be here.  Must be called with the mutex held. */
+static int fuse_ll_path_locked(struct fuse_ll * ll,
+	struct fuse_ll_node * node, char * path, size_t len)
+{
+	struct fuse_ll_node * parent;
+	size_t used;
+	int ret;
+
+	if (node==&ll->root) {
+		snprintf(path,len,"/");
+		return 0;
+	}
+
+	if ((node->parent==0) ||
+		((parent=fuse_ll_find_locked(ll,fuse_ll_ino(node->parent)))==NULL))
+		return -ESTALE;
+	if ((ret=fuse_ll_path_locked(ll,parent,path,len)))
+		return ret;
+
+	used=strlen(path);
+	if (snprintf(path+used,len-used,"%s%s",
+		(used>1) ? "/" : "", node->name)>=len-used)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+static int fuse_ll_path(struct fuse_ll * ll, struct fuse_ll_node * node,
+	char * path, size_t len)
+{
+	int ret;
+
+	pthread_mutex_lock(&ll->mutex);
+	ret=fuse_ll_path_locked(ll,node,path,len);
+	pthread_mutex_unlock(&ll->mutex);
+	return ret;
+}
+
+static int fuse_ll_child_path(struct fuse_ll * ll, struct fuse_ll_node * dir,
+	const char * name, char * path, size_t len)
+{
+	size_t used;
+	int ret;
+
+	if ((ret=fuse_ll_path(ll,dir,path,len)))
+		return ret;
+
+	used=strlen(path);
+	if (snprintf(path+used,len-used,"%s%s",
+		(used>1) ? "/" : "", name)>=len-used)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+/* The directory's own attributes change with what is in it */
+static void fuse_ll_changed(struct fuse_ll * ll, struct fuse_ll_node * dir)
+{
+	pthread_mutex_lock(&ll->mutex);
+	if (dir->parent)
+		ml_invalidate_did(ll->volume,dir->parent,dir->name);
+	pthread_mutex_unlock(&ll->mutex);
+}
+
+static int fuse_ll_getattr_node(struct fuse_ll * ll,
+	struct fuse_ll_node * node, struct stat * stbuf)
+{
+	char name[AFP_MAX_PATH];
+	unsigned int parent;
+	int ret;
+
+	if ((ret=fuse_ll_where(ll,node,&parent,name)))
+		return ret;
+
+	ret=ml_getattr_did(ll->volume,parent,name,stbuf);
+
+	/* A directory that someone else moved can still be found by its ID */
+	if ((ret==-ENOENT) && (node->isdir))
+		ret=ml_getattr_did(ll->volume,node->id,"",stbuf);
+
+	stbuf->st_ino=fuse_ll_ino(node->id);
+	return ret;
+}
+
+/* Fills e for name in the directory parent, and counts it as looked up */
+static int fuse_ll_entry(struct fuse_ll * ll, unsigned int parent,
+	const char * name, struct fuse_entry_param * e)
+{
+	struct fuse_ll_node * node;
+	int ret;
+
+	memset(e,0,sizeof(*e));
+
+	if ((ret=ml_getattr_did(ll->volume,parent,name,&e->attr)))
+		return ret;
+	if (e->attr.st_ino==0)
+		return -EIO;
+
+	if ((node=fuse_ll_remember(ll,e->attr.st_ino,parent,name,
+		S_ISDIR(e->attr.st_mode) ? 1 : 0))==NULL)
+		return -ENOMEM;
+
+	e->ino=fuse_ll_ino(node->id);
+	e->attr.st_ino=e->ino;
+	e->attr_timeout=ll->volume->attr_cache_timeout;
+	e->entry_timeout=ll->volume->attr_cache_timeout;
+	return 0;
+}
+
+static void fuse_ll_reply_entry(fuse_req_t req, struct fuse_ll * ll,
+	struct fuse_ll_node * dir, const char * name)
+{
+	struct fuse_entry_param e;
+	int ret;
+
+	if ((ret=fuse_ll_entry(ll,dir->id,name,&e)))
+		fuse_reply_err(req,-ret);
+	else
+		fuse_reply_entry(req,&e);
+}
+
+static void fuse_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+	const char * name)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * dir;
+
+	if ((dir=fuse_ll_find(ll,parent))==NULL) {
+		fuse_reply_err(req,ESTALE);
+		return;
+	}
+	fuse_ll_reply_entry(req,ll,dir,name);
+}
+
+static void fuse_ll_forget(fuse_req_t req, fuse_ino_t ino,
+	unsigned long nlookup)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * node;
+
+	if ((node=fuse_ll_find(ll,ino)))
+		fuse_ll_forget_node(ll,node,nlookup);
+	fuse_reply_none(req);
+}
+
+static void fuse_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info * fi)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * node;
+	struct stat stbuf;
+	int ret;
+
+	if ((node=fuse_ll_find(ll,ino))==NULL) {
+		fuse_reply_err(req,ESTALE);
+		return;
+	}
+
+	if ((ret=fuse_ll_getattr_node(ll,node,&stbuf)))
+		fuse_reply_err(req,-ret);
+	else
+		fuse_reply_attr(req,&stbuf,ll->volume->attr_cache_timeout);
+}
+
+static void fuse_ll_setattr(fuse_req_t req, fuse_ino_t ino,
+	struct stat * attr, int to_set, struct fuse_file_info * fi)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct afp_volume * volume = ll->volume;
+	struct fuse_ll_node * node;
+	struct stat stbuf;
+	struct utimbuf timebuf;
+	char path[AFP_MAX_PATH];
+	int ret;
+
+	if ((node=fuse_ll_find(ll,ino))==NULL) {
+		ret=-ESTALE;
+		goto error;
+	}
+	if ((ret=fuse_ll_path(ll,node,path,AFP_MAX_PATH)))
+		goto error;
+	if ((ret=fuse_ll_getattr_node(ll,node,&stbuf)))
+		goto error;
+
+	if (to_set & FUSE_SET_ATTR_MODE) {
+		ret=ml_chmod(volume,path,attr->st_mode);
+		/* Like fuse_chmod(), go on without the bits that a broken
+		   netatalk won't take */
+		if ((ret) && (ret!=-EFAULT))
+			goto error;
+	}
+
+	if (to_set & (FUSE_SET_ATTR_UID|FUSE_SET_ATTR_GID)) {
+		if ((ret=ml_chown(volume,path,
+			(to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : stbuf.st_uid,
+			(to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : stbuf.st_gid)))
+			goto error;
+	}
+
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		if ((ret=ml_truncate(volume,path,attr->st_size)))
+			goto error;
+	}
+
+	/* AFP only keeps the modification time */
+	if (to_set & FUSE_SET_ATTR_MTIME) {
+		timebuf.actime=attr->st_atime;
+		timebuf.modtime=attr->st_mtime;
+		if ((ret=ml_utime(volume,path,&timebuf)))
+			goto error;
+	}
+
+	if ((ret=fuse_ll_getattr_node(ll,node,&stbuf)))
+		goto error;
+	fuse_reply_attr(req,&stbuf,volume->attr_cache_timeout);
+	return;
+
+error:
+	fuse_reply_err(req,-ret);
+}
+
+static void fuse_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * node;
+	char path[AFP_MAX_PATH];
+	char link[AFP_MAX_PATH];
+	int ret;
+
+	if ((node=fuse_ll_find(ll,ino))==NULL) {
+		fuse_reply_err(req,ESTALE);
+		return;
+	}
+	memset(link,0,AFP_MAX_PATH);
+	if (((ret=fuse_ll_path(ll,node,path,AFP_MAX_PATH))) ||
+		((ret=ml_readlink(ll->volume,path,link,AFP_MAX_PATH-1)))) {
+		fuse_reply_err(req,-ret);
+		return;
+	}
+	fuse_reply_readlink(req,link);
+}
+
+static void fuse_ll_mknod(fuse_req_t req, fuse_ino_t parent,
+	const char * name, mode_t mode, dev_t rdev)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * dir;
+	int ret;
+
+	if ((dir=fuse_ll_find(ll,parent))==NULL) {
+		fuse_reply_err(req,ESTALE);
+		return;
+	}
+	ret=ml_creat_did(ll->volume,dir->id,name,mode);
+	fuse_ll_changed(ll,dir);
+	if (ret) {
+		fuse_reply_err(req,-ret);
+		return;
+	}
+	fuse_ll_reply_entry(req,ll,dir,name);
+}
+
+static void fuse_ll_mkdir(fuse_req_t req, fuse_ino_t parent,
+	const char * name, mode_t mode)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * dir;
+	int ret;
+
+	if ((dir=fuse_ll_find(ll,parent))==NULL) {
+		fuse_reply_err(req,ESTALE);
+		return;
+	}
+	ret=ml_mkdir_did(ll->volume,dir->id,name,mode);
+	fuse_ll_changed(ll,dir);
+	if (ret) {
+		fuse_reply_err(req,-ret);
+		return;
+	}
+	fuse_ll_reply_entry(req,ll,dir,name);
+}
+
+static void fuse_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+	const char * name)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * dir;
+	int ret;
+
+	if ((dir=fuse_ll_find(ll,parent))==NULL) {
+		fuse_reply_err(req,ESTALE);
+		return;
+	}
+	ret=ml_unlink_did(ll->volume,dir->id,name);
+	fuse_ll_changed(ll,dir);
+	fuse_reply_err(req,-ret);
+}
+
+static void fuse_ll_rmdir(fuse_req_t req, fuse_ino_t parent,
+	const char * name)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * dir;
+	int ret;
+
+	if ((dir=fuse_ll_find(ll,parent))==NULL) {
+		fuse_reply_err(req,ESTALE);
+		return;
+	}
+	ret=ml_rmdir_did(ll->volume,dir->id,name);
+	fuse_ll_changed(ll,dir);
+	fuse_reply_err(req,-ret);
+}
+
+static void fuse_ll_symlink(fuse_req_t req, const char * link,
+	fuse_ino_t parent, const char * name)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * dir;
+	char path[AFP_MAX_PATH];
+	int ret;
+
+	if ((dir=fuse_ll_find(ll,parent))==NULL) {
+		fuse_reply_err(req,ESTALE);
+		return;
+	}
+	if ((ret=fuse_ll_child_path(ll,dir,name,path,AFP_MAX_PATH))==0)
+		ret=ml_symlink(ll->volume,link,path);
+	fuse_ll_changed(ll,dir);
+	if (ret) {
+		if ((ret==-EFAULT) || (ret==-ENOSYS))
+			log_for_client(NULL,AFPFSD,LOG_WARNING,
+			"Got some sort of internal error in when creating symlink\n");
+		fuse_reply_err(req,-ret);
+		return;
+	}
+	fuse_ll_reply_entry(req,ll,dir,name);
+}
+
+static void fuse_ll_rename(fuse_req_t req, fuse_ino_t parent,
+	const char * name, fuse_ino_t newparent, const char * newname)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * dir, * newdir, * node;
+	struct stat stbuf, replaced;
+	int ret;
+
+	if (((dir=fuse_ll_find(ll,parent))==NULL) ||
+		((newdir=fuse_ll_find(ll,newparent))==NULL)) {
+		fuse_reply_err(req,ESTALE);
+		return;
+	}
+
+	/* Find out what is being moved and what it replaces, which the
+	   cache usually knows */
+	if ((ret=ml_getattr_did(ll->volume,dir->id,name,&stbuf)))
+		goto out;
+	if (ml_getattr_did(ll->volume,newdir->id,newname,&replaced))
+		replaced.st_ino=0;
+
+	ret=ml_rename_did(ll->volume,dir->id,name,newdir->id,newname);
+	fuse_ll_changed(ll,dir);
+	fuse_ll_changed(ll,newdir);
+	if (ret)
+		goto out;
+
+	pthread_mutex_lock(&ll->mutex);
+	/* The kernel may still hold the replaced node, but it is gone */
+	if ((replaced.st_ino) && (replaced.st_ino!=stbuf.st_ino) &&
+		((node=fuse_ll_find_locked(ll,fuse_ll_ino(replaced.st_ino)))) &&
+		(node!=&ll->root))
+		node->parent=0;
+	if ((node=fuse_ll_find_locked(ll,fuse_ll_ino(stbuf.st_ino))))
+		ret=fuse_ll_set_name(node,newdir->id,newname);
+	pthread_mutex_unlock(&ll->mutex);
+
+out:
+	fuse_reply_err(req,-ret);
+}
+
+static void fuse_ll_open(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info * fi)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * node;
+	struct afp_file_info * fp;
+	char name[AFP_MAX_PATH];
+	unsigned int dirid;
+	int ret;
+
+	if ((node=fuse_ll_find(ll,ino))==NULL) {
+		fuse_reply_err(req,ESTALE);
+		return;
+	}
+	if (node->isdir) {
+		fuse_reply_err(req,EISDIR);
+		return;
+	}
+
+	if (((ret=fuse_ll_where(ll,node,&dirid,name))) ||
+		((ret=ml_open_did(ll->volume,dirid,name,fi->flags,&fp)))) {
+		fuse_reply_err(req,-ret);
+		return;
+	}
+	fi->fh=(unsigned long) fp;
+	fuse_reply_open(req,fi);
+}
+
+static void fuse_ll_create(fuse_req_t req, fuse_ino_t parent,
+	const char * name, mode_t mode, struct fuse_file_info * fi)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * dir;
+	struct fuse_entry_param e;
+	struct afp_file_info * fp;
+	int ret;
+
+	if ((dir=fuse_ll_find(ll,parent))==NULL) {
+		fuse_reply_err(req,ESTALE);
+		return;
+	}
+
+	ret=ml_creat_did(ll->volume,dir->id,name,mode);
+	fuse_ll_changed(ll,dir);
+	if ((ret==-EEXIST) && (!(fi->flags & O_EXCL)))
+		ret=0;
+	if (ret)
+		goto error;
+
+	if ((ret=ml_open_did(ll->volume,dir->id,name,fi->flags,&fp)))
+		goto error;
+
+	if ((ret=fuse_ll_entry(ll,dir->id,name,&e))) {
+		ml_close(ll->volume,NULL,fp);
+		free(fp);
+		goto error;
+	}
+
+	fi->fh=(unsigned long) fp;
+	fuse_reply_create(req,&e,fi);
+	return;
+
+error:
+	fuse_reply_err(req,-ret);
+}
+
+static void fuse_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+	off_t offset, struct fuse_file_info * fi)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct afp_file_info * fp = (void *) (unsigned long) fi->fh;
+	size_t amount_read=0;
+	char * buf;
+	int ret, eof;
+
+	if ((buf=malloc(size))==NULL) {
+		fuse_reply_err(req,ENOMEM);
+		return;
+	}
+
+	while (amount_read<size) {
+		ret=ml_read(ll->volume,NULL,buf+amount_read,
+			size-amount_read,offset+amount_read,fp,&eof);
+		if (ret<0) {
+			fuse_reply_err(req,-ret);
+			goto out;
+		}
+		amount_read+=ret;
+		if (eof) break;
+	}
+	fuse_reply_buf(req,buf,amount_read);
+out:
+	free(buf);
+}
+
+static void fuse_ll_write(fuse_req_t req, fuse_ino_t ino, const char * buf,
+	size_t size, off_t offset, struct fuse_file_info * fi)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct afp_file_info * fp = (void *) (unsigned long) fi->fh;
+	const struct fuse_ctx * ctx = fuse_req_ctx(req);
+	int ret;
+
+	ret=ml_write(ll->volume,NULL,buf,size,offset,fp,ctx->uid,ctx->gid);
+	if (ret<0)
+		fuse_reply_err(req,-ret);
+	else
+		fuse_reply_write(req,ret);
+}
+
+static void fuse_ll_flush(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info * fi)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+
+	fuse_reply_err(req,-ml_flush(ll->volume,NULL,
+		(void *) (unsigned long) fi->fh));
+}
+
+static void fuse_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+	struct fuse_file_info * fi)
+{
+	fuse_ll_flush(req,ino,fi);
+}
+
+static void fuse_ll_release(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info * fi)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct afp_file_info * fp = (void *) (unsigned long) fi->fh;
+	int ret;
+
+	/* EIO comes back positive, a failed flush negative */
+	ret=ml_close(ll->volume,NULL,fp);
+	free(fp);
+	fuse_reply_err(req,ret<0 ? -ret : ret);
+}
+
+/* The directory is read a batch at a time as readdir gets to it, with
+ * the offsets as indexes into it, so only one batch is kept however big
+ * it is */
+static void fuse_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info * fi)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct fuse_ll_node * node;
+	struct ml_dir * dir;
+	int ret;
+
+	if ((node=fuse_ll_find(ll,ino))==NULL) {
+		fuse_reply_err(req,ESTALE);
+		return;
+	}
+	if (!node->isdir) {
+		fuse_reply_err(req,ENOTDIR);
+		return;
+	}
+
+	if ((ret=ml_opendir_did(ll->volume,node->id,&dir))) {
+		fuse_reply_err(req,-ret);
+		return;
+	}
+	fi->fh=(unsigned long) dir;
+	fuse_reply_open(req,fi);
+}
+
+/* Offsets 1 and 2 follow . and .., and each entry is at its index plus 3 */
+static void fuse_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+	off_t offset, struct fuse_file_info * fi)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct ml_dir * dir = (void *) (unsigned long) fi->fh;
+	struct fuse_ll_node * node;
+	struct afp_dirent * p;
+	struct stat stbuf;
+	char name[AFP_MAX_PATH];
+	unsigned int i, dirid;
+	size_t pos=0, len;
+	char * buf;
+	int ret=0;
+
+	if ((buf=malloc(size))==NULL) {
+		fuse_reply_err(req,ENOMEM);
+		return;
+	}
+	memset(&stbuf,0,sizeof(stbuf));
+
+	for (;offset<2;offset++) {
+		stbuf.st_ino=ino;
+		if ((offset==1) && (ino!=FUSE_ROOT_ID) &&
+			((node=fuse_ll_find(ll,ino))) &&
+			(fuse_ll_where(ll,node,&dirid,name)==0))
+			stbuf.st_ino=fuse_ll_ino(dirid);
+		stbuf.st_mode=S_IFDIR;
+		len=fuse_add_direntry(req,buf+pos,size-pos,
+			offset ? ".." : ".",&stbuf,offset+1);
+		if (len>size-pos)
+			goto out;
+		pos+=len;
+	}
+
+	for (i=offset-2;(ret=ml_readdir_entry(dir,i,&p))==1;i++) {
+		stbuf.st_ino=fuse_ll_ino(p->fileid);
+		if (p->unixprivs.permissions & S_IFMT)
+			stbuf.st_mode=p->unixprivs.permissions & S_IFMT;
+		else
+			stbuf.st_mode=p->isdir ? S_IFDIR : S_IFREG;
+		len=fuse_add_direntry(req,buf+pos,size-pos,p->name,
+			&stbuf,i+3);
+		if (len>size-pos)
+			break;
+		pos+=len;
+	}
+
+out:
+	/* An error after some entries waits for the next readdir */
+	if ((ret<0) && (pos==0))
+		fuse_reply_err(req,-ret);
+	else
+		fuse_reply_buf(req,buf,pos);
+	free(buf);
+}
+
+static void fuse_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info * fi)
+{
+	ml_closedir((void *) (unsigned long) fi->fh);
+	fuse_reply_err(req,0);
+}
+
+static void fuse_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct fuse_ll * ll = fuse_req_userdata(req);
+	struct statvfs stat;
+	int ret;
+
+	if ((ret=ml_statfs(ll->volume,"/",&stat)))
+		fuse_reply_err(req,-ret);
+	else
+		fuse_reply_statfs(req,&stat);
+}
+
+static void fuse_ll_init(void * userdata, struct fuse_conn_info * conn)
+{
+	struct fuse_ll * ll = userdata;
+	struct afp_volume * vol = ll->volume;
+
+	vol->priv=ll;
+	/* Trigger the daemon that we've started */
+	vol->mounted=1;
+	pthread_cond_signal(&vol->startup_condition_cond);
+}
+
+static void fuse_ll_destroy(void * userdata)
+{
+	struct fuse_ll * ll = userdata;
+	struct afp_volume * volume = ll->volume;
+
+	if (volume->mounted==AFP_VOLUME_UNMOUNTED) {
+		log_for_client(NULL,AFPFSD,LOG_WARNING,"Skipping unmounting of the volume %s\n",volume->volume_name_printable);
+		return;
+	}
+	if (!volume->server) return;
+
+	afp_unmount_volume(volume);
+}
+
+static struct fuse_lowlevel_ops fuse_ll_oper = {
+	.init		= fuse_ll_init,
+	.destroy	= fuse_ll_destroy,
+	.lookup		= fuse_ll_lookup,
+	.forget		= fuse_ll_forget,
+	.getattr	= fuse_ll_getattr,
+	.setattr	= fuse_ll_setattr,
+	.readlink	= fuse_ll_readlink,
+	.mknod		= fuse_ll_mknod,
+	.mkdir		= fuse_ll_mkdir,
+	.unlink		= fuse_ll_unlink,
+	.rmdir		= fuse_ll_rmdir,
+	.symlink	= fuse_ll_symlink,
+	.rename		= fuse_ll_rename,
+	.open		= fuse_ll_open,
+	.read		= fuse_ll_read,
+	.write		= fuse_ll_write,
+	.flush		= fuse_ll_flush,
+	.release	= fuse_ll_release,
+	.fsync		= fuse_ll_fsync,
+	.opendir	= fuse_ll_opendir,
+	.readdir	= fuse_ll_readdir,
+	.releasedir	= fuse_ll_releasedir,
+	.statfs		= fuse_ll_statfs,
+	.create		= fuse_ll_create,
+};
+
+/* Stops the session loop, from another thread */
+void afp_exit_fuse_ll(struct afp_volume * vol)
+{
+	struct fuse_ll * ll = vol->priv;
+
+	if (ll) fuse_session_exit(ll->se);
+}
+
+int afp_register_fuse_ll(int fuseargc, char *fuseargv[],
+	struct afp_volume * vol)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(fuseargc, fuseargv);
+	struct fuse_chan * ch;
+	struct fuse_ll * ll;
+	char * mountpoint=NULL;
+	int ret=-1;
+
+	if ((ll=malloc(sizeof(*ll)))==NULL)
+		return -1;
+	memset(ll,0,sizeof(*ll));
+	ll->volume=vol;
+	ll->root.id=AFP_ROOT_DID;
+	ll->root.parent=AFP_ROOT_DID;
+	ll->root.isdir=1;
+	ll->root.name="";
+	pthread_mutex_init(&ll->mutex,NULL);
+
+	fuse_capture_stderr_start();
+
+	if (fuse_parse_cmdline(&args,&mountpoint,NULL,NULL)==-1)
+		goto out;
+
+	if ((ch=fuse_mount(mountpoint,&args))==NULL)
+		goto out;
+
+	if ((ll->se=fuse_lowlevel_new(&args,&fuse_ll_oper,
+		sizeof(fuse_ll_oper),ll))) {
+		if (fuse_set_signal_handlers(ll->se)!=-1) {
+			fuse_session_add_chan(ll->se,ch);
+			ret=fuse_session_loop_mt(ll->se);
+			fuse_remove_signal_handlers(ll->se);
+			fuse_session_remove_chan(ch);
+		}
+		fuse_session_destroy(ll->se);
+	}
+	fuse_unmount(mountpoint,ch);
+
+out:
+	vol->priv=NULL;
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	fuse_ll_free_nodes(ll);
+	pthread_mutex_destroy(&ll->mutex);
+	free(ll);
+	return ret;
+}
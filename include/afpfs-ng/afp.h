@@ -78,6 +78,60 @@ struct afp_file_info {
 	unsigned short forkid;
 	struct afp_icon * icon;
 	int eof;
+	struct afp_readahead * readahead;
+	struct afp_writebehind * writebehind;
+	struct afp_fork_locks * locks;
+	struct afp_fork_stripes * stripes;
+};
+
+/* One entry of a directory listing.  Only what a stat or an ls needs is
+ * kept, the name points into the listing's name pool. */
+struct afp_dirent {
+	unsigned int did;		/* of the directory it is in */
+	unsigned int fileid;
+	unsigned int creation_date;
+	unsigned int modification_date;
+	unsigned int backup_date;
+	unsigned int accessrights;
+	unsigned long long size;
+	unsigned long long resourcesize;
+	struct afp_unixprivs unixprivs;
+	unsigned short attributes;
+	unsigned short offspring;
+	unsigned char isdir;
+	unsigned short namelen;
+	const char * name;
+};
+
+/* What ml_readdir() returns: the entries of one directory, kept in an
+ * arena that afp_listing_free() gives back in one go. */
+struct afp_listing;
+
+struct afp_listing * afp_listing_new(void);
+struct afp_dirent * afp_listing_add(struct afp_listing * listing,
+	const char * name, unsigned int namelen);
+unsigned int afp_listing_count(struct afp_listing * listing);
+struct afp_dirent * afp_listing_next(struct afp_listing * listing,
+	unsigned int * cursor);
+void afp_listing_free(struct afp_listing * listing);
+
+/* What a catalog search looks for.  Only the criteria whose bits are in
+ * bitmap are checked: kFPCreateDateBit, kFPModDateBit, kFPDataForkLenBit
+ * and kFPUTF8NameBit or kFPLongNameBit for the name.  The dates and sizes
+ * are inclusive ranges, and dates outside what AFP can carry are held
+ * to its first and last.  The name has to match in full unless partial
+ * is set.  Sizes over 4GB can't be told apart by the server. */
+#define AFP_CATALOG_POSITION_LEN 16
+
+struct afp_catsearch_spec {
+	unsigned int bitmap;
+	unsigned char partial;
+	unsigned char files;		/* return files */
+	unsigned char dirs;		/* return directories */
+	char name[AFP_MAX_PATH];
+	time_t created_from, created_to;
+	time_t modified_from, modified_to;
+	unsigned long long size_from, size_to;
 };
 
 
@@ -88,6 +142,25 @@ struct afp_file_info {
 #define VOLUME_EXTRA_FLAGS_NO_LOCKING 0x10
 #define VOLUME_EXTRA_FLAGS_IGNORE_UNIXPRIVS 0x20
 #define VOLUME_EXTRA_FLAGS_READONLY 0x40
+#define VOLUME_EXTRA_FLAGS_NODE_IDS 0x80	/* inode numbers are node IDs */
+
+#define AFP_DEFAULT_DID_CACHE_TIMEOUT 10
+#define AFP_DEFAULT_DID_CACHE_MAX 16384
+
+/* How many entries ll_readdir() asks for in each enumerate */
+#define AFP_MIN_ENUMERATE_COUNT 20
+#define AFP_MAX_ENUMERATE_COUNT 0x7fff
+
+#define AFP_DEFAULT_ATTR_CACHE_TIMEOUT 1
+#define AFP_MAX_ATTR_CACHE_ENTRIES 65536
+
+#define AFP_DEFAULT_READAHEAD_WINDOW 4
+#define AFP_MAX_READAHEAD_WINDOW 16
+#define AFP_DEFAULT_WRITEBEHIND_WINDOW 4
+#define AFP_MAX_WRITEBEHIND_WINDOW 16
+
+/* Most extra sessions for bulk transfers, see sessions.c */
+#define AFP_MAX_SESSIONS 8
 
 #define AFP_VOLUME_UNMOUNTED 0
 #define AFP_VOLUME_MOUNTED 1
@@ -111,9 +184,16 @@ struct afp_volume {
 	char volpassword[AFP_VOLPASS_LEN];
 	unsigned int extra_flags; /* This is an afpfs-ng specific field */
 
-	/* Our directory ID cache */
-	struct did_cache_entry * did_cache_base;
+	/* Our directory ID cache, see did.c */
+	struct did_cache * did_cache;
 	pthread_mutex_t did_cache_mutex;
+	unsigned int did_cache_timeout;	/* seconds, 0 turns it off */
+	unsigned int did_cache_max;	/* most entries kept */
+
+	/* Attributes for stat, see attrcache.c */
+	struct afp_attr_cache * attr_cache;
+	pthread_mutex_t attr_cache_mutex;
+	unsigned int attr_cache_timeout;	/* seconds, 0 turns it off */
 
 	/* Our journal of open forks */
 	struct afp_file_info * open_forks;
@@ -125,10 +205,26 @@ struct afp_volume {
 	struct {
 		uint64_t hits;
 		uint64_t misses;
+		uint64_t negative_hits;
 		uint64_t expired;
+		uint64_t evicted;
 		uint64_t force_removed;
 	} did_cache_stats;
 
+	struct {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t expired;
+	} attr_cache_stats;
+
+	/* Number of reads kept in flight ahead of a sequential reader,
+	 * zero turns read-ahead off */
+	unsigned int readahead_window;
+
+	/* Number of tx_quantum sized writes that can be in flight before
+	 * we wait for the server, zero turns write-behind off */
+	unsigned int writebehind_window;
+
 	void * priv;  /* This is a private structure for fuse/cmdline, etc */
 	pthread_t thread; /* This is the per-volume thread */
 
@@ -180,6 +276,8 @@ struct afp_server {
 		uint64_t rx_bytes;
 		uint64_t tx_bytes;
 		uint64_t requests_pending;
+		uint64_t readahead_hits;
+		uint64_t readahead_misses;
 	} stats;
 
 	/* General information */
@@ -226,7 +324,8 @@ struct afp_server {
 	pthread_mutex_t request_queue_mutex;
 	unsigned short lastrequestid;
 	unsigned short expectedrequestid;
-	struct dsi_request * command_requests;
+	struct dsi_request * request_table;
+	pthread_cond_t request_slot_cond;
 
 
 	char loginmesg[200];
@@ -237,6 +336,20 @@ struct afp_server {
 	int data_read;
 	int bufsize;
 
+	/* Bytes read past the end of the packet being received */
+	char * ring;
+	unsigned int ring_size;
+	unsigned int ring_start;
+	unsigned int ring_used;
+
+	/* Where the payload of the packet being received goes */
+	char recv_state;
+	struct dsi_request * recv_request;
+	struct afp_rx_buffer * recv_rx;
+	char * recv_target;
+	unsigned int recv_wanted;
+	unsigned int recv_discard;
+
 	/* And this is for the outgoing queue */
 	pthread_mutex_t send_mutex;
 
@@ -252,6 +365,14 @@ struct afp_server {
 	unsigned int attention_len;
 	char * attention_buffer;
 
+	/* Extra sessions that fork data is striped across, see sessions.c */
+	struct afp_session_pool * sessions;
+	/* If this is one of those, the server it belongs to */
+	struct afp_server * session_of;
+
+	/* Calls and latency of each AFP command, see cmdstats.c */
+	struct afp_cmdstats * cmdstats;
+
 };
 
 struct afp_extattr_info {
@@ -314,7 +435,19 @@ struct afp_server * afp_server_full_connect(void * priv, struct afp_connection_r
 
 void * just_end_it_now(void *other);
 void add_fd_and_signal(int fd);
+void rm_fd_and_signal(int fd);
+void loop_connect(struct afp_server *s);
 void loop_disconnect(struct afp_server *s);
+
+/* Callback is only run when new data arrives, it must read until EAGAIN */
+#define AFP_LOOP_EDGE 1
+int afp_loop_add_fd(int fd, int flags,
+	void (*callback)(int fd, void * priv), void * priv);
+void afp_loop_rm_fd(int fd);
+int afp_loop_set_io_threads(unsigned int count);
+
+int afp_sessions_start(struct afp_server * server, unsigned int count);
+void afp_sessions_stop(struct afp_server * server);
 void afp_wait_for_started_loop(void);
 
 
@@ -440,7 +573,7 @@ int afp_enumerate(struct afp_volume * volume,
         unsigned short reqcount,
         unsigned short startindex,
         char * path,
-	struct afp_file_info ** file_p);
+	struct afp_listing * listing);
 
 int afp_enumerateext2(struct afp_volume * volume, 
 	unsigned int dirid, 
@@ -448,7 +581,13 @@ int afp_enumerateext2(struct afp_volume * volume,
         unsigned short reqcount,
         unsigned long startindex,
         char * path,
-	struct afp_file_info ** file_p);
+	struct afp_listing * listing);
+
+int afp_catsearchext(struct afp_volume * volume,
+	const struct afp_catsearch_spec * spec,
+	unsigned int filebitmap, unsigned int dirbitmap,
+	unsigned int reqmatches, char * position,
+	struct afp_listing * listing);
 
 int afp_openfork(struct afp_volume * volume,
         unsigned char forktype,
@@ -465,6 +604,10 @@ int afp_readext(struct afp_volume * volume, unsigned short forkid,
                 uint64_t offset,
                 uint64_t count, struct afp_rx_buffer * rx);
 
+struct dsi_request * afp_readext_async(struct afp_volume * volume, 
+		unsigned short forkid, uint64_t offset, uint64_t count,
+		struct afp_rx_buffer * rx);
+
 int afp_getvolparms(struct afp_volume * volume, unsigned short bitmap);
 
 
@@ -485,6 +628,14 @@ int afp_writeext(struct afp_volume * volume, unsigned short forkid,
         uint64_t offset, uint64_t reqcount,
         char * data, uint64_t * written);
 
+/* Space needed in front of the data for afp_writeext_async(): the DSI
+ * header plus the FPWriteExt parameters */
+#define AFP_WRITEEXT_HEADER_LEN 36
+
+struct dsi_request * afp_writeext_async(struct afp_volume * volume,
+	unsigned short forkid, uint64_t offset, uint64_t reqcount,
+	char * msg, uint64_t * written);
+
 int afp_flushfork(struct afp_volume * volume, unsigned short forkid);
 
 int afp_closefork(struct afp_volume * volume, unsigned short forkid);
@@ -517,6 +668,9 @@ int afp_byterangelockext(struct afp_volume * volume,
         uint64_t offset,
         uint64_t len, uint64_t *generated_offset);
 
+int afp_byterangeunlock_async(struct afp_volume * volume,
+	unsigned short forkid, uint64_t offset, uint64_t len);
+
 int afp_moveandrename(struct afp_volume *volume,
 	unsigned int src_did,
 	unsigned int dst_did,
@@ -526,6 +680,10 @@ int afp_rename(struct afp_volume * volume,
         unsigned int dirid,
         char * path_from, char * path_to);
 
+int afp_copyfile(struct afp_volume * volume,
+	unsigned int src_did, char * src_path,
+	unsigned int dst_did, char * dst_path, char * new_name);
+
 int afp_listextattr(struct afp_volume * volume,
         unsigned int dirid, unsigned short bitmap,
         char * pathname, struct afp_extattr_info * info);
@@ -153,6 +153,11 @@ enum {
 	kFPExtRsrcForkLenBit = 0x4000, // AFP version 3.0 and later
 };
 
+/* In the request bitmap of FPCatSearch, matches names that only contain
+   the one searched for */
+
+#define kFPPartialNameBit 0x80000000U
+
 /* AFP Extended Attributes Bitmap, p.238  */
 
 enum {
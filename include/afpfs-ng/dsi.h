@@ -2,6 +2,8 @@
 #ifndef __DSI_H_
 #define __DSI_H_
 
+#include <sys/uio.h>
+#include <sys/time.h>
 #include "afpfs-ng/afp.h"
 
 struct dsi_request
@@ -13,19 +15,56 @@ struct dsi_request
         int done_waiting;
         pthread_cond_t  waiting_cond;
         pthread_mutex_t waiting_mutex;
-        struct dsi_request * next;
+        int in_use;
+        int no_waiter;	/* the slot is released when the reply comes */
         int return_code;
+	struct timeval sent;
+	unsigned int tx_bytes;
 };
 
+/* Requests live in a preallocated table per server, indexed by the low
+ * bits of the DSI request id.  This bounds how many requests can be in
+ * flight on one session at once. */
+#define DSI_MAX_REQUESTS 256
+#define DSI_REQUEST_MASK (DSI_MAX_REQUESTS-1)
+
+int dsi_request_table_init(struct afp_server * server);
+void dsi_request_table_free(struct afp_server * server);
+void dsi_request_table_wakeup(struct afp_server * server);
+struct dsi_request * dsi_find_request(struct afp_server *server,
+	unsigned short request_id);
+
 int dsi_receive(struct afp_server * server, void * data, int size);
 int dsi_getstatus(struct afp_server * server);
 
 int dsi_opensession(struct afp_server *server);
 
 int dsi_send(struct afp_server *server, char * msg, int size,int wait,unsigned char subcommand, void ** other);
+struct dsi_request * dsi_send_request(struct afp_server *server, char * msg,
+	int size,int wait,unsigned char subcommand, void ** other);
+int dsi_send_iov(struct afp_server *server, const struct iovec * iov,
+	int iovcnt, int wait, unsigned char subcommand, void ** other);
+struct dsi_request * dsi_send_request_iov(struct afp_server *server,
+	const struct iovec * iov, int iovcnt, int wait,
+	unsigned char subcommand, void ** other);
+
+/* Most pieces a single request can be sent in */
+#define DSI_MAX_IOV 8
+int dsi_wait_request(struct afp_server *server, struct dsi_request * request);
 struct dsi_session * dsi_create(struct afp_server *server);
 int dsi_restart(struct afp_server *server);
 int dsi_recv(struct afp_server * server);
+void dsi_recv_reset(struct afp_server * server);
+
+/* States of the receive path */
+#define DSI_RECV_HEADER 0
+#define DSI_RECV_PAYLOAD 1
+
+/* Size of the ring that holds bytes read past the current packet */
+#define DSI_RING_SIZE 65536
+
+/* Largest non-read packet we'll buffer in full */
+#define DSI_MAX_INCOMING_PACKET (1024*1024)
 
 #define DSI_BLOCK_TIMEOUT -1
 #define DSI_DONT_WAIT 0
@@ -5,7 +5,8 @@
 #include <unistd.h>
 #include <syslog.h>
 
-#define MAX_CLIENT_RESPONSE 2048
+/* Big enough for the status of a server, with its command stats */
+#define MAX_CLIENT_RESPONSE 16384
 
 
 enum loglevels {
@@ -11,7 +11,20 @@ int ml_creat(struct afp_volume * volume, const char *path,mode_t mode);
 
 int ml_readdir(struct afp_volume * volume, 
 	const char *path, 
-	struct afp_file_info **base);
+	struct afp_listing **listing);
+
+/* Reads a directory a batch at a time, keeping only the last batch.
+ * ml_readdir_entry() returns 1 with *e set to the entry at index, 0 past
+ * the end, or a negative errno. */
+struct ml_dir;
+
+int ml_opendir(struct afp_volume * volume, const char * path,
+	struct ml_dir ** dir);
+
+int ml_readdir_entry(struct ml_dir * dir, unsigned int index,
+	struct afp_dirent ** e);
+
+void ml_closedir(struct ml_dir * dir);
 
 int ml_read(struct afp_volume * volume, const char *path,
 	char *buf, size_t size, off_t offset,
@@ -26,6 +39,9 @@ int ml_mkdir(struct afp_volume * vol, const char * path, mode_t mode);
 int ml_close(struct afp_volume * volume, const char * path,
         struct afp_file_info * fp);
 
+int ml_flush(struct afp_volume * volume, const char * path,
+	struct afp_file_info * fp);
+
 int ml_getattr(struct afp_volume * volume, const char *path, 
 	struct stat *stbuf);
 
@@ -52,13 +68,71 @@ int ml_symlink(struct afp_volume *vol, const char * path1, const char * path2);
 int ml_rename(struct afp_volume * vol,
 	const char * path_from, const char * path_to);
 
+int ml_copy(struct afp_volume * vol,
+	const char * path_from, const char * path_to);
+
 int ml_statfs(struct afp_volume * vol, const char *path, struct statvfs *stat);
 
-void afp_ml_filebase_free(struct afp_file_info **filebase);
+/* Catalog searches, see catsearch.c.  Matches come back with their full
+ * paths as their names. */
+struct ml_catsearch;
+
+int ml_catsearch(struct afp_volume * volume,
+	const struct afp_catsearch_spec * spec, char * position,
+	unsigned int count, struct afp_listing ** listing, int * eof);
+
+int ml_catsearch_start(struct afp_volume * volume,
+	const struct afp_catsearch_spec * spec,
+	struct ml_catsearch ** search);
+
+int ml_catsearch_next(struct ml_catsearch * search, struct afp_dirent ** e);
+
+void ml_catsearch_end(struct ml_catsearch * search);
 
 int ml_passwd(struct afp_server *server,
                 char * username, char * oldpasswd, char * newpasswd);
 
+/* By directory ID and name rather than path.  ml_read(), ml_write(),
+ * ml_close() and ml_flush() only need the fp, and can be given a NULL
+ * path for the files opened with ml_open_did(). */
+
+void ml_invalidate_did(struct afp_volume * volume, unsigned int dirid,
+	const char * name);
+
+int ml_getattr_did(struct afp_volume * volume, unsigned int dirid,
+	const char * name, struct stat * stbuf);
+
+int ml_readdir_did(struct afp_volume * volume, unsigned int dirid,
+	struct afp_listing ** listing);
+
+int ml_opendir_did(struct afp_volume * volume, unsigned int dirid,
+	struct ml_dir ** dir);
+
+/* Fills stbuf for an entry of a listing the same as a getattr of it
+ * would, without asking the server.  Not for the entries made up in an
+ * AppleDouble directory. */
+int ml_dirent_stat(struct afp_volume * volume, const struct afp_dirent * e,
+	struct stat * stbuf);
+
+int ml_open_did(struct afp_volume * volume, unsigned int dirid,
+	const char * name, int flags, struct afp_file_info ** newfp);
+
+int ml_creat_did(struct afp_volume * volume, unsigned int dirid,
+	const char * name, mode_t mode);
+
+int ml_mkdir_did(struct afp_volume * vol, unsigned int dirid,
+	const char * name, mode_t mode);
+
+int ml_unlink_did(struct afp_volume * vol, unsigned int dirid,
+	const char * name);
+
+int ml_rmdir_did(struct afp_volume * vol, unsigned int dirid,
+	const char * name);
+
+int ml_rename_did(struct afp_volume * vol,
+	unsigned int dirid_from, const char * name_from,
+	unsigned int dirid_to, const char * name_to);
+
 
 
 #endif
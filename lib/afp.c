@@ -29,7 +29,9 @@
 #include "afp_replies.h"
 #include "afp_internal.h"
 #include "did.h"
+#include "attrcache.h"
 #include "forklist.h"
+#include "cmdstats.h"
 #include "afpfs-ng/codepage.h"
 
 struct afp_versions      afp_versions[] = {
@@ -47,7 +49,7 @@ static int afp_blank_reply(struct afp_server *server, char * buf, unsigned int s
 
 int (*afp_replies[])(struct afp_server * server,char * buf, unsigned int len, void * other) = {
 	NULL, afp_byterangelock_reply, afp_blank_reply, NULL,
-	afp_blank_reply, NULL, afp_createdir_reply, afp_blank_reply, /* 0 - 7 */
+	afp_blank_reply, afp_blank_reply, afp_createdir_reply, afp_blank_reply, /* 0 - 7 */
 	afp_blank_reply, afp_enumerate_reply, afp_blank_reply, afp_blank_reply, 
 	NULL, NULL, NULL, NULL,                       /* 8 - 15 */
 	afp_getsrvrparms_reply, afp_getvolparms_reply, afp_login_reply, afp_login_reply,
@@ -64,7 +66,7 @@ int (*afp_replies[])(struct afp_server * server,char * buf, unsigned int len, vo
 	afp_blank_reply, NULL, afp_getcomment_reply, afp_byterangelockext_reply,
 	afp_readext_reply, afp_writeext_reply, 
 	NULL, NULL,                       /*56 - 63 */
-	afp_getsessiontoken_reply,afp_blank_reply, NULL, NULL,
+	afp_getsessiontoken_reply,afp_blank_reply, NULL, afp_catsearchext_reply,
 	afp_enumerateext2_reply, NULL, NULL, NULL,    /*64 - 71 */
 	afp_listextattrs_reply, NULL, NULL, NULL,
 	afp_blank_reply, NULL, afp_blank_reply, afp_blank_reply,                       /*72 - 79 */
@@ -182,6 +184,10 @@ int server_still_valid(struct afp_server * server)
 {
 	struct afp_server * s = server_base;
 
+	/* Extra sessions aren't on the list, they last as long as the
+	   server they were opened for */
+	if (server->session_of) server=server->session_of;
+
 	for (;s;s=s->next)
 		if (s==server) return 1;
 	return 0;
@@ -282,6 +288,7 @@ int afp_unmount_volume(struct afp_volume * volume)
 	afp_flush(volume);
 
 	free_entire_did_cache(volume);
+	attrcache_free(volume);
 	remove_fork_list(volume);
 	if (volume->dtrefnum) afp_closedt(server,volume->dtrefnum);
 	volume->dtrefnum=0;
@@ -307,7 +314,6 @@ int afp_unmount_volume(struct afp_volume * volume)
 
 void afp_free_server(struct afp_server ** sp)
 {
-	struct dsi_request * p, *next;
 	struct afp_volume * volumes;
 	struct afp_server * server;
 
@@ -317,18 +323,17 @@ void afp_free_server(struct afp_server ** sp)
 
 	if (!server) return;
 
-	for (p=server->command_requests;p;) {
-		log_for_client(NULL,AFPFSD,LOG_NOTICE,"FSLeft in queue: %p, id: %d command: %d\n",                p,p->requestid,p->subcommand);
-		next=p->next;
-		free(p);
-		p=next;
-	}
+	afp_sessions_stop(server);
+
+	dsi_request_table_free(server);
+	cmdstats_free(server);
 
 	volumes=server->volumes;
 
 	loop_disconnect(server);
 
 	if (server->incoming_buffer) free(server->incoming_buffer);
+	if (server->ring) free(server->ring);
 	if (server->attention_buffer) free(server->attention_buffer);
 	if (volumes) free(volumes);
 
@@ -340,19 +345,13 @@ void afp_free_server(struct afp_server ** sp)
 int afp_server_remove(struct afp_server *s) 
 {
 	
-	struct dsi_request * p;
 	struct afp_server *s2;
 
 
 	if (s==NULL) 
 		goto out;
 
-	for (p=s->command_requests;p;p=p->next) {
-		pthread_mutex_lock(&p->waiting_mutex);
-		p->done_waiting=1;
-		pthread_cond_signal(&p->waiting_cond);
-		pthread_mutex_unlock(&p->waiting_mutex);
-	}
+	dsi_request_table_wakeup(s);
 
 	if (s==server_base) {
 		server_base=s->next;
@@ -386,6 +385,16 @@ struct afp_server * afp_server_init(struct addrinfo * address)
 	s->next=NULL;
 	s->bufsize=4096;
 	s->incoming_buffer=malloc(s->bufsize);
+	s->ring_size=DSI_RING_SIZE;
+	s->ring=malloc(s->ring_size);
+	if ((s->incoming_buffer==NULL) || (s->ring==NULL) ||
+		(dsi_request_table_init(s)) || (cmdstats_init(s))) {
+		if (s->incoming_buffer) free(s->incoming_buffer);
+		if (s->ring) free(s->ring);
+		dsi_request_table_free(s);
+		free(s);
+		return NULL;
+	}
 
 	s->attention_quantum=AFP_DEFAULT_ATTENTION_QUANTUM;
 	s->attention_buffer=malloc(s->attention_quantum);
@@ -707,10 +716,13 @@ int afp_server_connect(struct afp_server *server, int full)
 	server->lastrequestid	= 0;
 	server->connect_state	= SERVER_STATE_CONNECTED;
 	server->used_address	= address;
+	dsi_recv_reset(server);
 
-	add_server(server);
+	/* Extra sessions stay off the list, see sessions.c */
+	if (server->session_of==NULL)
+		add_server(server);
 
-	add_fd_and_signal(server->fd);
+	loop_connect(server);
 	if (!full) {
 		return 0;
 	}
@@ -41,6 +41,8 @@ int afp_enumerate_reply(struct afp_server *server, char * buf, unsigned int size
 
 int afp_enumerateext2_reply(struct afp_server *server, char * buf, unsigned int size, void * other);
 
+int afp_catsearchext_reply(struct afp_server *server, char * buf, unsigned int size, void * other);
+
 int afp_getvolparms_reply(struct afp_server *server, char * buf, unsigned int size,void * other);
 
 int afp_openfork_reply(struct afp_server *server, char * buf, unsigned int size, void * x);
@@ -0,0 +1,220 @@
+/*
+    attrcache.c: remembers the attributes of files and directories, so
+    that a stat doesn't always cost a round trip.
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    Entries are keyed by (parent directory ID, name) like the DID cache,
+    with names in the server's encoding.  They are filled by getattr
+    replies and by every entry a readdir enumerates, and are trusted for
+    volume->attr_cache_timeout seconds.  Our own changes drop the entries
+    for the path and its parent through attrcache_invalidate(); changes
+    made by other clients show up when the entries expire.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "afpfs-ng/afp.h"
+#include "did.h"
+#include "attrcache.h"
+
+#define ATTR_CACHE_BUCKETS 4096
+
+struct attr_cache_entry {
+	struct attr_cache_entry * next;	/* in the hash chain */
+	struct attr_cache_entry * lru_prev, * lru_next;
+	unsigned int dirid;
+	struct timeval time;
+	struct stat stbuf;
+	char name[1];
+};
+
+struct afp_attr_cache {
+	struct attr_cache_entry * entries[ATTR_CACHE_BUCKETS];
+	struct attr_cache_entry * lru_head, * lru_tail;
+	unsigned int count;
+};
+
+static unsigned int attrcache_bucket(unsigned int dirid, const char * name)
+{
+	unsigned int hash=2166136261U;
+
+	for (;*name;name++) {
+		hash^=(unsigned char) *name;
+		hash*=16777619U;
+	}
+	return ((dirid*2654435761U)^hash) & (ATTR_CACHE_BUCKETS-1);
+}
+
+static void attrcache_lru_unlink(struct afp_attr_cache * cache,
+	struct attr_cache_entry * e)
+{
+	if (e->lru_prev) e->lru_prev->lru_next=e->lru_next;
+	else cache->lru_head=e->lru_next;
+	if (e->lru_next) e->lru_next->lru_prev=e->lru_prev;
+	else cache->lru_tail=e->lru_prev;
+	e->lru_prev=e->lru_next=NULL;
+}
+
+static void attrcache_lru_push(struct afp_attr_cache * cache,
+	struct attr_cache_entry * e)
+{
+	e->lru_prev=NULL;
+	e->lru_next=cache->lru_head;
+	if (cache->lru_head) cache->lru_head->lru_prev=e;
+	cache->lru_head=e;
+	if (cache->lru_tail==NULL) cache->lru_tail=e;
+}
+
+/* The following need attr_cache_mutex held */
+
+static void attrcache_drop(struct afp_attr_cache * cache,
+	struct attr_cache_entry * e)
+{
+	struct attr_cache_entry ** pp;
+
+	for (pp=&cache->entries[attrcache_bucket(e->dirid,e->name)];*pp;
+		pp=&(*pp)->next)
+		if (*pp==e) {
+			*pp=e->next;
+			break;
+		}
+	attrcache_lru_unlink(cache,e);
+	cache->count--;
+	free(e);
+}
+
+static struct attr_cache_entry * attrcache_find(
+	struct afp_attr_cache * cache, unsigned int dirid, const char * name)
+{
+	struct attr_cache_entry * e;
+
+	for (e=cache->entries[attrcache_bucket(dirid,name)];e;e=e->next)
+		if ((e->dirid==dirid) && (strcmp(e->name,name)==0))
+			return e;
+	return NULL;
+}
+
+int attrcache_lookup(struct afp_volume * volume, unsigned int dirid,
+	const char * name, struct stat * stbuf)
+{
+	struct attr_cache_entry * e;
+	struct timeval time;
+	int ret=0;
+
+	pthread_mutex_lock(&volume->attr_cache_mutex);
+	if ((volume->attr_cache==NULL) ||
+		((e=attrcache_find(volume->attr_cache,dirid,name))==NULL)) {
+		volume->attr_cache_stats.misses++;
+		goto out;
+	}
+
+	gettimeofday(&time,NULL);
+	if (time.tv_sec > (e->time.tv_sec+volume->attr_cache_timeout)) {
+		volume->attr_cache_stats.expired++;
+		volume->attr_cache_stats.misses++;
+		attrcache_drop(volume->attr_cache,e);
+		goto out;
+	}
+
+	memcpy(stbuf,&e->stbuf,sizeof(struct stat));
+	attrcache_lru_unlink(volume->attr_cache,e);
+	attrcache_lru_push(volume->attr_cache,e);
+	volume->attr_cache_stats.hits++;
+	ret=1;
+out:
+	pthread_mutex_unlock(&volume->attr_cache_mutex);
+	return ret;
+}
+
+void attrcache_add(struct afp_volume * volume, unsigned int dirid,
+	const char * name, const struct stat * stbuf)
+{
+	struct afp_attr_cache * cache;
+	struct attr_cache_entry * e;
+	unsigned int bucket;
+
+	if (volume->attr_cache_timeout==0) return;
+
+	pthread_mutex_lock(&volume->attr_cache_mutex);
+
+	if ((cache=volume->attr_cache)==NULL) {
+		if ((cache=malloc(sizeof(*cache)))==NULL) goto out;
+		memset(cache,0,sizeof(*cache));
+		volume->attr_cache=cache;
+	}
+
+	if ((e=attrcache_find(cache,dirid,name))) {
+		attrcache_lru_unlink(cache,e);
+	} else {
+		while ((cache->count>=AFP_MAX_ATTR_CACHE_ENTRIES) &&
+			(cache->lru_tail))
+			attrcache_drop(cache,cache->lru_tail);
+
+		if ((e=malloc(sizeof(*e)+strlen(name)))==NULL) goto out;
+		e->dirid=dirid;
+		strcpy(e->name,name);
+		bucket=attrcache_bucket(dirid,name);
+		e->next=cache->entries[bucket];
+		cache->entries[bucket]=e;
+		cache->count++;
+	}
+	memcpy(&e->stbuf,stbuf,sizeof(struct stat));
+	gettimeofday(&e->time,NULL);
+	attrcache_lru_push(cache,e);
+out:
+	pthread_mutex_unlock(&volume->attr_cache_mutex);
+}
+
+void attrcache_remove(struct afp_volume * volume, unsigned int dirid,
+	const char * name)
+{
+	struct attr_cache_entry * e;
+
+	pthread_mutex_lock(&volume->attr_cache_mutex);
+	if ((volume->attr_cache) &&
+		((e=attrcache_find(volume->attr_cache,dirid,name))))
+		attrcache_drop(volume->attr_cache,e);
+	pthread_mutex_unlock(&volume->attr_cache_mutex);
+}
+
+/* Forgets a path that we have changed, along with its parent directory,
+ * whose size and modification time probably changed as well. */
+void attrcache_invalidate(struct afp_volume * volume, const char * path)
+{
+	char basename[AFP_MAX_PATH];
+	char parent[AFP_MAX_PATH];
+	unsigned int dirid;
+	char * p;
+
+	if (volume->attr_cache==NULL) return;
+
+	if (get_dirid(volume,path,basename,&dirid)==0)
+		attrcache_remove(volume,dirid,basename);
+
+	snprintf(parent,AFP_MAX_PATH,"%s",path);
+	if ((p=strrchr(parent,'/'))==NULL) return;
+	if (p==parent) p++;
+	*p='\0';
+	if (get_dirid(volume,parent,basename,&dirid)==0)
+		attrcache_remove(volume,dirid,basename);
+}
+
+void attrcache_free(struct afp_volume * volume)
+{
+	struct afp_attr_cache * cache;
+
+	pthread_mutex_lock(&volume->attr_cache_mutex);
+	if ((cache=volume->attr_cache)) {
+		while (cache->lru_head)
+			attrcache_drop(cache,cache->lru_head);
+		free(cache);
+		volume->attr_cache=NULL;
+	}
+	pthread_mutex_unlock(&volume->attr_cache_mutex);
+}
@@ -0,0 +1,16 @@
+#ifndef __ATTRCACHE_H_
+#define __ATTRCACHE_H_
+
+#include <sys/stat.h>
+#include "afpfs-ng/afp.h"
+
+int attrcache_lookup(struct afp_volume * volume, unsigned int dirid,
+	const char * name, struct stat * stbuf);
+void attrcache_add(struct afp_volume * volume, unsigned int dirid,
+	const char * name, const struct stat * stbuf);
+void attrcache_remove(struct afp_volume * volume, unsigned int dirid,
+	const char * name);
+void attrcache_invalidate(struct afp_volume * volume, const char * path);
+void attrcache_free(struct afp_volume * volume);
+
+#endif
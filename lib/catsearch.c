@@ -0,0 +1,427 @@
+/*
+    catsearch.c: finding files with the server's catalog search
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    FPCatSearchExt has the server look through the whole volume for the
+    files and directories matching a name, dates or sizes, and send back
+    only those, many to a reply.  Walking the tree ourselves costs at
+    least one enumerate for every directory on the volume.
+
+    The server only says which directory each match is in, by its ID, so
+    the matches are given paths here.  A directory's path is found with
+    an FPGetFileDirParms for it and each of its parents up to one that
+    is already known, and is remembered for the rest of the search, as
+    are the paths of directories that match.  A search whose matches are
+    spread over a few directories only costs a few calls more.
+
+    A search carries on from the catalog position the server handed back
+    with the last matches, so ml_catsearch() keeps no state between
+    calls and the position can be passed between processes.  Servers
+    forget positions when the volume changes, and the search then fails
+    with -EAGAIN and has to be started again.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/dsi.h"
+#include "afpfs-ng/utils.h"
+#include "afpfs-ng/codepage.h"
+#include "afpfs-ng/midlevel.h"
+#include "lowlevel.h"
+
+#define CATSEARCH_DIR_BUCKETS 512
+#define CATSEARCH_MAX_DEPTH 256
+#define CATSEARCH_FIRST_MATCHES 64
+
+/* Paths of directories by their ID, in the server's encoding.  The root
+ * is "" so that every path is its parent's, a slash and a name. */
+struct catsearch_dir {
+	struct catsearch_dir * next;
+	unsigned int did;
+	char path[1];
+};
+
+struct catsearch_dirs {
+	struct catsearch_dir * buckets[CATSEARCH_DIR_BUCKETS];
+};
+
+struct ml_catsearch {
+	struct afp_volume * volume;
+	struct afp_catsearch_spec spec;		/* with the name converted */
+	char position[AFP_CATALOG_POSITION_LEN];
+	unsigned int reqmatches, maxmatches;
+	struct afp_listing * listing;
+	unsigned int cursor;
+	int eof;
+	struct catsearch_dirs dirs;
+};
+
+static const char * catsearch_dir_lookup(struct catsearch_dirs * dirs,
+	unsigned int did)
+{
+	struct catsearch_dir * d;
+
+	if (did==AFP_ROOT_DID) return "";
+
+	for (d=dirs->buckets[did % CATSEARCH_DIR_BUCKETS];d;d=d->next)
+		if (d->did==did) return d->path;
+	return NULL;
+}
+
+static const char * catsearch_dir_add(struct catsearch_dirs * dirs,
+	unsigned int did, const char * path)
+{
+	struct catsearch_dir * d;
+	unsigned int bucket = did % CATSEARCH_DIR_BUCKETS;
+
+	if ((d=malloc(sizeof(*d)+strlen(path)))==NULL)
+		return NULL;
+	d->did=did;
+	strcpy(d->path,path);
+	d->next=dirs->buckets[bucket];
+	dirs->buckets[bucket]=d;
+	return d->path;
+}
+
+static void catsearch_dirs_free(struct catsearch_dirs * dirs)
+{
+	struct catsearch_dir * d, * next;
+	unsigned int i;
+
+	for (i=0;i<CATSEARCH_DIR_BUCKETS;i++) {
+		for (d=dirs->buckets[i];d;d=next) {
+			next=d->next;
+			free(d);
+		}
+		dirs->buckets[i]=NULL;
+	}
+}
+
+/* Finds the path of directory did, asking the server for it and those of
+ * its parents that aren't known yet */
+static int catsearch_dir_path(struct afp_volume * volume,
+	struct catsearch_dirs * dirs, unsigned int did, const char ** path_p)
+{
+	struct {
+		unsigned int did, parent;
+		char * name;
+	} chain[CATSEARCH_MAX_DEPTH];
+	struct afp_file_info fp;
+	char path[AFP_MAX_PATH];
+	const char * parent_path;
+	unsigned int dirbitmap, n=0;
+	int rc, ret=0;
+
+	if ((*path_p=catsearch_dir_lookup(dirs,did)))
+		return 0;
+
+	dirbitmap=kFPParentDirIDBit |
+		((volume->attributes & kSupportsUTF8Names) ?
+		kFPUTF8NameBit : kFPLongNameBit);
+
+	/* Go up until we reach a directory we know */
+	while ((parent_path=catsearch_dir_lookup(dirs,did))==NULL) {
+		if (n==CATSEARCH_MAX_DEPTH) {
+			ret=-ELOOP;
+			goto out;
+		}
+		rc=afp_getfiledirparms(volume,did,0,dirbitmap,"",&fp);
+		switch(rc) {
+		case kFPNoErr:
+			break;
+		case kFPAccessDenied:
+			ret=-EACCES;
+			goto out;
+		case kFPObjectNotFound:
+		case kFPDirNotFound:
+			ret=-ENOENT;
+			goto out;
+		default:
+			ret=-EIO;
+			goto out;
+		}
+		chain[n].did=did;
+		chain[n].parent=fp.did;
+		if ((chain[n].name=strdup(fp.name))==NULL) {
+			ret=-ENOMEM;
+			goto out;
+		}
+		n++;
+		did=fp.did;
+	}
+
+	/* And come back down, remembering each one */
+	while (n>0) {
+		n--;
+		if (snprintf(path,AFP_MAX_PATH,"%s/%s",parent_path,
+			chain[n].name)>=AFP_MAX_PATH)
+			ret=-ENAMETOOLONG;
+		else if ((parent_path=catsearch_dir_add(dirs,chain[n].did,
+			path))==NULL)
+			ret=-ENOMEM;
+		free(chain[n].name);
+		if (ret) goto out;
+	}
+	*path_p=parent_path;
+
+out:
+	while (n>0)
+		free(chain[--n].name);
+	return ret;
+}
+
+static void catsearch_bitmaps(struct afp_volume * volume,
+	unsigned int * filebitmap, unsigned int * dirbitmap)
+{
+	*filebitmap=kFPParentDirIDBit | kFPCreateDateBit | kFPModDateBit |
+		kFPNodeIDBit | kFPExtDataForkLenBit;
+	*dirbitmap=kFPParentDirIDBit | kFPCreateDateBit | kFPModDateBit |
+		kFPNodeIDBit | kFPOffspringCountBit;
+
+	if (volume->attributes & kSupportsUTF8Names) {
+		*filebitmap|=kFPUTF8NameBit;
+		*dirbitmap|=kFPUTF8NameBit;
+	} else {
+		*filebitmap|=kFPLongNameBit;
+		*dirbitmap|=kFPLongNameBit;
+	}
+	if (volume->extra_flags & VOLUME_EXTRA_FLAGS_VOL_SUPPORTS_UNIX) {
+		*filebitmap|=kFPUnixPrivsBit;
+		*dirbitmap|=kFPUnixPrivsBit;
+	}
+}
+
+/* The most matches that should fit in one reply */
+static unsigned int catsearch_max_matches(struct afp_volume * volume)
+{
+	unsigned int filebitmap, dirbitmap, count;
+
+	catsearch_bitmaps(volume,&filebitmap,&dirbitmap);
+	count=min(volume->server->rx_quantum,DSI_MAX_INCOMING_PACKET) /
+		ll_enumerate_entry_size(volume,filebitmap,dirbitmap);
+	return max(count,1);
+}
+
+/* Checks that the volume can be searched, and puts spec's name in the
+ * server's encoding */
+static int catsearch_prepare(struct afp_volume * volume,
+	const struct afp_catsearch_spec * spec,
+	struct afp_catsearch_spec * converted)
+{
+	if ((volume->server->using_version->av_number<30) ||
+		(~volume->attributes & kSupportsCatSearch))
+		return -ENOTSUP;
+
+	if ((!spec->files) && (!spec->dirs))
+		return -EINVAL;
+
+	memcpy(converted,spec,sizeof(*spec));
+	if (!(spec->bitmap & (kFPLongNameBit|kFPUTF8NameBit)))
+		return 0;
+	if (convert_path_to_afp(volume->server->path_encoding,
+		converted->name,(char *) spec->name,AFP_MAX_PATH))
+		return -EINVAL;
+	if (invalid_filename(volume->server,converted->name))
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+/* Asks for the next count matches, and puts them in a new listing with
+ * their full paths as names */
+static int catsearch_page(struct afp_volume * volume,
+	const struct afp_catsearch_spec * spec, char * position,
+	unsigned int count, struct catsearch_dirs * dirs,
+	struct afp_listing ** listing_p, int * eof)
+{
+	struct afp_listing * raw, * listing = NULL;
+	struct afp_dirent * e, * n;
+	unsigned int filebitmap, dirbitmap, cursor=0;
+	char path[AFP_MAX_PATH], unixpath[AFP_MAX_PATH];
+	const char * dirpath, * name;
+	int rc, ret=0;
+
+	*eof=0;
+	catsearch_bitmaps(volume,&filebitmap,&dirbitmap);
+
+	if ((raw=afp_listing_new())==NULL)
+		return -ENOMEM;
+
+	rc=afp_catsearchext(volume,spec,filebitmap,dirbitmap,count,
+		position,raw);
+	switch(rc) {
+	case kFPEOFErr:
+		*eof=1;
+	case kFPNoErr:
+		break;
+	case kFPCallNotSupported:
+		ret=-ENOTSUP;
+		goto out;
+	case kFPCatalogChanged:
+		ret=-EAGAIN;
+		goto out;
+	case kFPAccessDenied:
+		ret=-EACCES;
+		goto out;
+	case kFPBitmapErr:
+	case kFPMiscErr:
+	case kFPParamErr:
+	default:
+		ret=-EIO;
+		goto out;
+	}
+
+	if ((listing=afp_listing_new())==NULL) {
+		ret=-ENOMEM;
+		goto out;
+	}
+
+	while ((e=afp_listing_next(raw,&cursor))) {
+		/* Matches that have gone, or whose paths are too long to
+		   use, are left out */
+		ret=catsearch_dir_path(volume,dirs,e->did,&dirpath);
+		if ((ret==-ENOENT) || (ret==-ENAMETOOLONG))
+			continue;
+		if (ret) goto out;
+
+		if (snprintf(path,AFP_MAX_PATH,"%s/%s",dirpath,
+			e->name)>=AFP_MAX_PATH)
+			continue;
+		if ((e->isdir) && (catsearch_dir_lookup(dirs,e->fileid)==NULL) &&
+			(catsearch_dir_add(dirs,e->fileid,path)==NULL)) {
+			ret=-ENOMEM;
+			goto out;
+		}
+		if (convert_path_to_unix(volume->server->path_encoding,
+			unixpath,path,AFP_MAX_PATH))
+			continue;
+
+		if ((n=afp_listing_add(listing,unixpath,strlen(unixpath)))==NULL) {
+			ret=-ENOMEM;
+			goto out;
+		}
+		name=n->name;
+		memcpy(n,e,sizeof(*n));
+		n->name=name;
+		n->namelen=strlen(unixpath);
+	}
+	ret=0;
+
+out:
+	afp_listing_free(raw);
+	if (ret) {
+		afp_listing_free(listing);
+		listing=NULL;
+	}
+	*listing_p=listing;
+	return ret;
+}
+
+/* ml_catsearch()
+ *
+ * Finds up to count more files and directories that match spec, starting
+ * from position, which is all zeros for a new search.  They are returned
+ * in a listing with their full paths as their names, and position is
+ * moved on past them.  *eof is set once the search is over.  Fewer than
+ * count matches doesn't mean the end; servers stop after a while and
+ * return what they have so far.
+ */
+
+int ml_catsearch(struct afp_volume * volume,
+	const struct afp_catsearch_spec * spec, char * position,
+	unsigned int count, struct afp_listing ** listing, int * eof)
+{
+	struct afp_catsearch_spec converted;
+	struct catsearch_dirs * dirs;
+	int ret;
+
+	*listing=NULL;
+	*eof=0;
+
+	if ((ret=catsearch_prepare(volume,spec,&converted)))
+		return ret;
+
+	if ((dirs=calloc(1,sizeof(*dirs)))==NULL)
+		return -ENOMEM;
+
+	ret=catsearch_page(volume,&converted,position,
+		min(max(count,1),catsearch_max_matches(volume)),
+		dirs,listing,eof);
+
+	catsearch_dirs_free(dirs);
+	free(dirs);
+	return ret;
+}
+
+/* ml_catsearch_start()
+ *
+ * Starts a search that ml_catsearch_next() then returns the matches of
+ * one at a time, asking the server for more as they are needed.  Each
+ * request asks for more matches than the last, up to what fits in a
+ * reply, so that a search that is stopped early doesn't wait for many.
+ */
+
+int ml_catsearch_start(struct afp_volume * volume,
+	const struct afp_catsearch_spec * spec,
+	struct ml_catsearch ** search_p)
+{
+	struct ml_catsearch * search;
+	int ret;
+
+	if ((search=calloc(1,sizeof(*search)))==NULL)
+		return -ENOMEM;
+
+	if ((ret=catsearch_prepare(volume,spec,&search->spec))) {
+		free(search);
+		return ret;
+	}
+	search->volume=volume;
+	search->maxmatches=catsearch_max_matches(volume);
+	search->reqmatches=min(CATSEARCH_FIRST_MATCHES,search->maxmatches);
+
+	*search_p=search;
+	return 0;
+}
+
+/* ml_catsearch_next()
+ *
+ * Returns 1 and the next match in *e, with its full path as its name, or
+ * 0 at the end of the search.  The entry lasts until the next call.
+ */
+
+int ml_catsearch_next(struct ml_catsearch * search, struct afp_dirent ** e)
+{
+	int ret;
+
+	while ((*e=afp_listing_next(search->listing,&search->cursor))==NULL) {
+		if (search->eof) return 0;
+
+		afp_listing_free(search->listing);
+		search->listing=NULL;
+		search->cursor=0;
+
+		ret=catsearch_page(search->volume,&search->spec,
+			search->position,search->reqmatches,&search->dirs,
+			&search->listing,&search->eof);
+		if (ret) {
+			search->eof=1;
+			return ret;
+		}
+		search->reqmatches=min(search->reqmatches*2,search->maxmatches);
+	}
+	return 1;
+}
+
+void ml_catsearch_end(struct ml_catsearch * search)
+{
+	if (search==NULL) return;
+
+	afp_listing_free(search->listing);
+	catsearch_dirs_free(&search->dirs);
+	free(search);
+}
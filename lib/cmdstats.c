@@ -0,0 +1,290 @@
+/*
+    cmdstats.c: how many of each AFP command were sent to a server, and
+    how long the replies took
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    For each command this counts calls, errors, timeouts and the bytes
+    both ways, and keeps a histogram of the latency from sending the
+    request to its reply being in, in buckets that double in width from
+    one microsecond up.
+
+    Replies are counted by the loop threads as they come in, so the
+    counters are kept per thread: each thread has its own shard of every
+    server's counters and adds to it without taking a lock or using
+    atomic operations.  The shards are only added together when the
+    status is asked for.  A thread finds its shard through a small cache
+    of its own, keyed by a serial number that is never reused, so a
+    server that is freed and another allocated at the same address can't
+    be mixed up.
+
+    The extra sessions of a server count towards the server itself.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/afp_protocol.h"
+#include "afpfs-ng/utils.h"
+#include "cmdstats.h"
+
+/* Bucket i has latencies under 2^(i+1) microseconds; the last one has
+ * everything over about 8 seconds */
+#define CMDSTATS_BUCKETS 24
+#define CMDSTATS_COMMANDS 256
+
+/* How many servers a thread remembers its shard for */
+#define CMDSTATS_CACHE 8
+
+struct cmdstats_counters {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t timeouts;
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t total_usec;
+	uint64_t max_usec;
+	uint64_t buckets[CMDSTATS_BUCKETS];
+};
+
+struct cmdstats_shard {
+	struct cmdstats_shard * next;
+	pthread_t thread;
+	/* Allocated by the owning thread the first time it sees a command */
+	struct cmdstats_counters * commands[CMDSTATS_COMMANDS];
+};
+
+struct afp_cmdstats {
+	pthread_mutex_t mutex;		/* Held to add or walk the shards */
+	unsigned int serial;
+	struct cmdstats_shard * shards;
+};
+
+static pthread_mutex_t cmdstats_serial_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int cmdstats_next_serial = 1;
+
+static __thread struct {
+	unsigned int serial;
+	struct cmdstats_shard * shard;
+} cmdstats_cache[CMDSTATS_CACHE];
+
+int cmdstats_init(struct afp_server * server)
+{
+	struct afp_cmdstats * stats;
+
+	if ((stats=malloc(sizeof(*stats)))==NULL)
+		return -1;
+	memset(stats,0,sizeof(*stats));
+	pthread_mutex_init(&stats->mutex,NULL);
+
+	pthread_mutex_lock(&cmdstats_serial_mutex);
+	stats->serial=cmdstats_next_serial++;
+	pthread_mutex_unlock(&cmdstats_serial_mutex);
+
+	server->cmdstats=stats;
+	return 0;
+}
+
+void cmdstats_free(struct afp_server * server)
+{
+	struct afp_cmdstats * stats = server->cmdstats;
+	struct cmdstats_shard * shard, * next;
+	int i;
+
+	if (stats==NULL) return;
+
+	for (shard=stats->shards;shard;shard=next) {
+		next=shard->next;
+		for (i=0;i<CMDSTATS_COMMANDS;i++)
+			free(shard->commands[i]);
+		free(shard);
+	}
+	pthread_mutex_destroy(&stats->mutex);
+	free(stats);
+	server->cmdstats=NULL;
+}
+
+/* This thread's shard of stats, made if it doesn't have one yet */
+static struct cmdstats_shard * cmdstats_shard(struct afp_cmdstats * stats)
+{
+	struct cmdstats_shard * shard;
+	unsigned int slot = stats->serial % CMDSTATS_CACHE;
+	pthread_t self = pthread_self();
+
+	if (cmdstats_cache[slot].serial==stats->serial)
+		return cmdstats_cache[slot].shard;
+
+	pthread_mutex_lock(&stats->mutex);
+	for (shard=stats->shards;shard;shard=shard->next)
+		if (pthread_equal(shard->thread,self))
+			break;
+	if ((shard==NULL) && ((shard=malloc(sizeof(*shard))))) {
+		memset(shard,0,sizeof(*shard));
+		shard->thread=self;
+		shard->next=stats->shards;
+		stats->shards=shard;
+	}
+	pthread_mutex_unlock(&stats->mutex);
+
+	if (shard) {
+		cmdstats_cache[slot].serial=stats->serial;
+		cmdstats_cache[slot].shard=shard;
+	}
+	return shard;
+}
+
+static struct cmdstats_counters * cmdstats_counters(
+	struct afp_server * server, unsigned char command)
+{
+	struct cmdstats_shard * shard;
+	struct cmdstats_counters * c;
+
+	if (server->session_of) server=server->session_of;
+	if (server->cmdstats==NULL) return NULL;
+
+	if ((shard=cmdstats_shard(server->cmdstats))==NULL)
+		return NULL;
+
+	if ((c=shard->commands[command])==NULL) {
+		if ((c=malloc(sizeof(*c)))==NULL)
+			return NULL;
+		memset(c,0,sizeof(*c));
+		shard->commands[command]=c;
+	}
+	return c;
+}
+
+/* cmdstats_record()
+ *
+ * Counts a reply to command, which was sent at the time in sent.  The
+ * bytes are those of the request and the reply without the DSI headers.
+ */
+
+void cmdstats_record(struct afp_server * server, unsigned char command,
+	int result, unsigned int tx_bytes, unsigned int rx_bytes,
+	struct timeval * sent)
+{
+	struct cmdstats_counters * c;
+	struct timeval now;
+	uint64_t usec;
+	int bucket=0;
+
+	if ((c=cmdstats_counters(server,command))==NULL)
+		return;
+
+	gettimeofday(&now,NULL);
+	if (timercmp(&now,sent,<))
+		usec=0;
+	else
+		usec=(now.tv_sec-sent->tv_sec)*1000000ULL+
+			(now.tv_usec-sent->tv_usec);
+
+	while ((bucket<CMDSTATS_BUCKETS-1) && (usec>>(bucket+1)))
+		bucket++;
+
+	c->calls++;
+	/* Reads that reach the end of the fork, and searches that reach
+	   the end of the catalog, aren't failures */
+	if ((result!=kFPNoErr) && (!((result==kFPEOFErr) &&
+		((command==afpRead) || (command==afpReadExt) ||
+		(command==afpCatSearchExt)))))
+		c->errors++;
+	c->tx_bytes+=tx_bytes;
+	c->rx_bytes+=rx_bytes;
+	c->total_usec+=usec;
+	if (usec>c->max_usec) c->max_usec=usec;
+	c->buckets[bucket]++;
+}
+
+/* Counts a request that we stopped waiting for */
+void cmdstats_timeout(struct afp_server * server, unsigned char command)
+{
+	struct cmdstats_counters * c;
+
+	if ((c=cmdstats_counters(server,command)))
+		c->timeouts++;
+}
+
+/* The upper bound of the bucket that the fraction of calls falls in */
+static uint64_t cmdstats_percentile(struct cmdstats_counters * c,
+	unsigned int percent)
+{
+	uint64_t wanted = (c->calls*percent+99)/100, seen=0;
+	int i;
+
+	for (i=0;i<CMDSTATS_BUCKETS-1;i++) {
+		seen+=c->buckets[i];
+		if (seen>=wanted)
+			return min(2ULL<<i,c->max_usec);
+	}
+	return c->max_usec;
+}
+
+static const char * cmdstats_command_name(unsigned char command,
+	char * buf, int len)
+{
+	if (command<0x80)
+		return afp_get_command_name(command);
+	snprintf(buf,len,"command %u",command);
+	return buf;
+}
+
+/* Adds a line for each command that has been sent to the server's status */
+int cmdstats_status(struct afp_server * server, char * text, int len)
+{
+	struct afp_cmdstats * stats = server->cmdstats;
+	struct cmdstats_shard * shard;
+	struct cmdstats_counters total, * c;
+	char name[32];
+	int pos=0, command, i;
+
+	if ((stats==NULL) || (len<=0)) return 0;
+
+	pos+=snprintf(text+pos,len-pos,
+		"    commands: calls, errors, timeouts, bytes, "
+		"latency avg/p50/p99/max in us\n");
+
+	pthread_mutex_lock(&stats->mutex);
+	for (command=0;(command<CMDSTATS_COMMANDS) && (pos<len);command++) {
+		memset(&total,0,sizeof(total));
+		for (shard=stats->shards;shard;shard=shard->next) {
+			if ((c=shard->commands[command])==NULL)
+				continue;
+			total.calls+=c->calls;
+			total.errors+=c->errors;
+			total.timeouts+=c->timeouts;
+			total.tx_bytes+=c->tx_bytes;
+			total.rx_bytes+=c->rx_bytes;
+			total.total_usec+=c->total_usec;
+			total.max_usec=max(total.max_usec,c->max_usec);
+			for (i=0;i<CMDSTATS_BUCKETS;i++)
+				total.buckets[i]+=c->buckets[i];
+		}
+		if ((total.calls==0) && (total.timeouts==0))
+			continue;
+
+		pos+=snprintf(text+pos,len-pos,
+			"        %-22s %8llu %6llu %4llu %12llu(tx) %12llu(rx)"
+			" %8llu %8llu %8llu %8llu\n",
+			cmdstats_command_name(command,name,sizeof(name)),
+			(unsigned long long) total.calls,
+			(unsigned long long) total.errors,
+			(unsigned long long) total.timeouts,
+			(unsigned long long) total.tx_bytes,
+			(unsigned long long) total.rx_bytes,
+			(unsigned long long) (total.calls ? 
+				total.total_usec/total.calls : 0),
+			(unsigned long long) cmdstats_percentile(&total,50),
+			(unsigned long long) cmdstats_percentile(&total,99),
+			(unsigned long long) total.max_usec);
+	}
+	pthread_mutex_unlock(&stats->mutex);
+
+	return min(pos,len);
+}
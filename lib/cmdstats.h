@@ -0,0 +1,17 @@
+#ifndef __CMDSTATS_H_
+#define __CMDSTATS_H_
+
+#include <sys/time.h>
+#include "afpfs-ng/afp.h"
+
+int cmdstats_init(struct afp_server * server);
+void cmdstats_free(struct afp_server * server);
+
+void cmdstats_record(struct afp_server * server, unsigned char command,
+	int result, unsigned int tx_bytes, unsigned int rx_bytes,
+	struct timeval * sent);
+void cmdstats_timeout(struct afp_server * server, unsigned char command);
+
+int cmdstats_status(struct afp_server * server, char * text, int len);
+
+#endif
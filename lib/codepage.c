@@ -14,6 +14,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "afpfs-ng/afp_protocol.h"
 #include "afpfs-ng/utils.h"
 #include "unicode.h"
@@ -34,13 +35,14 @@ int convert_path_to_unix(char encoding, char * dest,
 	char * src, int dest_len)
 {
 
-	memset(dest,0,dest_len);
-
 	switch (encoding) {
 	case kFPUTF8Name:
-		convert_utf8dec_to_utf8pre(src, strlen(src), dest, dest_len);
+		if (convert_utf8dec_to_utf8pre(src, strlen(src),
+			dest, dest_len)<0)
+			return -1;
 		break;
 	case kFPLongName:
+		memset(dest,0,dest_len);
 		memcpy(dest,src,dest_len);
 		break;
 	/* This is where you would put support for other codepages. */
@@ -60,13 +62,14 @@ int convert_path_to_unix(char encoding, char * dest,
 int convert_path_to_afp(char encoding, char * dest, 
 	char * src, int dest_len)
 {
-	memset(dest,0,dest_len);
-
 	switch (encoding) {
 	case kFPUTF8Name: 
-		convert_utf8pre_to_utf8dec(src, strlen(src), dest,dest_len);
+		if (convert_utf8pre_to_utf8dec(src, strlen(src),
+			dest,dest_len)<0)
+			return -1;
 		break;
 	case kFPLongName:
+		memset(dest,0,dest_len);
 		memcpy(dest,src,dest_len);
 		break;
 	/* This is where you would put support for other codepages. */
@@ -76,10 +79,108 @@ int convert_path_to_afp(char encoding, char * dest,
 	return 0;
 }
 
+/* The number of plain ASCII bytes at the start of s, looked at a word
+ * at a time.  Most names are all ASCII, and they need no conversion. */
+
+static int ascii_span(const unsigned char * s, int len)
+{
+	uint64_t w;
+	int i=0;
+
+	while (i+(int) sizeof(w)<=len) {
+		memcpy(&w,s+i,sizeof(w));
+		if (w & 0x8080808080808080ULL) break;
+		i+=sizeof(w);
+	}
+	while ((i<len) && (s[i]<0x80)) i++;
+	return i;
+}
+
+/* Decodes the character at s.  Returns the number of bytes it takes, or
+ * 0 if it isn't valid UTF8, in which case the byte is copied as it is. */
+
+static int utf8_decode(const unsigned char * s, int len, unsigned int * c)
+{
+	if (s[0]<0x80) {
+		*c=s[0];
+		return 1;
+	}
+	if ((s[0]>=0xc2) && (s[0]<0xe0) && (len>=2) &&
+		((s[1] & 0xc0)==0x80)) {
+		*c=((s[0] & 0x1f)<<6) | (s[1] & 0x3f);
+		return 2;
+	}
+	if (((s[0] & 0xf0)==0xe0) && (len>=3) &&
+		((s[1] & 0xc0)==0x80) && ((s[2] & 0xc0)==0x80)) {
+		*c=((s[0] & 0x0f)<<12) | ((s[1] & 0x3f)<<6) | (s[2] & 0x3f);
+		if ((*c<0x800) || ((*c>=0xd800) && (*c<0xe000))) return 0;
+		return 3;
+	}
+	if (((s[0] & 0xf8)==0xf0) && (len>=4) &&
+		((s[1] & 0xc0)==0x80) && ((s[2] & 0xc0)==0x80) &&
+		((s[3] & 0xc0)==0x80)) {
+		*c=((s[0] & 0x07)<<18) | ((s[1] & 0x3f)<<12) |
+			((s[2] & 0x3f)<<6) | (s[3] & 0x3f);
+		if ((*c<0x10000) || (*c>0x10ffff)) return 0;
+		return 4;
+	}
+	return 0;
+}
+
+/* Appends c to dest, leaving room for the terminating null.  Returns -1
+ * if it doesn't fit. */
+
+static int utf8_put(char * dest, int * j, int dest_len, unsigned int c)
+{
+	unsigned char * d = (unsigned char *) dest + *j;
+	int len = (c<0x80) ? 1 : (c<0x800) ? 2 : (c<0x10000) ? 3 : 4;
+
+	if (*j+len>=dest_len) return -1;
+
+	switch (len) {
+	case 1:
+		d[0]=c;
+		break;
+	case 2:
+		d[0]=0xc0 | (c>>6);
+		d[1]=0x80 | (c & 0x3f);
+		break;
+	case 3:
+		d[0]=0xe0 | (c>>12);
+		d[1]=0x80 | ((c>>6) & 0x3f);
+		d[2]=0x80 | (c & 0x3f);
+		break;
+	default:
+		d[0]=0xf0 | (c>>18);
+		d[1]=0x80 | ((c>>12) & 0x3f);
+		d[2]=0x80 | ((c>>6) & 0x3f);
+		d[3]=0x80 | (c & 0x3f);
+	}
+	*j+=len;
+	return 0;
+}
+
+/* Appends as much of src as fits */
+
+static int copy_bytes(char * dest, int * j, int dest_len,
+	const unsigned char * src, int len)
+{
+	int ret=0;
+
+	if (*j+len>=dest_len) {
+		len=dest_len-1-*j;
+		ret=-1;
+	}
+	memcpy(dest+*j,src,len);
+	*j+=len;
+	return ret;
+}
+
 /* convert_utf8dec_to_utf8pre()
  *
  * Conversion for text from Decomposed UTF8 used in AFP to Precomposed
- * UTF8 used elsewhere.
+ * UTF8 used elsewhere.  dest is always null terminated.  Returns the
+ * length of dest, or -1 if it was too short.
  *
  */
 
@@ -88,86 +189,102 @@ int convert_path_to_afp(char encoding, char * dest,
 int convert_utf8dec_to_utf8pre(const char *src, int src_len,
 	char * dest, int dest_len)
 {
-	char16 *path16dec, c, prev, *p16dec, *p16pre;
-        char16 path16pre[384];  // max 127 * 3 byte UTF8 characters
-        char *pathUTF8pre, *p8pre;
-        int comp;
-
-	path16dec = UTF8toUCS2(src);
-        p16dec = path16dec;
-	p16pre = path16pre;
-
-        prev = 0;
-        while(*p16dec > 0) {
-		c = *p16dec;
-		if(prev > 0) {
-			comp = UCS2precompose(prev, c);
-			if(comp != -1) {
-				prev = (char16)comp;  // Keep and try to combine again on next loop
-			}
-			else {
-				*p16pre = prev;
-				prev = c;
-				p16pre++;
-			}
-		}
-		else {
-			prev = c;
-		}
-		p16dec++;
+	const unsigned char * s = (const unsigned char *) src;
+	unsigned int c, comp, starter=0;
+	int i=0, j=0, n, have_starter=0;
 
-		if(*p16dec == 0) {		// End of string?
-			*p16pre = prev;		// Add last char
-			p16pre++;
+	if (dest_len<=0) return -1;
+
+	while (i<src_len) {
+		/* Only the last of a run of ASCII characters can be
+		   combined with what follows */
+		if ((n=ascii_span(s+i,src_len-i))>1) {
+			if ((have_starter) &&
+				(utf8_put(dest,&j,dest_len,starter)))
+				goto toolong;
+			have_starter=0;
+			if (copy_bytes(dest,&j,dest_len,s+i,n-1))
+				goto toolong;
+			i+=n-1;
 		}
-	}
-        *p16pre = 0; // Terminate string
 
-        pathUTF8pre = UCS2toUTF8(path16pre);
-        p8pre = pathUTF8pre;
+		if ((n=utf8_decode(s+i,src_len-i,&c))==0) {
+			if ((have_starter) &&
+				(utf8_put(dest,&j,dest_len,starter)))
+				goto toolong;
+			have_starter=0;
+			if (copy_bytes(dest,&j,dest_len,s+i,1))
+				goto toolong;
+			i++;
+			continue;
+		}
+		i+=n;
 
-        while(*p8pre) {		// Copy precomposed UTF8 string to dest
-		*dest = *p8pre;
-                dest++;
-                p8pre++;
+		if ((have_starter) && ((comp=unicode_compose(starter,c)))) {
+			/* Keep it, it may combine again with the next one */
+			starter=comp;
+			continue;
+		}
+		if ((have_starter) && (utf8_put(dest,&j,dest_len,starter)))
+			goto toolong;
+		starter=c;
+		have_starter=1;
 	}
-	*dest = 0;
+	if ((have_starter) && (utf8_put(dest,&j,dest_len,starter)))
+		goto toolong;
 
-        if(path16dec)
-		free(path16dec);
-        if(pathUTF8pre)
-		free(pathUTF8pre);
+	dest[j]='\0';
+	return j;
 
-        return 0;
+toolong:
+	dest[j]='\0';
+	return -1;
 }
 
 /* convert_utf8pre_to_utf8dec()
  *
- * Conversion for text from Precomposed UTF8 to Decomposed UTF8.
- *
- * This is a sample conversion.  The only translation it does is on one 
- * sequence of characters (0xc3 0xa4 becomes 0x61 0xcc 0x88).
- *
- * Fix this.
+ * Conversion for text from Precomposed UTF8 to Decomposed UTF8.  Every
+ * character in the composition table is fully decomposed, as are Hangul
+ * syllables.  Combining marks are left in the order they come in.
+ * dest is always null terminated.  Returns the length of dest, or -1 if
+ * it was too short.
  */
 
 int convert_utf8pre_to_utf8dec(const char * src, int src_len, 
 	char * dest, int dest_len)
 {
-	int i, j=0;
-	for (i=0;i<src_len && j < dest_len; i++) {
-		if (((src[i] & 0xff)==0xc3) && ((src[i+1] & 0xff)==0xa4)) {
-			dest[j]=0x61;
-			j++;
-			dest[j]=0xcc;
-			j++;
-			dest[j]=0x88;
+	const unsigned char * s = (const unsigned char *) src;
+	unsigned int c, decomposed[UNICODE_MAX_DECOMPOSITION];
+	int i=0, j=0, k, n;
+
+	if (dest_len<=0) return -1;
+
+	while (i<src_len) {
+		if ((n=ascii_span(s+i,src_len-i))) {
+			if (copy_bytes(dest,&j,dest_len,s+i,n))
+				goto toolong;
+			i+=n;
+			continue;
+		}
+
+		if ((n=utf8_decode(s+i,src_len-i,&c))==0) {
+			if (copy_bytes(dest,&j,dest_len,s+i,1))
+				goto toolong;
 			i++;
-		} else 
-			dest[j]=src[i];
-		j++;
+			continue;
+		}
+		i+=n;
 
+		n=unicode_decompose(c,decomposed);
+		for (k=0;k<n;k++)
+			if (utf8_put(dest,&j,dest_len,decomposed[k]))
+				goto toolong;
 	}
+
+	dest[j]='\0';
 	return j;
-}
 
+toolong:
+	dest[j]='\0';
+	return -1;
+}
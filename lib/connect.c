@@ -58,6 +58,7 @@ struct afp_server * afp_server_full_connect (void * priv, struct afp_connection_
         char server_name_utf8[AFP_SERVER_NAME_UTF8_LEN];
         char server_name_printable[AFP_SERVER_NAME_UTF8_LEN];
 	unsigned int rx_quantum;
+	unsigned short flags;
 	char icon[AFP_SERVER_ICON_LEN];
 
 	if ((address = afp_get_address(priv,req->url.servername, req->url.port)) == NULL)
@@ -92,6 +93,7 @@ struct afp_server * afp_server_full_connect (void * priv, struct afp_connection_
 	memcpy(server_name_printable,&tmpserver->server_name_printable,
 		AFP_SERVER_NAME_UTF8_LEN);
 	rx_quantum=tmpserver->rx_quantum;
+	flags=tmpserver->flags;
 
 	afp_server_remove(tmpserver);
 
@@ -132,6 +134,7 @@ struct afp_server * afp_server_full_connect (void * priv, struct afp_connection_
 		memcpy(s->machine_type,machine_type,AFP_MACHINETYPE_LEN);
 		memcpy(s->icon,icon,AFP_SERVER_ICON_LEN);
 		s->rx_quantum=rx_quantum;
+		s->flags=flags;
 	} 
 have_server:
 
@@ -14,102 +14,328 @@
 
 #undef DID_CACHE_DISABLE
 
-static unsigned short timeout=10;
+/* The cache maps a (parent directory ID, name) pair to the ID of that
+ * directory, so resolving /foo/bar/baz is one hash lookup per component,
+ * and entries below a directory stay valid when it is renamed.  An entry
+ * with a did of zero records that the name doesn't exist.
+ *
+ * Entries go away once they are older than volume->did_cache_timeout
+ * seconds, or least recently used first when there are more than
+ * volume->did_cache_max of them.  Names are interned, since the same few
+ * (Contents, Resources, ...) turn up in a great many directories. */
+
+#define DID_CACHE_BUCKETS 4096
+
+struct did_name {
+	struct did_name * next;
+	unsigned int hash;
+	unsigned int refcount;
+	unsigned int len;
+	char name[1];
+};
 
 struct did_cache_entry {
-                                 /* For the example /foo/bar/baz */
-	char dirname[AFP_MAX_PATH];  /* full name, eg. /foo/bar/     */
-	unsigned int did;            /*            eg  2323          */
+	unsigned int parent;
+	unsigned int did;            /* 0 if the name doesn't exist */
+	struct did_name * name;
 	struct timeval time;
-	struct did_cache_entry * next;
+	struct did_cache_entry * next;	/* in the hash chain */
+	struct did_cache_entry * lru_prev, * lru_next;
 } ;
 
-int free_entire_did_cache(struct afp_volume * volume) 
+struct did_cache {
+	struct did_cache_entry * entries[DID_CACHE_BUCKETS];
+	struct did_name * names[DID_CACHE_BUCKETS];
+	struct did_cache_entry * lru_head, * lru_tail;
+	unsigned int count;
+};
+
+static unsigned int did_hash_name(const char * name, unsigned int len)
 {
+	unsigned int hash=2166136261U;
+	unsigned int i;
 
-	struct did_cache_entry * d, * p, *p2;
+	for (i=0;i<len;i++) {
+		hash^=(unsigned char) name[i];
+		hash*=16777619U;
+	}
+	return hash;
+}
 
-	pthread_mutex_lock(&volume->did_cache_mutex);
+static unsigned int did_bucket(unsigned int parent, unsigned int namehash)
+{
+	return ((parent*2654435761U)^namehash) & (DID_CACHE_BUCKETS-1);
+}
+
+static struct did_name * did_intern(struct did_cache * cache,
+	const char * name, unsigned int len, unsigned int hash)
+{
+	struct did_name * n;
+	unsigned int bucket = hash & (DID_CACHE_BUCKETS-1);
+
+	for (n=cache->names[bucket];n;n=n->next)
+		if ((n->hash==hash) && (n->len==len) &&
+			(memcmp(n->name,name,len)==0)) {
+			n->refcount++;
+			return n;
+		}
 
-	p=volume->did_cache_base;
+	if ((n=malloc(sizeof(*n)+len))==NULL) return NULL;
+	n->hash=hash;
+	n->refcount=1;
+	n->len=len;
+	memcpy(n->name,name,len);
+	n->name[len]='\0';
+	n->next=cache->names[bucket];
+	cache->names[bucket]=n;
+	return n;
+}
+
+static void did_name_release(struct did_cache * cache, struct did_name * n)
+{
+	struct did_name ** pp;
+
+	if (--n->refcount) return;
+
+	for (pp=&cache->names[n->hash & (DID_CACHE_BUCKETS-1)];*pp;
+		pp=&(*pp)->next)
+		if (*pp==n) {
+			*pp=n->next;
+			break;
+		}
+	free(n);
+}
+
+static void did_lru_unlink(struct did_cache * cache,
+	struct did_cache_entry * d)
+{
+	if (d->lru_prev) d->lru_prev->lru_next=d->lru_next;
+	else cache->lru_head=d->lru_next;
+	if (d->lru_next) d->lru_next->lru_prev=d->lru_prev;
+	else cache->lru_tail=d->lru_prev;
+	d->lru_prev=d->lru_next=NULL;
+}
+
+static void did_lru_push(struct did_cache * cache, struct did_cache_entry * d)
+{
+	d->lru_prev=NULL;
+	d->lru_next=cache->lru_head;
+	if (cache->lru_head) cache->lru_head->lru_prev=d;
+	cache->lru_head=d;
+	if (cache->lru_tail==NULL) cache->lru_tail=d;
+}
+
+/* All of the following must be called with did_cache_mutex held */
+
+static void did_remove(struct did_cache * cache, struct did_cache_entry * d)
+{
+	struct did_cache_entry ** pp;
+
+	for (pp=&cache->entries[did_bucket(d->parent,d->name->hash)];*pp;
+		pp=&(*pp)->next)
+		if (*pp==d) {
+			*pp=d->next;
+			break;
+		}
+	did_lru_unlink(cache,d);
+	did_name_release(cache,d->name);
+	cache->count--;
+	free(d);
+}
+
+static struct did_cache_entry * did_find(struct afp_volume * volume,
+	unsigned int parent, const char * name, unsigned int len)
+{
+	struct did_cache * cache = volume->did_cache;
+	struct did_cache_entry * d;
+	struct timeval time;
+	unsigned int hash;
 
-	for (d=volume->did_cache_base;d;d=p)
-	{
-		p2=p;
-		p=d->next;
-		free(p2);
+	if (cache==NULL) return NULL;
+
+	hash=did_hash_name(name,len);
+	for (d=cache->entries[did_bucket(parent,hash)];d;d=d->next)
+		if ((d->parent==parent) && (d->name->hash==hash) &&
+			(d->name->len==len) &&
+			(memcmp(d->name->name,name,len)==0))
+			break;
+	if (d==NULL) return NULL;
+
+	gettimeofday(&time,NULL);
+	if (time.tv_sec > (d->time.tv_sec+volume->did_cache_timeout)) {
+		volume->did_cache_stats.expired++;
+		did_remove(cache,d);
+		return NULL;
+	}
+
+	did_lru_unlink(cache,d);
+	did_lru_push(cache,d);
+	return d;
+}
+
+int free_entire_did_cache(struct afp_volume * volume)
+{
+	struct did_cache * cache;
+
+	pthread_mutex_lock(&volume->did_cache_mutex);
+
+	if ((cache=volume->did_cache)) {
+		while (cache->lru_head)
+			did_remove(cache,cache->lru_head);
+		free(cache);
+		volume->did_cache=NULL;
 	}
+
 	pthread_mutex_unlock(&volume->did_cache_mutex);
 
 	return 0;
 }
 
-int remove_did_entry(struct afp_volume * volume, const char * name) 
+/* Drops whatever we know about a full path, eg. when it is removed,
+ * renamed or created.  Only the cache is consulted to find its parent. */
+int remove_did_entry(struct afp_volume * volume, const char * name)
 {
-	struct did_cache_entry * d, * p=NULL;
+	struct did_cache_entry * d = NULL;
+	unsigned int parent=AFP_ROOT_DID;
+	const char * p = name, * next;
 
 	pthread_mutex_lock(&volume->did_cache_mutex);
 
-	for (d=volume->did_cache_base;d;d=d->next)
-	{
-		if (strcmp(d->dirname,name)==0) {
-			if (p) 
-				p->next=d->next;
-			else 
-				volume->did_cache_base=d->next;
+	while (*p=='/') p++;
+	while (*p) {
+		if ((next=strchr(p,'/'))==NULL) next=p+strlen(p);
+		if ((d=did_find(volume,parent,p,next-p))==NULL) break;
+		while (*next=='/') next++;
+		if (*next=='\0') {
 			volume->did_cache_stats.force_removed++;
-			free(d);
+			did_remove(volume->did_cache,d);
 			break;
-		} else 
-			p=d;
+		}
+		if (d->did==0) break;
+		parent=d->did;
+		p=next;
 	}
+
 	pthread_mutex_unlock(&volume->did_cache_mutex);
 	return 0;
 }
 
-	
-static int add_did_cache_entry(struct afp_volume * volume, 
-	unsigned int new_did, char * path)
+/* The same for one name in a directory we know the ID of */
+int remove_did_child(struct afp_volume * volume, unsigned int parent,
+	const char * name)
 {
+	struct did_cache_entry * d;
+
+	pthread_mutex_lock(&volume->did_cache_mutex);
+	if ((d=did_find(volume,parent,name,strlen(name)))) {
+		volume->did_cache_stats.force_removed++;
+		did_remove(volume->did_cache,d);
+	}
+	pthread_mutex_unlock(&volume->did_cache_mutex);
+	return 0;
+}
 
-	struct did_cache_entry * new, *old_base;
+/* Looks up one component.  Returns 1 and sets did if it is a known
+ * directory, -1 if it is known not to exist and 0 if we don't know. */
+static int find_did_cache_entry(struct afp_volume * volume,
+	unsigned int parent, const char * name, unsigned int len,
+	unsigned int * did)
+{
+	struct did_cache_entry * d;
+	int ret=0;
 
 	#ifdef DID_CACHE_DISABLE
 	return 0;
 	#endif
 
-	if ((new=malloc(sizeof(* new)))==NULL) return -1;
+	pthread_mutex_lock(&volume->did_cache_mutex);
+	if ((d=did_find(volume,parent,name,len))) {
+		if (d->did) {
+			*did=d->did;
+			volume->did_cache_stats.hits++;
+			ret=1;
+		} else {
+			volume->did_cache_stats.negative_hits++;
+			ret=-1;
+		}
+	}
+	pthread_mutex_unlock(&volume->did_cache_mutex);
+
+	return ret;
+}
 
+static int add_did_cache_entry(struct afp_volume * volume,
+	unsigned int parent, const char * name, unsigned int len,
+	unsigned int new_did)
+{
+	struct did_cache * cache;
+	struct did_cache_entry * new;
+	unsigned int hash;
+	int ret=-1;
 
-	memset(new,0,sizeof(*new));
+	#ifdef DID_CACHE_DISABLE
+	return 0;
+	#endif
+
+	if ((volume->did_cache_max==0) || (volume->did_cache_timeout==0))
+		return 0;
+
+	pthread_mutex_lock(&volume->did_cache_mutex);
+
+	if ((cache=volume->did_cache)==NULL) {
+		if ((cache=malloc(sizeof(*cache)))==NULL) goto out;
+		memset(cache,0,sizeof(*cache));
+		volume->did_cache=cache;
+	}
+
+	if ((new=did_find(volume,parent,name,len)))
+		did_remove(cache,new);
 
+	while ((cache->count>=volume->did_cache_max) && (cache->lru_tail)) {
+		volume->did_cache_stats.evicted++;
+		did_remove(cache,cache->lru_tail);
+	}
+
+	if ((new=malloc(sizeof(* new)))==NULL) goto out;
+
+	memset(new,0,sizeof(*new));
+	hash=did_hash_name(name,len);
+	if ((new->name=did_intern(cache,name,len,hash))==NULL) {
+		free(new);
+		goto out;
+	}
+	new->parent=parent;
 	new->did=new_did;
-	memcpy(new->dirname,path,AFP_MAX_PATH);
 	gettimeofday(&new->time,NULL);
 
-	pthread_mutex_lock(&volume->did_cache_mutex);
-	old_base=volume->did_cache_base;
-	volume->did_cache_base=new;
-	new->next=old_base;
+	new->next=cache->entries[did_bucket(parent,hash)];
+	cache->entries[did_bucket(parent,hash)]=new;
+	did_lru_push(cache,new);
+	cache->count++;
+	ret=0;
+out:
 	pthread_mutex_unlock(&volume->did_cache_mutex);
 
-	return 0;
+	return ret;
+
+}
 
+/* Records that name in parent is the directory did, as a listing of
+ * parent told us */
+int add_did_child(struct afp_volume * volume, unsigned int parent,
+	const char * name, unsigned int did)
+{
+	return add_did_cache_entry(volume,parent,name,strlen(name),did);
 }
 
-unsigned char is_dir(struct afp_volume * volume, 
+unsigned char is_dir(struct afp_volume * volume,
 	unsigned int parentdid, const char * path)
 {
 	int ret;
 	unsigned int filebitmap=0;
 	unsigned int dirbitmap=0;
 	struct afp_file_info fi;
-#if 0
-	struct did_cache_entry * p;
 
-	if ((p=find_did_cache_entry(volume,parentdid,path,strlen(path)))) 
-		return p->isdir;
-#endif
 	ret =afp_getfiledirparms(volume,parentdid,
 		filebitmap,dirbitmap,path,&fi);
 
@@ -119,141 +345,71 @@ unsigned char is_dir(struct afp_volume * volume,
 	return fi.isdir;
 }
 
-static unsigned int find_dirid_by_fullname(struct afp_volume * volume,
-	char * path)
-{
-	struct did_cache_entry * p, *prev=volume->did_cache_base;
-	struct timeval time;
-	unsigned int found_did=0;
-	unsigned char breakearly=0;
-
-	#ifdef DID_CACHE_DISABLE
-	goto out;
-	#endif
-
-	gettimeofday(&time,NULL);
+/* This calculates the dirid and basename.  It *always* gets the parent did.
+ * If some parent doesn't exist, dirid is the deepest one that does. */
 
-	pthread_mutex_lock(&volume->did_cache_mutex);
-	for (p=volume->did_cache_base;p;p=p->next) {
-		if (time.tv_sec > (p->time.tv_sec+timeout)) {
-			volume->did_cache_stats.expired++;
-			if (prev==volume->did_cache_base) {
-				if (strcmp(p->dirname,path)==0) breakearly=1;
-				volume->did_cache_base=p->next;
-				free(p);
-				if (breakearly) goto out;
-				p=volume->did_cache_base;
-				if (!p) goto out;
-				prev=volume->did_cache_base;
-				continue;
-			} else {
-				prev->next=p->next;
-				free(p);
-				p=prev;
-			}
-		}
-		if (strcmp(p->dirname,path)==0) {
-			found_did=p->did;
-			volume->did_cache_stats.hits++;
-			goto out;
-		}
-		prev=p;
-	}
-out:
-	pthread_mutex_unlock(&volume->did_cache_mutex);
-	return found_did;
-}
-
-
-/* This calculates the dirid and basename.  It *always* gets the parent did. */
-
-int get_dirid(struct afp_volume * volume, const char * path, 
+int get_dirid(struct afp_volume * volume, const char * path,
 	char * basename, unsigned int * dirid)
 {
-	char * p, *p2;
+	const char * p, * last, * next;
 	int ret;
 	struct afp_file_info fi;
 	unsigned int filebitmap,dirbitmap;
 	unsigned int newdid;
-	unsigned int parent_did;
+	unsigned int parent_did=AFP_ROOT_DID;
+	unsigned int len;
 	char copy[AFP_MAX_PATH];
 
-	if (((p=strrchr(path,'/')))==NULL) return -1; 
+	if (((last=strrchr(path,'/')))==NULL) return -1;
 
-	/* Calculate the basename, leave copy with just the parent */
+	/* Calculate the basename */
 	if (basename) {
 		memset(basename,0,AFP_MAX_PATH);
-		memcpy(basename,p+1,strlen(path)-(p-path)-1);
-	}
-
-	/* p now points to the last '/' */
-
-	if (p-path==0) {
-		*dirid=AFP_ROOT_DID;
-		goto out;
-	}
-
-	memcpy(copy,path,p-path+1);
-
-	if (copy[p-path]=='/') copy[p-path]='\0'; /* Lop off the last '/' */
-
-	/* See if the parent's fullname is in the cache */
-
-	if ((newdid=find_dirid_by_fullname(volume,copy))) {
-		*dirid=newdid;
-		goto out;
-	}
-	
-	/* No?  Work your way back to the start from the end looking
-	   for a parent */
-
-	while ((p=strrchr(copy,'/'))) {
-		if (p==copy) {
-			/* Okay, we're done since we're at the start*/
-			parent_did=AFP_ROOT_DID;
-			break;
-		}
-		*p='\0';
-		if ((parent_did=find_dirid_by_fullname(volume,copy))) {
-			break;
-		}
+		memcpy(basename,last+1,strlen(path)-(last-path)-1);
 	}
 
-	/* Okay, now we have the topmost cached parent */
-	/* Move forward now from the last parentid */
 	filebitmap=kFPNodeIDBit ;
 	dirbitmap=kFPNodeIDBit ;
 
+	/* Walk down the parents one at a time, only going to the server
+	   for the ones that aren't cached */
 
-	/* Go to the end of last known entry */
-	p=(char *)path+(p-copy);
-	p2=p;
+	for (p=path;p<last;p=next+1) {
+		while (*p=='/') p++;
+		if (p>last) break;
+		next=strchr(p,'/');
+		len=next-p;
 
-	while ((p=strchr(p+1,'/'))) {
-
-		memset(copy,0,AFP_MAX_PATH);
-		memcpy(copy,p2,p-p2);
+		switch (find_did_cache_entry(volume,parent_did,p,len,&newdid)) {
+		case 1:
+			parent_did=newdid;
+			continue;
+		case -1:
+			goto out;
+		}
 
 		volume->did_cache_stats.misses++;
 
+		memcpy(copy,p,len);
+		copy[len]='\0';
+
 		ret =afp_getfiledirparms(volume,parent_did,
 			filebitmap,dirbitmap,copy,&fi);
 
-		if (fi.isdir) {
-			/* Add it to the cache */
-			memset(copy,0,AFP_MAX_PATH);
-			memcpy(copy,path,p-path);
-			add_did_cache_entry(volume, fi.fileid,copy);
-
-		} else {
+		if (ret==kFPObjectNotFound) {
+			add_did_cache_entry(volume,parent_did,p,len,0);
 			break;
 		}
+		if ((ret) || (!fi.isdir))
+			break;
+
+		/* Add it to the cache */
+		add_did_cache_entry(volume,parent_did,p,len,fi.fileid);
 		parent_did=fi.fileid;
-		p2=p;
 	}
-	*dirid=parent_did;
 
 out:
+	*dirid=parent_did;
 	return 0;
 }
 
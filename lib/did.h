@@ -3,6 +3,10 @@
 
 int free_entire_did_cache(struct afp_volume * volume) ;
 int remove_did_entry(struct afp_volume * volume, const char * name) ;
+int remove_did_child(struct afp_volume * volume, unsigned int parent,
+	const char * name);
+int add_did_child(struct afp_volume * volume, unsigned int parent,
+	const char * name, unsigned int did);
 unsigned char is_dir(struct afp_volume * volume,
         unsigned int parentdid, const char * path);
 int get_dirid(struct afp_volume * volume, const char * path,
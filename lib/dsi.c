@@ -18,6 +18,10 @@
 #include <errno.h>
 #include <signal.h>
 #include <iconv.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "afpfs-ng/utils.h"
 #include "afpfs-ng/dsi.h"
@@ -27,6 +31,7 @@
 #include "afpfs-ng/libafpclient.h"
 #include "afp_internal.h"
 #include "afp_replies.h"
+#include "cmdstats.h"
 
 /* define this in order to get reams of DSI debugging information */
 #undef DEBUG_DSI
@@ -38,20 +43,27 @@ int convert_utf8dec_to_utf8pre(const char *src, int src_len,
 int convert_utf8pre_to_utf8dec(const char * src, int src_len, 
 	char * dest, int dest_len);
 
-/* This sets up a DSI header. */
-void dsi_setup_header(struct afp_server * server, struct dsi_header * header, char command) 
+static unsigned short dsi_next_requestid(struct afp_server * server)
 {
-
-	memset(header,0, sizeof(struct dsi_header));
+	unsigned short id;
 
 	pthread_mutex_lock(&server->requestid_mutex);
 	if (server->lastrequestid == 65535) server->lastrequestid = 0;
 	else server->lastrequestid++;
 	server->expectedrequestid = server->lastrequestid;
-
+	id=server->lastrequestid;
 	pthread_mutex_unlock(&server->requestid_mutex);
 
-	header->requestid = htons(server->lastrequestid);
+	return id;
+}
+
+/* This sets up a DSI header. */
+void dsi_setup_header(struct afp_server * server, struct dsi_header * header, char command) 
+{
+
+	memset(header,0, sizeof(struct dsi_header));
+
+	header->requestid = htons(dsi_next_requestid(server));
 
 	header->command = command;
 
@@ -139,29 +151,116 @@ static int check_incoming_dsi_message(struct afp_server * server, void * data, i
 }
 */
 
+int dsi_request_table_init(struct afp_server * server)
+{
+	struct dsi_request * p;
+	int i;
+
+	if ((server->request_table=calloc(DSI_MAX_REQUESTS,
+		sizeof(struct dsi_request)))==NULL)
+		return -1;
+
+	for (i=0;i<DSI_MAX_REQUESTS;i++) {
+		p=&server->request_table[i];
+		pthread_cond_init(&p->waiting_cond,NULL);
+		pthread_mutex_init(&p->waiting_mutex,NULL);
+	}
+	pthread_mutex_init(&server->request_queue_mutex,NULL);
+	pthread_cond_init(&server->request_slot_cond,NULL);
+	return 0;
+}
+
+void dsi_request_table_free(struct afp_server * server)
+{
+	struct dsi_request * p;
+	int i;
+
+	if (server->request_table==NULL) return;
+
+	for (i=0;i<DSI_MAX_REQUESTS;i++) {
+		p=&server->request_table[i];
+		if (p->in_use)
+			log_for_client(NULL,AFPFSD,LOG_NOTICE,
+				"FSLeft in queue: %p, id: %d command: %d\n",
+				p,p->requestid,p->subcommand);
+		pthread_cond_destroy(&p->waiting_cond);
+		pthread_mutex_destroy(&p->waiting_mutex);
+	}
+	pthread_cond_destroy(&server->request_slot_cond);
+	free(server->request_table);
+	server->request_table=NULL;
+}
+
+/* Wake up everyone waiting on this server, used when it goes away.  The
+ * replies nobody was waiting for won't come now, so their slots go. */
+void dsi_request_table_wakeup(struct afp_server * server)
+{
+	struct dsi_request * p;
+	int i;
+
+	if (server->request_table==NULL) return;
+
+	for (i=0;i<DSI_MAX_REQUESTS;i++) {
+		p=&server->request_table[i];
+		if (!p->in_use) continue;
+		if (p->no_waiter) {
+			pthread_mutex_lock(&server->request_queue_mutex);
+			if ((p->in_use) && (p->no_waiter)) {
+				p->in_use=0;
+				server->stats.requests_pending--;
+			}
+			pthread_mutex_unlock(&server->request_queue_mutex);
+			continue;
+		}
+		pthread_mutex_lock(&p->waiting_mutex);
+		p->done_waiting=1;
+		pthread_cond_signal(&p->waiting_cond);
+		pthread_mutex_unlock(&p->waiting_mutex);
+	}
+	pthread_mutex_lock(&server->request_queue_mutex);
+	pthread_cond_broadcast(&server->request_slot_cond);
+	pthread_mutex_unlock(&server->request_queue_mutex);
+}
+
+/* Claims the slot for the request id in the header.  If that slot is still
+ * held by an older request (one that has been outstanding for a full turn of
+ * the table), a fresh id is picked and written back into the header.
+ * Must be called with request_queue_mutex held. */
+static struct dsi_request * dsi_reserve_request(struct afp_server * server,
+	struct dsi_header * header)
+{
+	struct dsi_request * p;
+	unsigned short id = ntohs(header->requestid);
+
+	if (server->stats.requests_pending>=DSI_MAX_REQUESTS)
+		return NULL;
+
+	for (p=&server->request_table[id & DSI_REQUEST_MASK];p->in_use;
+		p=&server->request_table[id & DSI_REQUEST_MASK])
+		id=dsi_next_requestid(server);
+
+	header->requestid=htons(id);
+	p->requestid=id;
+	p->in_use=1;
+	server->stats.requests_pending++;
+	return p;
+}
+
 static int dsi_remove_from_request_queue(struct afp_server *server,
 	struct dsi_request *toremove)
 {
-
-	struct dsi_request *p, *prev=NULL;
 	#ifdef DEBUG_DSI
 	printf("*** removing %d, %s\n",toremove->requestid, 
 		afp_get_command_name(toremove->subcommand));
 	#endif
 	if (!server_still_valid(server)) return -1;
 	pthread_mutex_lock(&server->request_queue_mutex);
-	for (p=server->command_requests;p;p=p->next) {
-		if (p==toremove) {
-			if (prev==NULL)
-				server->command_requests=p->next;
-			else
-				prev->next = p->next;
-			server->stats.requests_pending--;
-			free(p);
-			pthread_mutex_unlock(&server->request_queue_mutex);
-			return 0;
-		}
-		prev=p;
+	if (toremove->in_use) {
+		toremove->in_use=0;
+		server->stats.requests_pending--;
+		pthread_cond_signal(&server->request_slot_cond);
+		pthread_mutex_unlock(&server->request_queue_mutex);
+		return 0;
 	}
 
 	pthread_mutex_unlock(&server->request_queue_mutex);
@@ -169,58 +268,107 @@ static int dsi_remove_from_request_queue(struct afp_server *server,
 	printf("*** Never removed anything for %d, %s\n",toremove->requestid,
 		afp_get_command_name(toremove->subcommand));
 	#endif
-	log_for_client(NULL,AFPFSD,LOG_WARNING,
-		"Got an unknown reply for requestid %i\n",ntohs(toremove->requestid));
 	return -1;
 }
 
 
-int dsi_send(struct afp_server *server, char * msg, int size,int wait,unsigned char subcommand, void ** other) 
+/* Writes out all of an iovec, picking up where a short write left off */
+static int dsi_writev_all(struct afp_server * server, 
+	const struct iovec * msg_iov, int iovcnt)
+{
+	struct iovec iovbuf[DSI_MAX_IOV], *iov=iovbuf;
+	ssize_t ret;
+
+	memcpy(iovbuf,msg_iov,iovcnt*sizeof(struct iovec));
+
+	while (iovcnt>0) {
+		if ((ret=writev(server->fd,iov,iovcnt))<0) {
+			if (errno==EINTR) continue;
+			return -1;
+		}
+		server->stats.tx_bytes+=ret;
+		while ((iovcnt>0) && (ret>=iov->iov_len)) {
+			ret-=iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt>0) {
+			iov->iov_base=(char *) iov->iov_base+ret;
+			iov->iov_len-=ret;
+		}
+	}
+	return 0;
+}
+
+/* Nobody waits for the reply to a command sent without waiting, so its
+ * slot is held until dsi_finish_packet() gets the reply, rather than
+ * freed while the reply can still turn up for it.  Our tickles get no
+ * reply. */
+static int dsi_no_waiter(const struct dsi_header * header, int wait)
+{
+	return (wait==0) && (header->command!=DSI_DSITickle);
+}
+
+static void dsi_cork(struct afp_server * server, int on)
+{
+#ifdef TCP_CORK
+	setsockopt(server->fd,IPPROTO_TCP,TCP_CORK,&on,sizeof(on));
+#endif
+}
+
+/* Queues a request and puts it on the wire, but doesn't wait for the
+ * reply.  The caller must eventually call dsi_wait_request() on the
+ * returned request, which releases it.  The first iovec has to start with
+ * the DSI header; the rest (eg. the data of a write) is sent as is,
+ * without being copied. */
+struct dsi_request * dsi_send_request_iov(struct afp_server *server, 
+	const struct iovec * iov, int iovcnt, int wait,
+	unsigned char subcommand, void ** other) 
 {
 	/* For wait:
 	 * -1: wait forever
 	 *  0: don't wait
 	 * x>n: wait for N seconds */
 
-	struct dsi_header  *header = (struct dsi_header *) msg;
-	struct dsi_request * new_request, *p;
-	int rc=0;
-	struct timespec ts;
-	struct timeval tv;
+	struct dsi_header  *header = (struct dsi_header *) iov[0].iov_base;
+	struct dsi_request * new_request;
+	unsigned int size=0;
+	int i, rc;
+
+	if ((iovcnt<1) || (iovcnt>DSI_MAX_IOV))
+		return NULL;
+
+	for (i=0;i<iovcnt;i++)
+		size+=iov[i].iov_len;
  	header->length=htonl(size-sizeof(struct dsi_header));
 
 	if (!server_still_valid(server) || server->fd==0)
-		return -1;
+		return NULL;
 
 	afp_wait_for_started_loop();
 
-	/* Add request to the queue */
-	if ((new_request=malloc(sizeof(struct dsi_request))) == NULL) {
-		log_for_client(NULL,AFPFSD,LOG_ERR,
-			"Could not allocate for new request\n");
-		return -1;
+	/* Add request to the queue, waiting for a free slot if every one
+	 * of them is in flight */
+	pthread_mutex_lock(&server->request_queue_mutex);
+	while ((new_request=dsi_reserve_request(server,header))==NULL) {
+		if (!server_still_valid(server) || server->fd==0) {
+			pthread_mutex_unlock(&server->request_queue_mutex);
+			return NULL;
+		}
+		pthread_cond_wait(&server->request_slot_cond,
+			&server->request_queue_mutex);
 	}
-	memset(new_request,0,sizeof(struct dsi_request));
-	new_request->requestid=server->lastrequestid;
 	new_request->subcommand=subcommand;
 	new_request->other=other;
 	new_request->wait=wait;
-	new_request->next=NULL;
-      	new_request->done_waiting=0;
-
-	pthread_mutex_lock(&server->request_queue_mutex);
-	if (server->command_requests==NULL) {
-		server->command_requests=new_request;
-	} else {
-		for (p=server->command_requests;p->next;p=p->next);
-		p->next=new_request;
-	}
-	server->stats.requests_pending++;
+	/* Nobody waits for the reply to a command sent without waiting, so
+	   its slot is held until the reply is in.  Our tickles get none. */
+	new_request->no_waiter=dsi_no_waiter(header,wait);
+	new_request->done_waiting=0;
+	new_request->return_code=0;
+	new_request->tx_bytes=size-sizeof(struct dsi_header);
 	pthread_mutex_unlock(&server->request_queue_mutex);
 
-	pthread_cond_init(&new_request->waiting_cond,NULL);
-	pthread_mutex_init(&new_request->waiting_mutex,NULL);
-
 	if (server->connect_state==SERVER_STATE_DISCONNECTED) {
 		char mesg[1024];
 		unsigned int l=0; 
@@ -236,21 +384,45 @@ int dsi_send(struct afp_server *server, char * msg, int size,int wait,unsigned c
 	printf("*** Sending %d, %s\n",ntohs(header->requestid),
 		afp_get_command_name(new_request->subcommand));
 	#endif
-	if (write(server->fd,msg,size)<0) {
+	gettimeofday(&new_request->sent,NULL);
+	/* Hold the header back until the payload is ready to go with it */
+	if (iovcnt>1) dsi_cork(server,1);
+	rc=dsi_writev_all(server,iov,iovcnt);
+	if (iovcnt>1) dsi_cork(server,0);
+	if (rc<0) {
 		if ((errno==EPIPE) || (errno==EBADF)) {
 			/* The server has closed the connection */
 			server->connect_state=SERVER_STATE_DISCONNECTED;
-			return -1;
-
-		}
-		perror("writing to server");
-		rc=-1;
+		} else
+			perror("writing to server");
 		pthread_mutex_unlock(&server->send_mutex);
-		goto out;
+		dsi_remove_from_request_queue(server,new_request);
+		return NULL;
 	}
-	server->stats.tx_bytes+=size;
 	pthread_mutex_unlock(&server->send_mutex);
 
+	return new_request;
+}
+
+struct dsi_request * dsi_send_request(struct afp_server *server, char * msg, 
+	int size,int wait,unsigned char subcommand, void ** other) 
+{
+	struct iovec iov;
+
+	iov.iov_base=msg;
+	iov.iov_len=size;
+	return dsi_send_request_iov(server,&iov,1,wait,subcommand,other);
+}
+
+/* Waits for a request queued by dsi_send_request() according to its wait
+ * setting, then releases it.  Returns the DSI return code.  Not for a
+ * command sent without waiting, which may be gone already. */
+int dsi_wait_request(struct afp_server *server, struct dsi_request * new_request)
+{
+	int rc=0;
+	struct timespec ts;
+	struct timeval tv;
+
 	#ifdef DEBUG_DSI
 	printf("=== Waiting for response for %d %s\n",
 		new_request->requestid,
@@ -303,6 +475,7 @@ int dsi_send(struct afp_server *server, char * msg, int size,int wait,unsigned c
 		pthread_mutex_unlock(&new_request->waiting_mutex);
 
 		if (rc==ETIMEDOUT) {
+			cmdstats_timeout(server,new_request->subcommand);
 /* FIXME: should handle this case properly */
 			#ifdef DEBUG_DSI
 			printf("=== Timedout for %d\n",
@@ -331,6 +504,33 @@ out:
 	return rc;
 }
 
+int dsi_send(struct afp_server *server, char * msg, int size,int wait,unsigned char subcommand, void ** other) 
+{
+	struct dsi_request * new_request;
+
+	if ((new_request=dsi_send_request(server,msg,size,wait,
+		subcommand,other))==NULL)
+		return -1;
+	if (dsi_no_waiter((struct dsi_header *) msg,wait))
+		return 0;
+
+	return dsi_wait_request(server,new_request);
+}
+
+int dsi_send_iov(struct afp_server *server, const struct iovec * iov,
+	int iovcnt, int wait, unsigned char subcommand, void ** other) 
+{
+	struct dsi_request * new_request;
+
+	if ((new_request=dsi_send_request_iov(server,iov,iovcnt,wait,
+		subcommand,other))==NULL)
+		return -1;
+	if (dsi_no_waiter(iov[0].iov_base,wait))
+		return 0;
+
+	return dsi_wait_request(server,new_request);
+}
+
 int dsi_command_reply(struct afp_server* server,unsigned short subcommand, void * other) {
 
 	int ret = 0;
@@ -348,22 +548,6 @@ int dsi_command_reply(struct afp_server* server,unsigned short subcommand, void
 		return -1;
 	}
 
-	if ((subcommand==afpRead) || ( subcommand==afpReadExt)) {
-		struct afp_rx_buffer * buf = other;
-		#ifdef DEBUG_DSI
-		printf("=== read() for afpRead, %d bytes\n",buf->maxsize-buf->size);
-		#endif
-		if ((ret=read(server->fd,buf->data+buf->size,
-			buf->maxsize-buf->size))<0) {
-			return -1;
-		}
-		server->stats.rx_bytes+=ret;
-		if (ret==0) {
-			return -1;
-		}
-		server->data_read+=ret;
-	}
-
 	ret = afp_reply(subcommand,server,other);
 	return ret;
 }
@@ -637,159 +821,191 @@ void * dsi_incoming_attention(void * other)
 struct dsi_request * dsi_find_request(struct afp_server *server,
 	unsigned short request_id)
 {
-
-	struct dsi_request *p, *prev=NULL;
+	struct dsi_request *p;
 
 	pthread_mutex_lock(&server->request_queue_mutex);
-	for (p=server->command_requests;p;p=p->next) {
-		if (request_id==p->requestid) {
-			pthread_mutex_unlock(&server->request_queue_mutex);
-			return p;
+	p=&server->request_table[request_id & DSI_REQUEST_MASK];
+	if ((!p->in_use) || (p->requestid!=request_id))
+		p=NULL;
+	pthread_mutex_unlock(&server->request_queue_mutex);
+
+	return p;
+}
+
+/* Copies up to len bytes out of the ring, or throws them away if dest is
+ * NULL.  Returns how many were taken. */
+static unsigned int dsi_ring_take(struct afp_server * server, char * dest,
+	unsigned int len)
+{
+	unsigned int amount, chunk;
+
+	amount=min(len,server->ring_used);
+	if (amount==0) return 0;
+	chunk=min(amount,server->ring_size-server->ring_start);
+	if (dest) {
+		memcpy(dest,server->ring+server->ring_start,chunk);
+		if (amount>chunk)
+			memcpy(dest+chunk,server->ring,amount-chunk);
+	}
+	server->ring_start=(server->ring_start+amount) % server->ring_size;
+	server->ring_used-=amount;
+	if (server->ring_used==0) server->ring_start=0;
+	return amount;
+}
+
+/* Reads up to len bytes straight into dest, and anything past that which
+ * is already waiting on the socket into the free space of the ring, in one
+ * scatter/gather read.  Returns the total read, 0 if nothing was waiting,
+ * -1 if the connection is gone. */
+static int dsi_fill(struct afp_server * server, char * dest, unsigned int len)
+{
+	struct iovec iov[3];
+	struct msghdr msg;
+	unsigned int tail, ring_free, chunk;
+	int n=0, ret;
+
+	if (len) {
+		iov[n].iov_base=dest;
+		iov[n].iov_len=len;
+		n++;
+	}
+	ring_free=server->ring_size-server->ring_used;
+	if (ring_free) {
+		tail=(server->ring_start+server->ring_used) % server->ring_size;
+		chunk=min(ring_free,server->ring_size-tail);
+		iov[n].iov_base=server->ring+tail;
+		iov[n].iov_len=chunk;
+		n++;
+		if (ring_free>chunk) {
+			iov[n].iov_base=server->ring;
+			iov[n].iov_len=ring_free-chunk;
+			n++;
 		}
-		prev=p;
 	}
-	pthread_mutex_unlock(&server->request_queue_mutex);
 
-	return NULL;
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov=iov;
+	msg.msg_iovlen=n;
+
+	/* The socket itself is blocking, so that sends don't have to deal
+	 * with EAGAIN; just don't block here. */
+	ret=recvmsg(server->fd,&msg,MSG_DONTWAIT);
+	if (ret<0) {
+		if ((errno==EAGAIN) || (errno==EWOULDBLOCK) || (errno==EINTR))
+			return 0;
+		perror("dsi_recv");
+		return -1;
+	}
+	if (ret==0) return -1;
+
+	server->stats.rx_bytes+=ret;
+	if (ret>len)
+		server->ring_used+=ret-len;
+	return ret;
 }
 
-int dsi_recv(struct afp_server * server) 
+void dsi_recv_reset(struct afp_server * server)
+{
+	server->data_read=0;
+	server->ring_start=0;
+	server->ring_used=0;
+	server->recv_state=DSI_RECV_HEADER;
+	server->recv_request=NULL;
+	server->recv_rx=NULL;
+}
+
+/* We have a header, figure out where its payload is going */
+static int dsi_start_packet(struct afp_server * server)
 {
 	struct dsi_header * header = (void *) server->incoming_buffer;
 	struct dsi_request * request=NULL;
-	int rc;
-        int amount_to_read=0;
-	int ret;
-	unsigned char runt_packet=0;
-	/* Make sure we have at least one  header */
-	if ((amount_to_read=sizeof(struct dsi_header)-server->data_read)>0) {
-		#ifdef DEBUG_DSI
-		printf("<<< read() for dsi, %d bytes\n",amount_to_read);
-		#endif
-		ret = read(server->fd,server->incoming_buffer+server->data_read,
-			amount_to_read);
-		if (ret<0) {
-			perror("dsi_recv");
-			return -1;
-		}
-		if (ret==0) {
-			return -1;
-		}
-		server->stats.rx_bytes+=ret;
-		server->data_read+=ret;
-		if ((server->data_read==sizeof(struct dsi_header)) && 
-			(ntohl(header->length)==0)) {
-			goto gotenough;
-			}
-		return 0;
-			/* We'll get the rest of the packet next time */
-	}
-gotenough:
-	/* At this point, we have just the header */
-	/* Figure out what it is a reply to */
-	request = dsi_find_request(server,ntohs(header->requestid));
-	if (!request && (header->flags==DSI_REPLY)) {
-		log_for_client(NULL,AFPFSD,LOG_ERR,
-			"I have no idea what this is a reply to, id %d.\n",
-			ntohs(header->requestid));
-			runt_packet=1;
+	unsigned int length = ntohl(header->length);
+	char * newbuffer;
+
+	/* Figure out what it is a reply to.  Requests from the server
+	 * (tickles, attention) use their own id space. */
+	if (header->flags==DSI_REPLY) {
+		request = dsi_find_request(server,ntohs(header->requestid));
+		if (!request) {
+			log_for_client(NULL,AFPFSD,LOG_ERR,
+				"I have no idea what this is a reply to, id %d.\n",
+				ntohs(header->requestid));
 			server->stats.runt_packets++;
+		}
 	}
 	if (request) request->return_code=ntohl(header->return_code.error_code);
 
-	/* If it is a read, read in as much as we can */
+	server->recv_request=request;
+	server->recv_rx=NULL;
+	server->recv_wanted=0;
+	server->recv_discard=0;
+	server->recv_state=DSI_RECV_PAYLOAD;
+
+	if ((header->flags==DSI_REPLY) && (!request)) {
+		/* A runt, just skip over it */
+		server->recv_discard=length;
+		return 0;
+	}
+
 	if ((request) && 
 		((request->subcommand==afpRead) || 
 		(request->subcommand==afpReadExt))) {
+		/* Read data goes straight into the caller's buffer */
 		struct afp_rx_buffer * buf = request->other;
-		int newmax=buf->maxsize-buf->size;
-
-		if (((server->data_read==sizeof(struct dsi_header)) &&
-			(ntohl(header->length)==0))) {
-				server->data_read=0;
-				goto out;
-			}
 
+		if (length==0) return 0;
 		if ((!buf) || (!buf->maxsize)) {
 			log_for_client(NULL,AFPFSD,LOG_ERR,
 				"No buffer allocated for incoming data\n");
 			return -1;
 		}
-		if (newmax>ntohl(header->length)-buf->size)
-			newmax=ntohl(header->length)-buf->size;
+		server->recv_rx=buf;
+		server->recv_target=buf->data+buf->size;
+		server->recv_wanted=min(length,buf->maxsize-buf->size);
+		server->recv_discard=length-server->recv_wanted;
+		return 0;
+	}
 
-		#ifdef DEBUG_DSI
-		printf("<<< read() in response to a request, %d bytes\n",newmax);
-		#endif
-		ret = read(server->fd,buf->data+buf->size,
-			newmax);
-		if (ret<0) {
-			return -1;
-		}
-		if (ret==0) {
+	/* Anything else is parsed in place, so it has to be contiguous */
+	if (length>DSI_MAX_INCOMING_PACKET) {
+		log_for_client(NULL,AFPFSD,LOG_ERR,
+			"DSI packet of %u bytes is too large\n",length);
+		return -1;
+	}
+	if (length+sizeof(*header)>server->bufsize) {
+		if ((newbuffer=realloc(server->incoming_buffer,
+			length+sizeof(*header)))==NULL) {
+			log_for_client(NULL,AFPFSD,LOG_ERR,
+				"Problem allocating memory for dsi_recv of size %d",length);
 			return -1;
 		}
-		server->stats.rx_bytes+=ret;
-		buf->size+=ret;
-
-		/* Check to see if we've read enough */
-		if (ntohl(header->length)==buf->size) {
-			char * tmpbuf;
-			int size_to_copy=server->data_read
-				-sizeof(struct dsi_header);
-			if (size_to_copy==0) {
-				server->data_read=0;
-				goto out;
-			} else if (size_to_copy<0) goto error;
-
-
-			/* Okay, so there is a buffer we have to shift */
-			if ((tmpbuf=malloc(size_to_copy))==NULL) {
-				log_for_client(NULL,AFPFSD,LOG_ERR,
-					"Problem allocating memory for dsi_recv of size %d",size_to_copy);
-				goto error;
-			}
+		server->incoming_buffer=newbuffer;
+		server->bufsize=length+sizeof(*header);
+	}
+	server->recv_target=server->incoming_buffer+sizeof(*header);
+	server->recv_wanted=length;
+	return 0;
+}
 
-			memcpy(tmpbuf,
-				server->incoming_buffer+
-				sizeof(struct dsi_header), 
-				size_to_copy);
-			memcpy(server->incoming_buffer,tmpbuf,
-				size_to_copy);
-			server->data_read=size_to_copy;
-			free(tmpbuf);
-		} else return 0;
-	} else {
-		/* Okay, so it isn't a response to an afpRead or afpReadExt */
+/* The whole packet is in, deal with it and wake up whoever was waiting */
+static void dsi_finish_packet(struct afp_server * server)
+{
+	struct dsi_header * header = (void *) server->incoming_buffer;
+	struct dsi_request * request = server->recv_request;
 
-		if (((server->data_read==sizeof(struct dsi_header)) &&
-			(ntohl(header->length)==0))) 
-				goto process_packet;
+	if ((header->flags==DSI_REPLY) && (!request))
+		goto out;
 
-		amount_to_read=min(ntohl(header->length),server->bufsize);
-		#ifdef DEBUG_DSI
-		printf("<<< read() of rest of AFP, %d bytes\n",amount_to_read);
-		#endif
-		ret = read(server->fd, (void *)
-		(((unsigned long) server->incoming_buffer)+server->data_read),
-			amount_to_read);
-		if (ret<0) return -1;
-		if (ret==0) {
-			return -1;
-		}
-		server->stats.rx_bytes+=ret;
-		server->data_read+=ret;
+	/* Read data has already been put in place */
+	if (server->recv_rx)
+		goto signal;
+	if ((request) && 
+		((request->subcommand==afpRead) || 
+		(request->subcommand==afpReadExt)))
+		goto signal;
 
-		if (server->data_read<(ntohl(header->length)+sizeof(*header)))
-			return 0;
-	}
-	if (runt_packet) 
-		goto after_processing;
+	server->data_read=ntohl(header->length)+sizeof(*header);
 
-process_packet:
-	/* At this point, we have a full DSI packet
-	   (or, for an afpRead, just the header and the data's been
-	    dumped in the preallocated buffer */
 	#ifdef DEBUG_DSI
 	printf("<<< Handling %d\n",ntohs(header->requestid));
 	#endif
@@ -810,16 +1026,17 @@ process_packet:
 		break;
 	case DSI_DSIWrite:
 	case DSI_DSICommand:
-		if (!runt_packet) 
-		dsi_command_reply(server, request->subcommand,request->other);
+		if (request)
+			dsi_command_reply(server, request->subcommand,request->other);
 		break;
 	case DSI_DSIAttention:
 		{
 			pthread_t thread;
+			server->attention_len=min(server->data_read,
+				server->attention_quantum);
 			memcpy( server->attention_buffer,
 				server->incoming_buffer,
-				server->data_read);
-			server->attention_len=server->data_read;
+				server->attention_len);
 			pthread_create(&thread,NULL,
 				dsi_incoming_attention,server);
 		}
@@ -827,46 +1044,15 @@ process_packet:
 	default:
 		log_for_client(NULL,AFPFSD,LOG_ERR,
 			"Unknown DSI command %i\n",header->command);
-		goto error;
-
-	}
-after_processing:
-	if  (server->data_read==ntohl(header->length)+sizeof(*header)) {
-		/* The most common case */
-		server->data_read=0;
-	} else {
-		unsigned int size_to_copy=
-			server->data_read-
-			(ntohl(header->length)+sizeof(*header));
-		char * tmpbuf;
-
-		if (size_to_copy<ntohl(header->length)) {
-			/* This could be replaced with memmove, as it handles
-			 * overlaps */
-			memcpy( server->incoming_buffer,
-				server->incoming_buffer+ntohl(header->length),
-				size_to_copy);
-		} else {
-			/* This is more complicated, we need an tmp buf */
-			if ((tmpbuf=malloc(size_to_copy))==NULL) {
-				log_for_client(NULL,AFPFSD,LOG_ERR,
-					"Problem allocating memory for dsi_recv of size %d",size_to_copy);
-				goto error;
-			}
-
-			memcpy(tmpbuf,
-				server->incoming_buffer+ntohl(header->length),
-				size_to_copy);
-
-			memcpy(server->incoming_buffer,tmpbuf,size_to_copy);
-			free(tmpbuf);
-		}
-		server->data_read-=size_to_copy;
+		break;
 	}
-			
-out:
 
-	rc=ntohl(header->return_code.error_code);
+signal:
+	if ((request) && ((header->command==DSI_DSICommand) ||
+		(header->command==DSI_DSIWrite)))
+		cmdstats_record(server,request->subcommand,
+			request->return_code,request->tx_bytes,
+			ntohl(header->length),&request->sent);
 	if (request) {
 		#ifdef DEBUG_DSI
 		printf("<<< Found request %d, %s\n",request->requestid,
@@ -874,25 +1060,81 @@ out:
 		#endif
 		if (request->wait) {
 			#ifdef DEBUG_DSI
-			printf("<<< Signalling %d, returning %d or %d\n",request->requestid,request->return_code,rc);
+			printf("<<< Signalling %d, returning %d\n",request->requestid,request->return_code);
 			#endif
 			pthread_mutex_lock(&request->waiting_mutex);
 			request->wait=0;
 			request->done_waiting=1;
 			pthread_cond_signal(&request->waiting_cond);
 			pthread_mutex_unlock(&request->waiting_mutex);
-		} else {
-			dsi_remove_from_request_queue(server,request);
 		}
+		/* Whoever sent it releases the slot in dsi_wait_request(),
+		   unless nobody is waiting for the reply */
+		if (request->no_waiter)
+			dsi_remove_from_request_queue(server,request);
 	}
-	return 0;
-error:
-	#ifdef DEBUG_DSI
-	printf("returning from dsi_recv with an error\n");
-	#endif
-	return -1;
+out:
+	server->data_read=0;
+	server->recv_state=DSI_RECV_HEADER;
+	server->recv_request=NULL;
+	server->recv_rx=NULL;
+}
 
+/* Handles everything that's waiting on the server's socket.  Bytes that
+ * arrive after the packet being received are kept in a ring, so complete
+ * packets are handled here without going back through the select loop. */
+int dsi_recv(struct afp_server * server) 
+{
+	unsigned int amount;
+	int ret;
 
-}
+	while (1) {
+		if (server->recv_state==DSI_RECV_HEADER) {
+			amount=sizeof(struct dsi_header)-server->data_read;
+			server->data_read+=dsi_ring_take(server,
+				server->incoming_buffer+server->data_read,amount);
+			if (server->data_read<sizeof(struct dsi_header)) {
+				amount=sizeof(struct dsi_header)-server->data_read;
+				#ifdef DEBUG_DSI
+				printf("<<< read() for dsi, %d bytes\n",amount);
+				#endif
+				if ((ret=dsi_fill(server,
+					server->incoming_buffer+server->data_read,
+					amount))<=0)
+					return ret;
+				server->data_read+=min(ret,amount);
+				continue;
+			}
+			if (dsi_start_packet(server)<0)
+				return -1;
+		}
 
+		while (server->recv_wanted) {
+			amount=dsi_ring_take(server,server->recv_target,
+				server->recv_wanted);
+			if (amount==0) {
+				#ifdef DEBUG_DSI
+				printf("<<< read() of payload, %d bytes\n",
+					server->recv_wanted);
+				#endif
+				if ((ret=dsi_fill(server,server->recv_target,
+					server->recv_wanted))<=0)
+					return ret;
+				amount=min(ret,server->recv_wanted);
+			}
+			server->recv_target+=amount;
+			server->recv_wanted-=amount;
+			if (server->recv_rx) server->recv_rx->size+=amount;
+		}
 
+		while (server->recv_discard) {
+			amount=dsi_ring_take(server,NULL,server->recv_discard);
+			server->recv_discard-=amount;
+			if ((amount==0) && 
+				((ret=dsi_fill(server,NULL,0))<=0))
+				return ret;
+		}
+
+		dsi_finish_packet(server);
+	}
+}
@@ -11,8 +11,14 @@
 
 
 #include "afpfs-ng/afp.h"
+#include "readahead.h"
+#include "writebehind.h"
+#include "locks.h"
+#include "sessions.h"
+#include "attrcache.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
 void add_opened_fork(struct afp_volume * volume, struct afp_file_info * fp)
@@ -49,6 +55,30 @@ done:
 	pthread_mutex_unlock(&volume->open_forks_mutex);
 }
 
+/* Pushes out the buffered writes of every fork open on a file, so that
+ * what we ask the server about it next includes them.  Attributes cached
+ * before, such as those a directory listing seeded, are dropped too. */
+void sync_opened_forks(struct afp_volume * volume, unsigned int did,
+	const char * basename)
+{
+	struct afp_file_info * p;
+	int synced=0;
+
+	pthread_mutex_lock(&volume->open_forks_mutex);
+
+	for (p=volume->open_forks;p;p=p->largelist_next)
+		if ((p->writebehind) && (p->did==did) &&
+			(strcmp(p->basename,basename)==0)) {
+			writebehind_sync(p);
+			synced=1;
+		}
+
+	pthread_mutex_unlock(&volume->open_forks_mutex);
+
+	if (synced)
+		attrcache_remove(volume,did,basename);
+}
+
 void remove_fork_list(struct afp_volume * volume) 
 {
 	struct afp_file_info * p, * next;
@@ -58,6 +88,10 @@ void remove_fork_list(struct afp_volume * volume)
 	for (p=volume->open_forks;p;p=next) 
 	{
 		next=p->largelist_next;
+		readahead_free(p);
+		writebehind_free(p);
+		locks_free(p);
+		sessions_close_fork(p);
 		afp_flushfork(volume,p->forkid);
 		afp_closefork(volume,p->forkid);
 
@@ -3,4 +3,6 @@
 void add_opened_fork(struct afp_volume * volume, struct afp_file_info * fp);
 void remove_opened_fork(struct afp_volume * volume, struct afp_file_info * fp);
 void remove_fork_list(struct afp_volume * volume); 
+void sync_opened_forks(struct afp_volume * volume, unsigned int did,
+	const char * basename);
 #endif
@@ -0,0 +1,171 @@
+/*
+    listing.c: compact directory listings
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    A listing keeps one fixed size struct afp_dirent per entry in an
+    array that doubles as it fills, and the names in a pool of large
+    chunks, each name stored once with its length in front of it.  A
+    directory of 100k entries is then a handful of allocations and about
+    a hundred bytes an entry, where a list of struct afp_file_info was
+    100k allocations of 2.4k each.
+
+    Entries are returned in the order they were added.  Names never move,
+    but entries may be moved when the array grows, so don't hold on to an
+    entry across afp_listing_add().
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/utils.h"
+#include "listing.h"
+
+#define LISTING_FIRST_ENTRIES 64
+#define LISTING_NAME_CHUNK (64*1024)
+
+struct listing_name_chunk {
+	struct listing_name_chunk * next;
+	unsigned int used;
+	unsigned int size;
+	char data[1];
+};
+
+struct afp_listing {
+	struct afp_dirent * entries;
+	unsigned int count;
+	unsigned int max;
+	struct listing_name_chunk * names;
+};
+
+struct afp_listing * afp_listing_new(void)
+{
+	struct afp_listing * listing;
+
+	if ((listing=malloc(sizeof(*listing)))==NULL)
+		return NULL;
+	memset(listing,0,sizeof(*listing));
+	return listing;
+}
+
+/* Copies name into the pool, as a 16 bit length, the name and a null */
+static const char * listing_add_name(struct afp_listing * listing,
+	const char * name, unsigned int namelen)
+{
+	struct listing_name_chunk * chunk = listing->names;
+	unsigned int needed = sizeof(uint16_t) + namelen + 1;
+	uint16_t len = namelen;
+	char * p;
+
+	if ((chunk==NULL) || (chunk->used+needed>chunk->size)) {
+		unsigned int size = max(LISTING_NAME_CHUNK,needed);
+
+		if ((chunk=malloc(sizeof(*chunk)+size))==NULL)
+			return NULL;
+		chunk->used=0;
+		chunk->size=size;
+		chunk->next=listing->names;
+		listing->names=chunk;
+	}
+
+	p=chunk->data+chunk->used;
+	memcpy(p,&len,sizeof(len));
+	p+=sizeof(len);
+	memcpy(p,name,namelen);
+	p[namelen]='\0';
+	chunk->used+=needed;
+	return p;
+}
+
+/* Adds an entry with just its name filled in */
+struct afp_dirent * afp_listing_add(struct afp_listing * listing,
+	const char * name, unsigned int namelen)
+{
+	struct afp_dirent * e;
+
+	if (namelen>0xffff) return NULL;
+
+	if (listing->count==listing->max) {
+		unsigned int max = listing->max ?
+			listing->max*2 : LISTING_FIRST_ENTRIES;
+
+		if ((e=realloc(listing->entries,max*sizeof(*e)))==NULL)
+			return NULL;
+		listing->entries=e;
+		listing->max=max;
+	}
+
+	e=&listing->entries[listing->count];
+	memset(e,0,sizeof(*e));
+	if ((e->name=listing_add_name(listing,name,namelen))==NULL)
+		return NULL;
+	e->namelen=namelen;
+	listing->count++;
+	return e;
+}
+
+unsigned int afp_listing_count(struct afp_listing * listing)
+{
+	return listing ? listing->count : 0;
+}
+
+/* Returns the entry at *cursor and moves the cursor on, or NULL at the
+ * end.  Start with *cursor set to 0. */
+struct afp_dirent * afp_listing_next(struct afp_listing * listing,
+	unsigned int * cursor)
+{
+	if ((listing==NULL) || (*cursor>=listing->count))
+		return NULL;
+	return &listing->entries[(*cursor)++];
+}
+
+void afp_listing_free(struct afp_listing * listing)
+{
+	struct listing_name_chunk * chunk, * next;
+
+	if (listing==NULL) return;
+
+	for (chunk=listing->names;chunk;chunk=next) {
+		next=chunk->next;
+		free(chunk);
+	}
+	free(listing->entries);
+	free(listing);
+}
+
+/* The name is left pointing at fp's */
+void listing_dirent_from_file_info(struct afp_dirent * e,
+	struct afp_file_info * fp)
+{
+	e->did=fp->did;
+	e->fileid=fp->fileid;
+	e->creation_date=fp->creation_date;
+	e->modification_date=fp->modification_date;
+	e->backup_date=fp->backup_date;
+	e->accessrights=fp->accessrights;
+	e->size=fp->size;
+	e->resourcesize=fp->resourcesize;
+	e->unixprivs=fp->unixprivs;
+	e->attributes=fp->attributes;
+	e->offspring=fp->offspring;
+	e->isdir=fp->isdir;
+	e->name=fp->name;
+	e->namelen=strlen(fp->name);
+}
+
+struct afp_dirent * listing_add_file_info(struct afp_listing * listing,
+	struct afp_file_info * fp)
+{
+	struct afp_dirent * e;
+	const char * name;
+
+	if ((e=afp_listing_add(listing,fp->name,strlen(fp->name)))==NULL)
+		return NULL;
+	name=e->name;
+	listing_dirent_from_file_info(e,fp);
+	e->name=name;
+	return e;
+}
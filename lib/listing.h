@@ -0,0 +1,11 @@
+#ifndef __LISTING_H_
+#define __LISTING_H_
+
+#include "afpfs-ng/afp.h"
+
+void listing_dirent_from_file_info(struct afp_dirent * e,
+	struct afp_file_info * fp);
+struct afp_dirent * listing_add_file_info(struct afp_listing * listing,
+	struct afp_file_info * fp);
+
+#endif
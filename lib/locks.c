@@ -0,0 +1,351 @@
+/*
+    locks.c: keeps track of the byte range locks we hold on each open fork,
+    so that reads and writes don't each cost a lock and an unlock.
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    A fork opened with deny modes that already keep everyone else out
+    doesn't need range locks at all.  Otherwise a range is locked in
+    chunks of AFP_LOCK_CHUNK, so that a sequential reader or writer only
+    goes to the server once per chunk.  Ranges are held after the read or
+    write that needed them, and given back without waiting for the reply
+    once they have gone unused for AFP_LOCK_LINGER seconds, once the
+    reader has gone past them or when too many are held.  Closing the
+    fork drops whatever is left, since the server does that for us.
+
+    Forks holding ranges are watched by a thread that wakes up every
+    AFP_LOCK_LINGER seconds, so a fork that goes idle still gives its
+    ranges back.
+
+    Like other clients that cache locks, this means another user may
+    have to wait a little longer for a range we have just used.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/afp_protocol.h"
+#include "afpfs-ng/utils.h"
+#include "locks.h"
+
+#define AFP_LOCK_CHUNK (1024*1024)
+#define AFP_LOCK_LINGER 1
+#define AFP_MAX_HELD_LOCKS 16
+#define MAX_LOCKTRYCOUNT 10
+
+struct afp_lock_range {
+	uint64_t start, end;
+	struct timeval used;
+	struct afp_lock_range * next;
+};
+
+struct afp_fork_locks {
+	pthread_mutex_t mutex;
+	struct afp_volume * volume;
+	unsigned short forkid;
+	unsigned char aflags;
+	unsigned int count;
+	struct afp_lock_range * held;	/* sorted, never overlapping */
+	int watched;	/* on locks_watched, protected by its mutex */
+	struct afp_fork_locks * watch_next;
+};
+
+static struct afp_fork_locks * locks_watched = NULL;
+static pthread_mutex_t locks_watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t locks_watch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t locks_watch_once = PTHREAD_ONCE_INIT;
+
+int locks_open(struct afp_volume * volume, struct afp_file_info * fp,
+	unsigned char aflags)
+{
+	struct afp_fork_locks * l;
+
+	if (volume->extra_flags & VOLUME_EXTRA_FLAGS_NO_LOCKING)
+		return 0;
+
+	if ((l=malloc(sizeof(*l)))==NULL)
+		return -1;
+	memset(l,0,sizeof(*l));
+	pthread_mutex_init(&l->mutex,NULL);
+	l->volume=volume;
+	l->forkid=fp->forkid;
+	l->aflags=aflags;
+	fp->locks=l;
+	return 0;
+}
+
+/* Whether the way the fork was opened already keeps others out */
+static int locks_exclusive(struct afp_fork_locks * l, int write)
+{
+	if (!write)
+		return (l->aflags & AFP_OPENFORK_DENYWRITE);
+
+	return ((l->aflags & (AFP_OPENFORK_DENYREAD|AFP_OPENFORK_DENYWRITE))==
+		(AFP_OPENFORK_DENYREAD|AFP_OPENFORK_DENYWRITE));
+}
+
+static int locks_remote_lock(struct afp_fork_locks * l,
+	uint64_t start, uint64_t end)
+{
+	uint64_t generated_offset=0;
+
+	if (l->volume->server->using_version->av_number < 30)
+		return afp_byterangelock(l->volume,ByteRangeLock_Lock,
+			l->forkid,start,end-start,
+			(uint32_t *) &generated_offset);
+	else
+		return afp_byterangelockext(l->volume,ByteRangeLock_Lock,
+			l->forkid,start,end-start,&generated_offset);
+}
+
+/* Must be called with l->mutex held */
+static void locks_drop(struct afp_fork_locks * l,
+	struct afp_lock_range ** pp)
+{
+	struct afp_lock_range * r = *pp;
+
+	afp_byterangeunlock_async(l->volume,l->forkid,r->start,r->end-r->start);
+	*pp=r->next;
+	l->count--;
+	free(r);
+}
+
+/* Gives back ranges that haven't been used for a while, or the oldest
+ * ones if we are holding too many.  Must be called with l->mutex held. */
+static void locks_expire(struct afp_fork_locks * l, struct timeval * now)
+{
+	struct afp_lock_range ** pp, ** oldest;
+
+	for (pp=&l->held;*pp;) {
+		if (now->tv_sec > (*pp)->used.tv_sec+AFP_LOCK_LINGER)
+			locks_drop(l,pp);
+		else
+			pp=&(*pp)->next;
+	}
+
+	while (l->count>=AFP_MAX_HELD_LOCKS) {
+		oldest=&l->held;
+		for (pp=&l->held;*pp;pp=&(*pp)->next)
+			if (timercmp(&(*pp)->used,&(*oldest)->used,<))
+				oldest=pp;
+		locks_drop(l,oldest);
+	}
+}
+
+/* Expires the ranges of every watched fork, and stops watching those
+ * that hold none.  A fork busy with a read or write is left alone, it
+ * expires its own ranges when it is done. */
+static void * locks_watch_thread(void * other)
+{
+	struct afp_fork_locks ** pp, * l;
+	struct timeval now;
+
+	pthread_mutex_lock(&locks_watch_mutex);
+	while (1) {
+		while (locks_watched==NULL)
+			pthread_cond_wait(&locks_watch_cond,&locks_watch_mutex);
+
+		pthread_mutex_unlock(&locks_watch_mutex);
+		sleep(AFP_LOCK_LINGER);
+		pthread_mutex_lock(&locks_watch_mutex);
+
+		gettimeofday(&now,NULL);
+		for (pp=&locks_watched;(l=*pp);) {
+			if (pthread_mutex_trylock(&l->mutex)) {
+				pp=&l->watch_next;
+				continue;
+			}
+			locks_expire(l,&now);
+			if (l->count==0) {
+				*pp=l->watch_next;
+				l->watched=0;
+			} else
+				pp=&l->watch_next;
+			pthread_mutex_unlock(&l->mutex);
+		}
+	}
+	return NULL;
+}
+
+static void locks_watch_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread,&attr,locks_watch_thread,NULL))
+		log_for_client(NULL,AFPFSD,LOG_WARNING,
+			"Could not start the lock expiry thread, idle "
+			"forks keep their range locks until closed\n");
+	pthread_attr_destroy(&attr);
+}
+
+/* Has the watch thread look after a fork that now holds ranges */
+static void locks_watch(struct afp_fork_locks * l)
+{
+	pthread_once(&locks_watch_once,locks_watch_start);
+
+	pthread_mutex_lock(&locks_watch_mutex);
+	if (!l->watched) {
+		l->watched=1;
+		l->watch_next=locks_watched;
+		locks_watched=l;
+		pthread_cond_signal(&locks_watch_cond);
+	}
+	pthread_mutex_unlock(&locks_watch_mutex);
+}
+
+/* Locks [start,end), stretched up to the end of its chunk where that
+ * doesn't run into limit, and records it.  Must be called with l->mutex
+ * held. */
+static int locks_get(struct afp_fork_locks * l, uint64_t start,
+	uint64_t end, uint64_t limit, struct timeval * now)
+{
+	struct afp_lock_range * new, ** pp;
+	uint64_t lockend;
+	unsigned int delay=10000;	/* microseconds */
+	int try=0, rc;
+
+	lockend=((end+AFP_LOCK_CHUNK-1)/AFP_LOCK_CHUNK)*AFP_LOCK_CHUNK;
+	if (lockend>limit) lockend=limit;
+	if ((l->volume->server->using_version->av_number < 30) &&
+		(lockend>0xffffffffULL))
+		lockend=0xffffffffULL;
+	if (lockend<end) lockend=end;
+
+	while (1) {
+		rc=locks_remote_lock(l,start,lockend);
+		if (rc==kFPNoErr) break;
+		switch (rc) {
+		case kFPLockErr:
+			/* Someone else has part of the chunk, just ask for
+			   what we need */
+			if (lockend>end) {
+				lockend=end;
+				continue;
+			}
+			/* Fall through */
+		case kFPNoMoreLocks:
+			if (++try>=MAX_LOCKTRYCOUNT)
+				return -1;
+			pthread_mutex_unlock(&l->mutex);
+			usleep(delay);
+			pthread_mutex_lock(&l->mutex);
+			if (delay<1000000) delay*=2;
+			continue;
+		default:
+			return -1;
+		}
+	}
+
+	if ((new=malloc(sizeof(*new)))==NULL) {
+		afp_byterangeunlock_async(l->volume,l->forkid,
+			start,lockend-start);
+		return -1;
+	}
+	new->start=start;
+	new->end=lockend;
+	new->used=*now;
+	for (pp=&l->held;*pp && (*pp)->start<start;pp=&(*pp)->next);
+	new->next=*pp;
+	*pp=new;
+	l->count++;
+	return 0;
+}
+
+/* Makes sure [offset,offset+size) is locked, only going to the server
+ * for the parts that we don't hold already. */
+int locks_acquire(struct afp_file_info * fp, int write,
+	uint64_t offset, uint64_t size)
+{
+	struct afp_fork_locks * l = fp->locks;
+	struct afp_lock_range * r;
+	struct timeval now;
+	uint64_t pos=offset, end=offset+size;
+	unsigned int held;
+	int ret=0;
+
+	if ((l==NULL) || (size==0) || (locks_exclusive(l,write)))
+		return 0;
+
+	gettimeofday(&now,NULL);
+
+	pthread_mutex_lock(&l->mutex);
+	locks_expire(l,&now);
+
+	while (pos<end) {
+		/* The first range we hold that ends after pos */
+		for (r=l->held;r && (r->end<=pos);r=r->next);
+		if ((r) && (r->start<=pos)) {
+			r->used=now;
+			pos=r->end;
+			continue;
+		}
+		/* pos isn't covered, lock up to the next range we hold */
+		if ((ret=locks_get(l,pos,r ? min(r->start,end) : end,
+			r ? r->start : (uint64_t) -1,&now)))
+			break;
+	}
+
+	held=l->count;
+	pthread_mutex_unlock(&l->mutex);
+
+	if (held) locks_watch(l);
+	return ret;
+}
+
+/* Called when a read or write is done with a range.  The locks stay
+ * around for the next one, except those the caller has gone past. */
+void locks_release(struct afp_file_info * fp, uint64_t offset, uint64_t size)
+{
+	struct afp_fork_locks * l = fp->locks;
+	struct afp_lock_range ** pp;
+	struct timeval now;
+
+	if (l==NULL) return;
+
+	gettimeofday(&now,NULL);
+
+	pthread_mutex_lock(&l->mutex);
+	for (pp=&l->held;*pp;) {
+		if (((*pp)->end<=offset+size) && ((*pp)->end>offset))
+			/* The caller has reached the end of it */
+			locks_drop(l,pp);
+		else
+			pp=&(*pp)->next;
+	}
+	locks_expire(l,&now);
+	pthread_mutex_unlock(&l->mutex);
+}
+
+/* The server drops a fork's locks when it is closed, so there's nothing
+ * to send here. */
+void locks_free(struct afp_file_info * fp)
+{
+	struct afp_fork_locks * l = fp->locks;
+	struct afp_fork_locks ** pp;
+	struct afp_lock_range * r, * next;
+
+	if (l==NULL) return;
+
+	pthread_mutex_lock(&locks_watch_mutex);
+	if (l->watched) {
+		for (pp=&locks_watched;*pp!=l;pp=&(*pp)->watch_next);
+		*pp=l->watch_next;
+	}
+	pthread_mutex_unlock(&locks_watch_mutex);
+
+	for (r=l->held;r;r=next) {
+		next=r->next;
+		free(r);
+	}
+	pthread_mutex_destroy(&l->mutex);
+	free(l);
+	fp->locks=NULL;
+}
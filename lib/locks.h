@@ -0,0 +1,14 @@
+#ifndef __LOCKS_H_
+#define __LOCKS_H_
+
+#include <sys/types.h>
+#include "afpfs-ng/afp.h"
+
+int locks_open(struct afp_volume * volume, struct afp_file_info * fp,
+	unsigned char aflags);
+int locks_acquire(struct afp_file_info * fp, int write,
+	uint64_t offset, uint64_t size);
+void locks_release(struct afp_file_info * fp, uint64_t offset, uint64_t size);
+void locks_free(struct afp_file_info * fp);
+
+#endif
@@ -20,14 +20,27 @@
 #include "afpfs-ng/dsi.h"
 #include "afpfs-ng/utils.h"
 
+#ifdef __linux__
+#define USE_EPOLL
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #define SIGNAL_TO_USE SIGUSR2
 
+/* Most events handled per wakeup */
+#define AFP_LOOP_MAX_EVENTS 64
+
+#define AFP_LOOP_MAX_IO_THREADS 16
+
 static unsigned char exit_program=0;
 
 static pthread_t ending_thread;
 static pthread_t main_thread = (pthread_t)NULL;
 
 static int loop_started=0;
+static int loop_command_fd=-1;
 static pthread_cond_t loop_started_condition;
 static pthread_mutex_t loop_started_mutex;
 
@@ -53,19 +66,98 @@ void termination_handler(int signum)
 		
 }
 
-#define max(a,b) (((a)>(b)) ? (a) : (b))
+/* Every descriptor the loop watches has a callback, kept in a table
+ * indexed by the descriptor. */
+struct loop_fd {
+	void (*callback)(int fd, void * priv);
+	void * priv;
+	int set;	/* which loop is watching it, -1 for the main one */
+};
+
+static struct loop_fd * fd_table=NULL;
+static int fd_table_size=0;
+static pthread_mutex_t fd_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t loop_backend_once = PTHREAD_ONCE_INIT;
+
+#ifdef USE_EPOLL
+
+static int epoll_fd=-1;
+static int wakeup_fd=-1;
+
+static void loop_backend_init(void)
+{
+	struct epoll_event ev;
+
+	epoll_fd=epoll_create(AFP_LOOP_MAX_EVENTS);
+	wakeup_fd=eventfd(0,EFD_NONBLOCK);
+
+	memset(&ev,0,sizeof(ev));
+	ev.events=EPOLLIN;
+	ev.data.fd=wakeup_fd;
+	epoll_ctl(epoll_fd,EPOLL_CTL_ADD,wakeup_fd,&ev);
+}
+
+/* Optional receive threads.  Each has its own epoll set and servers are
+ * spread across them, so that a slow dsi_recv() on one connection doesn't
+ * hold up replies on the others. */
+struct loop_io_thread {
+	pthread_t thread;
+	int epoll_fd;
+};
+
+static struct loop_io_thread io_threads[AFP_LOOP_MAX_IO_THREADS];
+static unsigned int io_thread_count=0;
+static unsigned int io_threads_running=0;
+static unsigned int io_thread_next=0;
+
+static void add_fd(int set, int fd, int flags)
+{
+	struct epoll_event ev;
+	int efd = (set<0) ? epoll_fd : io_threads[set].epoll_fd;
+
+	memset(&ev,0,sizeof(ev));
+	ev.events=EPOLLIN | ((flags & AFP_LOOP_EDGE) ? EPOLLET : 0);
+	ev.data.fd=fd;
+	if ((epoll_ctl(efd,EPOLL_CTL_ADD,fd,&ev)<0) && (errno==EEXIST))
+		epoll_ctl(efd,EPOLL_CTL_MOD,fd,&ev);
+}
+
+static void rm_fd(int set, int fd)
+{
+	struct epoll_event ev;
+	int efd = (set<0) ? epoll_fd : io_threads[set].epoll_fd;
+
+	/* Older kernels want a non-NULL event even for a delete */
+	epoll_ctl(efd,EPOLL_CTL_DEL,fd,&ev);
+}
+
+void signal_main_thread(void)
+{
+	uint64_t one=1;
+
+	pthread_once(&loop_backend_once,loop_backend_init);
+	if (write(wakeup_fd,&one,sizeof(one))<0) 
+		perror("waking up main loop");
+}
+
+#else
 
 static fd_set rds;
 static int max_fd=0;
 
-static void add_fd(int fd)
+static void loop_backend_init(void)
+{
+	FD_ZERO(&rds);
+}
+
+static void add_fd(int set, int fd, int flags)
 {
 	FD_SET(fd,&rds);
 
 	if ((fd+1) > max_fd) max_fd=fd+1;
 }
 
-static void rm_fd(int fd)
+static void rm_fd(int set, int fd)
 {
 	int i;
 	FD_CLR(fd,&rds);
@@ -84,6 +176,219 @@ void signal_main_thread(void)
 		pthread_kill(main_thread,SIGNAL_TO_USE);
 }
 
+#endif
+
+static int loop_add_fd(int set, int fd, int flags, 
+	void (*callback)(int fd, void * priv), void * priv)
+{
+	struct loop_fd * newtable;
+	int newsize;
+
+	if (fd<0) return -1;
+
+	pthread_once(&loop_backend_once,loop_backend_init);
+
+	pthread_mutex_lock(&fd_table_mutex);
+	if (fd>=fd_table_size) {
+		newsize=max(fd+1,fd_table_size*2);
+		if ((newtable=realloc(fd_table,
+			newsize*sizeof(struct loop_fd)))==NULL) {
+			pthread_mutex_unlock(&fd_table_mutex);
+			return -1;
+		}
+		memset(newtable+fd_table_size,0,
+			(newsize-fd_table_size)*sizeof(struct loop_fd));
+		fd_table=newtable;
+		fd_table_size=newsize;
+	}
+	fd_table[fd].callback=callback;
+	fd_table[fd].priv=priv;
+	fd_table[fd].set=set;
+	add_fd(set,fd,flags);
+	pthread_mutex_unlock(&fd_table_mutex);
+
+	if (set<0) signal_main_thread();
+	return 0;
+}
+
+/* Starts watching fd; callback is run from the main loop whenever there
+ * is something to read.  With AFP_LOOP_EDGE, it is only run when new data
+ * arrives, so it has to read everything that's waiting. */
+int afp_loop_add_fd(int fd, int flags, 
+	void (*callback)(int fd, void * priv), void * priv)
+{
+	return loop_add_fd(-1,fd,flags,callback,priv);
+}
+
+void afp_loop_rm_fd(int fd)
+{
+	if (fd<0) return;
+
+	pthread_once(&loop_backend_once,loop_backend_init);
+
+	pthread_mutex_lock(&fd_table_mutex);
+	if (fd<fd_table_size) {
+		fd_table[fd].callback=NULL;
+		fd_table[fd].priv=NULL;
+		rm_fd(fd_table[fd].set,fd);
+	} else
+		rm_fd(-1,fd);
+	pthread_mutex_unlock(&fd_table_mutex);
+
+	signal_main_thread();
+}
+
+static void loop_dispatch(int fd)
+{
+	void (*callback)(int fd, void * priv) = NULL;
+	void * priv = NULL;
+
+	pthread_mutex_lock(&fd_table_mutex);
+	if (fd<fd_table_size) {
+		callback=fd_table[fd].callback;
+		priv=fd_table[fd].priv;
+	}
+	pthread_mutex_unlock(&fd_table_mutex);
+
+	if (callback) callback(fd,priv);
+}
+
+static void loop_server_ready(int fd, void * priv)
+{
+	struct afp_server * s = priv;
+
+	if (dsi_recv(s)==-1)
+		loop_disconnect(s);
+}
+
+/* For descriptors added without a callback: it is either a server, or
+ * something the client watches through scan_extra_fds */
+static void loop_unknown_ready(int fd, void * priv)
+{
+	struct afp_server * s;
+	fd_set set;
+	int max_fd = fd+1;
+
+	for (s=get_server_base();s;s=s->next) {
+		if (s->next==s) printf("Danger, recursive loop\n");
+		if (s->fd==fd) {
+			loop_server_ready(fd,s);
+			return;
+		}
+	}
+
+	if (libafpclient->scan_extra_fds) {
+		FD_ZERO(&set);
+		FD_SET(fd,&set);
+		libafpclient->scan_extra_fds(loop_command_fd,&set,&max_fd);
+	}
+}
+
+#ifdef USE_EPOLL
+
+static void * loop_io_thread(void * other)
+{
+	struct loop_io_thread * t = other;
+	struct epoll_event events[AFP_LOOP_MAX_EVENTS];
+	sigset_t sigmask;
+	int ret, i;
+
+	/* Signals are for the main loop */
+	sigfillset(&sigmask);
+	pthread_sigmask(SIG_BLOCK,&sigmask,NULL);
+
+	while (1) {
+		ret=epoll_wait(t->epoll_fd,events,AFP_LOOP_MAX_EVENTS,-1);
+		if (ret<0) {
+			if (errno==EINTR) continue;
+			log_for_client(NULL,AFPFSD,LOG_ERR,
+				"epoll_wait failed in receive thread: %s\n",
+				strerror(errno));
+			break;
+		}
+		for (i=0;i<ret;i++)
+			loop_dispatch(events[i].data.fd);
+	}
+	return NULL;
+}
+
+/* Picks the receive thread for a new connection, starting the threads
+ * the first time.  Returns -1 to use the main loop. */
+static int loop_pick_io_thread(void)
+{
+	int set=-1;
+	unsigned int i;
+
+	pthread_mutex_lock(&fd_table_mutex);
+	if ((io_thread_count) && (io_threads_running==0)) {
+		for (i=0;i<io_thread_count;i++) {
+			if ((io_threads[i].epoll_fd=
+				epoll_create(AFP_LOOP_MAX_EVENTS))<0)
+				break;
+			if (pthread_create(&io_threads[i].thread,NULL,
+				loop_io_thread,&io_threads[i])) {
+				close(io_threads[i].epoll_fd);
+				break;
+			}
+			pthread_detach(io_threads[i].thread);
+		}
+		io_threads_running=i;
+		if (i==0) {
+			log_for_client(NULL,AFPFSD,LOG_WARNING,
+				"Could not start receive threads, "
+				"using the main loop\n");
+			io_thread_count=0;
+		}
+	}
+	if (io_threads_running) {
+		set=io_thread_next % io_threads_running;
+		io_thread_next++;
+	}
+	pthread_mutex_unlock(&fd_table_mutex);
+
+	return set;
+}
+
+/* Sets how many threads receive from servers.  Zero, the default, does
+ * it all from the main loop.  Only takes effect before the first
+ * connection. */
+int afp_loop_set_io_threads(unsigned int count)
+{
+	int ret=0;
+
+	pthread_mutex_lock(&fd_table_mutex);
+	if (io_threads_running) 
+		ret=-1;
+	else
+		io_thread_count=min(count,AFP_LOOP_MAX_IO_THREADS);
+	pthread_mutex_unlock(&fd_table_mutex);
+
+	return ret;
+}
+
+#else
+
+static int loop_pick_io_thread(void)
+{
+	return -1;
+}
+
+int afp_loop_set_io_threads(unsigned int count)
+{
+	/* Only the epoll loop knows how to do this */
+	return (count==0) ? 0 : -1;
+}
+
+#endif
+
+void loop_connect(struct afp_server * s)
+{
+	pthread_once(&loop_backend_once,loop_backend_init);
+
+	loop_add_fd(loop_pick_io_thread(),s->fd,AFP_LOOP_EDGE,
+		loop_server_ready,s);
+}
+
 static int ending=0;
 void * just_end_it_now(void * ignore)
 {
@@ -96,23 +401,14 @@ void * just_end_it_now(void * ignore)
 	return NULL;
 }
 
-/*This is a hack to handle a problem where the first pthread_kill doesnt' work*/
-static unsigned char firsttime=0; 
 void add_fd_and_signal(int fd)
 {
-	add_fd(fd);
-	signal_main_thread();
-	if (!firsttime) {
-		firsttime=1;
-		signal_main_thread();
-	}
-	
+	afp_loop_add_fd(fd,0,loop_unknown_ready,NULL);
 }
 
 void rm_fd_and_signal(int fd)
 {
-	rm_fd(fd);
-	signal_main_thread();
+	afp_loop_rm_fd(fd);
 }
 
 void loop_disconnect(struct afp_server *s)
@@ -125,41 +421,12 @@ void loop_disconnect(struct afp_server *s)
 
 	/* Handle disconnect */
         close(s->fd);
+	dsi_recv_reset(s);
 
 	s->connect_state=SERVER_STATE_DISCONNECTED;
 	s->need_resume=1;
 }
 
-static int process_server_fds(fd_set * set, int max_fd, int ** onfd)
-{
-
-	struct afp_server * s;
-	int ret;
-	s  = get_server_base();
-	for (;s;s=s->next) {
-		if (s->next==s) printf("Danger, recursive loop\n");
-		if (FD_ISSET(s->fd,set)) {
-			ret=dsi_recv(s);
-			*onfd=&s->fd;
-			if (ret==-1) {
-				loop_disconnect(s);
-				return -1;
-			}
-			return 1;
-		}
-	}
-	return 0;
-}
-
-static void deal_with_server_signals(fd_set *set, int * max_fd) 
-{
-
-	if (exit_program==1) {
-		pthread_create(&ending_thread,NULL,just_end_it_now,NULL);
-	}
-
-}
-
 void afp_wait_for_started_loop(void) 
 {
 	if (loop_started) return;
@@ -185,20 +452,90 @@ int afp_main_quick_startup(pthread_t * thread)
 }
 
 
+static void loop_mark_started(void)
+{
+	if (loop_started) return;
+
+	loop_started=1;
+	pthread_cond_signal(&loop_started_condition);
+	if (libafpclient->loop_started) 
+		libafpclient->loop_started();
+}
+
+#ifdef USE_EPOLL
+
+int afp_main_loop(int command_fd) {
+	struct epoll_event events[AFP_LOOP_MAX_EVENTS];
+	uint64_t count;
+	int ret, i;
+	sigset_t sigmask, orig_sigmask;
+
+	main_thread=pthread_self();
+
+	pthread_once(&loop_backend_once,loop_backend_init);
+
+	loop_command_fd=command_fd;
+	if (command_fd>=0) 
+		afp_loop_add_fd(command_fd,0,loop_unknown_ready,NULL);
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask,SIGNAL_TO_USE);
+	sigprocmask(SIG_BLOCK,&sigmask,&orig_sigmask);
+
+	signal(SIGTERM,termination_handler);
+	signal(SIGINT,termination_handler);
+	while(1) {
+
+		ret=epoll_pwait(epoll_fd,events,AFP_LOOP_MAX_EVENTS,
+			loop_started ? 30000 : 0, &orig_sigmask);
+		if (exit_program==2) break;
+		if (exit_program==1) {
+			pthread_create(&ending_thread,NULL,just_end_it_now,NULL);
+		}
+		if (ret<0) {
+			if (errno==EINTR) continue;
+			log_for_client(NULL,AFPFSD,LOG_ERR,
+				"epoll_wait failed: %s\n",strerror(errno));
+			break;
+		}
+		if (ret==0) {
+			/* Timeout */
+			loop_mark_started();
+			continue;
+		}
+
+		/* Handle every descriptor that is ready, not just the first */
+		for (i=0;i<ret;i++) {
+			if (events[i].data.fd==wakeup_fd) {
+				if (read(wakeup_fd,&count,sizeof(count))<0) {
+					/* Nothing to do, it is just a wakeup */
+				}
+				continue;
+			}
+			loop_dispatch(events[i].data.fd);
+		}
+	}
+
+	return -1;
+
+}
+
+#else
+
 int afp_main_loop(int command_fd) {
 	fd_set ords, oeds;
 	struct timespec tv;
-	int ret;
+	int ret, fd, ready;
 	int fderrors=0;
 	sigset_t sigmask, orig_sigmask;
 
 	main_thread=pthread_self();
 
-	FD_ZERO(&rds);
-	if (command_fd>=0) 
-		add_fd(command_fd);
-
+	pthread_once(&loop_backend_once,loop_backend_init);
 
+	loop_command_fd=command_fd;
+	if (command_fd>=0) 
+		afp_loop_add_fd(command_fd,0,loop_unknown_ready,NULL);
 
 	sigemptyset(&sigmask);
 	sigaddset(&sigmask,SIGNAL_TO_USE);
@@ -209,8 +546,11 @@ int afp_main_loop(int command_fd) {
 	signal(SIGINT,termination_handler);
 	while(1) {
 
+		pthread_mutex_lock(&fd_table_mutex);
 		ords=rds;
 		oeds=rds;
+		ready=max_fd;
+		pthread_mutex_unlock(&fd_table_mutex);
 		if (loop_started) {
 			tv.tv_sec=30;
 			tv.tv_nsec=0;
@@ -219,7 +559,7 @@ int afp_main_loop(int command_fd) {
 			tv.tv_nsec=0;
 		}
 
-		ret=pselect(max_fd,&ords,NULL,&oeds,&tv,&orig_sigmask);
+		ret=pselect(ready,&ords,NULL,&oeds,&tv,&orig_sigmask);
 			if (exit_program==2) break;
 			if (exit_program==1) {
 				pthread_create(&ending_thread,NULL,just_end_it_now,NULL);
@@ -227,7 +567,6 @@ int afp_main_loop(int command_fd) {
 		if (ret<0) {
 			switch(errno) {
 			case EINTR:
-				deal_with_server_signals(&rds,&max_fd);
 				break;
 			case EBADF:
 				if (fderrors > 100) {
@@ -243,30 +582,18 @@ int afp_main_loop(int command_fd) {
 		fderrors=0;
 		if (ret==0) {
 			/* Timeout */
-			if (loop_started==0) {
-				loop_started=1;
-				pthread_cond_signal(&loop_started_condition);
-				if (libafpclient->loop_started) 
-					libafpclient->loop_started();
-			}
-		} else {
-			int * onfd;
-			fderrors=0;
-			switch (process_server_fds(&ords,max_fd,&onfd)) {
-			case -1: 
-				continue;
-			case 1:
-				continue;
-			}
-			if (libafpclient->scan_extra_fds) {
-				if (libafpclient->scan_extra_fds(
-					command_fd,&ords,&max_fd)>0)
-					continue;
-			}
+			loop_mark_started();
+			continue;
 		}
+
+		/* Handle every descriptor that is ready, not just the first */
+		for (fd=0;fd<ready;fd++)
+			if (FD_ISSET(fd,&ords))
+				loop_dispatch(fd);
 	}
 
 	return -1;
 
 }
 
+#endif
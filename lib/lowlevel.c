@@ -23,90 +23,27 @@
 #include "afpfs-ng/afp_protocol.h"
 #include "afpfs-ng/codepage.h"
 #include "afpfs-ng/utils.h"
+#include "afpfs-ng/dsi.h"
 #include "afpfs-ng/midlevel.h"
 #include "lib/forklist.h"
 #include "did.h"
+#include "attrcache.h"
 #include "users.h"
-
-static void set_nonunix_perms(unsigned int * mode, struct afp_file_info *fp) 
+#include "readahead.h"
+#include "writebehind.h"
+#include "locks.h"
+#include "listing.h"
+#include "sessions.h"
+#include "lowlevel.h"
+
+static void set_nonunix_perms(unsigned int * mode, unsigned char isdir) 
 {
-	if (fp->isdir) 
+	if (isdir) 
 		*mode = 0700 | S_IFDIR;
 	else 
 		*mode = 0600 | S_IFREG;
 }
 
-int ll_handle_unlocking(struct afp_volume * volume,unsigned short forkid,
-	uint64_t offset, uint64_t sizetorequest)
-{
-	uint64_t generated_offset;
-	int rc;
-
-	if (volume->extra_flags & VOLUME_EXTRA_FLAGS_NO_LOCKING) 
-		return 0;
-
-	if (volume->server->using_version->av_number < 30) 
-		rc=afp_byterangelock(volume,ByteRangeLock_Unlock,
-				forkid,offset, sizetorequest,
-				(uint32_t *) &generated_offset);
-	else 
-		rc=afp_byterangelockext(volume,ByteRangeLock_Unlock,
-				forkid,offset, sizetorequest,&generated_offset);
-	switch(rc) {
-		case kFPNoErr:
-			break;
-		case kFPMiscErr:
-		case kFPParamErr:
-		case kFPRangeNotLocked:
-		default:
-			return -1;
-	}
-	return 0;
-}
-
-int ll_handle_locking(struct afp_volume * volume,unsigned short forkid, 
-	uint64_t offset, uint64_t sizetorequest)
-{
-
-#define MAX_LOCKTRYCOUNT 10
-
-	int rc=0;
-	int try=0;
-	uint64_t generated_offset;
-
-	if (volume->extra_flags & VOLUME_EXTRA_FLAGS_NO_LOCKING) 
-		return 0;
-
-	while (try<MAX_LOCKTRYCOUNT) {
-		try++;
-		if (volume->server->using_version->av_number < 30) 
-			rc=afp_byterangelock(volume,ByteRangeLock_Lock,
-				forkid,offset, sizetorequest,
-				(uint32_t *) &generated_offset);
-		else 
-			rc=afp_byterangelockext(volume,ByteRangeLock_Lock,
-				forkid,offset, sizetorequest,&generated_offset);
-		switch(rc) {
-		case kFPNoErr:
-			goto done;
-		case kFPNoMoreLocks: /* Max num of locks on server */
-		case kFPLockErr:  /*Some or all of the requested range is locked
-				    by another user. */
-
-			sleep(1);
-			break;
-		default:
-			return -1;
-		}
-	}
-done:
-
-	return 0;
-}
-
-
-
-
 /* zero_file()
  *
  * This function will truncate the fork given to zero bytes in length.
@@ -278,7 +215,7 @@ try_again:
 		ret=EACCES;
 		goto error;
 	case kFPObjectNotFound:
-		if ((flags & O_CREAT) && 
+		if ((flags & O_CREAT) && (path) &&
 			(ml_creat(volume,path,0644)==0)) {
 /* FIXME 0644 is just made up */
 				goto try_again;
@@ -313,12 +250,21 @@ try_again:
 		goto error;
 	}
 
+	if (locks_open(volume, fp, aflags)) {
+		afp_closefork(volume,fp->forkid);
+		ret=ENOMEM;
+		goto error;
+	}
 	add_opened_fork(volume, fp);
+	sessions_open_fork(volume, fp, aflags);
+	readahead_open(volume, fp);
+	writebehind_open(volume, fp);
 
 	if ((flags & O_TRUNC) && (!create_file)) {
 
 		/* This is the case where we want to truncate the 
 		   the file and it already exists. */
+		sync_opened_forks(volume,fp->did,fp->basename);
 		if ((ret=ll_zero_file(volume,fp->forkid,fp->resource)))
 			goto error;
 	}
@@ -340,14 +286,28 @@ int ll_read(struct afp_volume * volume,
 	int rc;
 	unsigned int bufsize=min(volume->server->rx_quantum,size);
 	struct afp_rx_buffer buffer;
+	struct afp_volume * v;
+	unsigned short forkid;
 
 	*eof=0;
 
+	/* Anything still buffered for writing has to reach the server first */
+	if ((ret=writebehind_flush(fp)))
+		return ret;
+
+	/* See if this was already fetched by the read-ahead */
+	if ((ret=readahead_read(volume,fp,buf,size,offset,eof)) || (*eof))
+		return ret;
+
+	/* Only ask for what fits in one reply; the rest is left for the
+	 * caller to come back for */
+	size=bufsize;
+
 	buffer.data = buf;
 	buffer.maxsize=bufsize;
 	buffer.size=0;
 	/* Lock the range */
-	if (ll_handle_locking(volume, fp->forkid,offset,size)) {
+	if (locks_acquire(fp,0,offset,size)) {
 		/* There was an irrecoverable error when locking */
 		ret=EBUSY;
 		goto error;
@@ -355,14 +315,12 @@ int ll_read(struct afp_volume * volume,
 
 	if (volume->server->using_version->av_number < 30)
 		rc=afp_read(volume, fp->forkid,offset,size,&buffer);
-	else
-		rc=afp_readext(volume, fp->forkid,offset,size,&buffer);
-
-	if (ll_handle_unlocking(volume, fp->forkid,offset,size)) {
-		/* Somehow, we couldn't unlock the range. */
-		ret=EIO;
-		goto error;
+	else {
+		v=sessions_pick(volume,fp,0,offset,size,bufsize,&forkid);
+		rc=afp_readext(v,forkid,offset,size,&buffer);
 	}
+
+	locks_release(fp,offset,size);
 	switch(rc) {
 	case kFPAccessDenied:
 		ret=EACCES;
@@ -392,16 +350,107 @@ error:
 
 
 
+/* Turns what the server told us about a file or directory into a stat */
+int ll_fill_stat(struct afp_volume * volume, const struct afp_dirent * fp,
+	struct stat * stbuf, int resource)
+{
+	unsigned int creation_date;
+	unsigned int modification_date;
+
+	memset(stbuf, 0, sizeof(struct stat));
+
+	if (volume->server->using_version->av_number>=30 && fp->unixprivs.permissions != 0)
+		stbuf->st_mode |= fp->unixprivs.permissions;
+	else
+		set_nonunix_perms((unsigned int *)&stbuf->st_mode,fp->isdir);
+
+	stbuf->st_ino=fp->fileid;
+	stbuf->st_uid=fp->unixprivs.uid;
+	stbuf->st_gid=fp->unixprivs.gid;
+
+	if (translate_uidgid_to_client(volume,
+		&stbuf->st_uid,&stbuf->st_gid)) {
+		return -EIO;
+	}
+	if (stbuf->st_mode & S_IFDIR) {
+		stbuf->st_nlink = fp->offspring +2;  
+		stbuf->st_size = (fp->offspring *34) + 24;  
+			/* This slight voodoo was taken from Mac OS X 10.2 */
+	} else {
+		stbuf->st_nlink = 1;
+		stbuf->st_size = (resource ? fp->resourcesize : fp->size);
+		stbuf->st_blksize = 4096;
+		stbuf->st_blocks = (stbuf->st_size) / 4096;
+	}
+
+        if ((volume->server->using_version->av_number<30) && 
+		(stbuf->st_mode & S_IFDIR)) {
+		/* AFP 2.x doesn't give ctime and mtime for directories*/
+		creation_date=volume->server->connect_time;
+		modification_date=volume->server->connect_time;
+	} else {
+		creation_date=fp->creation_date;
+		modification_date=fp->modification_date;
+	}
+
+#ifdef __linux__
+	stbuf->st_ctim.tv_sec=creation_date;
+	stbuf->st_mtim.tv_sec=modification_date;
+#else
+	stbuf->st_ctime=creation_date;
+	stbuf->st_mtime=modification_date;
+#endif
+
+	return 0;
+}
+
+/* Roughly how many bytes each entry of an enumerate or catalog search
+ * reply takes, for the largest of a file or a directory.  Names are
+ * guessed at 32 characters. */
+unsigned int ll_enumerate_entry_size(struct afp_volume * volume,
+	unsigned int filebitmap, unsigned int dirbitmap)
+{
+	/* Indexed by bit number, from the protocol guide p.236 and p.238 */
+	static const unsigned char file_sizes[16] = {
+		2, 4, 4, 4, 4, 32, 2+32, 2+12, 4, 4, 4, 8, 2, 2+6+32, 8, 16 };
+	static const unsigned char dir_sizes[16] = {
+		2, 4, 4, 4, 4, 32, 2+32, 2+12, 4, 2, 4, 4, 4, 2+6+32, 0, 16 };
+	unsigned int filesize=0, dirsize=0, i;
+
+	for (i=0;i<16;i++) {
+		if (filebitmap & (1<<i)) filesize+=file_sizes[i];
+		if (dirbitmap & (1<<i)) dirsize+=dir_sizes[i];
+	}
+
+	/* Each entry has a header and is padded to an even length */
+	return max(filesize,dirsize) + 
+		((volume->server->using_version->av_number<30) ? 2 : 4) + 1;
+}
+
+/* Remembers what one enumerate reply told us, from entry first of the
+ * listing on: the attributes of each entry, so the getattrs that follow
+ * a readdir don't go to the server, and the IDs of the directories, so
+ * paths through them don't have to be looked up. */
+static void ll_seed_caches(struct afp_volume * volume,
+	struct afp_listing * listing, unsigned int first, int resource)
+{
+	struct afp_dirent * p;
+	struct stat stbuf;
+	unsigned int i=first;
+
+	while ((p=afp_listing_next(listing,&i))) {
+		if ((p->isdir) && (p->fileid))
+			add_did_child(volume,p->did,p->name,p->fileid);
+		if ((!resource) && (volume->attr_cache_timeout) &&
+			(ll_fill_stat(volume,p,&stbuf,0)==0))
+			attrcache_add(volume,p->did,p->name,&stbuf);
+	}
+}
+
 int ll_readdir(struct afp_volume * volume, const char *path, 
-	struct afp_file_info **fb, int resource)
+	struct afp_listing **listing_p, int resource)
 {
-	struct afp_file_info * p, * filebase=NULL, *base, *last=NULL;
-	unsigned short reqcount=20;  /* Get them in batches of 20 */
-	unsigned long startindex=1;
-	int rc=0, ret=0, exit=0;
-	unsigned int filebitmap, dirbitmap;
 	char basename[AFP_MAX_PATH];
-	char converted_name[AFP_MAX_PATH];
 	unsigned int dirid;
 
 	if (invalid_filename(volume->server,path)) 
@@ -410,114 +459,159 @@ int ll_readdir(struct afp_volume * volume, const char *path,
 	if (get_dirid(volume, path, basename, &dirid)<0)
 		return -ENOENT;
 
+	return ll_readdir_did(volume,dirid,basename,listing_p,resource);
+}
+
+/* The bitmaps of what a listing asks for about each entry */
+static void ll_readdir_bitmaps(struct afp_volume * volume, int resource,
+	unsigned int * filebitmap, unsigned int * dirbitmap)
+{
 	/* We need to handle length bits differently for AFP < 3.0 */
 
-	filebitmap=kFPAttributeBit | kFPParentDirIDBit |
+	*filebitmap=kFPAttributeBit | kFPParentDirIDBit |
 		kFPCreateDateBit | kFPModDateBit |
 		kFPBackupDateBit|
 		kFPNodeIDBit;
-	dirbitmap=kFPAttributeBit | kFPParentDirIDBit |
+	*dirbitmap=kFPAttributeBit | kFPParentDirIDBit |
 		kFPCreateDateBit | kFPModDateBit |
 		kFPBackupDateBit|
 		kFPNodeIDBit | kFPOffspringCountBit|
 		kFPOwnerIDBit|kFPGroupIDBit;
 	if (volume->extra_flags & VOLUME_EXTRA_FLAGS_VOL_SUPPORTS_UNIX) {
-		dirbitmap|=kFPUnixPrivsBit;
-		filebitmap|=kFPUnixPrivsBit;
+		*dirbitmap|=kFPUnixPrivsBit;
+		*filebitmap|=kFPUnixPrivsBit;
 	}
 
 	if (volume->attributes & kSupportsUTF8Names ) {
-		dirbitmap|=kFPUTF8NameBit;
-		filebitmap|=kFPUTF8NameBit;
+		*dirbitmap|=kFPUTF8NameBit;
+		*filebitmap|=kFPUTF8NameBit;
 	} else {
-		dirbitmap|=kFPLongNameBit| kFPShortNameBit;
-		filebitmap|=kFPLongNameBit| kFPShortNameBit;
+		*dirbitmap|=kFPLongNameBit| kFPShortNameBit;
+		*filebitmap|=kFPLongNameBit| kFPShortNameBit;
 	}
 	if (volume->server->using_version->av_number<30) {
-		filebitmap |=(resource ? kFPRsrcForkLenBit:kFPDataForkLenBit);
+		*filebitmap |=(resource ? kFPRsrcForkLenBit:kFPDataForkLenBit);
 	} else {
-		filebitmap |=(resource ? kFPRsrcForkLenBit:kFPExtDataForkLenBit);
+		*filebitmap |=(resource ? kFPRsrcForkLenBit:kFPExtDataForkLenBit);
 	}
+}
 
-	while (!exit) {
+/* ll_readdir_batch()
+ *
+ * Adds the entries of one enumerate of the directory basename in dirid
+ * to listing, from startindex on (the first entry is 1).  *reqcount is
+ * how many to ask for; start it at 0, and it grows each time the server
+ * manages to send all that was asked for.  Returns how many were added,
+ * and sets *eof once there are no more.
+ */
+
+int ll_readdir_batch(struct afp_volume * volume, unsigned int dirid,
+	const char * basename, unsigned int startindex,
+	unsigned int * reqcount, struct afp_listing * listing,
+	int resource, int * eof)
+{
+	struct afp_dirent * p;
+	unsigned int filebitmap, dirbitmap;
+	unsigned int maxcount, first, count, i;
+	int rc;
 
-/* FIXME: check AFP version */
-		/* this function will allocate and generate a linked list 
-		   of files */
-		if (volume->server->using_version->av_number<30) {
-			rc = afp_enumerate(volume,dirid,
-				filebitmap, dirbitmap,reqcount,
-				startindex,basename,&base);
-		} else {
-			rc = afp_enumerateext2(volume,dirid,
-				filebitmap, dirbitmap,reqcount,
-				startindex,basename,&base);
-		}
+	ll_readdir_bitmaps(volume,resource,&filebitmap,&dirbitmap);
 
-		switch(rc) {
-		case -1:
-			ret=EIO;
-			goto error;
-		case 0:
-		case kFPObjectNotFound:
-			if (filebase==NULL) filebase=base;
-			else last->next=base;
-			for (p=base; p; p=p->next) {
-				startindex++;
-				last=p;
-			}
-			if (rc==kFPObjectNotFound) exit=1;
-			break;
-		case kFPAccessDenied:
-			ret=EACCES;
-			goto error;
-		case kFPDirNotFound:
-			ret=ENOENT;
-			exit++;
-			break;
-		case kFPBitmapErr:
-		case kFPMiscErr:
-		case kFPObjectTypeErr:
-		case kFPParamErr:
-		case kFPCallNotSupported:
-			ret=EIO;
-			goto error;
-		}
+	/* Ask for as many entries as should fit in a reply */
+	maxcount=min(volume->server->rx_quantum,DSI_MAX_INCOMING_PACKET) /
+		ll_enumerate_entry_size(volume,filebitmap,dirbitmap);
+	maxcount=max(min(maxcount,AFP_MAX_ENUMERATE_COUNT),
+		AFP_MIN_ENUMERATE_COUNT);
+	if (*reqcount==0)
+		*reqcount=min(maxcount,AFP_MIN_ENUMERATE_COUNT*4);
+
+	*eof=0;
+
+	/* This adds whatever the server sends to the listing */
+	first=afp_listing_count(listing);
+	if (volume->server->using_version->av_number<30) {
+		rc = afp_enumerate(volume,dirid,
+			filebitmap, dirbitmap,*reqcount,
+			startindex,(char *) basename,listing);
+	} else {
+		rc = afp_enumerateext2(volume,dirid,
+			filebitmap, dirbitmap,*reqcount,
+			startindex,(char *) basename,listing);
 	}
+	count=afp_listing_count(listing)-first;
 
-	for (p=filebase; p; p=p->next) {
-		/* Convert all the names back to precomposed */
-		convert_path_to_unix(
-			volume->server->path_encoding, 
-			converted_name,p->name, AFP_MAX_PATH);
-		startindex++;
+	switch(rc) {
+	case 0:
+		break;
+	case kFPObjectNotFound:
+	case kFPDirNotFound:
+		*eof=1;
+		break;
+	case kFPAccessDenied:
+		return -EACCES;
+	case -1:
+	case kFPBitmapErr:
+	case kFPMiscErr:
+	case kFPObjectTypeErr:
+	case kFPParamErr:
+	case kFPCallNotSupported:
+	default:
+		return -EIO;
 	}
 
+	if (count==0)
+		*eof=1;
+	else if ((!*eof) && (count>=*reqcount))
+		*reqcount=min(*reqcount*2,maxcount);
+
 	if (volume->server->using_version->av_number<30) {
-		for (p=filebase; p; p=p->next) {
-			set_nonunix_perms(&p->unixprivs.permissions, p);
+		for (i=first;(p=afp_listing_next(listing,&i));)
+			set_nonunix_perms(&p->unixprivs.permissions, p->isdir);
+	}
+
+	ll_seed_caches(volume,listing,first,resource);
+
+	return count;
+}
+
+/* ll_readdir_did()
+ *
+ * Lists the directory basename in dirid, or dirid itself if basename is
+ * empty.  The basename is in the server's encoding.
+ */
+
+int ll_readdir_did(struct afp_volume * volume, unsigned int dirid,
+	const char * basename, struct afp_listing **listing_p, int resource)
+{
+	struct afp_listing * listing;
+	unsigned int reqcount=0;
+	unsigned long startindex=1;
+	int ret, eof=0;
+
+	if ((listing=afp_listing_new())==NULL)
+		return -ENOMEM;
+
+	while (!eof) {
+		ret=ll_readdir_batch(volume,dirid,basename,startindex,
+			&reqcount,listing,resource,&eof);
+		if (ret<0) {
+			afp_listing_free(listing);
+			return ret;
 		}
+		startindex+=ret;
 	}
 
-	*fb=filebase;
+	*listing_p=listing;
 
 	return 0;
-error:
-	return -ret;
-
 }
 
 
 int ll_getattr(struct afp_volume * volume, const char *path, struct stat *stbuf,
 	int resource)
 {
-	struct afp_file_info fp;
 	unsigned int dirid;
-	int rc;
-	unsigned int filebitmap, dirbitmap;
 	char basename[AFP_MAX_PATH];
-	unsigned int creation_date;
-	unsigned int modification_date;
 
 	memset(stbuf, 0, sizeof(struct stat));
 
@@ -529,6 +623,38 @@ int ll_getattr(struct afp_volume * volume, const char *path, struct stat *stbuf,
 		return -ENOENT;
 	}
 
+	if ((volume->server->using_version->av_number < 30) &&
+		(path[0]=='/' && path[1]=='\0')) {
+		/* This will sound odd, but when referring to /, AFP 2.x
+		   clients check on a 'file' with the volume name. */
+		snprintf(basename,AFP_MAX_PATH,"%s",
+			volume->volume_name);
+		dirid=1;
+	}
+
+	return ll_getattr_did(volume,dirid,basename,stbuf,resource);
+}
+
+/* ll_getattr_did()
+ *
+ * Fills stbuf for basename in dirid, or for dirid itself if basename is
+ * empty.  The basename is in the server's encoding.  st_ino is the node
+ * ID.
+ */
+
+int ll_getattr_did(struct afp_volume * volume, unsigned int dirid,
+	const char * basename, struct stat *stbuf, int resource)
+{
+	struct afp_file_info fp;
+	struct afp_dirent e;
+	int rc, ret;
+	unsigned int filebitmap, dirbitmap;
+
+	memset(stbuf, 0, sizeof(struct stat));
+
+	if ((!resource) && (attrcache_lookup(volume,dirid,basename,stbuf)))
+		return 0;
+
 	dirbitmap=kFPAttributeBit 
 		| kFPCreateDateBit | kFPModDateBit|
 		kFPNodeIDBit |
@@ -540,13 +666,6 @@ int ll_getattr(struct afp_volume * volume, const char *path, struct stat *stbuf,
 		kFPParentDirIDBit;
 
 	if (volume->server->using_version->av_number < 30) {
-		if (path[0]=='/' && path[1]=='\0') {
-			/* This will sound odd, but when referring to /, AFP 2.x
-			   clients check on a 'file' with the volume name. */
-			snprintf(basename,AFP_MAX_PATH,"%s",
-				volume->volume_name);
-			dirid=1;
-		}
 		filebitmap |=(resource ? kFPRsrcForkLenBit:kFPDataForkLenBit);
 
 	} else {
@@ -578,52 +697,37 @@ int ll_getattr(struct afp_volume * volume, const char *path, struct stat *stbuf,
 		return -EIO;
 	}
 
-	if (volume->server->using_version->av_number>=30 && fp.unixprivs.permissions != 0)
-		stbuf->st_mode |= fp.unixprivs.permissions;
-	else
-		set_nonunix_perms((unsigned int *)&stbuf->st_mode,&fp);
+	listing_dirent_from_file_info(&e,&fp);
+	if ((ret=ll_fill_stat(volume,&e,stbuf,resource)))
+		return ret;
 
-	stbuf->st_uid=fp.unixprivs.uid;
-	stbuf->st_gid=fp.unixprivs.gid;
-
-	if (translate_uidgid_to_client(volume,
-		&stbuf->st_uid,&stbuf->st_gid)) {
-		return -EIO;
-	}
-	if (stbuf->st_mode & S_IFDIR) {
-		stbuf->st_nlink = fp.offspring +2;  
-		stbuf->st_size = (fp.offspring *34) + 24;  
-			/* This slight voodoo was taken from Mac OS X 10.2 */
-	} else {
-		stbuf->st_nlink = 1;
-		stbuf->st_size = (resource ? fp.resourcesize : fp.size);
-		stbuf->st_blksize = 4096;
-		stbuf->st_blocks = (stbuf->st_size) / 4096;
-	}
-
-        if ((volume->server->using_version->av_number<30) && 
-		(stbuf->st_mode & S_IFDIR)) {
-		/* AFP 2.x doesn't give ctime and mtime for directories*/
-		creation_date=volume->server->connect_time;
-		modification_date=volume->server->connect_time;
-	} else {
-		creation_date=fp.creation_date;
-		modification_date=fp.modification_date;
-	}
-
-#ifdef __linux__
-	stbuf->st_ctim.tv_sec=creation_date;
-	stbuf->st_mtim.tv_sec=modification_date;
-#else
-	stbuf->st_ctime=creation_date;
-	stbuf->st_mtime=modification_date;
-#endif
+	if (!resource)
+		attrcache_add(volume,dirid,basename,stbuf);
 
 	return 0;
 
 }
 
 
+/* Translates the result of an FPWrite or FPWriteExt into an errno */
+int ll_write_errno(int rc)
+{
+	switch(rc) {
+	case kFPNoErr:
+		return 0;
+	case kFPAccessDenied:
+		return EACCES;
+	case kFPDiskFull:
+		return ENOSPC;
+	case kFPLockErr:
+	case kFPMiscErr:
+	case kFPParamErr:
+		return EINVAL;
+	default:
+		return EIO;
+	}
+}
+
 int ll_write(struct afp_volume * volume,
 		const char *data, size_t size, off_t offset,
                   struct afp_file_info * fp, size_t * totalwritten)
@@ -634,14 +738,25 @@ int ll_write(struct afp_volume * volume,
 	uint32_t ignored32;
 	unsigned int max_packet_size=volume->server->tx_quantum;
 	off_t o=0;
+	struct afp_volume * v;
+	unsigned short forkid;
 	*totalwritten=0;
 
 	if (!fp) return -EBADF;
 
+	readahead_invalidate(fp);
+
+	if (fp->writebehind) {
+		if ((ret=writebehind_write(fp,data,size,offset)))
+			return ret;
+		*totalwritten=size;
+		return 0;
+	}
+
 	/* Get a lock */
-	if (ll_handle_locking(volume, fp->forkid,offset,size)) {
+	if (locks_acquire(fp,1,offset,size)) {
 		/* There was an irrecoverable error when locking */
-		ret=EBUSY;
+		err=EBUSY;
 		goto error;
 	}
 
@@ -655,38 +770,26 @@ int ll_write(struct afp_volume * volume,
 			ret=afp_write(volume, fp->forkid,
 				offset+o,sizetowrite,
 				(char *) data+o,&ignored32);
-		else 
-			ret=afp_writeext(volume, fp->forkid,
+		else {
+			v=sessions_pick(volume,fp,1,offset+o,sizetowrite,
+				max_packet_size,&forkid);
+			ret=afp_writeext(v,forkid,
 				offset+o,sizetowrite,
 				(char *) data+o,&ignored);
-		ret=0;
-		*totalwritten+=sizetowrite;
-		switch(ret) {
-		case kFPAccessDenied:
-			err=EACCES;
-			goto error;
-		case kFPDiskFull:
-			err=ENOSPC;
-			goto error;
-		case kFPLockErr:
-		case kFPMiscErr:
-		case kFPParamErr:
-			err=EINVAL;
+		}
+		if ((err=ll_write_errno(ret))) {
+			locks_release(fp,offset,size);
 			goto error;
 		}
+		*totalwritten+=sizetowrite;
 		o+=sizetowrite;
 	}
-	if (ll_handle_unlocking(volume, fp->forkid,offset,size)) {
-		/* Somehow, we couldn't unlock the range. */
-		ret=EIO;
-		goto error;
-	}
+	locks_release(fp,offset,size);
 	return 0;
 
 error:
 	return -err;
 
-
 }
 
 
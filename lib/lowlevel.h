@@ -6,10 +6,24 @@ int ll_get_directory_entry(struct afp_volume * volume,
         unsigned int filebitmap, unsigned int dirbitmap,
         struct afp_file_info *p);
 
+int ll_fill_stat(struct afp_volume * volume, const struct afp_dirent * fp,
+	struct stat * stbuf, int resource);
+
+unsigned int ll_enumerate_entry_size(struct afp_volume * volume,
+	unsigned int filebitmap, unsigned int dirbitmap);
+
 int ll_readdir(struct afp_volume * volume, const char *path,
-        struct afp_file_info **fb, int resource);
+        struct afp_listing **listing, int resource);
+int ll_readdir_did(struct afp_volume * volume, unsigned int dirid,
+	const char * basename, struct afp_listing **listing, int resource);
+int ll_readdir_batch(struct afp_volume * volume, unsigned int dirid,
+	const char * basename, unsigned int startindex,
+	unsigned int * reqcount, struct afp_listing * listing,
+	int resource, int * eof);
 int ll_getattr(struct afp_volume * volume, const char *path, struct stat *stbuf,
         int resourcefork);
+int ll_getattr_did(struct afp_volume * volume, unsigned int dirid,
+	const char * basename, struct stat *stbuf, int resource);
 
 int ll_zero_file(struct afp_volume * volume, unsigned short forkid,
 	unsigned int resource);
@@ -18,11 +32,7 @@ int ll_read(struct afp_volume * volume,
 	char *buf, size_t size, off_t offset,
 	struct afp_file_info *fp, int * eof);
 
-int ll_handle_unlocking(struct afp_volume * volume,unsigned short forkid,
-	uint64_t offset, uint64_t sizetorequest);
-
-int ll_handle_locking(struct afp_volume * volume,unsigned short forkid,
-	uint64_t offset, uint64_t sizetorequest);
+int ll_write_errno(int rc);
 
 int ll_write(struct afp_volume * volume,
 	const char *data, size_t size, off_t offset,
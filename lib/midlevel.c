@@ -27,6 +27,7 @@
 
 #include "users.h"
 #include "did.h"
+#include "attrcache.h"
 #include "resource.h"
 #include "afpfs-ng/utils.h"
 #include "afpfs-ng/codepage.h"
@@ -35,6 +36,10 @@
 #include "forklist.h"
 #include "uams.h"
 #include "lowlevel.h"
+#include "readahead.h"
+#include "writebehind.h"
+#include "locks.h"
+#include "sessions.h"
 
 
 #define min(a,b) (((a)<(b)) ? (a) : (b))
@@ -96,6 +101,7 @@ static int set_unixprivs(struct afp_volume * vol,
 		rc=afp_setfiledirparms(vol,dirid,basename,
 			kFPUnixPrivsBit, fp);
 	}
+	attrcache_remove(vol,dirid,basename);
 
 	switch (rc) {
 	case kFPAccessDenied:
@@ -157,22 +163,6 @@ void add_file_by_name(struct afp_file_info ** base, const char *filename)
 
 }
 
-void afp_ml_filebase_free(struct afp_file_info **filebase)
-{
-
-	struct afp_file_info * p, *next;
-
-	if (filebase==NULL) return;
-
-	p=*filebase;
-	while (p) {
-		next=p->next;
-		free(p);
-		p=next;
-	}
-	*filebase=NULL;
-}
-
 
 
 
@@ -262,32 +252,17 @@ error:
 
 
 
-int ml_creat(struct afp_volume * volume, const char *path, mode_t mode)
+/* Creates the file basename in dirid with mode, for ml_creat() and
+ * ml_creat_did() */
+static int creat_in_dir(struct afp_volume * volume, unsigned int dirid,
+	char * basename, mode_t mode)
 {
 	int ret=0;
-	char basename[AFP_MAX_PATH];
-	unsigned int dirid;
 	struct afp_file_info fp;
 	int rc;
-	char converted_path[AFP_MAX_PATH];
-
-	if (convert_path_to_afp(volume->server->path_encoding,
-		converted_path,(char *) path,AFP_MAX_PATH))
-		return -EINVAL;
-
-	if (volume_is_readonly(volume))
-		return -EACCES;
-
-	ret=appledouble_creat(volume,path,mode);
-	if (ret<0) return ret;
-	if (ret==1) return 0;
- 
-	if (invalid_filename(volume->server,converted_path)) 
-		return -ENAMETOOLONG;
-
-	get_dirid(volume, converted_path, basename, &dirid);
 
 	rc=afp_createfile(volume,kFPSoftCreate, dirid,basename);
+	attrcache_remove(volume,dirid,basename);
 	switch(rc) {
 	case kFPAccessDenied:
 		ret=EACCES;
@@ -362,10 +337,40 @@ error:
 }
 
 
+int ml_creat(struct afp_volume * volume, const char *path, mode_t mode)
+{
+	int ret=0;
+	char basename[AFP_MAX_PATH];
+	unsigned int dirid;
+	char converted_path[AFP_MAX_PATH];
+
+	if (convert_path_to_afp(volume->server->path_encoding,
+		converted_path,(char *) path,AFP_MAX_PATH))
+		return -EINVAL;
+
+	if (volume_is_readonly(volume))
+		return -EACCES;
+
+	ret=appledouble_creat(volume,path,mode);
+	if (ret<0) return ret;
+	if (ret==1) return 0;
+ 
+	if (invalid_filename(volume->server,converted_path)) 
+		return -ENAMETOOLONG;
+
+	get_dirid(volume, converted_path, basename, &dirid);
+
+	ret=creat_in_dir(volume,dirid,basename,mode);
+	attrcache_invalidate(volume,converted_path);
+
+	return ret;
+}
+
+
 
 int ml_readdir(struct afp_volume * volume, 
 	const char *path, 
-	struct afp_file_info **fb)
+	struct afp_listing **listing)
 {
 	int ret=0;
 	char converted_path[AFP_MAX_PATH];
@@ -375,32 +380,159 @@ int ml_readdir(struct afp_volume * volume,
 		return -EINVAL;
 	}
 
-	ret=appledouble_readdir(volume, converted_path, fb);
+	ret=appledouble_readdir(volume, converted_path, listing);
 
 	if (ret<0) return ret;
 	if (ret==1) goto done;
 
-	return ll_readdir(volume,converted_path,fb,0);
+	return ll_readdir(volume,converted_path,listing,0);
 done:
 	return 0;
 }
 
+/* A directory read one enumerate at a time.  Only the batch the last
+ * entry asked for came in is kept, so a directory of any size takes the
+ * memory of one reply, and its first entries can be handed out as soon
+ * as the first reply is in.  The made up AppleDouble directories are
+ * listed in full when they are opened. */
+struct ml_dir {
+	struct afp_volume * volume;
+	unsigned int dirid;
+	char basename[AFP_MAX_PATH];
+	struct afp_listing * window;
+	unsigned int first;	/* index of the first entry in window */
+	unsigned int reqcount;
+	int eof;		/* window runs to the end of the directory */
+};
+
+/* Replaces the window with the batch that starts at entry index */
+static int ml_dir_fetch(struct ml_dir * dir, unsigned int index)
+{
+	struct afp_listing * listing;
+	int ret;
+
+	if ((listing=afp_listing_new())==NULL)
+		return -ENOMEM;
+
+	ret=ll_readdir_batch(dir->volume,dir->dirid,dir->basename,index+1,
+		&dir->reqcount,listing,0,&dir->eof);
+	if (ret<0) {
+		afp_listing_free(listing);
+		return ret;
+	}
+
+	afp_listing_free(dir->window);
+	dir->window=listing;
+	dir->first=index;
+	return 0;
+}
+
+static int ml_opendir_first(struct ml_dir * dir, struct ml_dir ** dir_p)
+{
+	int ret;
+
+	if ((ret=ml_dir_fetch(dir,0))) {
+		free(dir);
+		return ret;
+	}
+	*dir_p=dir;
+	return 0;
+}
+
+int ml_opendir(struct afp_volume * volume, const char * path,
+	struct ml_dir ** dir_p)
+{
+	char converted_path[AFP_MAX_PATH];
+	struct afp_listing * listing;
+	struct ml_dir * dir;
+	int ret;
+
+	if (convert_path_to_afp(volume->server->path_encoding,
+		converted_path,(char *) path,AFP_MAX_PATH)) {
+		return -EINVAL;
+	}
+
+	if ((dir=malloc(sizeof(*dir)))==NULL)
+		return -ENOMEM;
+	memset(dir,0,sizeof(*dir));
+	dir->volume=volume;
+
+	ret=appledouble_readdir(volume, converted_path, &listing);
+	if (ret<0) goto error;
+	if (ret==1) {
+		dir->window=listing;
+		dir->eof=1;
+		*dir_p=dir;
+		return 0;
+	}
+
+	if (invalid_filename(volume->server,converted_path)) {
+		ret=-ENAMETOOLONG;
+		goto error;
+	}
+	if (get_dirid(volume,converted_path,dir->basename,&dir->dirid)<0) {
+		ret=-ENOENT;
+		goto error;
+	}
+
+	return ml_opendir_first(dir,dir_p);
+
+error:
+	free(dir);
+	return ret;
+}
+
+int ml_opendir_did(struct afp_volume * volume, unsigned int dirid,
+	struct ml_dir ** dir_p)
+{
+	struct ml_dir * dir;
+
+	if ((dir=malloc(sizeof(*dir)))==NULL)
+		return -ENOMEM;
+	memset(dir,0,sizeof(*dir));
+	dir->volume=volume;
+	dir->dirid=dirid;
+
+	return ml_opendir_first(dir,dir_p);
+}
+
+/* Sets *e to entry index (the first is 0) and returns 1, or returns 0
+ * past the last one.  *e lasts until the next call. */
+int ml_readdir_entry(struct ml_dir * dir, unsigned int index,
+	struct afp_dirent ** e)
+{
+	unsigned int cursor;
+	int ret;
+
+	if ((index<dir->first) || ((!dir->eof) &&
+		(index>=dir->first+afp_listing_count(dir->window)))) {
+		if ((ret=ml_dir_fetch(dir,index)))
+			return ret;
+	}
+
+	cursor=index-dir->first;
+	if ((*e=afp_listing_next(dir->window,&cursor))==NULL)
+		return 0;
+	return 1;
+}
+
+void ml_closedir(struct ml_dir * dir)
+{
+	if (dir==NULL) return;
+	afp_listing_free(dir->window);
+	free(dir);
+}
+
 int ml_read(struct afp_volume * volume, const char *path, 
 	char *buf, size_t size, off_t offset,
 	struct afp_file_info *fp, int * eof)
 {
 	int ret=0;
 	//unsigned int bufsize=min(volume->server->rx_quantum,size);
-	char converted_path[AFP_MAX_PATH];
 	size_t amount_copied=0;
 
 	*eof=0;
 
-	if (convert_path_to_afp(volume->server->path_encoding,
-		converted_path,(char *) path,AFP_MAX_PATH)) {
-		return -EINVAL;
-	}
-
 	if (fp->resource) {
 		ret=appledouble_read(volume,fp,buf,size,offset,&amount_copied,eof);
 
@@ -522,34 +654,16 @@ found with getvolparm or volopen, then to test chmod the first time.
 }
 
 
-int ml_unlink(struct afp_volume * vol, const char *path)
+/* Deletes the file basename in dirid, for ml_unlink() and ml_unlink_did() */
+static int unlink_in_dir(struct afp_volume * vol, unsigned int dirid,
+	char * basename)
 {
-	int ret,rc;
-	unsigned int dirid;
-	char basename[AFP_MAX_PATH];
-	char converted_path[AFP_MAX_PATH];
-	
-	if (convert_path_to_afp(vol->server->path_encoding,
-		converted_path,(char *) path,AFP_MAX_PATH))
-		return -EINVAL;
-
-	if (volume_is_readonly(vol))
-		return -EACCES;
-
-	ret=appledouble_unlink(vol,path);
-	if (ret<0) return ret;
-	if (ret==1) return 0;
-
-	get_dirid(vol, (char * ) converted_path, basename, &dirid);
-
-	if (is_dir(vol,dirid,basename) ) return -EISDIR;
-
-	if (invalid_filename(vol->server,converted_path)) 
-		return -ENAMETOOLONG;
+	int ret;
 
-	rc=afp_delete(vol,dirid,basename);
+	ret=afp_delete(vol,dirid,basename);
+	attrcache_remove(vol,dirid,basename);
 
-	switch(rc) {
+	switch(ret) {
 	case kFPAccessDenied:
 		ret=EACCES;
 		break;
@@ -575,34 +689,48 @@ int ml_unlink(struct afp_volume * vol, const char *path)
 	return -ret;
 }
 
-
-
-
-int ml_mkdir(struct afp_volume * vol, const char * path, mode_t mode) 
+int ml_unlink(struct afp_volume * vol, const char *path)
 {
-	int ret,rc;
-	unsigned int result_did;
+	int ret;
+	unsigned int dirid;
 	char basename[AFP_MAX_PATH];
 	char converted_path[AFP_MAX_PATH];
-	unsigned int dirid;
-
+	
 	if (convert_path_to_afp(vol->server->path_encoding,
 		converted_path,(char *) path,AFP_MAX_PATH))
 		return -EINVAL;
 
-	if (invalid_filename(vol->server,path)) 
-		return -ENAMETOOLONG;
-
 	if (volume_is_readonly(vol))
 		return -EACCES;
 
-	ret=appledouble_mkdir(vol,path,mode);
+	ret=appledouble_unlink(vol,path);
 	if (ret<0) return ret;
 	if (ret==1) return 0;
 
-	get_dirid(vol,converted_path,basename,&dirid);
+	get_dirid(vol, (char * ) converted_path, basename, &dirid);
+
+	if (is_dir(vol,dirid,basename) ) return -EISDIR;
+
+	if (invalid_filename(vol->server,converted_path)) 
+		return -ENAMETOOLONG;
+
+	ret=unlink_in_dir(vol,dirid,basename);
+	attrcache_invalidate(vol,converted_path);
+
+	return ret;
+}
+
+
+
+
+/* Makes the directory basename in dirid, for ml_mkdir() and ml_mkdir_did() */
+static int mkdir_in_dir(struct afp_volume * vol, unsigned int dirid,
+	char * basename, unsigned int * result_did)
+{
+	int ret,rc;
 
-	rc = afp_createdir(vol,dirid, basename,&result_did);
+	rc = afp_createdir(vol,dirid, basename,result_did);
+	attrcache_remove(vol,dirid,basename);
 
 	switch (rc) {
 	case kFPAccessDenied:
@@ -633,21 +761,46 @@ int ml_mkdir(struct afp_volume * vol, const char * path, mode_t mode)
 	return -ret;
 }
 
-int ml_close(struct afp_volume * volume, const char * path, 
-	struct afp_file_info * fp)
+int ml_mkdir(struct afp_volume * vol, const char * path, mode_t mode) 
 {
-
-	int ret=0;
+	int ret;
+	unsigned int result_did;
+	char basename[AFP_MAX_PATH];
 	char converted_path[AFP_MAX_PATH];
+	unsigned int dirid;
 
-	if (convert_path_to_afp(volume->server->path_encoding,
-		converted_path, (char *) path,AFP_MAX_PATH)) {
+	if (convert_path_to_afp(vol->server->path_encoding,
+		converted_path,(char *) path,AFP_MAX_PATH))
 		return -EINVAL;
-	}
- 
-	if (invalid_filename(volume->server,converted_path)) 
+
+	if (invalid_filename(vol->server,path)) 
 		return -ENAMETOOLONG;
 
+	if (volume_is_readonly(vol))
+		return -EACCES;
+
+	ret=appledouble_mkdir(vol,path,mode);
+	if (ret<0) return ret;
+	if (ret==1) return 0;
+
+	get_dirid(vol,converted_path,basename,&dirid);
+
+	ret=mkdir_in_dir(vol,dirid,basename,&result_did);
+	attrcache_invalidate(vol,converted_path);
+
+	/* We may have cached that it didn't exist */
+	if (ret==0)
+		remove_did_entry(vol,converted_path);
+
+	return ret;
+}
+
+int ml_close(struct afp_volume * volume, const char * path, 
+	struct afp_file_info * fp)
+{
+
+	int ret=0, flushret;
+
 	/* The logic here is that if we don't have an fp anymore, then the
 	   fork must already be closed. */
 	if (!fp) 
@@ -656,6 +809,17 @@ int ml_close(struct afp_volume * volume, const char * path,
 	if (fp->icon) {
 		free(fp->icon);
 	}
+	readahead_free(fp);
+
+	/* Errors from buffered writes are reported here, but we still
+	   close the fork */
+	remove_opened_fork(volume, fp);
+	flushret=writebehind_flush(fp);
+	writebehind_free(fp);
+	locks_free(fp);
+	sessions_close_fork(fp);
+	attrcache_remove(volume,fp->did,fp->basename);
+
 	if (fp->resource) {
 		return appledouble_close(volume,fp);
 	}
@@ -669,12 +833,53 @@ int ml_close(struct afp_volume * volume, const char * path,
 			ret=EIO;
 			goto error;
 	}
-	remove_opened_fork(volume, fp);
+	ret=flushret;
 		
 error:
 	return ret;
 }
 
+int ml_flush(struct afp_volume * volume, const char * path,
+	struct afp_file_info * fp)
+{
+	int ret;
+
+	if (!fp)
+		return -EBADF;
+
+	if (fp->resource)
+		return 0;
+
+	if ((ret=writebehind_flush(fp)))
+		return ret;
+
+	switch(afp_flushfork(volume,fp->forkid)) {
+		case kFPNoErr:
+			break;
+		default:
+		case kFPParamErr:
+		case kFPMiscErr:
+			return -EIO;
+	}
+	return 0;
+}
+
+/* Writes still sitting in write-behind buffers aren't known to the server
+ * yet, so push them out before asking about the file or changing its size. */
+static void sync_forks_of_path(struct afp_volume * volume,
+	const char * converted_path)
+{
+	char basename[AFP_MAX_PATH];
+	unsigned int dirid;
+
+	if (volume->open_forks==NULL) return;
+
+	if (get_dirid(volume,converted_path,basename,&dirid)<0)
+		return;
+
+	sync_opened_forks(volume,dirid,basename);
+}
+
 int ml_getattr(struct afp_volume * volume, const char *path, struct stat *stbuf)
 {
 	char converted_path[AFP_MAX_PATH];
@@ -695,7 +900,9 @@ int ml_getattr(struct afp_volume * volume, const char *path, struct stat *stbuf)
 	if (ret<0) return ret;
 	if (ret>0) return 0;
 
-	return ll_getattr(volume,path,stbuf,0);
+	sync_forks_of_path(volume,converted_path);
+
+	return ll_getattr(volume,converted_path,stbuf,0);
 }
 
 int ml_write(struct afp_volume * volume, const char * path, 
@@ -709,17 +916,12 @@ int ml_write(struct afp_volume * volume, const char * path,
 	//uint64_t sizetowrite, ignored;
 	unsigned char flags = 0;
 	//unsigned int max_packet_size=volume->server->tx_quantum;
-	char converted_path[AFP_MAX_PATH];
 /* TODO:
    - handle nonblocking IO correctly
 */
 	if ((volume->server->using_version->av_number < 30) && 
 		(size > AFP_MAX_AFP2_FILESIZE)) return -EFBIG;
 
-	if (convert_path_to_afp(volume->server->path_encoding,
-		converted_path,(char *) path,AFP_MAX_PATH))
-		return -EINVAL;
-
 	if (volume_is_readonly(volume))
 		return -EACCES;
 
@@ -742,6 +944,7 @@ int ml_write(struct afp_volume * volume, const char * path,
 	update_time(&fp->modification_date);
 	flags|=kFPModDateBit;
 
+	attrcache_remove(volume,fp->did,fp->basename);
 	ret=ll_write(volume,data,size,offset,fp,&totalwritten);
 	if (ret<0) return ret;
 	return totalwritten;
@@ -854,34 +1057,17 @@ error:
 	return -ret;
 }
 
-int ml_rmdir(struct afp_volume * vol, const char *path)
+/* Deletes the directory basename in dirid, for ml_rmdir() and
+ * ml_rmdir_did() */
+static int rmdir_in_dir(struct afp_volume * vol, unsigned int dirid,
+	char * basename)
 {
-	int ret,rc;
-	unsigned int dirid;
-	char basename[AFP_MAX_PATH];
-	char converted_path[AFP_MAX_PATH];
-
-	if (invalid_filename(vol->server,path)) 
-		return -ENAMETOOLONG;
-
-	if (convert_path_to_afp(vol->server->path_encoding,
-		converted_path,(char *) path,AFP_MAX_PATH))
-		return -EINVAL;
-
-	if (volume_is_readonly(vol))
-		return -EACCES;
-	
-	ret=appledouble_rmdir(vol,path);
-	if (ret<0) return ret;
-	if (ret==1) return 0;
-
-	get_dirid(vol, converted_path, basename, &dirid);
-
-	if (!is_dir(vol,dirid,basename)) return -ENOTDIR;
+	int ret;
 
-	rc=afp_delete(vol,dirid,basename);
+	ret=afp_delete(vol,dirid,basename);
+	attrcache_remove(vol,dirid,basename);
 
-	switch(rc) {
+	switch(ret) {
 	case kFPAccessDenied:
 		ret=EACCES;
 		break;
@@ -904,12 +1090,45 @@ int ml_rmdir(struct afp_volume * vol, const char *path)
 		ret=EINVAL;
 		break;
 	default:
-		remove_did_entry(vol,converted_path);
 		ret=0;
 	}
 	return -ret;
 }
 
+int ml_rmdir(struct afp_volume * vol, const char *path)
+{
+	int ret;
+	unsigned int dirid;
+	char basename[AFP_MAX_PATH];
+	char converted_path[AFP_MAX_PATH];
+
+	if (invalid_filename(vol->server,path)) 
+		return -ENAMETOOLONG;
+
+	if (convert_path_to_afp(vol->server->path_encoding,
+		converted_path,(char *) path,AFP_MAX_PATH))
+		return -EINVAL;
+
+	if (volume_is_readonly(vol))
+		return -EACCES;
+	
+	ret=appledouble_rmdir(vol,path);
+	if (ret<0) return ret;
+	if (ret==1) return 0;
+
+	get_dirid(vol, converted_path, basename, &dirid);
+
+	if (!is_dir(vol,dirid,basename)) return -ENOTDIR;
+
+	ret=rmdir_in_dir(vol,dirid,basename);
+	attrcache_invalidate(vol,converted_path);
+
+	if (ret==0)
+		remove_did_entry(vol,converted_path);
+
+	return ret;
+}
+
 int ml_chown(struct afp_volume * vol, const char * path, 
 	uid_t uid, gid_t gid) 
 {
@@ -1009,14 +1228,22 @@ int ml_truncate(struct afp_volume * vol, const char * path, off_t offset)
 	/* Here, we're going to use the untranslated path since it is
 	   translated through the ml_open() */
 
+	sync_forks_of_path(vol,converted_path);
+
 	flags=O_WRONLY;
 	if ((ml_open(vol,path,flags,&fp))) {
 		return ret;
 	};
 
-	if ((ret=ll_zero_file(vol,fp->forkid,0)))
+	ret=ll_zero_file(vol,fp->forkid,0);
+	attrcache_invalidate(vol,converted_path);
+	if (ret)
 		goto out;
 
+	readahead_free(fp);
+	writebehind_free(fp);
+	locks_free(fp);
+	sessions_close_fork(fp);
 	afp_closefork(vol,fp->forkid);
 	remove_opened_fork(vol, fp);
 	free(fp);
@@ -1065,6 +1292,7 @@ int ml_utime(struct afp_volume * vol, const char * path,
 		rc=afp_setfileparms(vol,
 			dirid,basename, kFPModDateBit, &fp);
 	}
+	attrcache_remove(vol,dirid,basename);
 
 	switch(rc) {
 	case kFPNoErr:
@@ -1220,6 +1448,7 @@ int ml_symlink(struct afp_volume *vol, const char * path1, const char * path2)
 
 	rc=afp_setfiledirparms(vol,dirid2,basename2,
 		kFPFinderInfoBit, &fp);
+	attrcache_invalidate(vol,converted_path2);
 	switch (rc) {
 	case kFPAccessDenied:
 		ret=EPERM;
@@ -1245,31 +1474,16 @@ error:
 	return -ret;
 };
 
-int ml_rename(struct afp_volume * vol,
-	const char * path_from, const char * path_to) 
+/* Moves basename_from in dirid_from to basename_to in dirid_to, replacing
+ * whatever is there, or into the directory basename_to if into_dir is set.
+ * For ml_rename() and ml_rename_did(). */
+static int rename_between_dirs(struct afp_volume * vol,
+	unsigned int dirid_from, char * basename_from,
+	unsigned int dirid_to, char * basename_to, int into_dir)
 {
 	int ret,rc;
-	char basename_from[AFP_MAX_PATH];
-	char basename_to[AFP_MAX_PATH];
-	char converted_path_from[AFP_MAX_PATH];
-	char converted_path_to[AFP_MAX_PATH];
-	unsigned int dirid_from,dirid_to;
 
-	if (convert_path_to_afp(vol->server->path_encoding,
-		converted_path_from,(char *) path_from,AFP_MAX_PATH))
-		return -EINVAL;
-
-	if (convert_path_to_afp(vol->server->path_encoding,
-		converted_path_to,(char *) path_to,AFP_MAX_PATH))
-		return -EINVAL;
-
-	if (volume_is_readonly(vol)) 
-		return -EACCES;
-
-	get_dirid(vol, converted_path_from, basename_from, &dirid_from);
-	get_dirid(vol, converted_path_to, basename_to, &dirid_to);
-
-	if (is_dir(vol,dirid_to,converted_path_to)) {
+	if (into_dir) {
 		rc=afp_moveandrename(vol,
 			dirid_from,dirid_to,
 			basename_from,basename_to,basename_from);
@@ -1338,6 +1552,7 @@ int ml_rename(struct afp_volume * vol,
 		break;
 	case kFPObjectNotFound:
 		ret=ENOENT;
+		break;
 	case kFPNoErr:
 		ret=0;
 		break;
@@ -1346,9 +1561,196 @@ int ml_rename(struct afp_volume * vol,
 	case kFPMiscErr:
 		ret=EIO;
 	}
+	attrcache_remove(vol,dirid_from,basename_from);
+	attrcache_remove(vol,dirid_to,basename_to);
 	return -ret;
 }
 
+int ml_rename(struct afp_volume * vol,
+	const char * path_from, const char * path_to) 
+{
+	int ret;
+	char basename_from[AFP_MAX_PATH];
+	char basename_to[AFP_MAX_PATH];
+	char converted_path_from[AFP_MAX_PATH];
+	char converted_path_to[AFP_MAX_PATH];
+	unsigned int dirid_from,dirid_to;
+
+	if (convert_path_to_afp(vol->server->path_encoding,
+		converted_path_from,(char *) path_from,AFP_MAX_PATH))
+		return -EINVAL;
+
+	if (convert_path_to_afp(vol->server->path_encoding,
+		converted_path_to,(char *) path_to,AFP_MAX_PATH))
+		return -EINVAL;
+
+	if (volume_is_readonly(vol)) 
+		return -EACCES;
+
+	get_dirid(vol, converted_path_from, basename_from, &dirid_from);
+	get_dirid(vol, converted_path_to, basename_to, &dirid_to);
+
+	ret=rename_between_dirs(vol,dirid_from,basename_from,
+		dirid_to,basename_to,
+		is_dir(vol,dirid_to,converted_path_to));
+	if (ret==0) {
+		remove_did_entry(vol,converted_path_from);
+		remove_did_entry(vol,converted_path_to);
+	}
+	attrcache_invalidate(vol,converted_path_from);
+	attrcache_invalidate(vol,converted_path_to);
+	return ret;
+}
+
+/* Has the server copy basename_from to basename_to.  -ENOTSUP means
+ * that it won't, and that the data has to go through us instead. */
+static int copy_on_server(struct afp_volume * vol,
+	unsigned int dirid_from, char * basename_from,
+	unsigned int dirid_to, char * basename_to)
+{
+	int ret;
+
+	if (~vol->server->flags & kSupportsCopyfile)
+		return -ENOTSUP;
+
+	ret=afp_copyfile(vol,dirid_from,basename_from,dirid_to,"",basename_to);
+	attrcache_remove(vol,dirid_to,basename_to);
+
+	switch(ret) {
+	case kFPNoErr:
+		return 0;
+	case kFPAccessDenied:
+		return -EACCES;
+	case kFPDenyConflict:
+		return -EBUSY;
+	case kFPDiskFull:
+		return -ENOSPC;
+	case kFPObjectExists:
+		return -EEXIST;
+	case kFPObjectNotFound:
+		return -ENOENT;
+	case kFPObjectTypeErr:
+		return -EISDIR;
+	case kFPCallNotSupported:
+	case kFPParamErr:
+	case kFPMiscErr:
+	default:
+		return -ENOTSUP;
+	}
+}
+
+/* Copies basename_from to a new basename_to by reading it and writing it
+ * back */
+static int copy_by_streaming(struct afp_volume * vol,
+	unsigned int dirid_from, char * basename_from,
+	unsigned int dirid_to, char * basename_to)
+{
+	struct afp_file_info * from, * to=NULL;
+	struct stat stbuf;
+	unsigned int bufsize=vol->server->rx_quantum;
+	char * buf=NULL;
+	off_t offset=0;
+	size_t written;
+	int ret, closeret, eof=0;
+
+	if ((ret=ll_getattr_did(vol,dirid_from,basename_from,&stbuf,0)))
+		return ret;
+	if (S_ISDIR(stbuf.st_mode))
+		return -EISDIR;
+
+	if (((from=malloc(sizeof(*from)))==NULL) ||
+		((to=malloc(sizeof(*to)))==NULL) ||
+		((buf=malloc(bufsize))==NULL)) {
+		ret=-ENOMEM;
+		goto out;
+	}
+	memset(from,0,sizeof(*from));
+	from->did=dirid_from;
+	snprintf(from->basename,AFP_MAX_PATH,"%s",basename_from);
+	memset(to,0,sizeof(*to));
+	to->did=dirid_to;
+	snprintf(to->basename,AFP_MAX_PATH,"%s",basename_to);
+
+	if ((ret=ll_open(vol,NULL,O_RDONLY,from))<0)
+		goto out;
+
+	if ((ret=creat_in_dir(vol,dirid_to,basename_to,stbuf.st_mode)))
+		goto close_from;
+
+	if ((ret=ll_open(vol,NULL,O_RDWR,to))<0)
+		goto remove_to;
+
+	while (!eof) {
+		if ((ret=ll_read(vol,buf,bufsize,offset,from,&eof))<=0)
+			break;
+		if ((ret=ll_write(vol,buf,ret,offset,to,&written))<0)
+			break;
+		offset+=written;
+	}
+	/* The last writes may only fail as they are flushed on close,
+	   which returns EIO positive but flush errors negative */
+	closeret=ml_close(vol,NULL,to);
+	if ((ret>=0) && (closeret))
+		ret=(closeret>0) ? -closeret : closeret;
+	if (ret>=0) {
+		ret=0;
+		goto close_from;
+	}
+
+remove_to:
+	unlink_in_dir(vol,dirid_to,basename_to);
+close_from:
+	ml_close(vol,NULL,from);
+out:
+	free(buf);
+	free(to);
+	free(from);
+	return ret;
+}
+
+/* ml_copy()
+ *
+ * Copies the file path_from to a new file path_to on the same volume.
+ * The server is asked to do it with FPCopyFile; if it can't, the data is
+ * read and written back through us.
+ */
+
+int ml_copy(struct afp_volume * vol,
+	const char * path_from, const char * path_to)
+{
+	int ret;
+	char basename_from[AFP_MAX_PATH];
+	char basename_to[AFP_MAX_PATH];
+	char converted_path_from[AFP_MAX_PATH];
+	char converted_path_to[AFP_MAX_PATH];
+	unsigned int dirid_from,dirid_to;
+
+	if (convert_path_to_afp(vol->server->path_encoding,
+		converted_path_from,(char *) path_from,AFP_MAX_PATH))
+		return -EINVAL;
+
+	if (convert_path_to_afp(vol->server->path_encoding,
+		converted_path_to,(char *) path_to,AFP_MAX_PATH))
+		return -EINVAL;
+
+	if (volume_is_readonly(vol)) 
+		return -EACCES;
+
+	if (invalid_filename(vol->server,converted_path_to)) 
+		return -ENAMETOOLONG;
+
+	get_dirid(vol, converted_path_from, basename_from, &dirid_from);
+	get_dirid(vol, converted_path_to, basename_to, &dirid_to);
+
+	ret=copy_on_server(vol,dirid_from,basename_from,dirid_to,basename_to);
+	if (ret==-ENOTSUP)
+		ret=copy_by_streaming(vol,dirid_from,basename_from,
+			dirid_to,basename_to);
+
+	attrcache_invalidate(vol,converted_path_to);
+	return ret;
+}
+
 int ml_statfs(struct afp_volume * vol, const char *path, struct statvfs *stat)
 {
 	unsigned short flags;
@@ -1393,3 +1795,191 @@ int ml_passwd(struct afp_server *server,
 	afp_dopasswd(server,server->using_uam,username,oldpasswd,newpasswd);
 	return 0;
 }
+
+/* The following are for frontends that keep track of where things are by
+ * directory ID, like the inode based FUSE frontend, and so don't need a
+ * path resolved for each call.  The name is the last component only, in
+ * the local encoding, and an empty name is the directory dirid itself.
+ * They don't make up the AppleDouble files. */
+
+static int convert_name_to_afp(struct afp_volume * volume,
+	const char * name, char * basename)
+{
+	if (strchr(name,'/'))
+		return -EINVAL;
+
+	if (convert_path_to_afp(volume->server->path_encoding,
+		basename,(char *) name,AFP_MAX_PATH))
+		return -EINVAL;
+
+	/* This skips the first character, as if it were a slash */
+	if ((basename[0]) && (invalid_filename(volume->server,basename)))
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+/* Drops the attributes we have of name in dirid, eg. when the frontend
+ * has changed what is in that directory */
+void ml_invalidate_did(struct afp_volume * volume, unsigned int dirid,
+	const char * name)
+{
+	char basename[AFP_MAX_PATH];
+
+	if (convert_name_to_afp(volume,name,basename)==0)
+		attrcache_remove(volume,dirid,basename);
+}
+
+int ml_getattr_did(struct afp_volume * volume, unsigned int dirid,
+	const char * name, struct stat * stbuf)
+{
+	char basename[AFP_MAX_PATH];
+	int ret;
+
+	if ((ret=convert_name_to_afp(volume,name,basename)))
+		return ret;
+
+	if (volume->open_forks)
+		sync_opened_forks(volume,dirid,basename);
+
+	return ll_getattr_did(volume,dirid,basename,stbuf,0);
+}
+
+int ml_readdir_did(struct afp_volume * volume, unsigned int dirid,
+	struct afp_listing ** listing)
+{
+	return ll_readdir_did(volume,dirid,"",listing,0);
+}
+
+int ml_dirent_stat(struct afp_volume * volume, const struct afp_dirent * e,
+	struct stat * stbuf)
+{
+	return ll_fill_stat(volume,e,stbuf,0);
+}
+
+int ml_open_did(struct afp_volume * volume, unsigned int dirid,
+	const char * name, int flags, struct afp_file_info ** newfp)
+{
+	struct afp_file_info * fp;
+	int ret;
+
+	if (volume_is_readonly(volume) && 
+		(flags & (O_WRONLY|O_RDWR|O_TRUNC|O_APPEND|O_CREAT))) 
+		return -EACCES;
+
+	if ((fp=malloc(sizeof(*fp)))==NULL)
+		return -ENOMEM;
+	memset(fp,0,sizeof(*fp));
+
+	if ((ret=convert_name_to_afp(volume,name,fp->basename)))
+		goto error;
+	fp->did=dirid;
+
+	/* Creating the file is left to ml_creat_did() */
+	if ((ret=ll_open(volume,NULL,flags & ~O_CREAT,fp))<0)
+		goto error;
+
+	if (flags & O_TRUNC)
+		attrcache_remove(volume,dirid,fp->basename);
+
+	*newfp=fp;
+	return 0;
+
+error:
+	free(fp);
+	return ret;
+}
+
+int ml_creat_did(struct afp_volume * volume, unsigned int dirid,
+	const char * name, mode_t mode)
+{
+	char basename[AFP_MAX_PATH];
+	int ret;
+
+	if (volume_is_readonly(volume))
+		return -EACCES;
+
+	if ((ret=convert_name_to_afp(volume,name,basename)))
+		return ret;
+
+	return creat_in_dir(volume,dirid,basename,mode);
+}
+
+int ml_mkdir_did(struct afp_volume * vol, unsigned int dirid,
+	const char * name, mode_t mode)
+{
+	char basename[AFP_MAX_PATH];
+	unsigned int result_did;
+	int ret;
+
+	if (volume_is_readonly(vol))
+		return -EACCES;
+
+	if ((ret=convert_name_to_afp(vol,name,basename)))
+		return ret;
+
+	ret=mkdir_in_dir(vol,dirid,basename,&result_did);
+
+	/* We may have cached that it didn't exist */
+	if (ret==0)
+		remove_did_child(vol,dirid,basename);
+
+	return ret;
+}
+
+int ml_unlink_did(struct afp_volume * vol, unsigned int dirid,
+	const char * name)
+{
+	char basename[AFP_MAX_PATH];
+	int ret;
+
+	if (volume_is_readonly(vol))
+		return -EACCES;
+
+	if ((ret=convert_name_to_afp(vol,name,basename)))
+		return ret;
+
+	return unlink_in_dir(vol,dirid,basename);
+}
+
+int ml_rmdir_did(struct afp_volume * vol, unsigned int dirid,
+	const char * name)
+{
+	char basename[AFP_MAX_PATH];
+	int ret;
+
+	if (volume_is_readonly(vol))
+		return -EACCES;
+
+	if ((ret=convert_name_to_afp(vol,name,basename)))
+		return ret;
+
+	if ((ret=rmdir_in_dir(vol,dirid,basename))==0)
+		remove_did_child(vol,dirid,basename);
+
+	return ret;
+}
+
+int ml_rename_did(struct afp_volume * vol,
+	unsigned int dirid_from, const char * name_from,
+	unsigned int dirid_to, const char * name_to)
+{
+	char basename_from[AFP_MAX_PATH];
+	char basename_to[AFP_MAX_PATH];
+	int ret;
+
+	if (volume_is_readonly(vol)) 
+		return -EACCES;
+
+	if ((ret=convert_name_to_afp(vol,name_from,basename_from)) ||
+		(ret=convert_name_to_afp(vol,name_to,basename_to)))
+		return ret;
+
+	ret=rename_between_dirs(vol,dirid_from,basename_from,
+		dirid_to,basename_to,0);
+	if (ret==0) {
+		remove_did_child(vol,dirid_from,basename_from);
+		remove_did_child(vol,dirid_to,basename_to);
+	}
+	return ret;
+}
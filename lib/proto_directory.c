@@ -8,6 +8,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "afpfs-ng/dsi.h"
 #include "afpfs-ng/afp.h"
@@ -15,6 +16,8 @@
 #include "afpfs-ng/afp_protocol.h"
 #include "dsi_protocol.h"
 #include "afp_replies.h"
+#include "afp_internal.h"
+#include "listing.h"
 
 int afp_moveandrename(struct afp_volume *volume,
 	unsigned int src_did, 
@@ -207,8 +210,8 @@ int afp_enumerate_reply(struct afp_server *server, char * buf, unsigned int size
 	char * p = buf + sizeof(*reply);
 	int i;
 	char  *max=buf+size;
-	struct afp_file_info * filebase = NULL, *filecur=NULL, *prev=NULL;
-	void **x = other;
+	struct afp_file_info filecur;
+	struct afp_listing * listing = other;
 
 	if (reply->dsi_header.return_code.error_code) {
 		return reply->dsi_header.return_code.error_code;
@@ -221,31 +224,22 @@ int afp_enumerate_reply(struct afp_server *server, char * buf, unsigned int size
 	for (i=0;i<ntohs(reply->reqcount);i++) {
 		entry  = (void *) p;
 
-		if (p>max) {
-			return -1;
-		}
-		prev=filecur;
-		if ((filecur=malloc(sizeof(struct afp_file_info)))==NULL) {
-			return -1;
-		}
-		if (filebase==NULL) {
-			filebase=filecur;
-			prev=filecur;
-		} else {
-			prev->next=filecur;
-		}
+		if ((p+sizeof(*entry)>max) || (p+entry->size>max) ||
+			(entry->size<sizeof(*entry)))
+			break;
 
+		memset(&filecur,0,sizeof(filecur));
 		parse_reply_block(server,p+sizeof(*entry),
-			ntohs(entry->size),entry->isdir,
+			entry->size,entry->isdir,
 			ntohs(reply->filebitmap), 
 			ntohs(reply->dirbitmap), 
-			filecur);
+			&filecur);
+		if (listing_add_file_info(listing,&filecur)==NULL)
+			return -1;
 
 		p+=entry->size;
 	}
 
-	*x=filebase;
-
 	return 0;
 }
 
@@ -266,8 +260,9 @@ int afp_enumerateext2_reply(struct afp_server *server, char * buf, unsigned int
 	} __attribute__((__packed__)) * entry;
 	char * p = buf + sizeof(*reply);
 	int i;
-	//char  *max=buf+size;
-	struct afp_file_info * filebase = NULL, *filecur = NULL, *new_file = NULL, **x = (struct afp_file_info **) other;
+	char  *max=buf+size;
+	struct afp_file_info filecur;
+	struct afp_listing * listing = other;
 
 	if (reply->dsi_header.return_code.error_code) {
 		return reply->dsi_header.return_code.error_code;
@@ -279,32 +274,22 @@ int afp_enumerateext2_reply(struct afp_server *server, char * buf, unsigned int
 
 	for (i=0;i<ntohs(reply->reqcount);i++) {
 
-		if ((new_file=malloc(sizeof(struct afp_file_info)))==NULL) {
-			return -1;
-		}
-
-		new_file->next=NULL;
-
-		if (filecur) {
-			filecur->next=new_file;
-			filecur=new_file;
-		} else {
-			filebase=new_file;
-			filecur=new_file;
-		}
-
 		entry = (struct sEntry *)p;
+		if ((p+sizeof(*entry)>max) || (p+ntohs(entry->size)>max) ||
+			(ntohs(entry->size)<sizeof(*entry)))
+			break;
 
+		memset(&filecur,0,sizeof(filecur));
 		parse_reply_block(server,p+sizeof(*entry),
 			ntohs(entry->size),entry->isdir,
 			ntohs(reply->filebitmap), 
 			ntohs(reply->dirbitmap), 
-			filecur);
+			&filecur);
+		if (listing_add_file_info(listing,&filecur)==NULL)
+			return -1;
 		p+=ntohs(entry->size);
 	}
 
-	*x=filebase;
-
 	return 0;
 }
 
@@ -315,7 +300,7 @@ int afp_enumerate(
 	unsigned short reqcount, 
 	unsigned short startindex,
 	char * pathname,
-	struct afp_file_info ** file_p)
+	struct afp_listing * listing)
 {
 	struct {
 		struct dsi_header dsi_header __attribute__((__packed__));
@@ -332,7 +317,6 @@ int afp_enumerate(
 	unsigned short len;
 	char * data;
 	int rc;
-	struct afp_file_info * files = NULL;
 	struct afp_server * server = volume->server;
 	char * path;
 
@@ -357,13 +341,13 @@ int afp_enumerate(
 	afp_enumerate_request_packet->dirbitmap=htons(dirbitmap);
 	afp_enumerate_request_packet->reqcount=htons(reqcount);
 	afp_enumerate_request_packet->startindex=htons(startindex);
-	afp_enumerate_request_packet->maxreplysize=htons(5280);
+	afp_enumerate_request_packet->maxreplysize=
+		htons(min(server->rx_quantum,0xffff));
 	copy_path(server,path,pathname,strlen(pathname));
 	unixpath_to_afppath(server,path);
 	
 	rc=dsi_send(server, (char *) data,len,DSI_DEFAULT_TIMEOUT,
-		afpEnumerate,(void **) &files);
-	*file_p = files;
+		afpEnumerate,(void **) listing);
 	free(data);
 	return rc;
 }
@@ -375,7 +359,7 @@ int afp_enumerateext2(
 	unsigned short reqcount, 
 	unsigned long startindex,
 	char * pathname,
-	struct afp_file_info ** file_p)
+	struct afp_listing * listing)
 {
 	struct {
 		struct dsi_header dsi_header __attribute__((__packed__));
@@ -392,7 +376,6 @@ int afp_enumerateext2(
 	unsigned short len;
 	char * data;
 	int rc;
-	struct afp_file_info * files = NULL;
 	struct afp_server * server = volume->server;
 	char * path;
 
@@ -417,16 +400,222 @@ int afp_enumerateext2(
 	afp_enumerateext2_request_packet->dirbitmap=htons(dirbitmap);
 	afp_enumerateext2_request_packet->reqcount=htons(reqcount);
 	afp_enumerateext2_request_packet->startindex=htonl(startindex);
-	afp_enumerateext2_request_packet->maxreplysize=htonl(5280);
+	afp_enumerateext2_request_packet->maxreplysize=
+		htonl(min(server->rx_quantum,DSI_MAX_INCOMING_PACKET));
 	copy_path(server,path,pathname,strlen(pathname));
 	unixpath_to_afppath(server,path);
 
 	
 	rc=dsi_send(server, (char *) data,len,DSI_DEFAULT_TIMEOUT,
-		afpEnumerateExt2,(void **) &files);
+		afpEnumerateExt2,(void **) listing);
 
-	*file_p = files;
 	free(data);
 	return rc;
 
 }
+
+/* What afp_catsearchext_reply() fills in */
+struct catsearch_result {
+	char * position;
+	struct afp_listing * listing;
+};
+
+int afp_catsearchext_reply(struct afp_server *server, char * buf, unsigned int size, void * other) 
+{
+	struct {
+		struct dsi_header dsi_header __attribute__((__packed__));
+		uint8_t position[AFP_CATALOG_POSITION_LEN];
+		uint16_t filebitmap;
+		uint16_t dirbitmap;
+		uint32_t count;
+	} __attribute__((__packed__)) * reply = (void *) buf;
+
+	struct sEntry{
+		uint16_t size;
+		uint8_t isdir;
+		uint8_t pad;
+	} __attribute__((__packed__)) * entry;
+	char * p = buf + sizeof(*reply);
+	unsigned int i;
+	char  *max=buf+size;
+	struct afp_file_info filecur;
+	struct catsearch_result * result = other;
+	int rc = ntohl(reply->dsi_header.return_code.error_code);
+
+	/* The last matches come with kFPEOFErr */
+	if ((rc!=kFPNoErr) && (rc!=kFPEOFErr))
+		return rc;
+
+	if (size<sizeof(*reply))
+		return rc;
+
+	memcpy(result->position,reply->position,AFP_CATALOG_POSITION_LEN);
+
+	for (i=0;i<ntohl(reply->count);i++) {
+
+		entry = (struct sEntry *)p;
+		if ((p+sizeof(*entry)>max) || (p+ntohs(entry->size)>max) ||
+			(ntohs(entry->size)<sizeof(*entry)))
+			break;
+
+		memset(&filecur,0,sizeof(filecur));
+		parse_reply_block(server,p+sizeof(*entry),
+			ntohs(entry->size),entry->isdir,
+			ntohs(reply->filebitmap), 
+			ntohs(reply->dirbitmap), 
+			&filecur);
+		if (listing_add_file_info(result->listing,&filecur)==NULL)
+			return -1;
+		p+=ntohs(entry->size);
+	}
+
+	return rc;
+}
+
+/* An AFP date, held to the dates that AFP can carry */
+static uint32_t catsearch_date(time_t t)
+{
+	long long d = (long long) t - AD_DATE_DELTA;
+
+	d=max(min(d,(long long) INT32_MAX),(long long) INT32_MIN);
+	return htonl((uint32_t) (int32_t) d);
+}
+
+/* Lays out one of the two specifications of a catalog search: a length,
+ * then the parameters in bitmap order and the name after them, with its
+ * offset counted from the start of the parameters.  The first gives the
+ * lower end of each range, the second the upper end.  Bit 9 is the
+ * offspring count for directories and the data fork length for files,
+ * and carries both, as netatalk reads it. */
+static unsigned int catsearch_put_spec(char * buf,
+	const struct afp_catsearch_spec * spec,
+	unsigned int reqbitmap, int upper)
+{
+	char * p = buf + sizeof(uint16_t), * start = p;
+	uint16_t * nameoffset = NULL;
+	uint16_t len16;
+	uint32_t v;
+	unsigned long long size;
+
+	if (reqbitmap & kFPCreateDateBit) {
+		v=catsearch_date(upper ? spec->created_to : spec->created_from);
+		memcpy(p,&v,4);
+		p+=4;
+	}
+	if (reqbitmap & kFPModDateBit) {
+		v=catsearch_date(upper ? spec->modified_to : spec->modified_from);
+		memcpy(p,&v,4);
+		p+=4;
+	}
+	if (reqbitmap & kFPLongNameBit) {
+		nameoffset=(void *) p;
+		p+=2;
+	}
+	if (reqbitmap & kFPDataForkLenBit) {
+		len16=htons(upper ? 0xffff : 0);
+		memcpy(p,&len16,2);
+		p+=2;
+		size=upper ? spec->size_to : spec->size_from;
+		v=htonl(min(size,0xffffffffULL));
+		memcpy(p,&v,4);
+		p+=4;
+	}
+	if (reqbitmap & kFPUTF8NameBit) {
+		nameoffset=(void *) p;
+		p+=6;
+		memset(p-4,0,4);
+	}
+
+	if (nameoffset) {
+		len16=htons(p-start);
+		memcpy(nameoffset,&len16,2);
+		if (reqbitmap & kFPUTF8NameBit) {
+			v=htonl(0x08000103);
+			memcpy(p,&v,4);
+			p+=4;
+			p+=copy_to_pascal_two(p,spec->name)+2;
+		} else
+			p+=copy_to_pascal(p,spec->name)+1;
+	}
+
+	len16=htons(p-start);
+	memcpy(buf,&len16,2);
+	return p-buf;
+}
+
+/* afp_catsearchext()
+ *
+ * Asks the server for up to reqmatches files and directories on the
+ * volume that match spec, with their parameters as in filebitmap and
+ * dirbitmap, and adds them to listing.  The search starts at position,
+ * which is zeroed for a new search, and position is moved on to where
+ * it stopped.  Returns kFPEOFErr once there are no more, which can come
+ * with the last matches.
+ */
+
+int afp_catsearchext(struct afp_volume * volume,
+	const struct afp_catsearch_spec * spec,
+	unsigned int filebitmap, unsigned int dirbitmap,
+	unsigned int reqmatches, char * position,
+	struct afp_listing * listing)
+{
+	struct {
+		struct dsi_header dsi_header __attribute__((__packed__));
+		uint8_t command;
+		uint8_t pad;
+		uint16_t volid;
+		uint32_t reqmatches;
+		uint32_t reserved;
+		uint8_t position[AFP_CATALOG_POSITION_LEN];
+		uint16_t filebitmap;
+		uint16_t dirbitmap;
+		uint32_t reqbitmap;
+	} __attribute__((__packed__)) * request_packet;
+	struct afp_server * server = volume->server;
+	struct catsearch_result result;
+	unsigned int reqbitmap, len;
+	char * msg, * p;
+	int rc;
+
+	/* Only ask for files or directories if they are wanted */
+	if (!spec->files) filebitmap=0;
+	if (!spec->dirs) dirbitmap=0;
+
+	reqbitmap=spec->bitmap &
+		(kFPCreateDateBit | kFPModDateBit | kFPDataForkLenBit);
+	if ((spec->bitmap & (kFPLongNameBit|kFPUTF8NameBit)) && (spec->name[0]))
+		reqbitmap|=(volume->attributes & kSupportsUTF8Names) ?
+			kFPUTF8NameBit : kFPLongNameBit;
+	if (spec->partial) reqbitmap|=kFPPartialNameBit;
+
+	len=sizeof(*request_packet)+2*(2+32+AFP_MAX_PATH);
+	if ((msg=malloc(len))==NULL)
+		return -1;
+
+	request_packet=(void *) msg;
+
+	dsi_setup_header(server,&request_packet->dsi_header,DSI_DSICommand);
+
+	request_packet->command=afpCatSearchExt;
+	request_packet->pad=0;
+	request_packet->volid=htons(volume->volid);
+	request_packet->reqmatches=htonl(reqmatches);
+	request_packet->reserved=0;
+	memcpy(request_packet->position,position,AFP_CATALOG_POSITION_LEN);
+	request_packet->filebitmap=htons(filebitmap);
+	request_packet->dirbitmap=htons(dirbitmap);
+	request_packet->reqbitmap=htonl(reqbitmap);
+
+	p=msg+sizeof(*request_packet);
+	p+=catsearch_put_spec(p,spec,reqbitmap,0);
+	p+=catsearch_put_spec(p,spec,reqbitmap,1);
+
+	result.position=position;
+	result.listing=listing;
+
+	rc=dsi_send(server, (char *) msg,p-msg,DSI_BLOCK_TIMEOUT,
+		afpCatSearchExt,(void **) &result);
+
+	free(msg);
+	return rc;
+}
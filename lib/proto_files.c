@@ -259,6 +259,32 @@ int afp_readext(struct afp_volume * volume, unsigned short forkid,
 	return rc;
 }
 
+/* Same as afp_readext(), but returns as soon as the request is sent.  The
+ * data lands in rx once dsi_wait_request() on the result returns. */
+struct dsi_request * afp_readext_async(struct afp_volume * volume, 
+		unsigned short forkid, uint64_t offset, uint64_t count,
+		struct afp_rx_buffer * rx)
+{
+	struct {
+		struct dsi_header dsi_header __attribute__((__packed__));
+		uint8_t command;
+		uint8_t pad;
+		uint16_t forkrefnum;
+		uint64_t offset;
+		uint64_t reqcount;
+	}  __attribute__((__packed__)) readext_packet;
+
+	dsi_setup_header(volume->server,&readext_packet.dsi_header,DSI_DSICommand);
+	readext_packet.command=afpReadExt;
+	readext_packet.pad=0x0;
+	readext_packet.forkrefnum=htons(forkid);
+	readext_packet.offset=hton64(offset);
+	readext_packet.reqcount=hton64(count);
+	return dsi_send_request(volume->server, (char *) &readext_packet,
+		sizeof(readext_packet), DSI_DEFAULT_TIMEOUT, 
+		afpReadExt, (void *) rx);
+}
+
 int afp_readext_reply(struct afp_server *server, char * buf, unsigned int size, void * other)
 {
 	struct afp_rx_buffer * rx = other;
@@ -393,47 +419,100 @@ int afp_createfile(struct afp_volume * volume, unsigned char flag,
 	return ret;
 }
 
-int afp_write(struct afp_volume * volume, unsigned short forkid,
-	uint32_t offset, uint32_t reqcount, 
-	char * data,uint32_t * written)
+/* afp_copyfile()
+ *
+ * Has the server copy the file src_path in src_did to new_name in the
+ * directory dst_path under dst_did, without the data coming through us.
+ * Both ends are on the one volume.  The copy can take as long as the file
+ * is big, so there's no timeout.
+ */
+
+int afp_copyfile(struct afp_volume * volume,
+	unsigned int src_did, char * src_path,
+	unsigned int dst_did, char * dst_path, char * new_name)
 {
 	struct {
 		struct dsi_header dsi_header __attribute__((__packed__));
 		uint8_t command;
-		uint8_t flag;
-		uint16_t forkid;
-		uint32_t offset;
-		uint32_t reqcount;
+		uint8_t pad;
+		uint16_t src_volid;
+		uint32_t src_did;
+		uint16_t dst_volid;
+		uint32_t dst_did;
 	}  __attribute__((__packed__)) * request_packet;
-	struct afp_server * server = volume->server;
-
+	struct afp_server * server=volume->server;
+	unsigned int slen=strlen(src_path), dlen=strlen(dst_path),
+		nlen=strlen(new_name);
 	unsigned int len = sizeof(*request_packet)+
-		reqcount;
+		(3*sizeof_path_header(server))+slen+dlen+nlen;
+	char * p, *msg;
 	int ret;
-	char * dataptr, * msg;
 
 	if ((msg = malloc(len))==NULL) 
 		return -1;
-
 	request_packet =(void *) msg;
-	dataptr=msg+(sizeof(*request_packet));
-	memcpy(dataptr,data,reqcount);
-	dsi_setup_header(server,&request_packet->dsi_header,DSI_DSIWrite);
-	request_packet->dsi_header.return_code.data_offset=htonl(sizeof(*request_packet)-sizeof(struct dsi_header));
-	/* For writing data, set the offset correctly */
-	request_packet->command=afpWrite;
-	request_packet->flag=0;  /* we'll always do this from the start */
-	request_packet->forkid=htons(forkid);
-	request_packet->offset=htonl(offset);
-	request_packet->reqcount=htonl(reqcount);
-	ret=dsi_send(server, (char *) request_packet,len,DSI_DEFAULT_TIMEOUT, 
-		afpWrite,(void *) written);
+	dsi_setup_header(server,&request_packet->dsi_header,DSI_DSICommand);
+
+	request_packet->command=afpCopyFile;
+	request_packet->pad=0;
+	request_packet->src_volid=htons(volume->volid);
+	request_packet->src_did=htonl(src_did);
+	request_packet->dst_volid=htons(volume->volid);
+	request_packet->dst_did=htonl(dst_did);
+
+	p=msg+sizeof(*request_packet);
+	copy_path(server,p,src_path,slen);
+	unixpath_to_afppath(server,p);
+	p+=sizeof_path_header(server)+slen;
+
+	copy_path(server,p,dst_path,dlen);
+	unixpath_to_afppath(server,p);
+	p+=sizeof_path_header(server)+dlen;
+
+	copy_path(server,p,new_name,nlen);
+	unixpath_to_afppath(server,p);
+
+	ret=dsi_send(server, (char *) request_packet,len,DSI_BLOCK_TIMEOUT, 
+		afpCopyFile,NULL);
 
 	free(msg);
 	
 	return ret;
 }
 
+int afp_write(struct afp_volume * volume, unsigned short forkid,
+	uint32_t offset, uint32_t reqcount, 
+	char * data,uint32_t * written)
+{
+	struct {
+		struct dsi_header dsi_header __attribute__((__packed__));
+		uint8_t command;
+		uint8_t flag;
+		uint16_t forkid;
+		uint32_t offset;
+		uint32_t reqcount;
+	}  __attribute__((__packed__)) request_packet;
+	struct afp_server * server = volume->server;
+	struct iovec iov[2];
+
+	dsi_setup_header(server,&request_packet.dsi_header,DSI_DSIWrite);
+	request_packet.dsi_header.return_code.data_offset=htonl(sizeof(request_packet)-sizeof(struct dsi_header));
+	/* For writing data, set the offset correctly */
+	request_packet.command=afpWrite;
+	request_packet.flag=0;  /* we'll always do this from the start */
+	request_packet.forkid=htons(forkid);
+	request_packet.offset=htonl(offset);
+	request_packet.reqcount=htonl(reqcount);
+
+	/* The data goes out from where it is, without a copy */
+	iov[0].iov_base=&request_packet;
+	iov[0].iov_len=sizeof(request_packet);
+	iov[1].iov_base=data;
+	iov[1].iov_len=reqcount;
+	return dsi_send_iov(server,iov,2,DSI_DEFAULT_TIMEOUT, 
+		afpWrite,(void *) written);
+}
+
 
 int afp_write_reply(struct afp_server *server, char * buf, unsigned int size,
 	void * other)
@@ -463,37 +542,58 @@ int afp_writeext(struct afp_volume * volume, unsigned short forkid,
 		uint16_t forkid;
 		uint64_t offset;
 		uint64_t reqcount;
-	}  __attribute__((__packed__)) * request_packet;
+	}  __attribute__((__packed__)) request_packet;
 	struct afp_server * server = volume->server;
+	struct iovec iov[2];
 
-	unsigned int len = sizeof(*request_packet)+
-		reqcount;
-	int ret;
-	char * dataptr, * msg;
+	dsi_setup_header(server,&request_packet.dsi_header,DSI_DSIWrite);
+	request_packet.dsi_header.return_code.data_offset=htonl(sizeof(request_packet)-sizeof(struct dsi_header));
+	/* For writing data, set the offset correctly */
+	request_packet.command=afpWriteExt;
+	request_packet.flag=0;  /* we'll always do this from the start */
+	request_packet.forkid=htons(forkid);
+	request_packet.offset=hton64(offset);
+	request_packet.reqcount=hton64(reqcount);
+
+	/* The data goes out from where it is, without a copy */
+	iov[0].iov_base=&request_packet;
+	iov[0].iov_len=sizeof(request_packet);
+	iov[1].iov_base=data;
+	iov[1].iov_len=reqcount;
+	return dsi_send_iov(server,iov,2,DSI_DEFAULT_TIMEOUT, 
+		afpWriteExt,(void *) written);
+}
 
-	if ((msg = malloc(len))==NULL) 
-		return -1;
 
-	request_packet =(void *) msg;
-	dataptr=msg+(sizeof(*request_packet));
-	memcpy(dataptr,data,reqcount);
+/* Like afp_writeext(), but doesn't copy the data or wait for the reply.
+ * The reqcount bytes of data must already be in msg, after
+ * AFP_WRITEEXT_HEADER_LEN bytes which are used to build the header. */
+struct dsi_request * afp_writeext_async(struct afp_volume * volume,
+	unsigned short forkid, uint64_t offset, uint64_t reqcount,
+	char * msg, uint64_t * written)
+{
+	struct {
+		struct dsi_header dsi_header __attribute__((__packed__));
+		uint8_t command;
+		uint8_t flag;
+		uint16_t forkid;
+		uint64_t offset;
+		uint64_t reqcount;
+	}  __attribute__((__packed__)) * request_packet = (void *) msg;
+	struct afp_server * server = volume->server;
+
 	dsi_setup_header(server,&request_packet->dsi_header,DSI_DSIWrite);
 	request_packet->dsi_header.return_code.data_offset=htonl(sizeof(*request_packet)-sizeof(struct dsi_header));
-	/* For writing data, set the offset correctly */
 	request_packet->command=afpWriteExt;
-	request_packet->flag=0;  /* we'll always do this from the start */
+	request_packet->flag=0;
 	request_packet->forkid=htons(forkid);
 	request_packet->offset=hton64(offset);
 	request_packet->reqcount=hton64(reqcount);
-	ret=dsi_send(server, (char *) request_packet,len,DSI_DEFAULT_TIMEOUT, 
+	return dsi_send_request(server, msg,
+		sizeof(*request_packet)+reqcount,DSI_DEFAULT_TIMEOUT, 
 		afpWriteExt,(void *) written);
-
-	free(msg);
-	
-	return ret;
 }
 
-
 int afp_writeext_reply(struct afp_server *server, char * buf, unsigned int size,
 	void * other)
 {
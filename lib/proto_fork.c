@@ -77,7 +77,7 @@ int afp_closefork(struct afp_volume * volume,
 	request_packet.forkid=htons(forkid);
 
 	return dsi_send(volume->server, (char *) &request_packet,
-		sizeof(request_packet),DSI_DEFAULT_TIMEOUT,afpFlushFork,NULL);
+		sizeof(request_packet),DSI_DEFAULT_TIMEOUT,afpCloseFork,NULL);
 }
 
 
@@ -210,6 +210,10 @@ int afp_byterangelock_reply(struct afp_server *server, char * buf, unsigned int
 		uint64_t offset;
 	}  __attribute__((__packed__)) * reply = (void *) buf;
 	uint32_t *offset=x;
+
+	/* Nobody is waiting for the reply to an asynchronous unlock */
+	if (offset==NULL) 
+		return reply->header.return_code.error_code;
 	*offset=0;
 
 	if (size>=sizeof(*reply)) 
@@ -253,6 +257,9 @@ int afp_byterangelockext_reply(struct afp_server *server, char * buf, unsigned i
 		uint64_t offset;
 	}  __attribute__((__packed__)) * reply = (void *) buf;
 	uint64_t *offset=x;
+
+	if (offset==NULL) 
+		return reply->header.return_code.error_code;
 	*offset=0;
 
 	if (size>=sizeof(*reply)) 
@@ -260,3 +267,46 @@ int afp_byterangelockext_reply(struct afp_server *server, char * buf, unsigned i
 
 	return reply->header.return_code.error_code;
 }
+
+/* Gives back a range without waiting to hear how it went */
+int afp_byterangeunlock_async(struct afp_volume * volume,
+	unsigned short forkid, uint64_t offset, uint64_t len)
+{
+	struct {
+		struct dsi_header dsi_header __attribute__((__packed__));
+		uint8_t command;
+		uint8_t flag;
+		uint16_t forkid;
+		uint32_t offset;
+		uint32_t len;
+	}  __attribute__((__packed__)) request;
+	struct {
+		struct dsi_header dsi_header __attribute__((__packed__));
+		uint8_t command;
+		uint8_t flag;
+		uint16_t forkid;
+		uint64_t offset;
+		uint64_t len;
+	}  __attribute__((__packed__)) request_ext;
+
+	if (volume->server->using_version->av_number < 30) {
+		dsi_setup_header(volume->server,&request.dsi_header,
+			DSI_DSICommand);
+		request.command=afpByteRangeLock;
+		request.flag=ByteRangeLock_Unlock;
+		request.forkid=htons(forkid);
+		request.offset=htonl(offset);
+		request.len=htonl(len);
+		return dsi_send(volume->server, (char *) &request,
+			sizeof(request),0,afpByteRangeLock,NULL);
+	}
+
+	dsi_setup_header(volume->server,&request_ext.dsi_header,DSI_DSICommand);
+	request_ext.command=afpByteRangeLockExt;
+	request_ext.flag=ByteRangeLock_Unlock;
+	request_ext.forkid=htons(forkid);
+	request_ext.offset=hton64(offset);
+	request_ext.len=hton64(len);
+	return dsi_send(volume->server, (char *) &request_ext,
+		sizeof(request_ext),0,afpByteRangeLockExt,NULL);
+}
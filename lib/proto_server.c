@@ -64,6 +64,13 @@ int afp_getsrvrparms_reply(struct afp_server *server, char * msg, unsigned int s
 		vol=&server->volumes[i];
 		vol->flags=p[0];
 		vol->server=server;
+		pthread_mutex_init(&vol->did_cache_mutex,NULL);
+		vol->did_cache_timeout=AFP_DEFAULT_DID_CACHE_TIMEOUT;
+		vol->did_cache_max=AFP_DEFAULT_DID_CACHE_MAX;
+		pthread_mutex_init(&vol->attr_cache_mutex,NULL);
+		vol->attr_cache_timeout=AFP_DEFAULT_ATTR_CACHE_TIMEOUT;
+		vol->readahead_window=AFP_DEFAULT_READAHEAD_WINDOW;
+		vol->writebehind_window=AFP_DEFAULT_WRITEBEHIND_WINDOW;
 		p++;
 		p+=copy_from_pascal(vol->volume_name,p,
 			AFP_VOLUME_NAME_LEN)+1;
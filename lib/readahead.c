@@ -0,0 +1,255 @@
+/*
+    readahead.c: keeps FPReadExt requests in flight ahead of a sequential
+    reader, so that streaming a large fork isn't one round trip per read.
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    Each open fork gets a window of slots.  Once a reader is seen to be
+    sequential, every empty slot is filled with an asynchronous read of the
+    next chunk of the fork.  Later reads are copied out of completed slots,
+    waiting on the ones still in flight.  A read that isn't sequential throws
+    the window away.
+
+    Prefetched data would be handed out without taking the byte range
+    locks, so forks that use them don't read ahead.
+
+    If the server has extra sessions, consecutive chunks are spread over
+    them, see sessions.c.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/dsi.h"
+#include "afpfs-ng/afp_protocol.h"
+#include "afpfs-ng/utils.h"
+#include "readahead.h"
+#include "sessions.h"
+
+#define READAHEAD_EMPTY 0
+#define READAHEAD_PENDING 1
+#define READAHEAD_DONE 2
+
+struct afp_readahead_slot {
+	uint64_t offset;
+	struct afp_server * server;	/* the session it was sent on */
+	struct afp_rx_buffer rx;
+	struct dsi_request * request;
+	int state;
+	int rc;
+};
+
+struct afp_readahead {
+	pthread_mutex_t mutex;
+	unsigned int window;
+	unsigned int chunk;
+	uint64_t last_offset;	/* start of the last read */
+	uint64_t next_offset;	/* end of the last read */
+	uint64_t fetch_offset;	/* where the next prefetch starts */
+	unsigned int sequential;
+	int eof;
+	struct afp_readahead_slot slots[AFP_MAX_READAHEAD_WINDOW];
+};
+
+int readahead_open(struct afp_volume * volume, struct afp_file_info * fp)
+{
+	struct afp_readahead * ra;
+
+	if ((volume->readahead_window==0) ||
+		(volume->server->using_version->av_number < 30))
+		return 0;
+
+	if (fp->locks)
+		return 0;
+
+	if ((ra=malloc(sizeof(*ra)))==NULL)
+		return -1;
+	memset(ra,0,sizeof(*ra));
+	pthread_mutex_init(&ra->mutex,NULL);
+	ra->window=min(volume->readahead_window,AFP_MAX_READAHEAD_WINDOW);
+	ra->chunk=volume->server->rx_quantum;
+	fp->readahead=ra;
+	return 0;
+}
+
+/* Waits for a prefetch to come back.  Must be called with ra->mutex held. */
+static void readahead_complete(struct afp_readahead * ra,
+	struct afp_readahead_slot * slot)
+{
+	if (slot->state!=READAHEAD_PENDING) return;
+
+	slot->rc=dsi_wait_request(slot->server,slot->request);
+	slot->request=NULL;
+	slot->state=READAHEAD_DONE;
+
+	if (slot->rc==kFPEOFErr)
+		ra->eof=1;
+	else if ((slot->rc==kFPNoErr) && (slot->rx.size>0) &&
+		(slot->rx.size<ra->chunk))
+		/* The server won't give us more than this at once */
+		ra->chunk=slot->rx.size;
+}
+
+static void readahead_drop(struct afp_readahead * ra,
+	struct afp_readahead_slot * slot)
+{
+	readahead_complete(ra,slot);
+	slot->state=READAHEAD_EMPTY;
+	slot->rx.size=0;
+}
+
+static void readahead_drop_all(struct afp_readahead * ra)
+{
+	int i;
+
+	for (i=0;i<ra->window;i++)
+		readahead_drop(ra,&ra->slots[i]);
+	ra->eof=0;
+	ra->sequential=0;
+}
+
+/* Fills every empty slot with a request for the next chunk */
+static void readahead_fill(struct afp_volume * volume,
+	struct afp_file_info * fp, struct afp_readahead * ra)
+{
+	struct afp_readahead_slot * slot;
+	struct afp_volume * v;
+	unsigned short forkid;
+	int i;
+
+	for (i=0;i<ra->window;i++) {
+		if (ra->eof) return;
+		slot=&ra->slots[i];
+		if (slot->state!=READAHEAD_EMPTY) continue;
+
+		if ((slot->rx.data==NULL) &&
+			((slot->rx.data=malloc(ra->chunk))==NULL))
+			return;
+		slot->offset=ra->fetch_offset;
+		slot->rx.maxsize=ra->chunk;
+		slot->rx.size=0;
+		slot->rx.errorcode=0;
+		v=sessions_pick(volume,fp,0,slot->offset,ra->chunk,
+			ra->chunk,&forkid);
+		if ((slot->request=afp_readext_async(v,forkid,
+			slot->offset,ra->chunk,&slot->rx))==NULL)
+			return;
+		slot->server=v->server;
+		slot->state=READAHEAD_PENDING;
+		ra->fetch_offset+=ra->chunk;
+	}
+}
+
+/* Copies as much of the range as is covered by prefetched data into buf.
+ * Returns the amount copied; zero means the caller has to go and read it
+ * itself. */
+int readahead_read(struct afp_volume * volume, struct afp_file_info * fp,
+	char * buf, size_t size, off_t offset, int * eof)
+{
+	struct afp_readahead * ra = fp->readahead;
+	struct afp_readahead_slot * slot;
+	uint64_t pos=offset, end=offset+size, dataend;
+	size_t copied=0, amount;
+	int i, found;
+
+	*eof=0;
+	if (ra==NULL) return 0;
+
+	pthread_mutex_lock(&ra->mutex);
+
+	if ((offset<ra->last_offset) || (offset>ra->next_offset)) {
+		/* Not sequential, throw away what we had fetched */
+		readahead_drop_all(ra);
+		ra->fetch_offset=end;
+	} else
+		ra->sequential++;
+
+	do {
+		found=0;
+		for (i=0;i<ra->window;i++) {
+			slot=&ra->slots[i];
+			if ((slot->state==READAHEAD_EMPTY) ||
+				(pos<slot->offset) ||
+				(pos>=slot->offset+slot->rx.maxsize))
+				continue;
+
+			readahead_complete(ra,slot);
+			if ((slot->rc!=kFPNoErr) && (slot->rc!=kFPEOFErr)) {
+				/* Let the caller get the real error */
+				readahead_drop(ra,slot);
+				break;
+			}
+			dataend=slot->offset+slot->rx.size;
+			if (pos<dataend) {
+				amount=min(dataend-pos,end-pos);
+				memcpy(buf+copied,
+					slot->rx.data+(pos-slot->offset),
+					amount);
+				copied+=amount;
+				pos+=amount;
+				found=1;
+			}
+			if ((pos>=dataend) && (slot->rc==kFPEOFErr))
+				*eof=1;
+			break;
+		}
+	} while (found && (pos<end) && (*eof==0));
+
+	/* Recycle the slots the reader has gone past */
+	for (i=0;i<ra->window;i++) {
+		slot=&ra->slots[i];
+		if ((slot->state==READAHEAD_DONE) &&
+			(slot->offset+slot->rx.size<=pos) && (*eof==0))
+			readahead_drop(ra,slot);
+	}
+
+	if (copied || *eof)
+		volume->server->stats.readahead_hits++;
+	else
+		volume->server->stats.readahead_misses++;
+
+	ra->last_offset=offset;
+	ra->next_offset=end;
+
+	if (ra->sequential) {
+		if (ra->fetch_offset<end) ra->fetch_offset=end;
+		readahead_fill(volume,fp,ra);
+	}
+
+	pthread_mutex_unlock(&ra->mutex);
+
+	return copied;
+}
+
+/* Called when the fork is written to, since what we've got may be stale */
+void readahead_invalidate(struct afp_file_info * fp)
+{
+	struct afp_readahead * ra = fp->readahead;
+
+	if (ra==NULL) return;
+
+	pthread_mutex_lock(&ra->mutex);
+	readahead_drop_all(ra);
+	ra->last_offset=ra->next_offset=ra->fetch_offset=0;
+	pthread_mutex_unlock(&ra->mutex);
+}
+
+void readahead_free(struct afp_file_info * fp)
+{
+	struct afp_readahead * ra = fp->readahead;
+	int i;
+
+	if (ra==NULL) return;
+
+	pthread_mutex_lock(&ra->mutex);
+	readahead_drop_all(ra);
+	for (i=0;i<ra->window;i++)
+		if (ra->slots[i].rx.data) free(ra->slots[i].rx.data);
+	pthread_mutex_unlock(&ra->mutex);
+	pthread_mutex_destroy(&ra->mutex);
+	free(ra);
+	fp->readahead=NULL;
+}
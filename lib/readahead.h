@@ -0,0 +1,13 @@
+#ifndef __READAHEAD_H_
+#define __READAHEAD_H_
+
+#include <sys/types.h>
+#include "afpfs-ng/afp.h"
+
+int readahead_open(struct afp_volume * volume, struct afp_file_info * fp);
+int readahead_read(struct afp_volume * volume, struct afp_file_info * fp,
+	char * buf, size_t size, off_t offset, int * eof);
+void readahead_invalidate(struct afp_file_info * fp);
+void readahead_free(struct afp_file_info * fp);
+
+#endif
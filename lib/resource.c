@@ -1,5 +1,6 @@
 #include <limits.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -496,44 +497,30 @@ error:
 
 }
 
-static void remove_fp(struct afp_file_info **base,struct afp_file_info * toremove)
+/* Adds a copy of e, with suffix added to its name */
+static int add_dirent(struct afp_listing * listing, struct afp_dirent * e,
+		const char * suffix, unsigned int size)
 {
-	struct afp_file_info *fp, *prev=NULL;
-
-	for (fp=*base;fp;fp=fp->next) 
-		if (fp==toremove) {
-			if (prev==NULL) {
-				*base=fp->next;;
-				free(fp);
-				prev=NULL;
-			} else {
-				prev->next=fp->next;
-				prev=fp;
-				free(fp);
-			}
-		}
-
-}
-
-static int add_fp(struct afp_file_info **newchain, struct afp_file_info *fp,
-		char * suffix, unsigned int size)
-{
-	struct afp_file_info * newfp;
-	newfp=malloc(sizeof(struct afp_file_info));
-	if(!newfp) {
+	char name[AFP_MAX_PATH];
+	struct afp_dirent * newe;
+	const char * newname;
+	int len;
+
+	len=snprintf(name,AFP_MAX_PATH,"%s%s",e->name,suffix);
+	if ((len>=AFP_MAX_PATH) ||
+		((newe=afp_listing_add(listing,name,len))==NULL))
 		return 1;
-	}
-	memcpy(newfp,fp,sizeof(struct afp_file_info));
-	strcat(newfp->name,suffix);
-	newfp->resourcesize=size;
-	newfp->unixprivs.permissions|=S_IFREG;
-	newfp->next=*newchain;
-	*newchain=newfp;
+	newname=newe->name;
+	*newe=*e;
+	newe->name=newname;
+	newe->namelen=len;
+	newe->resourcesize=size;
+	newe->unixprivs.permissions|=S_IFREG;
 	return 0;
 }
 
 int appledouble_readdir(struct afp_volume * volume, 
-	const char *path, struct afp_file_info **base)
+	const char *path, struct afp_listing **listing)
 {
 	unsigned int resource;
 	char * newpath;
@@ -545,36 +532,42 @@ int appledouble_readdir(struct afp_volume * volume,
 			return 0;
 		break;
 		case AFP_META_APPLEDOUBLE: {
-			struct afp_file_info *fp, *newchain=NULL, *last=NULL;
-			ll_readdir(volume, newpath,base,1);
+			struct afp_listing * forks, * newlisting;
+			struct afp_dirent * e;
+			unsigned int i;
+			int ret;
+
+			ret=ll_readdir(volume, newpath,&forks,1);
+			free(newpath);
+			if (ret) return ret;
+
+			if ((newlisting=afp_listing_new())==NULL) {
+				afp_listing_free(forks);
+				return -ENOMEM;
+			}
+
+			for (i=0;(e=afp_listing_next(forks,&i));) {
+				/* Files that have a resource fork */
+				if ((e->unixprivs.permissions & S_IFREG) &&
+					(e->resourcesize))
+					add_dirent(newlisting,e,"",
+						e->resourcesize);
 
-			/* Add .finderinfo files */
-			for (fp=*base;fp;fp=fp->next) {
-				add_fp(&newchain,fp,finderinfo_string,32);
+				/* Add .finderinfo files */
+				add_dirent(newlisting,e,finderinfo_string,32);
 
 				/* Add comments if it has a size > 0 */
 				if (ensure_dt_opened(volume)==0) {
 					int size=get_comment_size(volume,
-						fp->name,fp->did);
+						e->name,e->did);
 
 					if (size>0) 
-					add_fp(&newchain,fp,comment_string,32);
+					add_dirent(newlisting,e,comment_string,32);
 				}
-
-				if (fp->unixprivs.permissions & S_IFREG) {
-					if (fp->resourcesize==0) {
-						remove_fp(base,fp);
-					}
-				} else {
-					remove_fp(base,fp);
-				}
-				last=fp;
-			}
-			if ((newchain) && (last)) {
-				last->next=newchain;
 			}
+			afp_listing_free(forks);
 
-			free(newpath);
+			*listing=newlisting;
 			return 1;
 		}
 		break;
@@ -20,7 +20,7 @@ int appledouble_getattr(struct afp_volume * volume,
 
 
 int appledouble_readdir(struct afp_volume * volume,
-	const char *path, struct afp_file_info **base);
+	const char *path, struct afp_listing **listing);
 
 int appledouble_open(struct afp_volume * volume, const char * path, int flags,
         struct afp_file_info *newfp);
@@ -38,7 +38,7 @@ struct afp_server * afp_server_complete_connection(
 	memcpy(server->username,username,sizeof(server->username));
 	memcpy(server->password,password,sizeof(server->password));
 
-	add_fd_and_signal(server->fd);
+	loop_connect(server);
 	dsi_opensession(server);
 
 	/* Figure out what version we're using */
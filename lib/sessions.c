@@ -0,0 +1,385 @@
+/*
+    sessions.c: extra logged in sessions to a server, so that large fork
+    transfers aren't all squeezed through the one TCP connection.
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    A server can be given up to AFP_MAX_SESSIONS extra sessions, each its
+    own struct afp_server connected and logged in the usual way, but not
+    on the server list.  The first time a fork has a whole quantum to
+    read or write it is also opened on every session, and from then on
+    the data of read-ahead, write-behind and large reads and writes goes
+    over the sessions, picked by offset.  The original session is left to
+    the metadata requests, which then don't queue up behind the bulk data.
+    Small files never get that far, so they don't pay for the extra opens.
+
+    Fork refnums and byte range locks belong to a session, so forks that
+    use range locks stay on the original session.  A session that drops
+    isn't reconnected; the forks fall back to the original session.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/afp_protocol.h"
+#include "afpfs-ng/dsi.h"
+#include "afpfs-ng/utils.h"
+#include "sessions.h"
+
+struct afp_session {
+	struct afp_server * server;
+	struct {
+		uint64_t forks;
+		uint64_t reads;
+		uint64_t writes;
+		uint64_t read_bytes;
+		uint64_t write_bytes;
+	} stats;
+};
+
+struct afp_session_pool {
+	pthread_mutex_t mutex;
+	unsigned int count;
+	struct afp_session sessions[AFP_MAX_SESSIONS];
+};
+
+struct afp_fork_stripe {
+	struct afp_session * session;
+	struct afp_volume * volume;
+	unsigned short forkid;
+};
+
+struct afp_fork_stripes {
+	int opened;	/* 0 not yet, 1 on every session, -1 couldn't be */
+	unsigned char aflags;
+	unsigned int count;
+	struct afp_fork_stripe stripes[AFP_MAX_SESSIONS];
+};
+
+/* Connects and logs in another session like server's */
+static struct afp_server * sessions_connect(struct afp_server * server)
+{
+	struct afp_server * s;
+	unsigned char versions[SERVER_MAX_VERSIONS];
+
+	if ((s=afp_server_init(server->address))==NULL)
+		return NULL;
+	s->session_of=server;
+
+	if (afp_server_connect(s,0)) {
+		afp_free_server(&s);
+		return NULL;
+	}
+
+	memcpy(s->signature,server->signature,AFP_SIGNATURE_LEN);
+	memcpy(s->server_name,server->server_name,AFP_SERVER_NAME_LEN);
+	memcpy(s->server_name_utf8,server->server_name_utf8,
+		AFP_SERVER_NAME_UTF8_LEN);
+	memcpy(s->server_name_printable,server->server_name_printable,
+		AFP_SERVER_NAME_UTF8_LEN);
+	memcpy(s->machine_type,server->machine_type,sizeof(s->machine_type));
+	s->server_type=server->server_type;
+	s->supported_uams=server->supported_uams;
+	s->rx_quantum=server->rx_quantum;
+
+	/* server->versions isn't kept after the first connection, so offer
+	   just the version that it settled on */
+	memset(versions,0,sizeof(versions));
+	versions[0]=server->using_version->av_number;
+
+	/* This takes s off the server list if it fails, which it was never
+	   on, so it is left to us to free */
+	if (afp_server_complete_connection(NULL,s,server->address,
+		versions,server->supported_uams,
+		server->username,server->password,
+		server->requested_version,server->using_uam)==NULL) {
+		afp_free_server(&s);
+		return NULL;
+	}
+
+	return s;
+}
+
+/* afp_sessions_start()
+ *
+ * Brings server up to count extra sessions.  Returns how many it has.
+ */
+
+int afp_sessions_start(struct afp_server * server, unsigned int count)
+{
+	struct afp_session_pool * pool;
+	struct afp_server * s;
+
+	if ((server->session_of) ||
+		(server->using_version->av_number < 30))
+		return 0;
+
+	count=min(count,AFP_MAX_SESSIONS);
+
+	if ((pool=server->sessions)==NULL) {
+		if (count==0) return 0;
+		if ((pool=malloc(sizeof(*pool)))==NULL)
+			return 0;
+		memset(pool,0,sizeof(*pool));
+		pthread_mutex_init(&pool->mutex,NULL);
+		server->sessions=pool;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->count<count) {
+		if ((s=sessions_connect(server))==NULL) {
+			log_for_client(NULL,AFPFSD,LOG_WARNING,
+				"Could only open %d extra sessions to %s\n",
+				pool->count,server->server_name_printable);
+			break;
+		}
+		memset(&pool->sessions[pool->count],0,
+			sizeof(struct afp_session));
+		pool->sessions[pool->count].server=s;
+		pool->count++;
+	}
+	count=pool->count;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return count;
+}
+
+/* afp_sessions_stop()
+ *
+ * Logs out of all the extra sessions.  The forks on them have to be
+ * closed already.
+ */
+
+void afp_sessions_stop(struct afp_server * server)
+{
+	struct afp_session_pool * pool = server->sessions;
+	struct afp_server * s;
+	int i;
+
+	if (pool==NULL) return;
+
+	for (i=0;i<pool->count;i++) {
+		s=pool->sessions[i].server;
+		if (s->connect_state==SERVER_STATE_CONNECTED)
+			afp_logout(s,DSI_DONT_WAIT);
+		dsi_request_table_wakeup(s);
+		afp_free_server(&s);
+	}
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+	server->sessions=NULL;
+}
+
+/* The session's copy of volume, opened if it hasn't been yet.  Must be
+ * called with the pool mutex held. */
+static struct afp_volume * sessions_volume(struct afp_session * session,
+	struct afp_volume * volume)
+{
+	struct afp_server * s = session->server;
+	struct afp_volume * v;
+	char mesg[1024];
+	unsigned int l = 0;
+	int i;
+
+	for (i=0;i<s->num_volumes;i++) {
+		v=&s->volumes[i];
+		if (strcmp(v->volume_name,volume->volume_name))
+			continue;
+		if (v->mounted==AFP_VOLUME_MOUNTED)
+			return v;
+		memcpy(v->volpassword,volume->volpassword,AFP_VOLPASS_LEN);
+		if (afp_connect_volume(v,s,mesg,&l,sizeof(mesg)))
+			return NULL;
+		return v;
+	}
+	return NULL;
+}
+
+static void sessions_close_stripes(struct afp_fork_stripes * stripes)
+{
+	struct afp_fork_stripe * stripe;
+	int i;
+
+	for (i=0;i<stripes->count;i++) {
+		stripe=&stripes->stripes[i];
+		if (stripe->session->server->connect_state==
+			SERVER_STATE_CONNECTED)
+			afp_closefork(stripe->volume,stripe->forkid);
+	}
+}
+
+/* sessions_open_fork()
+ *
+ * Readies the fork to be striped over the extra sessions.  It is only
+ * opened on them by sessions_pick(), once it sees a whole quantum.
+ */
+
+void sessions_open_fork(struct afp_volume * volume,
+	struct afp_file_info * fp, unsigned char aflags)
+{
+	struct afp_session_pool * pool = volume->server->sessions;
+	struct afp_fork_stripes * stripes;
+
+	if ((pool==NULL) || (pool->count==0) || (fp->locks))
+		return;
+
+	if ((stripes=malloc(sizeof(*stripes)))==NULL)
+		return;
+	memset(stripes,0,sizeof(*stripes));
+	stripes->aflags=aflags;
+	fp->stripes=stripes;
+}
+
+/* Opens the fork on each extra session too, with the same access but
+ * none of the deny modes, which would only keep our own sessions out.
+ * If it can't be opened on all of them the fork is just not striped.
+ * Must be called with the pool mutex held. */
+static void sessions_stripe(struct afp_session_pool * pool,
+	struct afp_volume * volume, struct afp_file_info * fp)
+{
+	struct afp_fork_stripes * stripes = fp->stripes;
+	struct afp_fork_stripe * stripe;
+	struct afp_file_info * tmp;
+	unsigned char aflags;
+	int i;
+
+	stripes->opened=-1;
+
+	if ((tmp=malloc(sizeof(*tmp)))==NULL)
+		return;
+
+	aflags=stripes->aflags &
+		(AFP_OPENFORK_ALLOWREAD|AFP_OPENFORK_ALLOWWRITE);
+
+	for (i=0;i<pool->count;i++) {
+		stripe=&stripes->stripes[i];
+		stripe->session=&pool->sessions[i];
+		if (stripe->session->server->connect_state!=
+			SERVER_STATE_CONNECTED)
+			goto error;
+		if ((stripe->volume=sessions_volume(stripe->session,
+			volume))==NULL)
+			goto error;
+		memset(tmp,0,sizeof(*tmp));
+		if (afp_openfork(stripe->volume,fp->resource?1:0,fp->did,
+			aflags,fp->basename,tmp)!=kFPNoErr)
+			goto error;
+		stripe->forkid=tmp->forkid;
+		stripes->count++;
+	}
+	for (i=0;i<pool->count;i++)
+		pool->sessions[i].stats.forks++;
+
+	free(tmp);
+	stripes->opened=1;
+	return;
+
+error:
+	sessions_close_stripes(stripes);
+	stripes->count=0;
+	free(tmp);
+}
+
+void sessions_close_fork(struct afp_file_info * fp)
+{
+	if (fp->stripes==NULL) return;
+
+	sessions_close_stripes(fp->stripes);
+	free(fp->stripes);
+	fp->stripes=NULL;
+}
+
+/* sessions_pick()
+ *
+ * Says where to send a read or write of size bytes at offset: which
+ * volume, and so which server, and the forkid to use there.  Offsets are
+ * dealt out a unit at a time, so consecutive chunks of a stream go out
+ * over different sessions.
+ */
+
+struct afp_volume * sessions_pick(struct afp_volume * volume,
+	struct afp_file_info * fp, int write, uint64_t offset,
+	unsigned int size, unsigned int unit, unsigned short * forkid)
+{
+	struct afp_session_pool * pool = volume->server->sessions;
+	struct afp_fork_stripes * stripes = fp->stripes;
+	struct afp_fork_stripe * stripe;
+	struct afp_server * s;
+
+	*forkid=fp->forkid;
+
+	if ((stripes==NULL) || (unit==0))
+		return volume;
+
+	pthread_mutex_lock(&pool->mutex);
+	if ((stripes->opened==0) && (size>=(write ?
+		volume->server->tx_quantum : volume->server->rx_quantum)))
+		sessions_stripe(pool,volume,fp);
+	if (stripes->opened<=0)
+		goto unstriped;
+
+	stripe=&stripes->stripes[(offset/unit) % stripes->count];
+	s=stripe->session->server;
+
+	if ((s->connect_state!=SERVER_STATE_CONNECTED) ||
+		(size>(write ? s->tx_quantum : s->rx_quantum)))
+		goto unstriped;
+
+	if (write) {
+		stripe->session->stats.writes++;
+		stripe->session->stats.write_bytes+=size;
+	} else {
+		stripe->session->stats.reads++;
+		stripe->session->stats.read_bytes+=size;
+	}
+	*forkid=stripe->forkid;
+	volume=stripe->volume;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return volume;
+
+unstriped:
+	pthread_mutex_unlock(&pool->mutex);
+	return volume;
+}
+
+/* Adds a line for each session to the server's status */
+int sessions_status(struct afp_server * server, char * text, int len)
+{
+	struct afp_session_pool * pool = server->sessions;
+	struct afp_session * session;
+	int pos=0, i;
+
+	if (pool==NULL) return 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (i=0;i<pool->count;i++) {
+		session=&pool->sessions[i];
+		pos+=snprintf(text+pos,len-pos,
+			"    session %d: %s, %llu forks, "
+			"%llu reads (%llu bytes), %llu writes (%llu bytes), "
+			"transfer %llu(rx) %llu(tx)\n",
+			i+1,
+			(session->server->connect_state==
+				SERVER_STATE_CONNECTED) ?
+				"active" : "disconnected",
+			(unsigned long long) session->stats.forks,
+			(unsigned long long) session->stats.reads,
+			(unsigned long long) session->stats.read_bytes,
+			(unsigned long long) session->stats.writes,
+			(unsigned long long) session->stats.write_bytes,
+			(unsigned long long) session->server->stats.rx_bytes,
+			(unsigned long long) session->server->stats.tx_bytes);
+		if (pos>=len) {
+			pos=len;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return pos;
+}
@@ -0,0 +1,15 @@
+#ifndef __SESSIONS_H_
+#define __SESSIONS_H_
+
+#include <stdint.h>
+#include "afpfs-ng/afp.h"
+
+void sessions_open_fork(struct afp_volume * volume,
+	struct afp_file_info * fp, unsigned char aflags);
+void sessions_close_fork(struct afp_file_info * fp);
+struct afp_volume * sessions_pick(struct afp_volume * volume,
+	struct afp_file_info * fp, int write, uint64_t offset,
+	unsigned int size, unsigned int unit, unsigned short * forkid);
+int sessions_status(struct afp_server * server, char * text, int len);
+
+#endif
@@ -3,6 +3,8 @@
 #include "afpfs-ng/map_def.h"
 #include "afpfs-ng/dsi.h"
 #include "afpfs-ng/afp.h"
+#include "sessions.h"
+#include "cmdstats.h"
 
 int afp_status_header(char * text, int * len) 
 {
@@ -35,13 +37,21 @@ static void print_volume_status(struct afp_volume * v,
 
 	if (v->mounted==AFP_VOLUME_MOUNTED) {
 		pos+=snprintf(text+pos,*len-pos,
-		"        did cache stats: %llu miss, %llu hit, %llu expired, %llu force removal\n        uid/gid mapping: %s (%d/%d)\n",
-		v->did_cache_stats.misses, v->did_cache_stats.hits,
-		v->did_cache_stats.expired, 
-		v->did_cache_stats.force_removed,
+		"        did cache stats: %llu miss, %llu hit, %llu negative hit, %llu expired, %llu evicted, %llu force removal\n        uid/gid mapping: %s (%d/%d)\n",
+		(unsigned long long) v->did_cache_stats.misses,
+		(unsigned long long) v->did_cache_stats.hits,
+		(unsigned long long) v->did_cache_stats.negative_hits,
+		(unsigned long long) v->did_cache_stats.expired, 
+		(unsigned long long) v->did_cache_stats.evicted,
+		(unsigned long long) v->did_cache_stats.force_removed,
 		get_mapping_name(v),
 		s->server_uid,s->server_gid);
 		pos+=snprintf(text+pos,*len-pos,
+		"        attribute cache stats: %llu miss, %llu hit, %llu expired\n",
+		(unsigned long long) v->attr_cache_stats.misses,
+		(unsigned long long) v->attr_cache_stats.hits,
+		(unsigned long long) v->attr_cache_stats.expired);
+		pos+=snprintf(text+pos,*len-pos,
 		"        Unix permissions: %s",
 			(v->extra_flags&VOLUME_EXTRA_FLAGS_VOL_SUPPORTS_UNIX)?
 				"Yes":"No");
@@ -151,9 +161,11 @@ int afp_status_server(struct afp_server * s, char * text, int * len)
 	signature_string,
 	s->tx_delay,
 	s->tx_quantum, s->rx_quantum,
-	s->lastrequestid,s->stats.requests_pending);
+	s->lastrequestid,(unsigned long long) s->stats.requests_pending);
 
-	for (request=s->command_requests;request;request=request->next) {
+	for (j=0;j<DSI_MAX_REQUESTS;j++) {
+		request=&s->request_table[j];
+		if (!request->in_use) continue;
 		pos+=snprintf(text+pos,*len-pos,
 			"         request %d, %s\n",
 			request->requestid, afp_get_command_name(request->subcommand)); 
@@ -161,9 +173,18 @@ int afp_status_server(struct afp_server * s, char * text, int * len)
 
 	pos+=snprintf(text+pos,*len-pos,
 		"    transfer: %llu(rx) %llu(tx)\n"
-		"    runt packets: %llu\n",
-	s->stats.rx_bytes,s->stats.tx_bytes,
-	s->stats.runt_packets);
+		"    runt packets: %llu\n"
+		"    read-ahead: %llu hits, %llu misses\n",
+	(unsigned long long) s->stats.rx_bytes,
+	(unsigned long long) s->stats.tx_bytes,
+	(unsigned long long) s->stats.runt_packets,
+	(unsigned long long) s->stats.readahead_hits,
+	(unsigned long long) s->stats.readahead_misses);
+
+	if (pos<*len)
+		pos+=sessions_status(s,text+pos,*len-pos);
+	if (pos<*len)
+		pos+=cmdstats_status(s,text+pos,*len-pos);
 
 	if (*len==0) goto out;
 
@@ -18,6 +18,8 @@
  * char *UCS2toUTF8()   Convert UCS2/UNICODE string to UTF8
  *
  * int UCS2precompose() Canonically combine two UCS2 characters
+ * unsigned int unicode_compose()  Canonically combine two characters
+ * int unicode_decompose()  Fully decompose a character
  *
  * Copyright (c) Roland Krause 2002, roland_krause@freenet.de
  * Copyright (c) Michael Ulbrich 2007, mul@rentapacs.de
@@ -180,8 +182,7 @@ extern char *UCS2toUTF8(
 
 /*      Function Name:  UCS2precompose
  *      Description:    Canonically combine two UCS2 characters, if matching
- *                      pattern is found in table. Uniform binary search
- *                      algorithm from D. Knuth TAOCP Vol.3 p.414.
+ *                      pattern is found in table.
  *      Arguments:      first   - the first UCS2 character
  *                      second  - the second UCS2 character
  *      Returns:        Canonical composition of first and second or
@@ -194,5 +195,28 @@ extern int UCS2precompose(
 #endif
 );
 
+/* The longest full decomposition of a character */
+#define UNICODE_MAX_DECOMPOSITION 4
+
+/*      Function Name:  unicode_compose
+ *      Description:    Canonically combine two characters, looking them
+ *                      up in the hashed composition table.
+ *      Arguments:      first   - the first character
+ *                      second  - the second character
+ *      Returns:        Canonical composition of first and second or
+ *                      0 if they don't combine.
+ */
+extern unsigned int unicode_compose(unsigned int first, unsigned int second);
+
+/*      Function Name:  unicode_decompose
+ *      Description:    Full canonical decomposition of a character, that
+ *                      is the inverse of repeated unicode_compose().
+ *      Arguments:      c       - the character
+ *                      out     - UNICODE_MAX_DECOMPOSITION characters
+ *      Returns:        The number of characters stored in out, which is
+ *                      1 (c itself) if c doesn't decompose.
+ */
+extern int unicode_decompose(unsigned int c, unsigned int *out);
+
 #endif
 
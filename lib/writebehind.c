@@ -0,0 +1,237 @@
+/*
+    writebehind.c: gathers adjacent writes to a fork into tx_quantum sized
+    FPWriteExt packets and keeps several of them in flight.
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    Data is copied straight into the payload of the packet it will be sent
+    in, leaving room in front for the DSI and FPWriteExt headers.  A packet
+    goes out when it is full, when the next write isn't contiguous with it,
+    or on a flush.  We only wait for replies when a slot needs reusing or
+    on a flush, so an error from the server is reported on the next write,
+    flush or close rather than by the write that caused it.
+
+    Forks opened with O_SYNC or O_DIRECT, and forks that take byte range
+    locks, are written straight through, since buffered ranges would
+    land outside the locks.
+
+    With extra sessions to the server, packets are spread over them by
+    offset, see sessions.c.  Writes on different sessions can be carried
+    out in any order, so a packet that overlaps one still pending on
+    another session waits for that one first.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/dsi.h"
+#include "afpfs-ng/utils.h"
+#include "lowlevel.h"
+#include "writebehind.h"
+#include "sessions.h"
+
+struct afp_writebehind_slot {
+	char * msg;
+	struct dsi_request * request;
+	struct afp_server * server;	/* the session it was sent on */
+	uint64_t offset;
+	unsigned int size;
+	uint64_t written;
+	int pending;
+};
+
+struct afp_writebehind {
+	pthread_mutex_t mutex;
+	struct afp_volume * volume;
+	struct afp_file_info * fp;
+	unsigned int window;
+	unsigned int quantum;
+	unsigned int current;	/* the slot being filled */
+	uint64_t offset;	/* where the current slot's data goes */
+	unsigned int size;	/* how much is in the current slot */
+	int error;		/* reported on the next write or flush */
+	struct afp_writebehind_slot slots[AFP_MAX_WRITEBEHIND_WINDOW];
+};
+
+int writebehind_open(struct afp_volume * volume, struct afp_file_info * fp)
+{
+	struct afp_writebehind * wb;
+
+	if ((volume->writebehind_window==0) ||
+		(volume->server->using_version->av_number < 30) ||
+		(volume->server->tx_quantum==0))
+		return 0;
+
+	if ((fp->sync) || (fp->locks))
+		return 0;
+
+	if ((wb=malloc(sizeof(*wb)))==NULL)
+		return -1;
+	memset(wb,0,sizeof(*wb));
+	pthread_mutex_init(&wb->mutex,NULL);
+	wb->volume=volume;
+	wb->fp=fp;
+	wb->window=min(volume->writebehind_window,AFP_MAX_WRITEBEHIND_WINDOW);
+	wb->quantum=volume->server->tx_quantum;
+	fp->writebehind=wb;
+	return 0;
+}
+
+/* Waits for the reply to a packet.  Must be called with wb->mutex held. */
+static void writebehind_reap(struct afp_writebehind * wb,
+	struct afp_writebehind_slot * slot)
+{
+	int rc;
+
+	if (!slot->pending) return;
+
+	rc=dsi_wait_request(slot->server,slot->request);
+	slot->request=NULL;
+	slot->pending=0;
+	if ((rc!=kFPNoErr) && (wb->error==0))
+		wb->error=ll_write_errno(rc);
+}
+
+/* Sends whatever is in the current slot and moves on to the next one */
+static void writebehind_send(struct afp_writebehind * wb)
+{
+	struct afp_writebehind_slot * slot = &wb->slots[wb->current];
+	struct afp_writebehind_slot * other;
+	struct afp_volume * v;
+	unsigned short forkid;
+	int i;
+
+	if (wb->size==0) return;
+
+	v=sessions_pick(wb->volume,wb->fp,1,wb->offset,wb->size,
+		wb->quantum,&forkid);
+
+	for (i=0;i<wb->window;i++) {
+		other=&wb->slots[i];
+		if ((other->pending) && (other->server!=v->server) &&
+			(other->offset<wb->offset+wb->size) &&
+			(wb->offset<other->offset+other->size))
+			writebehind_reap(wb,other);
+	}
+
+	slot->server=v->server;
+	slot->offset=wb->offset;
+	slot->size=wb->size;
+	if ((slot->request=afp_writeext_async(v,forkid,
+		wb->offset,wb->size,slot->msg,&slot->written))==NULL) {
+		if (wb->error==0) wb->error=EIO;
+	} else
+		slot->pending=1;
+
+	wb->current=(wb->current+1) % wb->window;
+	wb->size=0;
+}
+
+int writebehind_write(struct afp_file_info * fp,
+	const char * data, size_t size, off_t offset)
+{
+	struct afp_writebehind * wb = fp->writebehind;
+	struct afp_writebehind_slot * slot;
+	size_t done=0, amount;
+	int ret=0;
+
+	pthread_mutex_lock(&wb->mutex);
+
+	if (wb->error) goto error;
+
+	while (done<size) {
+		if ((wb->size) && (offset+done!=wb->offset+wb->size))
+			writebehind_send(wb);
+
+		slot=&wb->slots[wb->current];
+		if (wb->size==0) {
+			writebehind_reap(wb,slot);
+			if (wb->error) goto error;
+			if ((slot->msg==NULL) && ((slot->msg=
+				malloc(AFP_WRITEEXT_HEADER_LEN+wb->quantum))==NULL)) {
+				wb->error=ENOMEM;
+				goto error;
+			}
+			wb->offset=offset+done;
+		}
+
+		amount=min(wb->quantum-wb->size,size-done);
+		memcpy(slot->msg+AFP_WRITEEXT_HEADER_LEN+wb->size,
+			data+done,amount);
+		wb->size+=amount;
+		done+=amount;
+
+		if (wb->size==wb->quantum)
+			writebehind_send(wb);
+	}
+
+	pthread_mutex_unlock(&wb->mutex);
+	return 0;
+
+error:
+	ret=wb->error;
+	wb->error=0;
+	pthread_mutex_unlock(&wb->mutex);
+	return -ret;
+}
+
+/* Pushes out everything and waits for all the replies.  Must be called
+ * with wb->mutex held. */
+static void writebehind_drain(struct afp_writebehind * wb)
+{
+	int i;
+
+	writebehind_send(wb);
+	for (i=0;i<wb->window;i++)
+		writebehind_reap(wb,&wb->slots[i]);
+}
+
+/* Like writebehind_flush(), but any error is left to be reported to the
+ * fork's own next write, flush or close. */
+void writebehind_sync(struct afp_file_info * fp)
+{
+	struct afp_writebehind * wb = fp->writebehind;
+
+	if (wb==NULL) return;
+
+	pthread_mutex_lock(&wb->mutex);
+	writebehind_drain(wb);
+	pthread_mutex_unlock(&wb->mutex);
+}
+
+/* Pushes out everything and waits for all the replies.  Returns the first
+ * error seen since the last time one was reported. */
+int writebehind_flush(struct afp_file_info * fp)
+{
+	struct afp_writebehind * wb = fp->writebehind;
+	int ret;
+
+	if (wb==NULL) return 0;
+
+	pthread_mutex_lock(&wb->mutex);
+	writebehind_drain(wb);
+	ret=wb->error;
+	wb->error=0;
+	pthread_mutex_unlock(&wb->mutex);
+
+	return -ret;
+}
+
+void writebehind_free(struct afp_file_info * fp)
+{
+	struct afp_writebehind * wb = fp->writebehind;
+	int i;
+
+	if (wb==NULL) return;
+
+	writebehind_flush(fp);
+	for (i=0;i<wb->window;i++)
+		if (wb->slots[i].msg) free(wb->slots[i].msg);
+	pthread_mutex_destroy(&wb->mutex);
+	free(wb);
+	fp->writebehind=NULL;
+}
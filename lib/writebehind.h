@@ -0,0 +1,14 @@
+#ifndef __WRITEBEHIND_H_
+#define __WRITEBEHIND_H_
+
+#include <sys/types.h>
+#include "afpfs-ng/afp.h"
+
+int writebehind_open(struct afp_volume * volume, struct afp_file_info * fp);
+int writebehind_write(struct afp_file_info * fp,
+	const char * data, size_t size, off_t offset);
+int writebehind_flush(struct afp_file_info * fp);
+void writebehind_sync(struct afp_file_info * fp);
+void writebehind_free(struct afp_file_info * fp);
+
+#endif
@@ -0,0 +1,778 @@
+/*
+    afp_bench.c: times the midlevel calls against a server, usually
+    mock_afpd on the loopback.
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    Usage: afp_bench [-i iterations] [-s size] [-r blocksize] [-n files]
+		[-S sessions] [-R readahead] [-W writebehind] [-C] [-L] [-P]
+		[-t tests] [url]
+
+    The url defaults to afp://localhost:10548/bench, which is what
+    mock_afpd serves.  The tests, all run unless -t lists some of them
+    separated by commas, are:
+
+	stat	stat each entry of /files, -i times over
+	lookup	the same by the directory ID of /files and the name, as
+		mount_afp -o inodes does
+	readdir	list /files, -i times
+	stream	read /files one batch at a time, -i times; the latency is
+		to the first entry
+	search	find the entries named file0001-something with a catalog
+		search, -i times
+	write	write -s bytes to /afp_bench.dat in -r byte blocks
+	read	read /afp_bench.dat back in -r byte blocks and check it
+	copy	copy /afp_bench.dat to /afp_bench.copy, on the server if it
+		can, then check and delete the copy
+	create	create, write -r bytes to and delete -n small files in
+		/afp_bench.dir
+	truncate write -r bytes to /afp_bench.trunc, check its size,
+		truncate it while still open and check it is empty after
+		the close, -i times
+
+    Each prints the operations a second and the median and 99th
+    percentile latency of one operation; write and read also the
+    throughput.  -C turns off the attribute and directory ID caches, so
+    every stat goes to the server.  -L has forks opened with the deny
+    modes taken as byte range locks, as mount_afp does.  -P prints the
+    server's status at the end, with the calls and latency of each AFP
+    command.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/midlevel.h"
+#include "afpfs-ng/map_def.h"
+
+#define DEFAULT_URL "afp://localhost:10548/bench"
+#define BENCH_FILE "/afp_bench.dat"
+#define BENCH_DIR "/afp_bench.dir"
+#define BENCH_COPY "/afp_bench.copy"
+#define BENCH_TRUNC "/afp_bench.trunc"
+
+static struct afp_volume * vol;
+static int verbose;
+
+static pthread_mutex_t started_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t started_cond = PTHREAD_COND_INITIALIZER;
+static int started;
+
+static unsigned int iterations=10, files=200;
+static unsigned long long size=64*1024*1024;
+static unsigned int blocksize=128*1024;
+
+struct timings {
+	double * samples;
+	unsigned int count, max;
+	double start;
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static void bench_log_for_client(void * priv,
+	enum loglevels loglevel, int logtype, const char *message)
+{
+	if ((verbose) || (loglevel<=LOG_ERR))
+		printf("%s",message);
+}
+
+static void bench_loop_started(void)
+{
+	pthread_mutex_lock(&started_mutex);
+	started=1;
+	pthread_cond_signal(&started_cond);
+	pthread_mutex_unlock(&started_mutex);
+}
+
+static struct libafpclient bench_client = {
+	.unmount_volume = NULL,
+	.log_for_client = bench_log_for_client,
+	.forced_ending_hook = NULL,
+	.scan_extra_fds = NULL,
+	.loop_started = bench_loop_started,
+};
+
+static void timings_start(struct timings * t)
+{
+	memset(t,0,sizeof(*t));
+	t->start=now();
+}
+
+/* Records one operation that started at op */
+static void timings_add(struct timings * t, double op)
+{
+	if (t->count==t->max) {
+		t->max=t->max ? t->max*2 : 1024;
+		if ((t->samples=realloc(t->samples,
+			t->max*sizeof(double)))==NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	t->samples[t->count++]=now()-op;
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x>y)-(x<y);
+}
+
+static void report(const char * what, struct timings * t,
+	unsigned long long bytes)
+{
+	double elapsed = now()-t->start;
+
+	if (t->count==0) {
+		printf("%-8s no operations\n",what);
+		return;
+	}
+	qsort(t->samples,t->count,sizeof(double),compare_doubles);
+	printf("%-8s %8u ops %10.1f ops/s  p50 %9.1f us  p99 %9.1f us",
+		what,t->count,t->count/elapsed,
+		t->samples[t->count/2]*1e6,
+		t->samples[(t->count*99)/100]*1e6);
+	if (bytes)
+		printf("  %8.1f MB/s",bytes/elapsed/1e6);
+	printf("\n");
+	free(t->samples);
+}
+
+/* The contents written to offset, so that read can check them */
+static void fill_block(char * buf, unsigned long long offset,
+	unsigned int len)
+{
+	unsigned int i;
+
+	for (i=0;i<len;i++)
+		buf[i]=((offset+i)*7+((offset+i)>>12)) & 0xff;
+}
+
+static int bench_stat(void)
+{
+	struct afp_listing * listing=NULL;
+	struct afp_dirent * e;
+	struct timings t;
+	struct stat st;
+	char path[AFP_MAX_PATH];
+	unsigned int i, cursor;
+	double op;
+	int ret;
+
+	if ((ret=ml_readdir(vol,"/files",&listing))) {
+		printf("Could not list /files: %d\n",ret);
+		return -1;
+	}
+	timings_start(&t);
+	for (i=0;i<iterations;i++) {
+		cursor=0;
+		while ((e=afp_listing_next(listing,&cursor))) {
+			snprintf(path,sizeof(path),"/files/%s",e->name);
+			op=now();
+			if ((ret=ml_getattr(vol,path,&st))) {
+				printf("Could not stat %s: %d\n",path,ret);
+				goto error;
+			}
+			timings_add(&t,op);
+		}
+	}
+	report("stat",&t,0);
+	afp_listing_free(listing);
+	return 0;
+error:
+	free(t.samples);
+	afp_listing_free(listing);
+	return -1;
+}
+
+static int bench_lookup(void)
+{
+	struct afp_listing * listing=NULL;
+	struct afp_dirent * e;
+	struct timings t;
+	struct stat st;
+	unsigned int i, cursor, dirid;
+	double op;
+	int ret;
+
+	if ((ret=ml_getattr(vol,"/files",&st)) ||
+		(ret=ml_readdir(vol,"/files",&listing))) {
+		printf("Could not list /files: %d\n",ret);
+		return -1;
+	}
+	dirid=st.st_ino;
+
+	timings_start(&t);
+	for (i=0;i<iterations;i++) {
+		cursor=0;
+		while ((e=afp_listing_next(listing,&cursor))) {
+			op=now();
+			if ((ret=ml_getattr_did(vol,dirid,e->name,&st))) {
+				printf("Could not look up %s: %d\n",
+					e->name,ret);
+				goto error;
+			}
+			timings_add(&t,op);
+		}
+	}
+	report("lookup",&t,0);
+	afp_listing_free(listing);
+	return 0;
+error:
+	free(t.samples);
+	afp_listing_free(listing);
+	return -1;
+}
+
+static int bench_readdir(void)
+{
+	struct afp_listing * listing;
+	struct timings t;
+	unsigned int i, entries=0;
+	double op;
+	int ret;
+
+	timings_start(&t);
+	for (i=0;i<iterations;i++) {
+		listing=NULL;
+		op=now();
+		if ((ret=ml_readdir(vol,"/files",&listing))) {
+			printf("Could not list /files: %d\n",ret);
+			free(t.samples);
+			return -1;
+		}
+		timings_add(&t,op);
+		entries=afp_listing_count(listing);
+		afp_listing_free(listing);
+	}
+	report("readdir",&t,0);
+	printf("         %u entries a listing\n",entries);
+	return 0;
+}
+
+static int bench_stream(void)
+{
+	struct ml_dir * dir;
+	struct afp_dirent * e;
+	struct timings t;
+	unsigned int i, entries=0;
+	double op, all=0;
+	int ret;
+
+	timings_start(&t);
+	for (i=0;i<iterations;i++) {
+		op=now();
+		if ((ret=ml_opendir(vol,"/files",&dir))) {
+			printf("Could not open /files: %d\n",ret);
+			free(t.samples);
+			return -1;
+		}
+		if ((ret=ml_readdir_entry(dir,0,&e))==1)
+			timings_add(&t,op);
+		for (entries=0;ret==1;)
+			ret=ml_readdir_entry(dir,++entries,&e);
+		ml_closedir(dir);
+		if (ret<0) {
+			printf("Could not read /files: %d\n",ret);
+			free(t.samples);
+			return -1;
+		}
+		all+=now()-op;
+	}
+	report("stream",&t,0);
+	printf("         %u entries in %.1f us a pass\n",entries,
+		all*1000000/iterations);
+	return 0;
+}
+
+static int bench_search(void)
+{
+	struct afp_catsearch_spec spec;
+	struct ml_catsearch * search;
+	struct afp_dirent * e;
+	struct timings t;
+	unsigned int i, found=0;
+	double op;
+	int ret;
+
+	memset(&spec,0,sizeof(spec));
+	spec.bitmap=kFPUTF8NameBit;
+	spec.partial=1;
+	spec.files=spec.dirs=1;
+	strcpy(spec.name,"file0001");
+
+	timings_start(&t);
+	for (i=0;i<iterations;i++) {
+		op=now();
+		if ((ret=ml_catsearch_start(vol,&spec,&search))) {
+			printf("Could not search: %d\n",ret);
+			free(t.samples);
+			return -1;
+		}
+		found=0;
+		while ((ret=ml_catsearch_next(search,&e))==1) found++;
+		ml_catsearch_end(search);
+		if (ret<0) {
+			printf("Could not search: %d\n",ret);
+			free(t.samples);
+			return -1;
+		}
+		timings_add(&t,op);
+	}
+	report("search",&t,0);
+	printf("         %u matches a search\n",found);
+	return 0;
+}
+
+static int bench_write(void)
+{
+	struct afp_file_info * fp;
+	struct timings t;
+	unsigned long long offset;
+	unsigned int len;
+	char * buf;
+	double op;
+	int ret, rc=-1;
+
+	if ((buf=malloc(blocksize))==NULL) return -1;
+
+	ml_unlink(vol,BENCH_FILE);
+	if ((ret=ml_creat(vol,BENCH_FILE,0644)) ||
+		(ret=ml_open(vol,BENCH_FILE,O_RDWR,&fp))) {
+		printf("Could not create %s: %d\n",BENCH_FILE,ret);
+		goto out;
+	}
+
+	timings_start(&t);
+	for (offset=0;offset<size;offset+=len) {
+		len=(size-offset<blocksize) ? size-offset : blocksize;
+		fill_block(buf,offset,len);
+		op=now();
+		if ((ret=ml_write(vol,BENCH_FILE,buf,len,offset,fp,
+			getuid(),getgid()))!=len) {
+			printf("Write at %llu returned %d\n",offset,ret);
+			ml_close(vol,BENCH_FILE,fp);
+			free(t.samples);
+			goto out;
+		}
+		timings_add(&t,op);
+	}
+	/* Write-behind has to finish before the time is up */
+	ret=ml_close(vol,BENCH_FILE,fp);
+	report("write",&t,size);
+	if (ret) {
+		printf("Could not close %s: %d\n",BENCH_FILE,ret);
+		goto out;
+	}
+	rc=0;
+out:
+	free(buf);
+	return rc;
+}
+
+static int bench_read(void)
+{
+	struct afp_file_info * fp;
+	struct timings t;
+	unsigned long long offset=0;
+	char * buf, * expected;
+	double op;
+	int ret, eof=0, rc=-1;
+
+	buf=malloc(blocksize);
+	expected=malloc(blocksize);
+	if ((buf==NULL) || (expected==NULL)) goto out;
+
+	if ((ret=ml_open(vol,BENCH_FILE,O_RDONLY,&fp))) {
+		printf("Could not open %s: %d\n",BENCH_FILE,ret);
+		goto out;
+	}
+
+	timings_start(&t);
+	while (offset<size) {
+		op=now();
+		ret=ml_read(vol,BENCH_FILE,buf,blocksize,offset,fp,&eof);
+		if (ret<=0) {
+			printf("Read at %llu returned %d\n",offset,ret);
+			break;
+		}
+		timings_add(&t,op);
+		fill_block(expected,offset,ret);
+		if (memcmp(buf,expected,ret)) {
+			printf("Read back the wrong data at %llu\n",offset);
+			break;
+		}
+		offset+=ret;
+	}
+	report("read",&t,offset);
+	ml_close(vol,BENCH_FILE,fp);
+	if (offset==size) rc=0;
+out:
+	free(buf);
+	free(expected);
+	return rc;
+}
+
+static int bench_copy(void)
+{
+	struct afp_file_info * fp;
+	struct timings t;
+	unsigned long long offset=0;
+	char * buf, * expected;
+	double op;
+	int ret, eof=0, rc=-1;
+
+	buf=malloc(blocksize);
+	expected=malloc(blocksize);
+	if ((buf==NULL) || (expected==NULL)) goto out;
+
+	ml_unlink(vol,BENCH_COPY);
+
+	timings_start(&t);
+	op=now();
+	if ((ret=ml_copy(vol,BENCH_FILE,BENCH_COPY))) {
+		printf("Could not copy %s: %d\n",BENCH_FILE,ret);
+		free(t.samples);
+		goto out;
+	}
+	timings_add(&t,op);
+	report("copy",&t,size);
+
+	if ((ret=ml_open(vol,BENCH_COPY,O_RDONLY,&fp))) {
+		printf("Could not open %s: %d\n",BENCH_COPY,ret);
+		goto remove;
+	}
+	while (!eof) {
+		ret=ml_read(vol,BENCH_COPY,buf,blocksize,offset,fp,&eof);
+		if (ret<=0) break;
+		fill_block(expected,offset,ret);
+		if (memcmp(buf,expected,ret)) {
+			printf("The copy is wrong at %llu\n",offset);
+			break;
+		}
+		offset+=ret;
+	}
+	ml_close(vol,BENCH_COPY,fp);
+	free(fp);
+	if (offset==size)
+		rc=0;
+	else
+		printf("The copy has %llu bytes, not %llu\n",offset,size);
+remove:
+	ml_unlink(vol,BENCH_COPY);
+out:
+	free(buf);
+	free(expected);
+	return rc;
+}
+
+static int bench_create(void)
+{
+	struct afp_file_info * fp;
+	struct timings t;
+	char path[AFP_MAX_PATH];
+	char * buf;
+	unsigned int i, made=0;
+	double op;
+	int ret, rc=-1;
+
+	if ((buf=malloc(blocksize))==NULL) return -1;
+	fill_block(buf,0,blocksize);
+
+	ml_mkdir(vol,BENCH_DIR,0755);
+
+	timings_start(&t);
+	for (i=0;i<files;i++) {
+		snprintf(path,sizeof(path),BENCH_DIR "/small%05u",i);
+		op=now();
+		if ((ret=ml_creat(vol,path,0644)) ||
+			(ret=ml_open(vol,path,O_WRONLY,&fp))) {
+			printf("Could not create %s: %d\n",path,ret);
+			goto out;
+		}
+		made++;
+		ret=ml_write(vol,path,buf,blocksize,0,fp,getuid(),getgid());
+		if ((ml_close(vol,path,fp)) || (ret!=blocksize)) {
+			printf("Could not write %s: %d\n",path,ret);
+			goto out;
+		}
+		timings_add(&t,op);
+	}
+	report("create",&t,(unsigned long long) files*blocksize);
+	rc=0;
+
+out:
+	for (i=0;i<made;i++) {
+		snprintf(path,sizeof(path),BENCH_DIR "/small%05u",i);
+		ml_unlink(vol,path);
+	}
+	ml_rmdir(vol,BENCH_DIR);
+	if (rc) free(t.samples);
+	free(buf);
+	return rc;
+}
+
+/* Buffered writes must show in the size, even after a listing has
+ * seeded the attribute cache, and must not land after a truncate done
+ * while the file is still open. */
+static int bench_truncate(void)
+{
+	struct afp_file_info * fp;
+	struct afp_listing * listing;
+	struct timings t;
+	struct stat stbuf;
+	char * buf;
+	unsigned int i;
+	double op;
+	int ret, rc=-1;
+
+	if ((buf=malloc(blocksize))==NULL) return -1;
+	fill_block(buf,0,blocksize);
+
+	timings_start(&t);
+	for (i=0;i<iterations;i++) {
+		ml_unlink(vol,BENCH_TRUNC);
+		op=now();
+		if ((ret=ml_creat(vol,BENCH_TRUNC,0644)) ||
+			(ret=ml_open(vol,BENCH_TRUNC,O_WRONLY,&fp))) {
+			printf("Could not create %s: %d\n",BENCH_TRUNC,ret);
+			goto out;
+		}
+		ret=ml_write(vol,BENCH_TRUNC,buf,blocksize,0,fp,
+			getuid(),getgid());
+		if (ret!=blocksize) {
+			printf("Could not write %s: %d\n",BENCH_TRUNC,ret);
+			ml_close(vol,BENCH_TRUNC,fp);
+			goto out;
+		}
+		listing=NULL;
+		ml_readdir(vol,"/",&listing);
+		afp_listing_free(listing);
+		if ((ret=ml_getattr(vol,BENCH_TRUNC,&stbuf)) ||
+			(stbuf.st_size!=blocksize)) {
+			printf("%s has %lld bytes, not %u\n",BENCH_TRUNC,
+				(long long) stbuf.st_size,blocksize);
+			ml_close(vol,BENCH_TRUNC,fp);
+			goto out;
+		}
+		ret=ml_truncate(vol,BENCH_TRUNC,0);
+		if ((ml_close(vol,BENCH_TRUNC,fp)) || (ret)) {
+			printf("Could not truncate %s: %d\n",BENCH_TRUNC,ret);
+			goto out;
+		}
+		free(fp);
+		if ((ret=ml_getattr(vol,BENCH_TRUNC,&stbuf)) ||
+			(stbuf.st_size!=0)) {
+			printf("%s has %lld bytes after the truncate\n",
+				BENCH_TRUNC,(long long) stbuf.st_size);
+			goto out;
+		}
+		timings_add(&t,op);
+	}
+	report("truncate",&t,0);
+	rc=0;
+
+out:
+	ml_unlink(vol,BENCH_TRUNC);
+	if (rc) free(t.samples);
+	free(buf);
+	return rc;
+}
+
+static struct {
+	const char * name;
+	int (*run)(void);
+} tests[] = {
+	{ "stat", bench_stat },
+	{ "lookup", bench_lookup },
+	{ "readdir", bench_readdir },
+	{ "stream", bench_stream },
+	{ "search", bench_search },
+	{ "write", bench_write },
+	{ "read", bench_read },
+	{ "copy", bench_copy },
+	{ "create", bench_create },
+	{ "truncate", bench_truncate },
+};
+
+#define NUM_TESTS (sizeof(tests)/sizeof(tests[0]))
+
+static int wanted(const char * list, const char * name)
+{
+	const char * p = list;
+	unsigned int len = strlen(name);
+
+	if (list==NULL) return 1;
+	while ((p=strstr(p,name))) {
+		if (((p==list) || (p[-1]==',')) &&
+			((p[len]=='\0') || (p[len]==',')))
+			return 1;
+		p+=len;
+	}
+	return 0;
+}
+
+static struct afp_server * connect_server(struct afp_url * url)
+{
+	struct afp_connection_request req;
+
+	memset(&req,0,sizeof(req));
+	req.url=*url;
+	req.url.requested_version=31;
+	req.uam_mask=default_uams_mask();
+
+	return afp_server_full_connect(NULL,&req);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,"Usage: afp_bench [-i iterations] [-s size] "
+		"[-r blocksize] [-n files]\n"
+		"                 [-S sessions] [-R readahead] "
+		"[-W writebehind] [-C] [-L] [-P] [-t tests] [url]\n");
+}
+
+int main(int argc, char ** argv)
+{
+	struct afp_server * server;
+	struct afp_url url;
+	char mesg[1024];
+	unsigned int len=0, i;
+	const char * url_string=DEFAULT_URL, * list=NULL;
+	int sessions=0, readahead=-1, writebehind=-1, nocache=0, locking=0;
+	int print_status=0;
+	int c, failed=0;
+
+	while ((c=getopt(argc,argv,"i:s:r:n:S:R:W:CLPt:vh"))!=-1) {
+		switch (c) {
+		case 'i':
+			iterations=strtoul(optarg,NULL,0);
+			break;
+		case 's':
+			size=strtoull(optarg,NULL,0);
+			break;
+		case 'r':
+			blocksize=strtoul(optarg,NULL,0);
+			break;
+		case 'n':
+			files=strtoul(optarg,NULL,0);
+			break;
+		case 'S':
+			sessions=strtol(optarg,NULL,0);
+			break;
+		case 'R':
+			readahead=strtol(optarg,NULL,0);
+			break;
+		case 'W':
+			writebehind=strtol(optarg,NULL,0);
+			break;
+		case 'C':
+			nocache=1;
+			break;
+		case 'L':
+			locking=1;
+			break;
+		case 'P':
+			print_status=1;
+			break;
+		case 't':
+			list=optarg;
+			break;
+		case 'v':
+			verbose=1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind<argc) url_string=argv[optind];
+	if ((blocksize==0) || (iterations==0)) {
+		usage();
+		return 1;
+	}
+
+	libafpclient_register(&bench_client);
+	if (init_uams()<0) return 1;
+
+	afp_default_url(&url);
+	if (afp_parse_url(&url,url_string,0)) {
+		printf("Could not parse %s\n",url_string);
+		return 1;
+	}
+	if (strlen(url.volumename)==0) {
+		printf("No volume in %s\n",url_string);
+		return 1;
+	}
+
+	afp_main_quick_startup(NULL);
+	pthread_mutex_lock(&started_mutex);
+	while (!started)
+		pthread_cond_wait(&started_cond,&started_mutex);
+	pthread_mutex_unlock(&started_mutex);
+
+	if ((server=connect_server(&url))==NULL) {
+		printf("Could not connect to %s\n",url_string);
+		return 1;
+	}
+	if ((sessions) && (afp_sessions_start(server,sessions)<sessions))
+		printf("Could not open %d extra sessions\n",sessions);
+
+	if ((vol=find_volume_by_name(server,url.volumename))==NULL) {
+		printf("No volume %s\n",url.volumename);
+		return 1;
+	}
+	vol->mapping=AFP_MAPPING_LOGINIDS;
+	if (!locking)
+		vol->extra_flags|=VOLUME_EXTRA_FLAGS_NO_LOCKING;
+	if (afp_connect_volume(vol,server,mesg,&len,sizeof(mesg))) {
+		printf("Could not mount %s\n",url.volumename);
+		return 1;
+	}
+	if (readahead>=0) vol->readahead_window=readahead;
+	if (writebehind>=0) vol->writebehind_window=writebehind;
+	if (nocache) {
+		vol->attr_cache_timeout=0;
+		vol->did_cache_timeout=0;
+	}
+
+	printf("%s on %s, readahead %u, writebehind %u, "
+		"%d extra sessions%s%s\n",
+		vol->volume_name_printable,server->server_name_printable,
+		vol->readahead_window,vol->writebehind_window,sessions,
+		nocache ? ", no caches" : "",locking ? ", locking" : "");
+
+	for (i=0;i<NUM_TESTS;i++)
+		if ((wanted(list,tests[i].name)) && (tests[i].run()))
+			failed++;
+
+	if (wanted(list,"write"))
+		ml_unlink(vol,BENCH_FILE);
+
+	if (print_status) {
+		char status[16384];
+		int status_len=sizeof(status);
+
+		afp_status_server(server,status,&status_len);
+		printf("\n%s",status);
+	}
+	afp_unmount_volume(vol);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,157 @@
+/*
+    codepage_bench.c: times the conversion of file names between the
+    precomposed UTF8 we hand to applications and the decomposed UTF8
+    that AFP servers use.
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    Usage: codepage_bench [-n iterations] [names file...]
+
+    Each file has one name per line, in precomposed form as it would
+    come from an application.  Every name is decomposed and composed
+    again, and is checked to come back unchanged.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "afpfs-ng/codepage.h"
+
+#define MAX_NAME 1024
+
+struct name {
+	char pre[MAX_NAME];
+	char dec[MAX_NAME];
+	int pre_len, dec_len;
+};
+
+static struct name * names;
+static int num_names, max_names;
+
+static int load_names(const char * filename)
+{
+	FILE * f;
+	char line[MAX_NAME];
+	struct name * n;
+	int len;
+
+	if ((f=fopen(filename,"r"))==NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	while (fgets(line,MAX_NAME,f)) {
+		len=strlen(line);
+		if ((len>0) && (line[len-1]=='\n')) line[--len]='\0';
+		if (len==0) continue;
+
+		if (num_names==max_names) {
+			max_names=max_names ? max_names*2 : 256;
+			if ((names=realloc(names,
+				max_names*sizeof(*names)))==NULL) {
+				fclose(f);
+				return -1;
+			}
+		}
+		n=&names[num_names++];
+		memcpy(n->pre,line,len+1);
+		n->pre_len=len;
+	}
+	fclose(f);
+	return 0;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static void report(const char * what, double elapsed, unsigned long count,
+	unsigned long bytes)
+{
+	printf("%-24s %8.1f ns/name %8.1f MB/s\n",what,
+		elapsed*1e9/count,bytes/elapsed/1e6);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,"Usage: codepage_bench [-n iterations] "
+		"[names file...]\n");
+}
+
+int main(int argc, char ** argv)
+{
+	char buf[MAX_NAME];
+	unsigned long iterations=20000, count, bytes_pre=0, bytes_dec=0;
+	unsigned long i, nonascii=0;
+	double start;
+	int c, j, failed=0;
+
+	while ((c=getopt(argc,argv,"n:h"))!=-1) {
+		switch (c) {
+		case 'n':
+			iterations=strtoul(optarg,NULL,0);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind==argc) {
+		if (load_names("filenames.txt")) return 1;
+	} else
+		for (j=optind;j<argc;j++)
+			if (load_names(argv[j])) return 1;
+
+	if ((num_names==0) || (iterations==0)) {
+		usage();
+		return 1;
+	}
+
+	for (j=0;j<num_names;j++) {
+		struct name * n = &names[j];
+
+		n->dec_len=convert_utf8pre_to_utf8dec(n->pre,n->pre_len,
+			n->dec,MAX_NAME);
+		if ((n->dec_len<0) || (convert_utf8dec_to_utf8pre(n->dec,
+			n->dec_len,buf,MAX_NAME)<0) || (strcmp(buf,n->pre))) {
+			printf("Round trip failed for %s\n",n->pre);
+			failed++;
+		}
+		if (n->dec_len!=n->pre_len) nonascii++;
+		bytes_pre+=n->pre_len;
+		bytes_dec+=n->dec_len;
+	}
+
+	printf("%d names, %lu change when decomposed, %lu iterations\n",
+		num_names,nonascii,iterations);
+
+	count=iterations*num_names;
+
+	start=now();
+	for (i=0;i<iterations;i++)
+		for (j=0;j<num_names;j++)
+			convert_utf8pre_to_utf8dec(names[j].pre,
+				names[j].pre_len,buf,MAX_NAME);
+	report("precomposed->decomposed",now()-start,count,
+		bytes_pre*iterations);
+
+	start=now();
+	for (i=0;i<iterations;i++)
+		for (j=0;j<num_names;j++)
+			convert_utf8dec_to_utf8pre(names[j].dec,
+				names[j].dec_len,buf,MAX_NAME);
+	report("decomposed->precomposed",now()-start,count,
+		bytes_dec*iterations);
+
+	free(names);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,1720 @@
+/*
+    mock_afpd.c: a stand-in AFP server on the loopback, serving a made up
+    volume, so that the client can be measured without a Mac around.
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    Usage: mock_afpd [-a address] [-p port] [-l latency] [-b bandwidth]
+		[-q quantum] [-n files] [-f filesize] [-B bigsize] [-F] [-v]
+
+    There is one volume, "bench", holding a directory "files" of -n made
+    up files of -f bytes each and a file "big" of -B bytes.  Made up files
+    read back as a fixed pattern; anything written is kept in memory, so
+    new files can be created, written, read back and deleted.
+
+    It does DSI and just enough AFP 3.x for libafpclient's midlevel calls:
+    logging in without a password or with a clear text one, FPOpenVol,
+    FPGetFileDirParms, FPEnumerateExt2, FPCatSearchExt, FPCreateFile,
+    FPCreateDir, FPDelete, FPCopyFile, FPOpenFork, FPReadExt, FPWriteExt,
+    FPByteRangeLockExt and the calls around them.  Anything else gets
+    kFPCallNotSupported, as does FPCopyFile with -F.
+
+    Every reply goes out -l microseconds after its request came in, and
+    each direction of a connection is held to -b kilobytes a second, so
+    pipelined requests overlap their latency as they would on a real
+    network.  -q is the most the server takes in one FPWriteExt and sends
+    in one FPReadExt reply.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "afpfs-ng/afp_protocol.h"
+
+#define DSI_REQUEST 0x0
+#define DSI_REPLY 0x1
+
+#define DSI_DSICloseSession 1
+#define DSI_DSICommand 2
+#define DSI_DSIGetStatus 3
+#define DSI_DSIOpenSession 4
+#define DSI_DSITickle 5
+#define DSI_DSIWrite 6
+
+#define DSI_HEADER_LEN 16
+
+#define AD_DATE_DELTA 946684800
+
+#define MOCK_VOLUME_ID 1
+#define MOCK_MAX_FORKS 256
+#define MOCK_HASH_SIZE 4096
+#define MOCK_PATTERN_LEN 65536
+
+struct node {
+	unsigned int id;
+	unsigned int parent;
+	char name[256];
+	unsigned int namelen;
+	int isdir;
+	time_t ctime, mtime;
+	unsigned int mode;
+	uint64_t size;
+	char * data;		/* NULL while the contents are made up */
+	unsigned int opened;
+	unsigned int * children;
+	unsigned int count, max;
+	struct node * hash_next;
+};
+
+struct range_lock {
+	unsigned int id;
+	void * owner;
+	uint64_t start, end;
+	struct range_lock * next;
+};
+
+struct fork {
+	unsigned int id;	/* zero if the slot is free */
+	int resource;
+	unsigned short access;
+};
+
+struct reply {
+	struct timeval due;
+	char * buf;
+	unsigned int len;
+	int close;
+	struct reply * next;
+};
+
+struct pacer {
+	struct timeval next;
+};
+
+struct conn {
+	int fd;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct reply * head, * tail;
+	int done;
+	struct pacer in, out;
+	struct fork forks[MOCK_MAX_FORKS];
+};
+
+struct msg {
+	char * buf;
+	unsigned int len, max;
+};
+
+static unsigned int latency;		/* microseconds */
+static unsigned int bandwidth;		/* bytes a second, 0 for no limit */
+static unsigned int quantum = 1024*1024;
+static int verbose;
+static int copyfile = 1;
+
+static pthread_mutex_t tree_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct node ** nodes;
+static unsigned int num_nodes;
+static struct node * hash[MOCK_HASH_SIZE];
+static struct range_lock * range_locks;
+static unsigned char pattern[MOCK_PATTERN_LEN];
+static time_t start_time;
+
+/* Building replies */
+
+static char * msg_add(struct msg * m, unsigned int len)
+{
+	char * p;
+
+	if (m->len+len>m->max) {
+		unsigned int max = m->max ? m->max : 1024;
+
+		while (max<m->len+len) max*=2;
+		if ((p=realloc(m->buf,max))==NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		m->buf=p;
+		m->max=max;
+	}
+	p=m->buf+m->len;
+	memset(p,0,len);
+	m->len+=len;
+	return p;
+}
+
+static void put8(struct msg * m, uint8_t v)
+{
+	*msg_add(m,1)=v;
+}
+
+static void put16(struct msg * m, uint16_t v)
+{
+	v=htons(v);
+	memcpy(msg_add(m,2),&v,2);
+}
+
+static void put32(struct msg * m, uint32_t v)
+{
+	v=htonl(v);
+	memcpy(msg_add(m,4),&v,4);
+}
+
+static void put64(struct msg * m, uint64_t v)
+{
+	put32(m,v>>32);
+	put32(m,v&0xffffffff);
+}
+
+static void put_pascal(struct msg * m, const char * s, unsigned int len)
+{
+	if (len>255) len=255;
+	put8(m,len);
+	memcpy(msg_add(m,len),s,len);
+}
+
+static void patch16(struct msg * m, unsigned int pos, uint16_t v)
+{
+	v=htons(v);
+	memcpy(m->buf+pos,&v,2);
+}
+
+static void patch32(struct msg * m, unsigned int pos, uint32_t v)
+{
+	v=htonl(v);
+	memcpy(m->buf+pos,&v,4);
+}
+
+/* Reading requests */
+
+static uint16_t get16(const unsigned char * p)
+{
+	return (p[0]<<8)|p[1];
+}
+
+static uint32_t get32(const unsigned char * p)
+{
+	return ((uint32_t) p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+}
+
+static uint64_t get64(const unsigned char * p)
+{
+	return ((uint64_t) get32(p)<<32)|get32(p+4);
+}
+
+static uint32_t afp_date(time_t t)
+{
+	return (uint32_t) (t-AD_DATE_DELTA);
+}
+
+/* The volume */
+
+static unsigned int hash_name(unsigned int parent, const char * name,
+	unsigned int len)
+{
+	unsigned int h = parent*31;
+
+	while (len--) h=h*33+(unsigned char) *name++;
+	return h % MOCK_HASH_SIZE;
+}
+
+static struct node * find_child(struct node * dir, const char * name,
+	unsigned int len)
+{
+	struct node * n;
+
+	for (n=hash[hash_name(dir->id,name,len)];n;n=n->hash_next)
+		if ((n->parent==dir->id) && (n->namelen==len) &&
+			(memcmp(n->name,name,len)==0))
+			return n;
+	return NULL;
+}
+
+static struct node * add_node(struct node * dir, const char * name,
+	unsigned int len, int isdir)
+{
+	struct node * n;
+	unsigned int h;
+
+	if ((n=calloc(1,sizeof(*n)))==NULL) return NULL;
+	if (len>sizeof(n->name)-1) len=sizeof(n->name)-1;
+
+	if ((num_nodes & (num_nodes-1))==0) {
+		nodes=realloc(nodes,(num_nodes ? num_nodes*2 : 1)*
+			sizeof(*nodes));
+		if (nodes==NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	n->id=num_nodes;
+	nodes[num_nodes++]=n;
+
+	memcpy(n->name,name,len);
+	n->namelen=len;
+	n->isdir=isdir;
+	n->mode=isdir ? (S_IFDIR|0755) : (S_IFREG|0644);
+	n->ctime=n->mtime=time(NULL);
+
+	if (dir) {
+		n->parent=dir->id;
+		if (dir->count==dir->max) {
+			dir->max=dir->max ? dir->max*2 : 16;
+			dir->children=realloc(dir->children,
+				dir->max*sizeof(unsigned int));
+			if (dir->children==NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		dir->children[dir->count++]=n->id;
+		dir->mtime=n->mtime;
+		h=hash_name(dir->id,n->name,len);
+		n->hash_next=hash[h];
+		hash[h]=n;
+	}
+	return n;
+}
+
+static void remove_node(struct node * n)
+{
+	struct node * dir = nodes[n->parent], ** pp;
+	unsigned int i;
+
+	for (pp=&hash[hash_name(dir->id,n->name,n->namelen)];*pp;
+		pp=&(*pp)->hash_next)
+		if (*pp==n) {
+			*pp=n->hash_next;
+			break;
+		}
+	for (i=0;i<dir->count;i++)
+		if (dir->children[i]==n->id) {
+			memmove(&dir->children[i],&dir->children[i+1],
+				(dir->count-i-1)*sizeof(unsigned int));
+			dir->count--;
+			break;
+		}
+	dir->mtime=time(NULL);
+	nodes[n->id]=NULL;
+	free(n->children);
+	free(n->data);
+	free(n);
+}
+
+/* Made up contents depend on the file and the offset */
+static void fill_pattern(struct node * n, char * buf, uint64_t offset,
+	unsigned int len)
+{
+	unsigned int pos, amount;
+
+	while (len) {
+		pos=(offset+n->id*4099) % MOCK_PATTERN_LEN;
+		amount=MOCK_PATTERN_LEN-pos;
+		if (amount>len) amount=len;
+		memcpy(buf,pattern+pos,amount);
+		buf+=amount;
+		offset+=amount;
+		len-=amount;
+	}
+}
+
+static int set_size(struct node * n, uint64_t size)
+{
+	char * data;
+
+	if (n->data==NULL) {
+		/* Keep what's there, now that it can change */
+		if ((data=malloc(size ? size : 1))==NULL)
+			return kFPDiskFull;
+		fill_pattern(n,data,0,size<n->size ? size : n->size);
+	} else if ((data=realloc(n->data,size ? size : 1))==NULL)
+		return kFPDiskFull;
+	if (size>n->size)
+		memset(data+n->size,0,size-n->size);
+	n->data=data;
+	n->size=size;
+	return kFPNoErr;
+}
+
+static void make_volume(unsigned int files, uint64_t filesize,
+	uint64_t bigsize)
+{
+	struct node * root, * dir, * n;
+	char name[32];
+	unsigned int i;
+
+	for (i=0;i<MOCK_PATTERN_LEN;i++)
+		pattern[i]=(i*31+(i>>8)*7) & 0xff;
+
+	add_node(NULL,"",0,1);			/* 0, unused */
+	add_node(NULL,"",0,1);			/* 1, the root's parent */
+	root=add_node(NULL,"bench",5,1);	/* 2, AFP_ROOT_DID */
+	root->parent=1;
+
+	dir=add_node(root,"files",5,1);
+	for (i=0;i<files;i++) {
+		snprintf(name,sizeof(name),"file%05u",i);
+		n=add_node(dir,name,strlen(name),0);
+		n->size=filesize;
+	}
+	n=add_node(root,"big",3,0);
+	n->size=bigsize;
+}
+
+/* Finds what path, relative to did, names.  The path is left in name
+ * as a sequence of null separated components, the last of which is
+ * looked for in *dir.  An empty last component is *dir itself. */
+static int walk(unsigned int did, const unsigned char * path,
+	unsigned int avail, struct node ** dir, const char ** last,
+	unsigned int * lastlen, struct node ** found)
+{
+	const char * p, * end, * next;
+	unsigned int len;
+	struct node * d, * n;
+
+	*found=NULL;
+	if ((did>=num_nodes) || ((d=nodes[did])==NULL) || (!d->isdir))
+		return kFPObjectNotFound;
+
+	if (avail<1) return kFPParamErr;
+	switch (path[0]) {
+	case kFPUTF8Name:
+		if (avail<7) return kFPParamErr;
+		len=get16(path+5);
+		p=(const char *) path+7;
+		break;
+	case kFPLongName:
+	case kFPShortName:
+		if (avail<2) return kFPParamErr;
+		len=path[1];
+		p=(const char *) path+2;
+		break;
+	default:
+		return kFPParamErr;
+	}
+	if (p+len>(const char *) path+avail) return kFPParamErr;
+	end=p+len;
+
+	while (1) {
+		for (next=p;(next<end) && (*next);next++);
+		if (next==end) break;
+		if (next>p) {
+			if (((n=find_child(d,p,next-p))==NULL) || (!n->isdir))
+				return kFPObjectNotFound;
+			d=n;
+		}
+		p=next+1;
+	}
+
+	*dir=d;
+	*last=p;
+	*lastlen=end-p;
+	if (*lastlen==0)
+		*found=d;
+	else
+		*found=find_child(d,p,*lastlen);
+	return kFPNoErr;
+}
+
+/* Appends n's parameters in the order of parse_reply_block() */
+static void put_params(struct msg * m, struct node * n,
+	unsigned short filebitmap, unsigned short dirbitmap)
+{
+	unsigned short bitmap = n->isdir ? dirbitmap : filebitmap;
+	unsigned int start = m->len, longname=0, shortname=0, utf8name=0;
+
+	if (bitmap & kFPAttributeBit) put16(m,0);
+	if (bitmap & kFPParentDirIDBit) put32(m,n->parent);
+	if (bitmap & kFPCreateDateBit) put32(m,afp_date(n->ctime));
+	if (bitmap & kFPModDateBit) put32(m,afp_date(n->mtime));
+	if (bitmap & kFPBackupDateBit) put32(m,0x80000000);
+	if (bitmap & kFPFinderInfoBit) msg_add(m,32);
+	if (bitmap & kFPLongNameBit) {
+		longname=m->len;
+		put16(m,0);
+	}
+	if (bitmap & kFPShortNameBit) {
+		shortname=m->len;
+		put16(m,0);
+	}
+	if (bitmap & kFPNodeIDBit) put32(m,n->id);
+	if (n->isdir) {
+		if (bitmap & kFPOffspringCountBit) put16(m,n->count);
+		if (bitmap & kFPOwnerIDBit) put32(m,getuid());
+		if (bitmap & kFPGroupIDBit) put32(m,getgid());
+		if (bitmap & kFPAccessRightsBit) put32(m,0x87070707);
+	} else {
+		if (bitmap & kFPDataForkLenBit)
+			put32(m,n->size>0xffffffff ? 0xffffffff : n->size);
+		if (bitmap & kFPRsrcForkLenBit) put32(m,0);
+		if (bitmap & kFPExtDataForkLenBit) put64(m,n->size);
+		if (bitmap & kFPLaunchLimitBit) put16(m,0);
+	}
+	if (bitmap & kFPUTF8NameBit) {
+		utf8name=m->len;
+		put16(m,0);
+		put32(m,0);
+	}
+	if (bitmap & kFPExtRsrcForkLenBit) put64(m,0);
+	if (bitmap & kFPUnixPrivsBit) {
+		put32(m,getuid());
+		put32(m,getgid());
+		put32(m,n->mode);
+		put32(m,0x87070707);
+	}
+
+	/* The names go after the fixed part, with offsets from its start */
+	if (longname) {
+		patch16(m,longname,m->len-start);
+		put_pascal(m,n->name,n->namelen);
+	}
+	if (shortname) {
+		patch16(m,shortname,m->len-start);
+		put_pascal(m,n->name,n->namelen>12 ? 12 : n->namelen);
+	}
+	if (utf8name) {
+		patch16(m,utf8name,m->len-start);
+		put32(m,0x08000103);
+		put16(m,n->namelen);
+		memcpy(msg_add(m,n->namelen),n->name,n->namelen);
+	}
+}
+
+static void put_volume_params(struct msg * m, unsigned short bitmap)
+{
+	unsigned int start = m->len, name=0;
+
+	if (bitmap & kFPVolAttributeBit)
+		put16(m,kSupportsFileIDs|kSupportsCatSearch|kSupportsUnixPrivs|
+			kSupportsUTF8Names);
+	if (bitmap & kFPVolSignatureBit) put16(m,AFP_VOL_FIXED);
+	if (bitmap & kFPVolCreateDateBit) put32(m,afp_date(start_time));
+	if (bitmap & kFPVolModDateBit) put32(m,afp_date(time(NULL)));
+	if (bitmap & kFPVolBackupDateBit) put32(m,0x80000000);
+	if (bitmap & kFPVolIDBit) put16(m,MOCK_VOLUME_ID);
+	if (bitmap & kFPVolBytesFreeBit) put32(m,0x7fffffff);
+	if (bitmap & kFPVolBytesTotalBit) put32(m,0x7fffffff);
+	if (bitmap & kFPVolNameBit) {
+		name=m->len;
+		put16(m,0);
+	}
+	if (bitmap & kFPVolExtBytesFreeBit) put64(m,1ULL<<40);
+	if (bitmap & kFPVolExtBytesTotalBit) put64(m,1ULL<<40);
+	if (bitmap & kFPVolBlockSizeBit) put32(m,4096);
+	if (name) {
+		patch16(m,name,m->len-start);
+		put_pascal(m,"bench",5);
+	}
+}
+
+/* Byte range locks, must be called with tree_mutex held */
+
+static int range_lock(struct conn * c, struct fork * f, int unlock,
+	uint64_t start, uint64_t len)
+{
+	struct range_lock * l, ** pp;
+	uint64_t end = (len==(uint64_t) -1) ? (uint64_t) -1 : start+len;
+
+	if (unlock) {
+		for (pp=&range_locks;*pp;pp=&(*pp)->next) {
+			l=*pp;
+			if ((l->owner==f) && (l->start==start)) {
+				*pp=l->next;
+				free(l);
+				return kFPNoErr;
+			}
+		}
+		return kFPRangeNotLocked;
+	}
+
+	for (l=range_locks;l;l=l->next) {
+		if ((l->id!=f->id) || (l->end<=start) || (l->start>=end))
+			continue;
+		return (l->owner==f) ? kFPRangeOverlap : kFPLockErr;
+	}
+	if ((l=malloc(sizeof(*l)))==NULL)
+		return kFPNoMoreLocks;
+	l->id=f->id;
+	l->owner=f;
+	l->start=start;
+	l->end=end;
+	l->next=range_locks;
+	range_locks=l;
+	return kFPNoErr;
+}
+
+static void range_unlock_fork(struct fork * f)
+{
+	struct range_lock * l, ** pp;
+
+	for (pp=&range_locks;*pp;) {
+		l=*pp;
+		if (l->owner==f) {
+			*pp=l->next;
+			free(l);
+		} else
+			pp=&l->next;
+	}
+}
+
+static struct fork * find_fork(struct conn * c, unsigned short forkid)
+{
+	if ((forkid==0) || (forkid>MOCK_MAX_FORKS) ||
+		(c->forks[forkid-1].id==0) ||
+		(nodes[c->forks[forkid-1].id]==NULL))
+		return NULL;
+	return &c->forks[forkid-1];
+}
+
+static void close_fork(struct fork * f)
+{
+	struct node * n = nodes[f->id];
+
+	range_unlock_fork(f);
+	if (n) n->opened--;
+	f->id=0;
+}
+
+/* AFP commands.  Each gets the request after the DSI header and adds
+ * its reply to m; the return value is the AFP result code. */
+
+static int afp_login(const unsigned char * req, unsigned int len)
+{
+	char uam[256];
+	unsigned int l;
+
+	if ((len<2) || (2+req[1]>=len)) return kFPParamErr;
+	l=req[2+req[1]];
+	if (3+req[1]+l>len) return kFPParamErr;
+	memcpy(uam,req+3+req[1],l);
+	uam[l]='\0';
+
+	if ((strcmp(uam,"No User Authent")==0) ||
+		(strcmp(uam,"Cleartxt Passwrd")==0))
+		return kFPNoErr;
+	return kFPBadUAM;
+}
+
+static int afp_getsrvrparms(struct msg * m)
+{
+	put32(m,afp_date(time(NULL)));
+	put8(m,1);
+	put8(m,0);
+	put_pascal(m,"bench",5);
+	return kFPNoErr;
+}
+
+static int afp_getsrvrmsg(const unsigned char * req, unsigned int len,
+	struct msg * m)
+{
+	if (len<6) return kFPParamErr;
+	put16(m,get16(req+2));
+	put16(m,get16(req+4));
+	if (get16(req+4) & AFP_GETSRVRMSG_UTF8)
+		put16(m,0);
+	else
+		put8(m,0);
+	return kFPNoErr;
+}
+
+static int afp_openvol(const unsigned char * req, unsigned int len,
+	struct msg * m)
+{
+	unsigned short bitmap;
+
+	if ((len<5) || (5+req[4]>len)) return kFPParamErr;
+	if ((req[4]!=5) || (memcmp(req+5,"bench",5)))
+		return kFPObjectNotFound;
+	bitmap=get16(req+2);
+	put16(m,bitmap);
+	put_volume_params(m,bitmap);
+	return kFPNoErr;
+}
+
+static int afp_getvolparms(const unsigned char * req, unsigned int len,
+	struct msg * m)
+{
+	unsigned short bitmap;
+
+	if (len<6) return kFPParamErr;
+	if (get16(req+2)!=MOCK_VOLUME_ID) return kFPParamErr;
+	bitmap=get16(req+4);
+	put16(m,bitmap);
+	put_volume_params(m,bitmap);
+	return kFPNoErr;
+}
+
+static int afp_getuserinfo(const unsigned char * req, unsigned int len,
+	struct msg * m)
+{
+	unsigned short bitmap;
+
+	if (len<8) return kFPParamErr;
+	bitmap=get16(req+6);
+	put16(m,bitmap);
+	if (bitmap & kFPGetUserInfo_USER_ID) put32(m,getuid());
+	if (bitmap & kFPGetUserInfo_PRI_GROUPID) put32(m,getgid());
+	return kFPNoErr;
+}
+
+static int afp_getfiledirparms(const unsigned char * req, unsigned int len,
+	struct msg * m)
+{
+	struct node * dir, * n;
+	const char * last;
+	unsigned int lastlen;
+	unsigned short filebitmap, dirbitmap;
+	int rc;
+
+	if (len<12) return kFPParamErr;
+	filebitmap=get16(req+8);
+	dirbitmap=get16(req+10);
+	if ((rc=walk(get32(req+4),req+12,len-12,&dir,&last,&lastlen,&n)))
+		return rc;
+	if (n==NULL) return kFPObjectNotFound;
+
+	put16(m,filebitmap);
+	put16(m,dirbitmap);
+	put8(m,n->isdir ? 0x80 : 0);
+	put8(m,0);
+	put_params(m,n,filebitmap,dirbitmap);
+	return kFPNoErr;
+}
+
+static int afp_setparms(const unsigned char * req, unsigned int len)
+{
+	struct node * dir, * n;
+	const char * last;
+	unsigned int lastlen;
+	int rc;
+
+	/* Nothing is changed, but the object has to be there */
+	if (len<10) return kFPParamErr;
+	if ((rc=walk(get32(req+4),req+10,len-10,&dir,&last,&lastlen,&n)))
+		return rc;
+	return n ? kFPNoErr : kFPObjectNotFound;
+}
+
+static int afp_enumerateext2(const unsigned char * req, unsigned int len,
+	struct msg * m)
+{
+	struct node * dir, * n, * child;
+	const char * last;
+	unsigned int lastlen, i, count=0, entry, countpos;
+	unsigned short filebitmap, dirbitmap, reqcount;
+	uint32_t startindex, maxreply;
+	int rc;
+
+	if (len<22) return kFPParamErr;
+	filebitmap=get16(req+8);
+	dirbitmap=get16(req+10);
+	reqcount=get16(req+12);
+	startindex=get32(req+14);
+	maxreply=get32(req+18);
+	if ((rc=walk(get32(req+4),req+22,len-22,&dir,&last,&lastlen,&n)))
+		return rc;
+	if (n==NULL) return kFPDirNotFound;
+	if (!n->isdir) return kFPObjectTypeErr;
+	if ((startindex==0) || (startindex>n->count))
+		return kFPObjectNotFound;
+
+	put16(m,filebitmap);
+	put16(m,dirbitmap);
+	countpos=m->len;
+	put16(m,0);
+
+	for (i=startindex-1;(i<n->count) && (count<reqcount);i++) {
+		child=nodes[n->children[i]];
+		entry=m->len;
+		put16(m,0);
+		put8(m,child->isdir ? 0x80 : 0);
+		put8(m,0);
+		put_params(m,child,filebitmap,dirbitmap);
+		if ((m->len-entry) & 1) put8(m,0);
+		if (m->len>maxreply) {
+			m->len=entry;
+			break;
+		}
+		patch16(m,entry,m->len-entry);
+		count++;
+	}
+	patch16(m,countpos,count);
+	return kFPNoErr;
+}
+
+/* What one FPCatSearchExt looks for, from its two specifications */
+struct search {
+	unsigned int bitmap;
+	time_t cdate[2], mdate[2];
+	unsigned int offspring[2];
+	uint64_t size[2];
+	const char * name;
+	unsigned int namelen;
+};
+
+/* Reads specification which (0 or 1) at *p, and moves *p past it */
+static int parse_search_spec(struct search * s, int which,
+	const unsigned char ** p, const unsigned char * end)
+{
+	const unsigned char * params, * q, * name;
+	unsigned int speclen, offset;
+
+	if (*p+2>end) return kFPParamErr;
+	speclen=get16(*p);
+	params=q=*p+2;
+	if (params+speclen>end) return kFPParamErr;
+	*p=params+speclen;
+	end=params+speclen;
+
+	if (s->bitmap & kFPCreateDateBit) {
+		if (q+4>end) return kFPParamErr;
+		s->cdate[which]=(time_t) (int32_t) get32(q)+AD_DATE_DELTA;
+		q+=4;
+	}
+	if (s->bitmap & kFPModDateBit) {
+		if (q+4>end) return kFPParamErr;
+		s->mdate[which]=(time_t) (int32_t) get32(q)+AD_DATE_DELTA;
+		q+=4;
+	}
+	if (s->bitmap & kFPLongNameBit) {
+		if (q+2>end) return kFPParamErr;
+		offset=get16(q);
+		q+=2;
+		name=params+offset;
+		if ((which==0) && (name<end) && (name+1+name[0]<=end)) {
+			s->name=(const char *) name+1;
+			s->namelen=name[0];
+		}
+	}
+	if (s->bitmap & kFPDataForkLenBit) {
+		if (q+6>end) return kFPParamErr;
+		s->offspring[which]=get16(q);
+		s->size[which]=get32(q+2);
+		q+=6;
+	}
+	if (s->bitmap & kFPUTF8NameBit) {
+		if (q+2>end) return kFPParamErr;
+		offset=get16(q);
+		name=params+offset;
+		if ((which==0) && (name+6<=end) &&
+			(name+6+get16(name+4)<=end)) {
+			s->name=(const char *) name+6;
+			s->namelen=get16(name+4);
+		}
+	}
+	if ((which==0) && (s->bitmap & (kFPLongNameBit|kFPUTF8NameBit)) &&
+		(s->name==NULL))
+		return kFPParamErr;
+	return kFPNoErr;
+}
+
+/* Names are compared without case, as netatalk does */
+static int search_name_matches(struct search * s, struct node * n)
+{
+	unsigned int i;
+
+	if (!(s->bitmap & (kFPLongNameBit|kFPUTF8NameBit))) return 1;
+
+	if (!(s->bitmap & kFPPartialNameBit))
+		return (n->namelen==s->namelen) &&
+			(strncasecmp(n->name,s->name,n->namelen)==0);
+
+	for (i=0;i+s->namelen<=n->namelen;i++)
+		if (strncasecmp(n->name+i,s->name,s->namelen)==0)
+			return 1;
+	return 0;
+}
+
+static int search_matches(struct search * s, struct node * n)
+{
+	uint64_t size = n->size>0xffffffff ? 0xffffffff : n->size;
+
+	if ((s->bitmap & kFPCreateDateBit) &&
+		((n->ctime<s->cdate[0]) || (n->ctime>s->cdate[1])))
+		return 0;
+	if ((s->bitmap & kFPModDateBit) &&
+		((n->mtime<s->mdate[0]) || (n->mtime>s->mdate[1])))
+		return 0;
+	if (s->bitmap & kFPDataForkLenBit) {
+		if ((n->isdir) && ((n->count<s->offspring[0]) ||
+			(n->count>s->offspring[1])))
+			return 0;
+		if ((!n->isdir) && ((size<s->size[0]) || (size>s->size[1])))
+			return 0;
+	}
+	return search_name_matches(s,n);
+}
+
+/* The catalog position is the ID of the next node to look at, so a
+ * search goes through the volume in the order it was made */
+static int afp_catsearchext(const unsigned char * req, unsigned int len,
+	struct msg * m)
+{
+	struct search s;
+	const unsigned char * p;
+	unsigned short filebitmap, dirbitmap;
+	unsigned int reqmatches, id, count=0, entry, start, countpos;
+	struct node * n;
+	int rc;
+
+	if (len<36) return kFPParamErr;
+	if (get16(req+2)!=MOCK_VOLUME_ID) return kFPParamErr;
+	reqmatches=get32(req+4);
+	id=get32(req+12);
+	filebitmap=get16(req+28);
+	dirbitmap=get16(req+30);
+	if ((filebitmap==0) && (dirbitmap==0)) return kFPBitmapErr;
+
+	memset(&s,0,sizeof(s));
+	s.bitmap=get32(req+32);
+	p=req+36;
+	if ((rc=parse_search_spec(&s,0,&p,req+len))) return rc;
+	if ((rc=parse_search_spec(&s,1,&p,req+len))) return rc;
+
+	/* Past the root and the nodes above it */
+	if (id<=AFP_ROOT_DID) id=AFP_ROOT_DID+1;
+
+	start=m->len;
+	msg_add(m,16);
+	put16(m,filebitmap);
+	put16(m,dirbitmap);
+	countpos=m->len;
+	put32(m,0);
+
+	for (;(id<num_nodes) && (count<reqmatches);id++) {
+		if ((n=nodes[id])==NULL) continue;
+		if (!(n->isdir ? dirbitmap : filebitmap)) continue;
+		if (!search_matches(&s,n)) continue;
+
+		entry=m->len;
+		put16(m,0);
+		put8(m,n->isdir ? 0x80 : 0);
+		put8(m,0);
+		put_params(m,n,filebitmap,dirbitmap);
+		if ((m->len-entry) & 1) put8(m,0);
+		if (m->len-start>quantum) {
+			m->len=entry;
+			break;
+		}
+		patch16(m,entry,m->len-entry);
+		count++;
+	}
+	patch32(m,start,id);
+	patch32(m,countpos,count);
+	return (id>=num_nodes) ? kFPEOFErr : kFPNoErr;
+}
+
+static int afp_createfile(const unsigned char * req, unsigned int len)
+{
+	struct node * dir, * n;
+	const char * last;
+	unsigned int lastlen;
+	int rc;
+
+	if (len<8) return kFPParamErr;
+	if ((rc=walk(get32(req+4),req+8,len-8,&dir,&last,&lastlen,&n)))
+		return rc;
+	if (lastlen==0) return kFPParamErr;
+	if (n) {
+		if (n->isdir) return kFPObjectExists;
+		if (!(req[1] & kFPHardCreate)) return kFPObjectExists;
+		if (n->opened) return kFPFileBusy;
+		return set_size(n,0);
+	}
+	if (add_node(dir,last,lastlen,0)==NULL) return kFPDiskFull;
+	return kFPNoErr;
+}
+
+static int afp_createdir(const unsigned char * req, unsigned int len,
+	struct msg * m)
+{
+	struct node * dir, * n;
+	const char * last;
+	unsigned int lastlen;
+	int rc;
+
+	if (len<8) return kFPParamErr;
+	if ((rc=walk(get32(req+4),req+8,len-8,&dir,&last,&lastlen,&n)))
+		return rc;
+	if (lastlen==0) return kFPParamErr;
+	if (n) return kFPObjectExists;
+	if ((n=add_node(dir,last,lastlen,1))==NULL) return kFPDiskFull;
+	put32(m,n->id);
+	return kFPNoErr;
+}
+
+/* How long the path at p is, or 0 if it doesn't fit in avail */
+static unsigned int path_len(const unsigned char * p, unsigned int avail)
+{
+	unsigned int len;
+
+	if (avail<1) return 0;
+	switch (p[0]) {
+	case kFPUTF8Name:
+		if (avail<7) return 0;
+		len=7+get16(p+5);
+		break;
+	case kFPLongName:
+	case kFPShortName:
+		if (avail<2) return 0;
+		len=2+p[1];
+		break;
+	default:
+		return 0;
+	}
+	return (len<=avail) ? len : 0;
+}
+
+static int afp_copyfile(const unsigned char * req, unsigned int len)
+{
+	struct node * dir, * src, * dst;
+	const char * last;
+	unsigned int lastlen, srclen, dstlen, dst_did;
+	int rc;
+
+	if (!copyfile) return kFPCallNotSupported;
+	if (len<14) return kFPParamErr;
+	dst_did=get32(req+10);
+	if ((get16(req+2)!=MOCK_VOLUME_ID) || (get16(req+8)!=MOCK_VOLUME_ID))
+		return kFPParamErr;
+
+	if ((srclen=path_len(req+14,len-14))==0) return kFPParamErr;
+	if ((rc=walk(get32(req+4),req+14,srclen,&dir,&last,&lastlen,&src)))
+		return rc;
+	if (src==NULL) return kFPObjectNotFound;
+	if (src->isdir) return kFPObjectTypeErr;
+
+	req+=14+srclen;
+	len-=14+srclen;
+	if ((dstlen=path_len(req,len))==0) return kFPParamErr;
+	if ((rc=walk(dst_did,req,dstlen,&dir,&last,&lastlen,&dst)))
+		return rc;
+	if ((dst==NULL) || (!dst->isdir)) return kFPObjectNotFound;
+
+	/* The new name, or the old one if it is empty */
+	if ((rc=walk(dst->id,req+dstlen,len-dstlen,&dir,&last,&lastlen,&dst)))
+		return rc;
+	if (lastlen==0) {
+		last=src->name;
+		lastlen=src->namelen;
+		dst=find_child(dir,last,lastlen);
+	}
+	if (dst) return kFPObjectExists;
+
+	if ((dst=add_node(dir,last,lastlen,0))==NULL) return kFPDiskFull;
+	dst->mode=src->mode;
+	if ((dst->data=malloc(src->size ? src->size : 1))==NULL) {
+		remove_node(dst);
+		return kFPDiskFull;
+	}
+	if (src->data)
+		memcpy(dst->data,src->data,src->size);
+	else
+		fill_pattern(src,dst->data,0,src->size);
+	dst->size=src->size;
+	return kFPNoErr;
+}
+
+static int afp_delete(const unsigned char * req, unsigned int len)
+{
+	struct node * dir, * n;
+	const char * last;
+	unsigned int lastlen;
+	int rc;
+
+	if (len<8) return kFPParamErr;
+	if ((rc=walk(get32(req+4),req+8,len-8,&dir,&last,&lastlen,&n)))
+		return rc;
+	if (n==NULL) return kFPObjectNotFound;
+	if (n->id<=AFP_ROOT_DID) return kFPAccessDenied;
+	if ((n->isdir) && (n->count)) return kFPDirNotEmpty;
+	if (n->opened) return kFPFileBusy;
+	remove_node(n);
+	return kFPNoErr;
+}
+
+static int afp_openfork(struct conn * c, const unsigned char * req,
+	unsigned int len, struct msg * m)
+{
+	struct node * dir, * n;
+	const char * last;
+	unsigned int lastlen, i;
+	unsigned short bitmap;
+	int rc;
+
+	if (len<12) return kFPParamErr;
+	bitmap=get16(req+8);
+	if ((rc=walk(get32(req+4),req+12,len-12,&dir,&last,&lastlen,&n)))
+		return rc;
+	if (n==NULL) return kFPObjectNotFound;
+	if (n->isdir) return kFPObjectTypeErr;
+
+	for (i=0;i<MOCK_MAX_FORKS;i++)
+		if (c->forks[i].id==0) break;
+	if (i==MOCK_MAX_FORKS) return kFPTooManyFilesOpen;
+
+	c->forks[i].id=n->id;
+	c->forks[i].resource=(req[1] & AFP_FORKTYPE_RESOURCE) ? 1 : 0;
+	c->forks[i].access=get16(req+10);
+	n->opened++;
+
+	put16(m,bitmap);
+	put16(m,i+1);
+	if (bitmap) put_params(m,n,bitmap,0);
+	return kFPNoErr;
+}
+
+static int afp_closefork(struct conn * c, const unsigned char * req,
+	unsigned int len)
+{
+	struct fork * f;
+
+	if (len<4) return kFPParamErr;
+	if ((f=find_fork(c,get16(req+2)))==NULL) return kFPParamErr;
+	close_fork(f);
+	return kFPNoErr;
+}
+
+static int afp_getforkparms(struct conn * c, const unsigned char * req,
+	unsigned int len, struct msg * m)
+{
+	struct fork * f;
+	unsigned short bitmap;
+
+	if (len<6) return kFPParamErr;
+	if ((f=find_fork(c,get16(req+2)))==NULL) return kFPParamErr;
+	bitmap=get16(req+4);
+	put16(m,bitmap);
+	put_params(m,nodes[f->id],bitmap,0);
+	return kFPNoErr;
+}
+
+static int afp_setforkparms(struct conn * c, const unsigned char * req,
+	unsigned int len)
+{
+	struct fork * f;
+	unsigned short bitmap;
+
+	if (len<10) return kFPParamErr;
+	if ((f=find_fork(c,get16(req+2)))==NULL) return kFPParamErr;
+	if (f->resource) return kFPNoErr;
+	bitmap=get16(req+4);
+	if (bitmap & kFPExtDataForkLenBit) {
+		if (len<14) return kFPParamErr;
+		return set_size(nodes[f->id],get64(req+6));
+	}
+	if (bitmap & kFPDataForkLenBit)
+		return set_size(nodes[f->id],get32(req+6));
+	return kFPNoErr;
+}
+
+static int afp_read(struct conn * c, const unsigned char * req,
+	unsigned int len, int ext, struct msg * m)
+{
+	struct fork * f;
+	struct node * n;
+	uint64_t offset, count, size;
+
+	if (len<(ext ? 20 : 12)) return kFPParamErr;
+	if ((f=find_fork(c,get16(req+2)))==NULL) return kFPParamErr;
+	if (ext) {
+		offset=get64(req+4);
+		count=get64(req+12);
+	} else {
+		offset=get32(req+4);
+		count=get32(req+8);
+	}
+	n=nodes[f->id];
+	size=f->resource ? 0 : n->size;
+
+	if (count>quantum) count=quantum;
+	if (offset>=size) return kFPEOFErr;
+	if (count>size-offset) count=size-offset;
+
+	if (n->data)
+		memcpy(msg_add(m,count),n->data+offset,count);
+	else
+		fill_pattern(n,msg_add(m,count),offset,count);
+	return (offset+count==size) ? kFPEOFErr : kFPNoErr;
+}
+
+static int afp_write(struct conn * c, const unsigned char * req,
+	unsigned int len, unsigned int dataoffset, int ext, struct msg * m)
+{
+	struct fork * f;
+	struct node * n;
+	uint64_t offset, count;
+	int rc;
+
+	if ((len<(ext ? 20 : 12)) || (dataoffset>len)) return kFPParamErr;
+	if ((f=find_fork(c,get16(req+2)))==NULL) return kFPParamErr;
+	if (!(f->access & AFP_OPENFORK_ALLOWWRITE)) return kFPAccessDenied;
+	if (ext) {
+		offset=get64(req+4);
+		count=get64(req+12);
+	} else {
+		offset=get32(req+4);
+		count=get32(req+8);
+	}
+	if (count>len-dataoffset) return kFPParamErr;
+	n=nodes[f->id];
+
+	if (f->resource) {
+		/* Resource forks just swallow what is written */
+		offset+=count;
+		goto out;
+	}
+	if (req[1] & 0x80) offset+=n->size;
+
+	if ((n->data==NULL) || (offset+count>n->size))
+		if ((rc=set_size(n,offset+count>n->size ?
+			offset+count : n->size)))
+			return rc;
+	memcpy(n->data+offset,req+dataoffset,count);
+	n->mtime=time(NULL);
+	offset+=count;
+out:
+	if (ext)
+		put64(m,offset);
+	else
+		put32(m,offset);
+	return kFPNoErr;
+}
+
+static int afp_byterangelock(struct conn * c, const unsigned char * req,
+	unsigned int len, int ext, struct msg * m)
+{
+	struct fork * f;
+	uint64_t offset, count;
+	int rc;
+
+	if (len<(ext ? 20 : 12)) return kFPParamErr;
+	if ((f=find_fork(c,get16(req+2)))==NULL) return kFPParamErr;
+	if (ext) {
+		offset=get64(req+4);
+		count=get64(req+12);
+	} else {
+		offset=get32(req+4);
+		count=get32(req+8);
+		if (count==0xffffffff) count=(uint64_t) -1;
+	}
+	if (req[1] & 0x80) offset+=nodes[f->id]->size;
+	if (count==0) return kFPParamErr;
+
+	if ((rc=range_lock(c,f,req[1] & ByteRangeLock_Unlock,offset,count)))
+		return rc;
+	if (ext)
+		put64(m,offset);
+	else
+		put32(m,offset);
+	return kFPNoErr;
+}
+
+static const char * command_name(unsigned char command)
+{
+	switch (command) {
+	case afpByteRangeLock: return "ByteRangeLock";
+	case afpCloseVol: return "CloseVol";
+	case afpCloseFork: return "CloseFork";
+	case afpCopyFile: return "CopyFile";
+	case afpCreateDir: return "CreateDir";
+	case afpCreateFile: return "CreateFile";
+	case afpDelete: return "Delete";
+	case afpFlush: return "Flush";
+	case afpFlushFork: return "FlushFork";
+	case afpGetForkParms: return "GetForkParms";
+	case afpGetSrvrParms: return "GetSrvrParms";
+	case afpGetVolParms: return "GetVolParms";
+	case afpLogin: return "Login";
+	case afpLogout: return "Logout";
+	case afpOpenVol: return "OpenVol";
+	case afpOpenFork: return "OpenFork";
+	case afpRead: return "Read";
+	case afpSetDirParms: return "SetDirParms";
+	case afpSetFileParms: return "SetFileParms";
+	case afpSetForkParms: return "SetForkParms";
+	case afpWrite: return "Write";
+	case afpGetFileDirParms: return "GetFileDirParms";
+	case afpSetFileDirParms: return "SetFileDirParms";
+	case afpGetUserInfo: return "GetUserInfo";
+	case afpGetSrvrMsg: return "GetSrvrMsg";
+	case afpByteRangeLockExt: return "ByteRangeLockExt";
+	case afpReadExt: return "ReadExt";
+	case afpWriteExt: return "WriteExt";
+	case afpEnumerateExt2: return "EnumerateExt2";
+	case afpCatSearchExt: return "CatSearchExt";
+	}
+	return "unknown";
+}
+
+static int afp_command(struct conn * c, const unsigned char * req,
+	unsigned int len, unsigned int dataoffset, struct msg * m)
+{
+	int rc;
+
+	if (len<1) return kFPParamErr;
+
+	if (verbose)
+		printf("%d: %s\n",c->fd,command_name(req[0]));
+
+	pthread_mutex_lock(&tree_mutex);
+	switch (req[0]) {
+	case afpLogin:
+		rc=afp_login(req,len);
+		break;
+	case afpLogout:
+	case afpCloseVol:
+	case afpFlush:
+	case afpFlushFork:
+		rc=kFPNoErr;
+		break;
+	case afpGetSrvrParms:
+		rc=afp_getsrvrparms(m);
+		break;
+	case afpGetSrvrMsg:
+		rc=afp_getsrvrmsg(req,len,m);
+		break;
+	case afpOpenVol:
+		rc=afp_openvol(req,len,m);
+		break;
+	case afpGetVolParms:
+		rc=afp_getvolparms(req,len,m);
+		break;
+	case afpGetUserInfo:
+		rc=afp_getuserinfo(req,len,m);
+		break;
+	case afpGetFileDirParms:
+		rc=afp_getfiledirparms(req,len,m);
+		break;
+	case afpSetFileDirParms:
+	case afpSetFileParms:
+	case afpSetDirParms:
+		rc=afp_setparms(req,len);
+		break;
+	case afpEnumerateExt2:
+		rc=afp_enumerateext2(req,len,m);
+		break;
+	case afpCatSearchExt:
+		rc=afp_catsearchext(req,len,m);
+		break;
+	case afpCreateFile:
+		rc=afp_createfile(req,len);
+		break;
+	case afpCreateDir:
+		rc=afp_createdir(req,len,m);
+		break;
+	case afpDelete:
+		rc=afp_delete(req,len);
+		break;
+	case afpCopyFile:
+		rc=afp_copyfile(req,len);
+		break;
+	case afpOpenFork:
+		rc=afp_openfork(c,req,len,m);
+		break;
+	case afpCloseFork:
+		rc=afp_closefork(c,req,len);
+		break;
+	case afpGetForkParms:
+		rc=afp_getforkparms(c,req,len,m);
+		break;
+	case afpSetForkParms:
+		rc=afp_setforkparms(c,req,len);
+		break;
+	case afpRead:
+		rc=afp_read(c,req,len,0,m);
+		break;
+	case afpReadExt:
+		rc=afp_read(c,req,len,1,m);
+		break;
+	case afpWrite:
+		rc=afp_write(c,req,len,dataoffset ? dataoffset : 12,0,m);
+		break;
+	case afpWriteExt:
+		rc=afp_write(c,req,len,dataoffset ? dataoffset : 20,1,m);
+		break;
+	case afpByteRangeLock:
+		rc=afp_byterangelock(c,req,len,0,m);
+		break;
+	case afpByteRangeLockExt:
+		rc=afp_byterangelock(c,req,len,1,m);
+		break;
+	default:
+		rc=kFPCallNotSupported;
+	}
+	pthread_mutex_unlock(&tree_mutex);
+
+	return rc;
+}
+
+/* DSI */
+
+static void dsi_getstatus(struct msg * m)
+{
+	static const char * versions[] = { "AFPX03", "AFP3.1", "AFP3.2" };
+	static const char * uams[] = { "No User Authent", "Cleartxt Passwrd" };
+	unsigned int start = m->len, i;
+	unsigned int machine, version, uam, signature, utf8name;
+
+	machine=m->len; put16(m,0);
+	version=m->len; put16(m,0);
+	uam=m->len; put16(m,0);
+	put16(m,0);		/* no icon */
+	put16(m,kSupportsSrvrMsg|kSrvrSig|kSupportsUTF8SrvrName|
+		(copyfile ? kSupportsCopyfile : 0));
+	put_pascal(m,"mock",4);
+	if ((m->len-start) & 1) put8(m,0);
+	signature=m->len; put16(m,0);
+	utf8name=m->len; put16(m,0);
+
+	patch16(m,machine,m->len-start);
+	put_pascal(m,"afpfs-ng mock",13);
+
+	patch16(m,version,m->len-start);
+	put8(m,sizeof(versions)/sizeof(versions[0]));
+	for (i=0;i<sizeof(versions)/sizeof(versions[0]);i++)
+		put_pascal(m,versions[i],strlen(versions[i]));
+
+	patch16(m,uam,m->len-start);
+	put8(m,sizeof(uams)/sizeof(uams[0]));
+	for (i=0;i<sizeof(uams)/sizeof(uams[0]);i++)
+		put_pascal(m,uams[i],strlen(uams[i]));
+
+	patch16(m,signature,m->len-start);
+	memcpy(msg_add(m,AFP_SIGNATURE_LEN),"afpfs-ng mock!!!",
+		AFP_SIGNATURE_LEN);
+
+	patch16(m,utf8name,m->len-start);
+	put16(m,4);
+	memcpy(msg_add(m,4),"mock",4);
+}
+
+/* Waits as long as len bytes take at the configured bandwidth */
+static void pace(struct pacer * p, unsigned int len)
+{
+	struct timeval now, t;
+	uint64_t usecs;
+
+	if (bandwidth==0) return;
+
+	gettimeofday(&now,NULL);
+	if (timercmp(&p->next,&now,<)) p->next=now;
+	usecs=(uint64_t) len*1000000/bandwidth;
+	t.tv_sec=usecs/1000000;
+	t.tv_usec=usecs%1000000;
+	timeradd(&p->next,&t,&p->next);
+	timersub(&p->next,&now,&t);
+	if (t.tv_sec || t.tv_usec)
+		usleep(t.tv_sec*1000000+t.tv_usec);
+}
+
+static int read_all(int fd, char * buf, unsigned int len)
+{
+	int ret;
+
+	while (len) {
+		if ((ret=read(fd,buf,len))<=0) {
+			if ((ret<0) && (errno==EINTR)) continue;
+			return -1;
+		}
+		buf+=ret;
+		len-=ret;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const char * buf, unsigned int len)
+{
+	int ret;
+
+	while (len) {
+		if ((ret=write(fd,buf,len))<0) {
+			if (errno==EINTR) continue;
+			return -1;
+		}
+		buf+=ret;
+		len-=ret;
+	}
+	return 0;
+}
+
+static void queue_reply(struct conn * c, struct timeval * received,
+	struct msg * m, int close)
+{
+	struct reply * r;
+	struct timeval t;
+
+	if ((r=calloc(1,sizeof(*r)))==NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	t.tv_sec=latency/1000000;
+	t.tv_usec=latency%1000000;
+	timeradd(received,&t,&r->due);
+	r->buf=m->buf;
+	r->len=m->len;
+	r->close=close;
+
+	pthread_mutex_lock(&c->mutex);
+	if (c->tail)
+		c->tail->next=r;
+	else
+		c->head=r;
+	c->tail=r;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->mutex);
+}
+
+/* Sends the replies in order, each once it is due */
+static void * writer_thread(void * arg)
+{
+	struct conn * c = arg;
+	struct reply * r;
+	struct timeval now, t;
+	int failed=0;
+
+	while (1) {
+		pthread_mutex_lock(&c->mutex);
+		while ((c->head==NULL) && (!c->done))
+			pthread_cond_wait(&c->cond,&c->mutex);
+		if ((r=c->head)==NULL) {
+			pthread_mutex_unlock(&c->mutex);
+			break;
+		}
+		if ((c->head=r->next)==NULL) c->tail=NULL;
+		pthread_mutex_unlock(&c->mutex);
+
+		gettimeofday(&now,NULL);
+		if (timercmp(&r->due,&now,>)) {
+			timersub(&r->due,&now,&t);
+			usleep(t.tv_sec*1000000+t.tv_usec);
+		}
+		pace(&c->out,r->len);
+		if ((!failed) && (write_all(c->fd,r->buf,r->len)))
+			failed=1;
+		if (r->close)
+			shutdown(c->fd,SHUT_RDWR);
+		free(r->buf);
+		free(r);
+	}
+	return NULL;
+}
+
+static void * connection_thread(void * arg)
+{
+	struct conn * c = arg;
+	unsigned char header[DSI_HEADER_LEN], * req=NULL;
+	unsigned int len, max=0, dataoffset;
+	struct timeval received;
+	struct msg m;
+	pthread_t writer;
+	int rc, closing, i;
+
+	pthread_mutex_init(&c->mutex,NULL);
+	pthread_cond_init(&c->cond,NULL);
+	if (pthread_create(&writer,NULL,writer_thread,c)) {
+		perror("pthread_create");
+		goto out;
+	}
+
+	while (read_all(c->fd,(char *) header,DSI_HEADER_LEN)==0) {
+		len=get32(header+8);
+		if (len>quantum+1024) {
+			fprintf(stderr,"Packet of %u bytes is too large\n",len);
+			break;
+		}
+		if (len>max) {
+			max=len;
+			if ((req=realloc(req,max))==NULL) {
+				perror("realloc");
+				break;
+			}
+		}
+		if (read_all(c->fd,(char *) req,len)) break;
+		pace(&c->in,DSI_HEADER_LEN+len);
+		gettimeofday(&received,NULL);
+
+		if (header[0]!=DSI_REQUEST) continue;
+
+		memset(&m,0,sizeof(m));
+		msg_add(&m,DSI_HEADER_LEN);
+		rc=kFPNoErr;
+		closing=0;
+
+		switch (header[1]) {
+		case DSI_DSIGetStatus:
+			dsi_getstatus(&m);
+			closing=1;
+			break;
+		case DSI_DSIOpenSession:
+			put8(&m,0);	/* server request quantum */
+			put8(&m,4);
+			put32(&m,quantum);
+			break;
+		case DSI_DSICloseSession:
+			closing=1;
+			break;
+		case DSI_DSICommand:
+			rc=afp_command(c,req,len,0,&m);
+			break;
+		case DSI_DSIWrite:
+			dataoffset=get32(header+4);
+			rc=afp_command(c,req,len,dataoffset,&m);
+			break;
+		case DSI_DSITickle:
+		default:
+			free(m.buf);
+			continue;
+		}
+
+		m.buf[0]=DSI_REPLY;
+		m.buf[1]=header[1];
+		memcpy(m.buf+2,header+2,2);
+		*(uint32_t *) (m.buf+4)=htonl(rc);
+		*(uint32_t *) (m.buf+8)=htonl(m.len-DSI_HEADER_LEN);
+		queue_reply(c,&received,&m,closing);
+		if (closing) break;
+	}
+
+	pthread_mutex_lock(&c->mutex);
+	c->done=1;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->mutex);
+	pthread_join(writer,NULL);
+
+out:
+	pthread_mutex_lock(&tree_mutex);
+	for (i=0;i<MOCK_MAX_FORKS;i++)
+		if (c->forks[i].id)
+			close_fork(&c->forks[i]);
+	pthread_mutex_unlock(&tree_mutex);
+
+	if (verbose) printf("%d: closed\n",c->fd);
+	close(c->fd);
+	pthread_mutex_destroy(&c->mutex);
+	pthread_cond_destroy(&c->cond);
+	free(req);
+	free(c);
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,"Usage: mock_afpd [-a address] [-p port] "
+		"[-l latency usecs] [-b bandwidth kB/s]\n"
+		"                 [-q quantum] [-n files] [-f filesize] "
+		"[-B bigsize] [-F] [-v]\n");
+}
+
+int main(int argc, char ** argv)
+{
+	struct sockaddr_in addr;
+	struct conn * c;
+	pthread_t thread;
+	unsigned int files=1000;
+	uint64_t filesize=4096, bigsize=64*1024*1024;
+	const char * address="127.0.0.1";
+	int port=10548, s, fd, on=1, opt;
+
+	while ((opt=getopt(argc,argv,"a:p:l:b:q:n:f:B:Fvh"))!=-1) {
+		switch (opt) {
+		case 'a':
+			address=optarg;
+			break;
+		case 'p':
+			port=strtol(optarg,NULL,0);
+			break;
+		case 'l':
+			latency=strtoul(optarg,NULL,0);
+			break;
+		case 'b':
+			bandwidth=strtoul(optarg,NULL,0)*1024;
+			break;
+		case 'q':
+			quantum=strtoul(optarg,NULL,0);
+			break;
+		case 'n':
+			files=strtoul(optarg,NULL,0);
+			break;
+		case 'f':
+			filesize=strtoull(optarg,NULL,0);
+			break;
+		case 'B':
+			bigsize=strtoull(optarg,NULL,0);
+			break;
+		case 'F':
+			copyfile=0;
+			break;
+		case 'v':
+			verbose=1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (quantum<4096) quantum=4096;
+
+	setvbuf(stdout,NULL,_IOLBF,0);
+	signal(SIGPIPE,SIG_IGN);
+	start_time=time(NULL);
+	make_volume(files,filesize,bigsize);
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(port);
+	if (inet_pton(AF_INET,address,&addr.sin_addr)!=1) {
+		fprintf(stderr,"Bad address %s\n",address);
+		return 1;
+	}
+	if (((s=socket(AF_INET,SOCK_STREAM,0))<0) ||
+		(setsockopt(s,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on))) ||
+		(bind(s,(struct sockaddr *) &addr,sizeof(addr))) ||
+		(listen(s,16))) {
+		perror("mock_afpd");
+		return 1;
+	}
+
+	printf("Serving volume bench on %s:%d, %u files of %llu bytes, "
+		"latency %uus, bandwidth %s, quantum %u\n",
+		address,port,files,(unsigned long long) filesize,latency,
+		bandwidth ? "limited" : "unlimited",quantum);
+	fflush(stdout);
+
+	while (1) {
+		if ((fd=accept(s,NULL,NULL))<0) {
+			if (errno==EINTR) continue;
+			perror("accept");
+			return 1;
+		}
+		setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+		if ((c=calloc(1,sizeof(*c)))==NULL) {
+			close(fd);
+			continue;
+		}
+		c->fd=fd;
+		if (pthread_create(&thread,NULL,connection_thread,c)) {
+			close(fd);
+			free(c);
+			continue;
+		}
+		pthread_detach(thread);
+		if (verbose) printf("%d: connected\n",fd);
+	}
+	return 0;
+}